@@ -44,7 +44,7 @@ namespace App
             } else {
                 int processId = Process.GetCurrentProcess().Id;
                 this.lycaniteBridge.SetLycanitePID((ulong)processId);
-                this.lycaniteBridge.OnLycaniteEvent += this.ProcessLycanite;
+                this.lycaniteBridge.OnLycaniteEventView += this.ProcessLycanite;
             }
             this.globalForm = new GlobalPathForm(this);
             this.globalForm.SetBridge(this.lycaniteBridge);
@@ -53,17 +53,20 @@ namespace App
             this.AllowResize = false;
         }
 
-        private void ProcessLycanite(LycaniteEvent e) {
+        // The view is only valid during the call, the UI thread gets copies
+        private void ProcessLycanite(LycaniteEventView e) {
+            ulong uuid = e.UUID;
             switch (e.eventType) {
                 case ELycaniteEventType.PROCESS_CREATE:
+                    ulong processId = e.ProcessID;
                     this.BeginInvoke((MethodInvoker)delegate () {
-                        this.CloseTab(e.UUID);
-                        this.processes[e.ProcessID] = e.UUID;
+                        this.CloseTab(uuid);
+                        this.processes[processId] = uuid;
                     });
                     break;
                 case ELycaniteEventType.PROCESS_DESTROY:
                     this.BeginInvoke((MethodInvoker)delegate () {
-                        this.CloseTab(e.UUID);
+                        this.CloseTab(uuid);
                     });
                     break;
                 case ELycaniteEventType.PROCESS_REQPERM:
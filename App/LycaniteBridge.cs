@@ -1,6 +1,8 @@
 ﻿using System;
+using System.Collections.Generic;
 using System.IO;
 using System.Runtime.InteropServices;
+using System.Text;
 using System.Threading;
 
 namespace Lycanite
@@ -11,33 +13,352 @@ namespace Lycanite
         PROCESS_CREATE = 1,
         PROCESS_DESTROY = 2,
         PROCESS_REQPERM = 3,
+        EVENTS_LOST = 4,
     }
 
-    public class LycaniteEvent
+    /*
+     * An event read in place, straight from the shared event ring or a message
+     * batch. It is only valid while the handler runs: nothing is copied or
+     * allocated unless the path tail is asked for or ToEvent() keeps it.
+     */
+    public unsafe ref struct LycaniteEventView
     {
-        internal LycaniteEvent(byte[] buffer)
+        private readonly byte* entry;
+
+        internal LycaniteEventView(byte* entry)
+        {
+            this.entry = entry;
+        }
+
+        public ELycaniteEventType eventType
+        {
+            get
+            {
+                return this.entry[0] <= (byte)ELycaniteEventType.EVENTS_LOST ? (ELycaniteEventType)this.entry[0] : ELycaniteEventType.UNKOWN;
+            }
+        }
+
+        public UInt64 UUID
         {
-            if (buffer[0] == (byte)ELycaniteEventType.PROCESS_CREATE)
+            get
             {
-                this.eventType = ELycaniteEventType.PROCESS_CREATE;
-                this.ProcessID = BitConverter.ToUInt64(buffer, 1);
-                this.UUID = BitConverter.ToUInt64(buffer, 9);
+                switch (this.eventType)
+                {
+                    case ELycaniteEventType.PROCESS_CREATE:
+                        return *(UInt64*)(this.entry + 9);
+                    case ELycaniteEventType.PROCESS_DESTROY:
+                    case ELycaniteEventType.PROCESS_REQPERM:
+                        return *(UInt64*)(this.entry + 1);
+                    default:
+                        return 0;
+                }
             }
-            else if (buffer[0] == (byte)ELycaniteEventType.PROCESS_DESTROY)
+        }
+
+        public UInt64 ProcessID
+        {
+            get
             {
-                this.eventType = ELycaniteEventType.PROCESS_DESTROY;
-                this.UUID = BitConverter.ToUInt64(buffer, 1); ;
+                return this.eventType == ELycaniteEventType.PROCESS_CREATE ? *(UInt64*)(this.entry + 1) : 0;
             }
-            else if (buffer[0] == (byte)ELycaniteEventType.PROCESS_DESTROY)
+        }
+
+        public UInt64 Count
+        {
+            get
             {
-                this.eventType = ELycaniteEventType.PROCESS_REQPERM;
+                switch (this.eventType)
+                {
+                    case ELycaniteEventType.PROCESS_REQPERM:
+                        return *(UInt32*)(this.entry + 14);
+                    case ELycaniteEventType.EVENTS_LOST:
+                        return *(UInt64*)(this.entry + 1);
+                    default:
+                        return 0;
+                }
             }
         }
 
-        public ELycaniteEventType eventType { get; } = ELycaniteEventType.UNKOWN;
-        public UInt64 UUID { get; } = 0;
-        public UInt64 ProcessID { get; } = 0;
+        public ELycanitePerm Operation
+        {
+            get
+            {
+                return this.eventType == ELycaniteEventType.PROCESS_REQPERM ? (ELycanitePerm)this.entry[9] : ELycanitePerm.LYCANITE_NONE;
+            }
+        }
 
+        public UInt32 PathHash
+        {
+            get
+            {
+                return this.eventType == ELycaniteEventType.PROCESS_REQPERM ? *(UInt32*)(this.entry + 10) : 0;
+            }
+        }
+
+        // Allocates the string, compare PathHash first
+        public string PathTail
+        {
+            get
+            {
+                return this.eventType == ELycaniteEventType.PROCESS_REQPERM ? new string((char*)(this.entry + 19), 0, this.entry[18]) : "";
+            }
+        }
+
+        // Serialized size of the event inside a batch, 0 if the type is unknown
+        internal int Size
+        {
+            get
+            {
+                switch (this.eventType)
+                {
+                    case ELycaniteEventType.PROCESS_CREATE:
+                        return 17;
+                    case ELycaniteEventType.PROCESS_DESTROY:
+                    case ELycaniteEventType.EVENTS_LOST:
+                        return 9;
+                    case ELycaniteEventType.PROCESS_REQPERM:
+                        return 19 + this.entry[18] * sizeof(char);
+                    default:
+                        return 0;
+                }
+            }
+        }
+
+        // Copies the event out, to keep it past the handler
+        public LycaniteEvent ToEvent()
+        {
+            return new LycaniteEvent(this);
+        }
+    }
+
+    public class LycaniteEvent
+    {
+        internal LycaniteEvent(LycaniteEventView view)
+        {
+            this.eventType = view.eventType;
+            this.UUID = view.UUID;
+            this.ProcessID = view.ProcessID;
+            this.Count = view.Count;
+            this.Operation = view.Operation;
+            this.PathHash = view.PathHash;
+            this.PathTail = view.PathTail;
+        }
+
+        public ELycaniteEventType eventType { get; private set; } = ELycaniteEventType.UNKOWN;
+        public UInt64 UUID { get; private set; } = 0;
+        public UInt64 ProcessID { get; private set; } = 0;
+
+        // Number of events the driver had to drop (EVENTS_LOST), or of denials
+        // coalesced into this one (PROCESS_REQPERM): the first denial of a file
+        // comes with a count of 1, its repeats follow once the window is over
+        public UInt64 Count { get; private set; } = 0;
+
+        // Denied operation, hash of the full path and its last characters (PROCESS_REQPERM)
+        public ELycanitePerm Operation { get; private set; } = ELycanitePerm.LYCANITE_NONE;
+        public UInt32 PathHash { get; private set; } = 0;
+        public string PathTail { get; private set; } = "";
+
+    }
+
+    public class LycaniteProcessStats
+    {
+        // Counters of one operation (write, read or delete)
+        public struct OperationStats
+        {
+            public UInt64 Checks;
+            public UInt64 Allows;
+            public UInt64 Denies;
+        }
+
+        internal const int SIZE = 13 * sizeof(UInt64);
+
+        internal LycaniteProcessStats(byte[] buffer)
+        {
+            this.Write = ReadOperation(buffer, 0);
+            this.Read = ReadOperation(buffer, 1);
+            this.Delete = ReadOperation(buffer, 2);
+            this.NameQueryFailures = BitConverter.ToUInt64(buffer, 9 * sizeof(UInt64));
+            this.LookupProbes = BitConverter.ToUInt64(buffer, 10 * sizeof(UInt64));
+            this.Throttled = BitConverter.ToUInt64(buffer, 11 * sizeof(UInt64));
+            this.ThrottleFailures = BitConverter.ToUInt64(buffer, 12 * sizeof(UInt64));
+        }
+
+        // Checks, allows and denies are laid out as three arrays of (write, read, delete)
+        private static OperationStats ReadOperation(byte[] buffer, int operation)
+        {
+            return new OperationStats
+            {
+                Checks = BitConverter.ToUInt64(buffer, operation * sizeof(UInt64)),
+                Allows = BitConverter.ToUInt64(buffer, (3 + operation) * sizeof(UInt64)),
+                Denies = BitConverter.ToUInt64(buffer, (6 + operation) * sizeof(UInt64)),
+            };
+        }
+
+        public OperationStats Write { get; }
+        public OperationStats Read { get; }
+        public OperationStats Delete { get; }
+
+        // I/O of the sandbox the driver could not get a file name for
+        public UInt64 NameQueryFailures { get; }
+
+        // Permission map lookups, one per parent folder walked
+        public UInt64 LookupProbes { get; }
+
+        // Reads and writes held back by the I/O budget, and those failed once the wait was over
+        public UInt64 Throttled { get; }
+        public UInt64 ThrottleFailures { get; }
+    }
+
+    // A path a sandbox accessed most, see HotPaths.h in the driver
+    public class LycaniteHotPath
+    {
+        internal const int HEADER_SIZE = 9;
+        internal const int MAX_TAIL = 32;
+        internal const int MAX_SIZE = 21 + MAX_TAIL * sizeof(char);
+        internal const int MAX_COUNT = 32;
+
+        internal LycaniteHotPath(byte[] buffer, int offset)
+        {
+            this.PathHash = BitConverter.ToUInt32(buffer, offset);
+            this.Count = BitConverter.ToUInt64(buffer, offset + 4);
+            this.Error = BitConverter.ToUInt64(buffer, offset + 12);
+            int tailLength = buffer[offset + 20];
+            this.Tail = Encoding.Unicode.GetString(buffer, offset + 21, tailLength * sizeof(char));
+            this.Size = 21 + tailLength * sizeof(char);
+        }
+
+        public UInt32 PathHash { get; }
+
+        // Accesses counted, at most Error of them belong to paths it replaced
+        public UInt64 Count { get; }
+        public UInt64 Error { get; }
+
+        // Last characters of the path
+        public string Tail { get; }
+
+        internal int Size { get; }
+    }
+
+    // A rule learned by a sandbox, see LearnedRules.h in the driver
+    public class LycaniteLearnedRule
+    {
+        internal const int HEADER_SIZE = 16;
+        internal const int REPLY_SIZE = 256 * 1024;
+        internal const uint END = UInt32.MaxValue;
+
+        internal LycaniteLearnedRule(byte[] buffer, int offset)
+        {
+            this.Permissions = (ELycanitePerm)buffer[offset];
+            int length = BitConverter.ToUInt16(buffer, offset + 1);
+            this.Path = Encoding.Unicode.GetString(buffer, offset + 3, length * sizeof(char));
+            this.Size = 3 + length * sizeof(char);
+        }
+
+        // A file or, once enough of its files were accessed, their folder
+        public string Path { get; }
+        public ELycanitePerm Permissions { get; }
+
+        internal int Size { get; }
+    }
+
+    // Bytes a sandbox may write and wrote, see WriteQuota.h in the driver
+    public class LycaniteWriteQuota
+    {
+        internal const int SIZE = 3 * sizeof(UInt64);
+
+        internal LycaniteWriteQuota(byte[] buffer)
+        {
+            this.Quota = BitConverter.ToUInt64(buffer, 0);
+            this.Usage = BitConverter.ToUInt64(buffer, 8);
+            this.Denied = BitConverter.ToUInt64(buffer, 16);
+        }
+
+        // 0 for no limit
+        public UInt64 Quota { get; }
+        public UInt64 Usage { get; }
+
+        // Writes refused with STATUS_QUOTA_EXCEEDED
+        public UInt64 Denied { get; }
+    }
+
+    public enum ELycaniteCallback : byte
+    {
+        CREATE = 0,
+        READ = 1,
+        WRITE = 2,
+        SET_INFORMATION = 3,
+    }
+
+    public enum ELycaniteLatencyStage : byte
+    {
+        TOTAL = 0,
+        NAME_QUERY = 1,
+        PROCESS_LOOKUP = 2,
+        POLICY = 3,
+    }
+
+    // Log-linear latency histogram in nanoseconds, see LatencyHistogram.h in the driver
+    public class LycaniteLatencyHistogram
+    {
+        internal const int MAX_SIZE = 11 + 528 * 10;
+
+        internal LycaniteLatencyHistogram(byte[] buffer)
+        {
+            this.SubBucketBits = buffer[0];
+            this.Count = BitConverter.ToUInt64(buffer, 1);
+
+            int buckets = BitConverter.ToUInt16(buffer, 9);
+            this.Indexes = new int[buckets];
+            this.Counts = new UInt64[buckets];
+            for (int i = 0; i < buckets; i++)
+            {
+                this.Indexes[i] = BitConverter.ToUInt16(buffer, 11 + i * 10);
+                this.Counts[i] = BitConverter.ToUInt64(buffer, 13 + i * 10);
+            }
+        }
+
+        public int SubBucketBits { get; }
+        public UInt64 Count { get; }
+
+        // Non-empty buckets, in increasing order
+        public int[] Indexes { get; }
+        public UInt64[] Counts { get; }
+
+        public UInt64 LowerBound(int index)
+        {
+            int subBuckets = 1 << this.SubBucketBits;
+            if (index < subBuckets)
+            {
+                return (UInt64)index;
+            }
+            return (UInt64)(subBuckets + index % subBuckets) << (index / subBuckets - 1);
+        }
+
+        // Lower bound of the bucket holding the quantile, e.g. 0.99 for p99
+        public UInt64 Quantile(double quantile)
+        {
+            UInt64 total = 0;
+            foreach (UInt64 count in this.Counts)
+            {
+                total += count;
+            }
+            if (total == 0)
+            {
+                return 0;
+            }
+
+            UInt64 rank = Math.Max(1, (UInt64)Math.Ceiling(total * quantile));
+            UInt64 seen = 0;
+            for (int i = 0; i < this.Counts.Length; i++)
+            {
+                seen += this.Counts[i];
+                if (seen >= rank)
+                {
+                    return this.LowerBound(this.Indexes[i]);
+                }
+            }
+            return this.LowerBound(this.Indexes[this.Indexes.Length - 1]);
+        }
     }
 
     [Flags]
@@ -113,15 +434,50 @@ namespace Lycanite
             GET_PROCESS_STATS = 3,
             DELETE_AUTHORIATION_PID = 4,
             DELETE_AUTHORIZATION_GLOBAL = 5,
+            SET_EVENT_RING = 6,
+            GET_LATENCY_HISTOGRAM = 7,
+            GET_TRACE = 8,
+            SET_CAPTURE = 9,
+            READ_CAPTURE = 10,
+            SEAL_AUTHORIZATION_PID = 11,
+            GET_HOT_PATHS = 12,
+            SET_LEARNING = 13,
+            GET_LEARNED_RULES = 14,
+            SET_IO_BUDGET = 15,
+            WRITE_QUOTA = 16,
+            SET_AUTHORIZATION_TTL = 17,
         }
 
+        // Shared event ring layout, see SharedRing.h in the driver
+        private const int RING_HEADER_SIZE_OFFSET = 8;
+        private const int RING_CAPACITY_OFFSET = 12;
+        private const int RING_PRODUCER_OFFSET = 64;
+        private const int RING_CONSUMER_OFFSET = 128;
+        private const int RING_ENTRY_HEADER = 2;
+        private const ushort RING_WRAP = 0xFFFF;
+        private const int RING_WAIT_MS = 100;
+
         private IntPtr port;
-        private bool connected;
+        private volatile bool connected;
         private Thread thread;
+        private IntPtr ring = IntPtr.Zero;
+        private EventWaitHandle doorbell;
 
         public delegate void LycaniteEventHandler(LycaniteEvent e);
+        public delegate void LycaniteEventViewHandler(LycaniteEventView e);
 
+        // Copies every event out, prefer OnLycaniteEventView on hot paths
         public event LycaniteEventHandler OnLycaniteEvent;
+        public event LycaniteEventViewHandler OnLycaniteEventView;
+
+        private void Dispatch(LycaniteEventView e)
+        {
+            this.OnLycaniteEventView?.Invoke(e);
+            if (this.OnLycaniteEvent != null)
+            {
+                this.OnLycaniteEvent.Invoke(e.ToEvent());
+            }
+        }
 
         private void MessageReader()
         {
@@ -133,20 +489,94 @@ namespace Lycanite
 
                 if (status == 0)
                 {
-                    SDATA_RECEIVE data = *(SDATA_RECEIVE*)dataReceive.ToPointer();
-                    byte[] buff = new byte[BUFFER_SIZE];
-                    Marshal.Copy((IntPtr)data.messageContent, buff, 0, sizeof(byte) * BUFFER_SIZE);
-                    OnLycaniteEvent.Invoke(new LycaniteEvent(buff));
+                    SDATA_RECEIVE* data = (SDATA_RECEIVE*)dataReceive.ToPointer();
+
+                    // A message is a batch of events ended by a 0 type byte
+                    int offset = 0;
+                    while (offset < BUFFER_SIZE && data->messageContent[offset] != (byte)ELycaniteEventType.UNKOWN)
+                    {
+                        LycaniteEventView e = new LycaniteEventView(data->messageContent + offset);
+                        if (e.Size == 0)
+                        {
+                            break;
+                        }
+                        this.Dispatch(e);
+                        offset += e.Size;
+                    }
                 }
 
             }
             Marshal.FreeHGlobal(dataReceive);
         }
 
+        /*
+         * Consumes the event ring the driver writes into. Events are parsed in
+         * place; the doorbell is only signalled when the ring goes from empty
+         * to non-empty, the timeout covers a missed wakeup.
+         */
+        private void RingReader()
+        {
+            byte* header = (byte*)this.ring.ToPointer();
+            long* producer = (long*)(header + RING_PRODUCER_OFFSET);
+            long* consumer = (long*)(header + RING_CONSUMER_OFFSET);
+            byte* data = header + *(uint*)(header + RING_HEADER_SIZE_OFFSET);
+            long capacity = *(uint*)(header + RING_CAPACITY_OFFSET);
+
+            while (this.connected)
+            {
+                long tail = *consumer;
+                if (tail == Volatile.Read(ref *producer))
+                {
+                    this.doorbell.WaitOne(RING_WAIT_MS);
+                    continue;
+                }
+
+                long pos = tail & (capacity - 1);
+                long contiguous = capacity - pos;
+                ushort size = contiguous >= RING_ENTRY_HEADER ? *(ushort*)(data + pos) : RING_WRAP;
+
+                if (size == RING_WRAP)
+                {
+                    Interlocked.Exchange(ref *consumer, tail + contiguous);
+                    continue;
+                }
+
+                LycaniteEventView e = new LycaniteEventView(data + pos + RING_ENTRY_HEADER);
+                if (e.Size != 0)
+                {
+                    this.Dispatch(e);
+                }
+                Interlocked.Exchange(ref *consumer, tail + RING_ENTRY_HEADER + size);
+            }
+        }
+
+        // Asks the driver to map its event ring in our address space
+        private bool MapEventRing()
+        {
+            this.doorbell = new EventWaitHandle(false, EventResetMode.AutoReset);
+
+            MemoryStream stream = new MemoryStream();
+            using (BinaryWriter writer = new BinaryWriter(stream))
+            {
+                writer.Write((byte)ELycaniteAction.SET_EVENT_RING);
+                writer.Write((UInt64)this.doorbell.SafeWaitHandle.DangerousGetHandle().ToInt64());
+            }
+
+            byte[] reply = new byte[12];
+            if (this.SendStream(stream, reply, out uint replyLength) && replyLength == reply.Length)
+            {
+                this.ring = new IntPtr((long)BitConverter.ToUInt64(reply, 0));
+                return true;
+            }
+
+            this.doorbell.Dispose();
+            this.doorbell = null;
+            return false;
+        }
+
         public LycaniteBridge()
         {
             this.port = Marshal.AllocHGlobal(sizeof(IntPtr));
-            this.thread = new Thread(new ThreadStart(this.MessageReader));
         }
 
         ~LycaniteBridge()
@@ -162,6 +592,15 @@ namespace Lycanite
                 this.connected = FilterConnectCommunicationPort("\\LycaniteFF", 0, IntPtr.Zero, 0, IntPtr.Zero, this.port) == 0;
                 if (this.connected)
                 {
+                    // Older drivers only deliver events over the port
+                    if (this.MapEventRing())
+                    {
+                        this.thread = new Thread(new ThreadStart(this.RingReader));
+                    }
+                    else
+                    {
+                        this.thread = new Thread(new ThreadStart(this.MessageReader));
+                    }
                     this.thread.Start();
                 }
             }
@@ -177,23 +616,55 @@ namespace Lycanite
         {
             if (this.connected)
             {
-                CloseHandle(*(IntPtr*)this.port.ToPointer());
+                this.StopCapture();
                 this.connected = false;
-                this.thread.Abort();
+                if (this.ring != IntPtr.Zero)
+                {
+                    // The driver unmaps the ring when the port closes
+                    this.doorbell.Set();
+                    this.thread.Join();
+                    this.ring = IntPtr.Zero;
+                    this.doorbell.Dispose();
+                    this.doorbell = null;
+                    CloseHandle(*(IntPtr*)this.port.ToPointer());
+                }
+                else
+                {
+                    CloseHandle(*(IntPtr*)this.port.ToPointer());
+                    this.thread.Abort();
+                }
             }
         }
 
         private bool SendStream(MemoryStream stream)
+        {
+            return this.SendStream(stream, null, out uint replyLength);
+        }
+
+        private bool SendStream(MemoryStream stream, byte[] reply, out uint replyLength)
         {
             byte[] bytes = stream.ToArray();
 
             int size = bytes.Length * sizeof(byte);
+            int replySize = reply == null ? 0 : reply.Length;
             IntPtr sendPtr = Marshal.AllocHGlobal(size);
+            IntPtr replyPtr = replySize == 0 ? IntPtr.Zero : Marshal.AllocHGlobal(replySize);
             IntPtr byterec = Marshal.AllocHGlobal(sizeof(uint));
             Marshal.Copy(bytes, 0, sendPtr, size);
+            *(uint*)byterec.ToPointer() = 0;
+
+            bool status = FilterSendMessage(*(IntPtr*)this.port.ToPointer(), sendPtr, (uint)size, replyPtr, (uint)replySize, byterec) == 0;
+            replyLength = *(uint*)byterec.ToPointer();
+            if (status && replySize != 0)
+            {
+                Marshal.Copy(replyPtr, reply, 0, (int)Math.Min(replyLength, (uint)replySize));
+            }
 
-            bool status = FilterSendMessage(*(IntPtr*)this.port.ToPointer(), sendPtr, (uint)size, IntPtr.Zero, 0, byterec) == 0;
             Marshal.FreeHGlobal(sendPtr);
+            if (replyPtr != IntPtr.Zero)
+            {
+                Marshal.FreeHGlobal(replyPtr);
+            }
             Marshal.FreeHGlobal(byterec);
 
             return status;
@@ -253,6 +724,55 @@ namespace Lycanite
             return false;
         }
 
+        // The rule is deleted once the ttl is over, to the driver's 10ms; setting it
+        // again replaces the ttl, and setting it without one makes it permanent
+        public bool SetPIDFilePermissions(UInt64 pid, string file, ELycanitePerm permissions, TimeSpan ttl)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.SET_AUTHORIZATION_TTL);
+                    writer.Write(TtlMilliseconds(ttl));
+                    writer.Write((byte)ELycaniteAction.SET_AUTHORIZATION_PID);
+                    writer.Write(pid);
+                    writer.Write((UInt64)permissions);
+                    writer.Write((UInt16)file.Length);
+                    writer.Write(file.ToCharArray());
+                }
+
+                return this.SendStream(stream);
+            }
+            return false;
+        }
+
+        public bool SetGlobalFilePermissions(string file, ELycanitePerm permissions, TimeSpan ttl)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.SET_AUTHORIZATION_TTL);
+                    writer.Write(TtlMilliseconds(ttl));
+                    writer.Write((byte)ELycaniteAction.SET_AUTHORIZATION_GLOBAL);
+                    writer.Write((UInt64)permissions);
+                    writer.Write((UInt16)file.Length);
+                    writer.Write(file.ToCharArray());
+                }
+
+                return this.SendStream(stream);
+            }
+            return false;
+        }
+
+        private static UInt32 TtlMilliseconds(TimeSpan ttl)
+        {
+            double milliseconds = Math.Ceiling(ttl.TotalMilliseconds);
+            return milliseconds < 1 ? 1 : milliseconds > UInt32.MaxValue ? UInt32.MaxValue : (UInt32)milliseconds;
+        }
+
         public bool DeletePIDFilePermissions(UInt64 pid, string file)
         {
             if (this.IsConnected())
@@ -271,6 +791,356 @@ namespace Lycanite
             return false;
         }
 
+        // Shares the sandbox's rules with the sandboxes sealed with the same rules,
+        // later changes stay private to the sandbox
+        public bool SealPIDFilePermissions(UInt64 pid)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.SEAL_AUTHORIZATION_PID);
+                    writer.Write(pid);
+                }
+
+                return this.SendStream(stream);
+            }
+            return false;
+        }
+
+        // Returns null if the sandbox is unknown to the driver
+        public LycaniteProcessStats GetProcessStats(UInt64 uuid)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.GET_PROCESS_STATS);
+                    writer.Write(uuid);
+                }
+
+                byte[] reply = new byte[LycaniteProcessStats.SIZE];
+                if (this.SendStream(stream, reply, out uint replyLength) && replyLength == reply.Length)
+                {
+                    return new LycaniteProcessStats(reply);
+                }
+            }
+            return null;
+        }
+
+        // The paths the sandbox accessed most, in decreasing order, at most 32 of them.
+        // The driver only tracks them from the first call for the sandbox on, which gets none.
+        // Returns null if the sandbox is unknown to the driver
+        public LycaniteHotPath[] GetHotPaths(UInt64 uuid, byte count)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.GET_HOT_PATHS);
+                    writer.Write(uuid);
+                    writer.Write(count);
+                }
+
+                byte[] reply = new byte[LycaniteHotPath.HEADER_SIZE + LycaniteHotPath.MAX_COUNT * LycaniteHotPath.MAX_SIZE];
+                if (this.SendStream(stream, reply, out uint replyLength) && replyLength >= LycaniteHotPath.HEADER_SIZE)
+                {
+                    LycaniteHotPath[] paths = new LycaniteHotPath[reply[8]];
+                    int offset = LycaniteHotPath.HEADER_SIZE;
+                    for (int i = 0; i < paths.Length; i++)
+                    {
+                        paths[i] = new LycaniteHotPath(reply, offset);
+                        offset += paths[i].Size;
+                    }
+                    return paths;
+                }
+            }
+            return null;
+        }
+
+        // While learning, what the sandbox's rules deny is allowed and learned as rules.
+        // Starting to learn forgets the rules learned before
+        public bool SetLearning(UInt64 uuid, bool enable)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.SET_LEARNING);
+                    writer.Write(uuid);
+                    writer.Write((byte)(enable ? 1 : 0));
+                }
+
+                return this.SendStream(stream);
+            }
+            return false;
+        }
+
+        // Operations and bytes per second the sandbox may read and write, 0 for no limit.
+        // Reads and writes over budget wait for it, up to a second, then fail
+        public bool SetIoBudget(UInt64 uuid, UInt64 readOps, UInt64 readBytes, UInt64 writeOps, UInt64 writeBytes)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.SET_IO_BUDGET);
+                    writer.Write(uuid);
+                    writer.Write(readOps);
+                    writer.Write(readBytes);
+                    writer.Write(writeOps);
+                    writer.Write(writeBytes);
+                }
+
+                return this.SendStream(stream);
+            }
+            return false;
+        }
+
+        // Sets the bytes the sandbox may write, 0 for no limit, and the bytes it wrote; null
+        // leaves either as it is. Writes are accounted from the first one set on, a write
+        // that would cross the quota fails. Returns null if the sandbox is unknown to the driver
+        public LycaniteWriteQuota SetWriteQuota(UInt64 uuid, UInt64? quota, UInt64? usage)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.WRITE_QUOTA);
+                    writer.Write(uuid);
+                    writer.Write((byte)((quota.HasValue ? 1 : 0) | (usage.HasValue ? 2 : 0)));
+                    writer.Write(quota ?? 0);
+                    writer.Write(usage ?? 0);
+                }
+
+                byte[] reply = new byte[LycaniteWriteQuota.SIZE];
+                if (this.SendStream(stream, reply, out uint replyLength) && replyLength == reply.Length)
+                {
+                    return new LycaniteWriteQuota(reply);
+                }
+            }
+            return null;
+        }
+
+        public LycaniteWriteQuota GetWriteQuota(UInt64 uuid)
+        {
+            return this.SetWriteQuota(uuid, null, null);
+        }
+
+        // The rules the sandbox learned, complete once it stopped learning, ready for
+        // SetPIDFilePermissions. Returns null if the driver could not be reached
+        public List<LycaniteLearnedRule> GetLearnedRules(UInt64 uuid, out UInt64 dropped)
+        {
+            dropped = 0;
+            if (!this.IsConnected())
+            {
+                return null;
+            }
+
+            List<LycaniteLearnedRule> rules = new List<LycaniteLearnedRule>();
+            byte[] reply = new byte[LycaniteLearnedRule.REPLY_SIZE];
+            uint cursor = 0;
+            while (cursor != LycaniteLearnedRule.END)
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.GET_LEARNED_RULES);
+                    writer.Write(uuid);
+                    writer.Write(cursor);
+                }
+
+                if (!this.SendStream(stream, reply, out uint replyLength) || replyLength < LycaniteLearnedRule.HEADER_SIZE)
+                {
+                    return null;
+                }
+
+                dropped = BitConverter.ToUInt64(reply, 0);
+                cursor = BitConverter.ToUInt32(reply, 8);
+                uint count = BitConverter.ToUInt32(reply, 12);
+                int offset = LycaniteLearnedRule.HEADER_SIZE;
+                for (uint i = 0; i < count; i++)
+                {
+                    LycaniteLearnedRule rule = new LycaniteLearnedRule(reply, offset);
+                    rules.Add(rule);
+                    offset += rule.Size;
+                }
+            }
+            return rules;
+        }
+
+        // Returns null if the driver was built without LYCANITE_LATENCY
+        public LycaniteLatencyHistogram GetLatencyHistogram(ELycaniteCallback callback, ELycaniteLatencyStage stage)
+        {
+            if (this.IsConnected())
+            {
+                MemoryStream stream = new MemoryStream();
+                using (BinaryWriter writer = new BinaryWriter(stream))
+                {
+                    writer.Write((byte)ELycaniteAction.GET_LATENCY_HISTOGRAM);
+                    writer.Write((byte)callback);
+                    writer.Write((byte)stage);
+                }
+
+                byte[] reply = new byte[LycaniteLatencyHistogram.MAX_SIZE];
+                if (this.SendStream(stream, reply, out uint replyLength) && replyLength >= 11)
+                {
+                    return new LycaniteLatencyHistogram(reply);
+                }
+            }
+            return null;
+        }
+
+        // Trace dump file, decoded by Tools/TraceDecode.c: this header then the raw 40 bytes records
+        private const UInt32 TRACE_DUMP_MAGIC = 0x5254594C; // "LYTR"
+        private const UInt16 TRACE_DUMP_VERSION = 1;
+        private const int TRACE_REPLY_HEADER = 20;
+        private const int TRACE_RECORD_SIZE = 40;
+        private const int TRACE_REPLY_RECORDS = 1024;
+
+        // Drains the trace rings of every CPU into a file. Returns false if the
+        // driver was built without LYCANITE_TRACE
+        public bool DumpTrace(string path)
+        {
+            if (!this.IsConnected())
+            {
+                return false;
+            }
+
+            byte[] reply = new byte[TRACE_REPLY_HEADER + TRACE_REPLY_RECORDS * TRACE_RECORD_SIZE];
+            using (BinaryWriter file = new BinaryWriter(File.Create(path)))
+            {
+                UInt16 cpuCount = 1;
+                for (UInt16 cpu = 0; cpu < cpuCount; cpu++)
+                {
+                    UInt64 from = 0;
+                    while (true)
+                    {
+                        MemoryStream stream = new MemoryStream();
+                        using (BinaryWriter writer = new BinaryWriter(stream))
+                        {
+                            writer.Write((byte)ELycaniteAction.GET_TRACE);
+                            writer.Write(cpu);
+                            writer.Write(from);
+                        }
+
+                        if (!this.SendStream(stream, reply, out uint replyLength) || replyLength < TRACE_REPLY_HEADER)
+                        {
+                            return false;
+                        }
+
+                        if (cpu == 0 && from == 0)
+                        {
+                            cpuCount = BitConverter.ToUInt16(reply, 0);
+                            file.Write(TRACE_DUMP_MAGIC);
+                            file.Write(TRACE_DUMP_VERSION);
+                            file.Write(cpuCount);
+                            file.Write(BitConverter.ToUInt64(reply, 2));
+                        }
+
+                        from = BitConverter.ToUInt64(reply, 10);
+                        UInt16 count = BitConverter.ToUInt16(reply, 18);
+                        if (count == 0)
+                        {
+                            break;
+                        }
+                        file.Write(reply, TRACE_REPLY_HEADER, count * TRACE_RECORD_SIZE);
+                    }
+                }
+            }
+            return true;
+        }
+
+        // Decision capture stream, replayed by Bench/Replay.c
+        private const int CAPTURE_READ_SIZE = 256 * 1024;
+        private const int CAPTURE_POLL_MS = 100;
+        private Thread captureThread;
+        private volatile bool capturing;
+
+        // Records the filter decisions, with the processes and rules they
+        // depend on, to a file until StopCapture
+        public bool StartCapture(string path)
+        {
+            if (!this.IsConnected() || this.capturing)
+            {
+                return false;
+            }
+
+            FileStream file = File.Create(path);
+            if (!this.SetCapture(true))
+            {
+                file.Dispose();
+                return false;
+            }
+
+            this.capturing = true;
+            this.captureThread = new Thread(() => this.CaptureWriter(file));
+            this.captureThread.Start();
+            return true;
+        }
+
+        public void StopCapture()
+        {
+            if (this.capturing)
+            {
+                this.SetCapture(false);
+                this.capturing = false;
+                this.captureThread.Join();
+                this.captureThread = null;
+            }
+        }
+
+        private bool SetCapture(bool enable)
+        {
+            MemoryStream stream = new MemoryStream();
+            using (BinaryWriter writer = new BinaryWriter(stream))
+            {
+                writer.Write((byte)ELycaniteAction.SET_CAPTURE);
+                writer.Write((byte)(enable ? 1 : 0));
+            }
+            return this.SendStream(stream);
+        }
+
+        private void CaptureWriter(FileStream file)
+        {
+            byte[] chunk = new byte[CAPTURE_READ_SIZE];
+            using (file)
+            {
+                bool running = true;
+                while (running)
+                {
+                    // drains one last time once stopped
+                    running = this.capturing;
+
+                    uint read;
+                    do
+                    {
+                        MemoryStream stream = new MemoryStream();
+                        using (BinaryWriter writer = new BinaryWriter(stream))
+                        {
+                            writer.Write((byte)ELycaniteAction.READ_CAPTURE);
+                        }
+                        if (!this.SendStream(stream, chunk, out read))
+                        {
+                            read = 0;
+                        }
+                        file.Write(chunk, 0, (int)read);
+                    } while (read == chunk.Length);
+
+                    if (running)
+                    {
+                        Thread.Sleep(CAPTURE_POLL_MS);
+                    }
+                }
+            }
+        }
+
         public bool DeleteGlobalFilePermissions(string file)
         {
             if (this.IsConnected())
@@ -0,0 +1,259 @@
+/*
+ * Process churn benchmark for the process notify routine.
+ *
+ * A few sandboxes are opened with their rules, then process trees are created
+ * and torn down under them the way a build does: a chain of nested children,
+ * exited deepest first, or every other tree parents first to leave orphans.
+ * Now and then a sandbox is closed and reopened, and processes outside of any
+ * sandbox come and go alongside. The process tree is checked on every chain:
+ * each child belongs to the sandbox and descends from all the levels above.
+ *
+ *   Churn [-n pairs] [-d depth] [-s sandboxes] [-r rules] [-k trees] [-c]
+ *
+ * -n counts create/exit pairs of sandboxed children, -k is the number of
+ * trees between two sandbox restarts. Every notify is timed on its own, and
+ * the driver allocations it made are counted through the shim. The rules of
+ * closed sandboxes are freed by the event worker; the run waits for it to
+ * catch up and checks every closed sandbox went through the reclaim queue.
+ * With -c notifies are timed in thread CPU time, leaving out the worker when
+ * it shares the CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define CHURN_LYCANITE_PID 100
+#define CHURN_FIRST_ROOT 4000000
+#define CHURN_FIRST_CHILD 1000
+#define CHURN_CHILD_PIDS 65536
+#define CHURN_OUTSIDE_PARENT 4
+#define CHURN_PATH_LENGTH 160
+
+enum ChurnEvent {
+    CHURN_ROOT_CREATE = 0,
+    CHURN_ROOT_EXIT = 1,
+    CHURN_CHILD_CREATE = 2,
+    CHURN_CHILD_EXIT = 3,
+    CHURN_OUTSIDE_CREATE = 4,
+    CHURN_OUTSIDE_EXIT = 5,
+    CHURN_EVENTS = 6
+};
+
+static CONST char* eventNames[CHURN_EVENTS] = {
+    "root create", "root exit", "child create", "child exit", "outside create", "outside exit"
+};
+
+typedef struct churnStats_s {
+    LatencyHistogram histogram;
+    UINT64 count;
+    UINT64 total;
+    UINT64 maximum;
+    UINT64 allocations;
+} churnStats;
+
+static UINT32 pairs = 100000;
+static UINT32 depth = 4;
+static UINT32 sandboxes = 8;
+static UINT32 rules = 32;
+static UINT32 restartEvery = 64;
+static BOOLEAN cpuTime = FALSE;
+
+static churnStats* stats = NULL;
+static UINT64* roots = NULL;
+static UINT64 nextRoot = CHURN_FIRST_ROOT;
+static UINT32 nextChild = 0;
+static UINT64 treeErrors = 0;
+
+static VOID sendRule(PFLT_PORT client, UINT64 uuid, UINT64 permissions, CONST char* path) {
+    unsigned char message[19 + CHURN_PATH_LENGTH];
+    UINT16 length = (UINT16)strlen(path);
+
+    message[0] = SET_AUTHORIZATION_PID;
+    writeUINT64(message + 1, uuid);
+    writeUINT64(message + 9, permissions);
+    message[17] = (unsigned char)(length & 0xFF);
+    message[18] = (unsigned char)(length >> 8);
+    memcpy(message + 19, path, length);
+    ShimSendMessage(client, message, 19 + length, NULL, 0, NULL);
+}
+
+static UINT64 now() {
+    if (cpuTime) {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return (UINT64)ts.tv_sec * 1000000000ull + (UINT64)ts.tv_nsec;
+    }
+    return ShimNanoseconds();
+}
+
+static VOID notify(UINT8 event, UINT64 parentId, UINT64 processId, BOOLEAN create) {
+    UINT64 allocations = ShimAllocations();
+    UINT64 start = now();
+    ShimNotifyProcess(parentId, processId, create);
+    UINT64 elapsed = now() - start;
+
+    churnStats* s = &stats[event];
+    LatencyHistogram_record(&s->histogram, elapsed);
+    s->count++;
+    s->total += elapsed;
+    s->maximum = elapsed > s->maximum ? elapsed : s->maximum;
+    s->allocations += ShimAllocations() - allocations;
+}
+
+// Windows hands out multiples of 4 and reuses ids of exited processes
+static UINT64 childPid() {
+    UINT64 pid = CHURN_FIRST_CHILD + (UINT64)(nextChild % CHURN_CHILD_PIDS) * 4;
+    nextChild++;
+    return pid;
+}
+
+static VOID openSandbox(PFLT_PORT client, UINT32 index) {
+    UINT64 pid = nextRoot;
+    nextRoot += 4;
+
+    notify(CHURN_ROOT_CREATE, CHURN_LYCANITE_PID, pid, TRUE);
+    processInfos* pinfo = processSandbox(pid);
+    if (pinfo == NULL) {
+        fprintf(stderr, "sandbox %llu was not created\n", (unsigned long long)pid);
+        exit(1);
+    }
+    roots[index] = pid;
+
+    for (UINT32 r = 0; r < rules; r++) {
+        char path[CHURN_PATH_LENGTH];
+        snprintf(path, sizeof(path), "\\Device\\HarddiskVolume2\\build\\sandbox%02u\\obj\\unit%04u", index, r);
+        sendRule(client, pinfo->uuid, LYCANITE_READ | LYCANITE_WRITE, path);
+    }
+}
+
+static VOID checkTree(UINT32 index, UINT64* chain) {
+    processInfos* pinfo = processSandbox(roots[index]);
+
+    for (UINT32 level = 0; level < depth; level++) {
+        if (processSandbox(chain[level]) != pinfo || !ProcessTree_isAncestor(&processTree, roots[index], chain[level])) {
+            treeErrors++;
+        }
+        for (UINT32 below = level + 1; below < depth; below++) {
+            if (!ProcessTree_isAncestor(&processTree, chain[level], chain[below]) ||
+                ProcessTree_isAncestor(&processTree, chain[below], chain[level])) {
+                treeErrors++;
+            }
+        }
+    }
+}
+
+// A chain of nested children under the sandbox
+static VOID runTree(UINT32 tree, UINT32 index) {
+    UINT64 chain[64];
+    UINT64 parent = roots[index];
+
+    for (UINT32 level = 0; level < depth; level++) {
+        chain[level] = childPid();
+        notify(CHURN_CHILD_CREATE, parent, chain[level], TRUE);
+        parent = chain[level];
+    }
+    checkTree(index, chain);
+
+    UINT64 outside = childPid();
+    notify(CHURN_OUTSIDE_CREATE, CHURN_OUTSIDE_PARENT, outside, TRUE);
+    if (processSandbox(outside) != NULL) {
+        treeErrors++;
+    }
+    notify(CHURN_OUTSIDE_EXIT, 0, outside, FALSE);
+
+    for (UINT32 i = 0; i < depth; i++) {
+        UINT32 level = tree % 2 == 0 ? depth - 1 - i : i;
+        notify(CHURN_CHILD_EXIT, 0, chain[level], FALSE);
+    }
+}
+
+static BOOLEAN parseArguments(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "n:d:s:r:k:c")) != -1) {
+        switch (option) {
+        case 'n': pairs = (UINT32)atoi(optarg); break;
+        case 'd': depth = (UINT32)atoi(optarg); break;
+        case 's': sandboxes = (UINT32)atoi(optarg); break;
+        case 'r': rules = (UINT32)atoi(optarg); break;
+        case 'k': restartEvery = (UINT32)atoi(optarg); break;
+        case 'c': cpuTime = TRUE; break;
+        default:
+            return FALSE;
+        }
+    }
+    return depth > 0 && depth <= 64 && sandboxes > 0 && restartEvery > 0;
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
+        fprintf(stderr, "usage: %s [-n pairs] [-d depth 1-64] [-s sandboxes] [-r rules] [-k trees] [-c]\n", argv[0]);
+        return 1;
+    }
+
+    if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        return 1;
+    }
+    PFLT_PORT client = ShimConnect();
+    unsigned char message[9] = { SET_LYCANITE_PID };
+    writeUINT64(message + 1, CHURN_LYCANITE_PID);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+
+    stats = (churnStats*)calloc(CHURN_EVENTS, sizeof(churnStats));
+    roots = (UINT64*)calloc(sandboxes, sizeof(UINT64));
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        openSandbox(client, i);
+    }
+
+    UINT64 start = ShimNanoseconds();
+    for (UINT32 tree = 0; stats[CHURN_CHILD_EXIT].count < pairs; tree++) {
+        runTree(tree, tree % sandboxes);
+
+        if ((tree + 1) % restartEvery == 0) {
+            UINT32 index = (tree / restartEvery) % sandboxes;
+            notify(CHURN_ROOT_EXIT, 0, roots[index], FALSE);
+            openSandbox(client, index);
+        }
+    }
+    double wall = (double)(ShimNanoseconds() - start) / 1e9;
+
+    UINT64 drainStart = ShimNanoseconds();
+    while (ReclaimQueue_pending(&reclaimQueue) != 0 || ReadPointerAcquire((PVOID volatile*)&reclaiming) != NULL) {
+        usleep(100);
+    }
+    double drain = (double)(ShimNanoseconds() - drainStart) / 1e6;
+
+    printf("%-15s %10s %8s %8s %8s %8s %10s\n", "event", "count", "mean ns", "p50", "p99", "max", "allocs/op");
+    for (UINT32 event = 0; event < CHURN_EVENTS; event++) {
+        churnStats* s = &stats[event];
+        printf("%-15s %10llu %8.0f %8llu %8llu %8llu %10.2f\n", eventNames[event], (unsigned long long)s->count,
+            s->count ? (double)s->total / (double)s->count : 0.0,
+            (unsigned long long)LatencyHistogram_quantile(&s->histogram, 500000),
+            (unsigned long long)LatencyHistogram_quantile(&s->histogram, 990000),
+            (unsigned long long)s->maximum,
+            s->count ? (double)s->allocations / (double)s->count : 0.0);
+    }
+    printf("%llu child pairs in %.2fs, %d processes, %u tree nodes and %d sandboxes tracked at the end, %llu tree errors\n",
+        (unsigned long long)stats[CHURN_CHILD_EXIT].count, wall, ihashmap_length(processTree.index), processTree.nodes,
+        ihashmap_length(controllers[0].sandboxes), (unsigned long long)treeErrors);
+
+    printf("%llu closed sandboxes reclaimed by the event worker, caught up %.2fms after the last exit\n",
+        (unsigned long long)ReadNoFence64(&reclaimQueue.taken), drain);
+
+    // only the roots should be left, every closed sandbox reclaimed
+    BOOLEAN leaked = ihashmap_length(processTree.index) != (INT)sandboxes || processTree.nodes != sandboxes ||
+        ihashmap_length(controllers[0].sandboxes) != (INT)sandboxes ||
+        (UINT64)ReadNoFence64(&reclaimQueue.taken) != stats[CHURN_ROOT_EXIT].count;
+
+    ShimDisconnect(client);
+    ShimUnloadDriver();
+    free(roots);
+    free(stats);
+    return leaked || treeErrors != 0;
+}
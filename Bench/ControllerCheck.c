@@ -0,0 +1,195 @@
+/*
+ * Checks of the isolation between controller connections.
+ *
+ * Only the primary controller, the first to connect, may change the global
+ * rules or capture the decisions; another connection is refused and changes
+ * nothing. A controller that disconnects leaves its sandboxes enforced with
+ * their rules, and no new connection gets its slot, so none can change them,
+ * until they close. Once the primary controller is gone, the next connection
+ * is the primary one.
+ *
+ *   ControllerCheck
+ *
+ * Prints each failure and exits with 1 if there is any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define CHECK_PRIMARY_PID 100
+#define CHECK_SECONDARY_PID 200
+#define CHECK_PROCESS 300 // sandboxed by the secondary controller
+#define CHECK_PATH_LENGTH 160
+
+#define CHECK_FILE "\\Device\\HarddiskVolume2\\Users\\controllers\\file.dat"
+
+static UINT32 failures = 0;
+
+static VOID ignoreEvents(PVOID Context, PFLT_PORT ClientPort, PVOID Buffer, ULONG Length) {
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(ClientPort);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+}
+
+static VOID setPid(PFLT_PORT client, UINT64 pid) {
+    unsigned char message[9];
+    message[0] = SET_LYCANITE_PID;
+    writeUINT64(message + 1, pid);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+static NTSTATUS sendRule(PFLT_PORT client, UINT64 uuid, UINT64 permissions, CONST char* path) {
+    unsigned char message[19 + CHECK_PATH_LENGTH];
+    UINT16 length = (UINT16)strlen(path);
+
+    message[0] = SET_AUTHORIZATION_PID;
+    writeUINT64(message + 1, uuid);
+    writeUINT64(message + 9, permissions);
+    message[17] = (unsigned char)(length & 0xFF);
+    message[18] = (unsigned char)(length >> 8);
+    memcpy(message + 19, path, length);
+    return ShimSendMessage(client, message, 19 + length, NULL, 0, NULL);
+}
+
+static NTSTATUS sendGlobalRule(PFLT_PORT client, UINT64 permissions, CONST char* path) {
+    unsigned char message[11 + CHECK_PATH_LENGTH];
+    UINT16 length = (UINT16)strlen(path);
+
+    message[0] = SET_AUTHORIZATION_GLOBAL;
+    writeUINT64(message + 1, permissions);
+    message[9] = (unsigned char)(length & 0xFF);
+    message[10] = (unsigned char)(length >> 8);
+    memcpy(message + 11, path, length);
+    return ShimSendMessage(client, message, 11 + length, NULL, 0, NULL);
+}
+
+static NTSTATUS deleteGlobalRule(PFLT_PORT client, CONST char* path) {
+    unsigned char message[3 + CHECK_PATH_LENGTH];
+    UINT16 length = (UINT16)strlen(path);
+
+    message[0] = DELETE_AUTHORIZATION_GLOBAL;
+    message[1] = (unsigned char)(length & 0xFF);
+    message[2] = (unsigned char)(length >> 8);
+    memcpy(message + 3, path, length);
+    return ShimSendMessage(client, message, 3 + length, NULL, 0, NULL);
+}
+
+static NTSTATUS setCapture(PFLT_PORT client, UINT8 enable) {
+    unsigned char message[2] = { SET_CAPTURE, enable };
+    return ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+static BOOLEAN readAllowed(ULONG pid, CONST char* path) {
+    WCHAR name[CHECK_PATH_LENGTH];
+    USHORT length = ShimWiden(path, name, CHECK_PATH_LENGTH);
+    FLT_CALLBACK_DATA data;
+    FLT_IO_PARAMETER_BLOCK iopb;
+
+    ShimInitCallbackData(&data, &iopb, IRP_MJ_READ, pid, name, length);
+    iopb.Parameters.Read.Length = 4096;
+    return ShimPreOperation(&data) != FLT_PREOP_COMPLETE;
+}
+
+static VOID expect(CONST char* what, BOOLEAN got, BOOLEAN expected) {
+    if (got != expected) {
+        printf("%s: %s, expected %s\n", what, got ? "yes" : "no", expected ? "yes" : "no");
+        failures++;
+    }
+}
+
+// Slot the driver gave the connection, NULL if none
+static controllerInfos* controllerOfPort(PFLT_PORT client) {
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        if (client != NULL && controllers[slot].clientPort == client) {
+            return &controllers[slot];
+        }
+    }
+    return NULL;
+}
+
+static UINT32 slotOf(PFLT_PORT client) {
+    controllerInfos* cinfo = controllerOfPort(client);
+    return cinfo != NULL ? cinfo->slot : LYCANITE_MAX_CONTROLLERS;
+}
+
+int main() {
+    ShimSetMessageSink(ignoreEvents, NULL);
+    if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        return 1;
+    }
+
+    PFLT_PORT primary = ShimConnect();
+    PFLT_PORT secondary = ShimConnect();
+    if (primary == NULL || secondary == NULL) {
+        fprintf(stderr, "could not connect to the driver\n");
+        return 1;
+    }
+    setPid(primary, CHECK_PRIMARY_PID);
+    setPid(secondary, CHECK_SECONDARY_PID);
+
+    // global rules and the capture
+    UINT64 globalRules = globalPerm.count;
+    expect("secondary sets a global rule", sendGlobalRule(secondary, LYCANITE_READ, CHECK_FILE) == STATUS_SUCCESS, FALSE);
+    expect("global rule set by the secondary", globalPerm.count != globalRules, FALSE);
+    expect("primary sets a global rule", sendGlobalRule(primary, LYCANITE_READ, CHECK_FILE) == STATUS_SUCCESS, TRUE);
+    expect("global rule set by the primary", globalPerm.count != globalRules, TRUE);
+    expect("secondary deletes a global rule", deleteGlobalRule(secondary, CHECK_FILE) == STATUS_SUCCESS, FALSE);
+    expect("global rule left by the secondary", globalPerm.count != globalRules, TRUE);
+    expect("primary deletes a global rule", deleteGlobalRule(primary, CHECK_FILE) == STATUS_SUCCESS, TRUE);
+    expect("global rule deleted by the primary", globalPerm.count != globalRules, FALSE);
+    expect("secondary starts a capture", setCapture(secondary, 1) == STATUS_SUCCESS, FALSE);
+    expect("capture started by the secondary", ReadNoFence(&captureEnabled) != 0, FALSE);
+
+    // a sandbox outliving its controller
+    ShimNotifyProcess(CHECK_SECONDARY_PID, CHECK_PROCESS, TRUE);
+    processInfos* pinfo = processSandbox(CHECK_PROCESS);
+    if (pinfo == NULL) {
+        fprintf(stderr, "the secondary controller could not open a sandbox\n");
+        return 1;
+    }
+    UINT64 uuid = pinfo->uuid;
+    UINT32 orphanSlot = slotOf(secondary);
+    expect("read before the rule", readAllowed(CHECK_PROCESS, CHECK_FILE), FALSE);
+    sendRule(secondary, uuid, LYCANITE_READ, CHECK_FILE);
+    expect("read granted by the secondary", readAllowed(CHECK_PROCESS, CHECK_FILE), TRUE);
+
+    ShimDisconnect(secondary);
+    expect("read granted after the secondary left", readAllowed(CHECK_PROCESS, CHECK_FILE), TRUE);
+
+    PFLT_PORT intruder = ShimConnect();
+    if (intruder == NULL) {
+        fprintf(stderr, "could not connect to the driver\n");
+        return 1;
+    }
+    expect("slot with open sandboxes handed over", slotOf(intruder) == orphanSlot, FALSE);
+    expect("new connection is primary", isPrimaryController(controllerOfPort(intruder)), FALSE);
+    sendRule(intruder, uuid, 0, CHECK_FILE);
+    expect("read granted after another connection changed it", readAllowed(CHECK_PROCESS, CHECK_FILE), TRUE);
+
+    // the slot is free again once its last sandbox closed
+    ShimNotifyProcess(CHECK_SECONDARY_PID, CHECK_PROCESS, FALSE);
+    PFLT_PORT next = ShimConnect();
+    expect("slot free once its sandboxes closed", slotOf(next) == orphanSlot, TRUE);
+
+    // the primary controller hands over to the next connection
+    ShimDisconnect(primary);
+    expect("intruder is primary once the primary left", isPrimaryController(controllerOfPort(intruder)), FALSE);
+    PFLT_PORT replacement = ShimConnect();
+    expect("next connection is primary", isPrimaryController(controllerOfPort(replacement)), TRUE);
+    expect("replacement sets a global rule", sendGlobalRule(replacement, LYCANITE_READ, CHECK_FILE) == STATUS_SUCCESS, TRUE);
+
+    printf("controller isolation: %u failures\n", failures);
+
+    ShimDisconnect(replacement);
+    ShimDisconnect(next);
+    ShimDisconnect(intruder);
+    ShimUnloadDriver();
+    return failures != 0;
+}
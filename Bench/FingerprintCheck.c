@@ -0,0 +1,148 @@
+/*
+ * Checks lookups in the global rules while a writer changes them.
+ *
+ * Reader threads look a rule up in a loop, in read sections as the filter
+ * does, while the writer adds and deletes thousands of other rules around it
+ * on the same volume: the tables are rebuilt under the readers, deletions
+ * leave tombstones in their probes. The rule must be found every time, with
+ * its permissions, in the string mode and both compact modes; make check
+ * builds it with -fsanitize=address, no lookup may touch memory already
+ * freed.
+ *
+ *   FingerprintCheck [-r rounds] [-n rules] [-t threads]
+ *
+ * Prints each failure and exits with 1 if there is any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "Shim.h"
+#include "VolumeRules.h"
+
+#define CHECK_PATH_LENGTH 160
+#define CHECK_MAX_THREADS 16
+#define CHECK_PERMISSIONS 0x5
+
+#define CHECK_VOLUME "\\Device\\HarddiskVolume2"
+#define CHECK_FILE CHECK_VOLUME "\\Users\\fingerprints\\kept\\file.dat"
+
+static VolumeRules rules;
+static GracePeriod grace;
+static volatile LONG stop = 0;
+static volatile LONG64 lookups = 0;
+static volatile LONG64 misses = 0;
+
+static PVOID reader(PVOID context) {
+    UNREFERENCED_PARAMETER(context);
+    WCHAR path[CHECK_PATH_LENGTH];
+    USHORT length = ShimWiden(CHECK_FILE, path, CHECK_PATH_LENGTH);
+    UINT32 volume = VolumeRules_volumeLength(path, length);
+
+    while (!ReadAcquire(&stop)) {
+        volatile LONG* section = GracePeriod_enter(&grace);
+        UINT64 permissions = VolumeRules_permission(&rules, path, length, volume, NULL);
+        GracePeriod_exit(section);
+        if (permissions != CHECK_PERMISSIONS) {
+            InterlockedIncrement64(&misses);
+        }
+        InterlockedIncrement64(&lookups);
+    }
+    return NULL;
+}
+
+static USHORT rulePath(UINT32 i, WCHAR* path) {
+    char narrow[CHECK_PATH_LENGTH];
+    snprintf(narrow, sizeof(narrow), CHECK_VOLUME "\\Users\\fingerprints\\churn\\%u", i);
+    return ShimWiden(narrow, path, CHECK_PATH_LENGTH);
+}
+
+// FALSE if a rule could not be set
+static BOOLEAN churn(UINT32 rounds, UINT32 count) {
+    WCHAR path[CHECK_PATH_LENGTH];
+
+    for (UINT32 round = 0; round < rounds; round++) {
+        for (UINT32 i = 0; i < count; i++) {
+            if (!VolumeRules_set(&rules, path, rulePath(i, path), 1)) {
+                return FALSE;
+            }
+        }
+        // every other one first, the probes end up full of tombstones
+        for (UINT32 i = 0; i < count; i += 2) {
+            VolumeRules_remove(&rules, path, rulePath(i, path));
+        }
+        for (UINT32 i = 1; i < count; i += 2) {
+            VolumeRules_remove(&rules, path, rulePath(i, path));
+        }
+    }
+    return TRUE;
+}
+
+static UINT32 check(UINT8 mode, UINT32 rounds, UINT32 count, UINT32 threads) {
+    WCHAR path[CHECK_PATH_LENGTH];
+    USHORT length = ShimWiden(CHECK_FILE, path, CHECK_PATH_LENGTH);
+    UINT32 failures = 0;
+
+    GracePeriod_init(&grace);
+    if (!VolumeRules_init(&rules, mode, &grace) || !VolumeRules_set(&rules, path, length, CHECK_PERMISSIONS)) {
+        fprintf(stderr, "could not allocate the rules\n");
+        exit(1);
+    }
+    stop = 0;
+    lookups = 0;
+    misses = 0;
+
+    pthread_t readers[CHECK_MAX_THREADS];
+    for (UINT32 t = 0; t < threads; t++) {
+        pthread_create(&readers[t], NULL, reader, NULL);
+    }
+    BOOLEAN churned = churn(rounds, count);
+    InterlockedExchange(&stop, 1);
+    for (UINT32 t = 0; t < threads; t++) {
+        pthread_join(readers[t], NULL);
+    }
+
+    printf("mode %u: %lld lookups, %lld missed the rule, %u rules left\n", mode,
+        (long long)lookups, (long long)misses, rules.count);
+    if (!churned) {
+        printf("mode %u: a rule could not be set\n", mode);
+        failures++;
+    }
+    failures += misses != 0;
+    failures += rules.count != 1;
+
+    VolumeRules_destroy(&rules);
+    GracePeriod_destroy(&grace);
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    UINT32 rounds = 20;
+    UINT32 count = 5000;
+    UINT32 threads = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:t:")) != -1) {
+        switch (opt) {
+        case 'r': rounds = (UINT32)strtoul(optarg, NULL, 10); break;
+        case 'n': count = (UINT32)strtoul(optarg, NULL, 10); break;
+        case 't': threads = (UINT32)strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-r rounds] [-n rules] [-t threads]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (threads == 0 || threads > CHECK_MAX_THREADS) {
+        threads = CHECK_MAX_THREADS;
+    }
+
+    UINT32 failures = check(VOLUMERULES_STRINGS, rounds, count, threads);
+    failures += check(VOLUMERULES_FINGERPRINTS, rounds, count, threads);
+    failures += check(VOLUMERULES_VERIFIED, rounds, count, threads);
+
+    printf("global rules: %u failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Rule memory of identical sandboxes, private and sealed.
+ *
+ * N sandboxes are opened and given the same rules, the way N instances of the
+ * same application are, and the driver's pool is measured; then every sandbox
+ * is sealed and measured again. Sealed sandboxes should hold a single shared
+ * copy of the rules. One sandbox then changes a rule and deletes another: the
+ * change stays private, the others keep their decisions. Reads are checked
+ * against the expected decisions at every step through the pre-operation
+ * callback.
+ *
+ *   Footprint [-n sandboxes] [-r rules] [-d depth]
+ *
+ * -d nests the modules that many node_modules folders deep, as package trees
+ * are, to measure the rules of deep paths sharing most of their components.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define FOOTPRINT_LYCANITE_PID 100
+#define FOOTPRINT_FIRST_PID 1000
+#define FOOTPRINT_PATH_LENGTH 512
+#define FOOTPRINT_FOLDER "\\Device\\HarddiskVolume2\\Program Files\\App"
+
+static UINT32 sandboxes = 50;
+static UINT32 rules = 512;
+static UINT32 depth = 0;
+static UINT64 wrongDecisions = 0;
+static PFLT_PORT client = NULL;
+
+static VOID rulePath(UINT32 rule, char* path) {
+    int length = snprintf(path, FOOTPRINT_PATH_LENGTH, FOOTPRINT_FOLDER "\\lib");
+    for (UINT32 level = 0; level < depth; level++) {
+        length += snprintf(path + length, FOOTPRINT_PATH_LENGTH - length, "\\node_modules\\package%u", (rule >> (2 * (depth - level))) % 4);
+    }
+    snprintf(path + length, FOOTPRINT_PATH_LENGTH - length, "\\module%04u.dll", rule);
+}
+
+// every third module is write only, the folder readable
+static UINT64 rulePermissions(UINT32 rule) {
+    return rule % 3 == 0 ? LYCANITE_WRITE : LYCANITE_READ | LYCANITE_WRITE;
+}
+
+static UINT64 sandboxPid(UINT32 index) {
+    return FOOTPRINT_FIRST_PID + (UINT64)index * 4;
+}
+
+static UINT64 sandboxUuid(UINT32 index) {
+    return processSandbox(sandboxPid(index))->uuid;
+}
+
+static VOID sendRule(UINT8 action, UINT64 uuid, UINT64 permissions, CONST char* path) {
+    unsigned char message[19 + FOOTPRINT_PATH_LENGTH];
+    UINT16 length = (UINT16)strlen(path);
+    ULONG size = 9;
+
+    message[0] = action;
+    writeUINT64(message + 1, uuid);
+    if (action == SET_AUTHORIZATION_PID) {
+        writeUINT64(message + 9, permissions);
+        size = 17;
+    }
+    message[size++] = (unsigned char)(length & 0xFF);
+    message[size++] = (unsigned char)(length >> 8);
+    memcpy(message + size, path, length);
+    ShimSendMessage(client, message, size + length, NULL, 0, NULL);
+}
+
+static VOID seal(UINT32 index) {
+    unsigned char message[9] = { SEAL_AUTHORIZATION_PID };
+    writeUINT64(message + 1, sandboxUuid(index));
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+static BOOLEAN readDenied(UINT32 index, CONST char* narrow) {
+    WCHAR path[FOOTPRINT_PATH_LENGTH];
+    FLT_CALLBACK_DATA data;
+    FLT_IO_PARAMETER_BLOCK iopb;
+
+    ShimInitCallbackData(&data, &iopb, IRP_MJ_READ, (ULONG)sandboxPid(index), path, ShimWiden(narrow, path, FOOTPRINT_PATH_LENGTH));
+    return ShimPreOperation(&data) == FLT_PREOP_COMPLETE;
+}
+
+// Reads of every module by the sandbox; `changed` is the one that went its own way
+static VOID checkReads(UINT32 index, BOOLEAN changed) {
+    for (UINT32 rule = 0; rule < rules; rule++) {
+        char path[FOOTPRINT_PATH_LENGTH];
+        rulePath(rule, path);
+
+        // rule 0 made readable, rule 3 deleted so the folder rule applies
+        BOOLEAN denied = (rulePermissions(rule) & LYCANITE_READ) == 0;
+        if (changed && (rule == 0 || rule == 3)) {
+            denied = FALSE;
+        }
+        if (readDenied(index, path) != denied) {
+            wrongDecisions++;
+        }
+    }
+}
+
+static VOID checkAll(CONST char* stage, BOOLEAN firstChanged) {
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        checkReads(i, firstChanged && i == 0);
+    }
+    printf("%-28s %10.1f KB pool %6u shared sets %llu wrong decisions\n", stage, (double)ShimPoolBytes() / 1024.0,
+        ruleSets.count, (unsigned long long)wrongDecisions);
+}
+
+static BOOLEAN parseArguments(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "n:r:d:")) != -1) {
+        switch (option) {
+        case 'n': sandboxes = (UINT32)atoi(optarg); break;
+        case 'r': rules = (UINT32)atoi(optarg); break;
+        case 'd': depth = (UINT32)atoi(optarg); break;
+        default:
+            return FALSE;
+        }
+    }
+    return sandboxes > 0 && rules > 3 && depth <= 16;
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
+        fprintf(stderr, "usage: %s [-n sandboxes] [-r rules, at least 4] [-d depth, up to 16]\n", argv[0]);
+        return 1;
+    }
+
+    if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        return 1;
+    }
+    client = ShimConnect();
+    unsigned char message[9] = { SET_LYCANITE_PID };
+    writeUINT64(message + 1, FOOTPRINT_LYCANITE_PID);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        ShimNotifyProcess(FOOTPRINT_LYCANITE_PID, sandboxPid(i), TRUE);
+    }
+    UINT64 empty = ShimPoolBytes();
+
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        UINT64 uuid = sandboxUuid(i);
+        sendRule(SET_AUTHORIZATION_PID, uuid, LYCANITE_READ, FOOTPRINT_FOLDER);
+        for (UINT32 rule = 0; rule < rules; rule++) {
+            char path[FOOTPRINT_PATH_LENGTH];
+            rulePath(rule, path);
+            sendRule(SET_AUTHORIZATION_PID, uuid, rulePermissions(rule), path);
+        }
+    }
+    UINT64 privateRules = ShimPoolBytes() - empty;
+    checkAll("private rules", FALSE);
+
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        seal(i);
+    }
+    UINT64 sealedRules = ShimPoolBytes() - empty;
+    checkAll("sealed", FALSE);
+    BOOLEAN shared = ruleSets.count == 1;
+    UINT64 setBytes = shared ? PathTrie_bytes(&processSandbox(sandboxPid(0))->base->rules) : 0;
+
+    // copy on write: only the first sandbox sees its changes
+    char path[FOOTPRINT_PATH_LENGTH];
+    rulePath(0, path);
+    sendRule(SET_AUTHORIZATION_PID, sandboxUuid(0), LYCANITE_READ, path);
+    rulePath(3, path);
+    sendRule(DELETE_AUTHORIZATION_PID, sandboxUuid(0), 0, path);
+    checkAll("one sandbox changed", TRUE);
+
+    seal(0);
+    seal(1);
+    checkAll("changed sandbox resealed", TRUE);
+    shared = shared && ruleSets.count == 2;
+
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        ShimNotifyProcess(0, sandboxPid(i), FALSE);
+    }
+    while (ReclaimQueue_pending(&reclaimQueue) != 0 || ReadPointerAcquire((PVOID volatile*)&reclaiming) != NULL) {
+        usleep(100);
+    }
+    printf("%-28s %10.1f KB pool %6u shared sets\n", "closed", (double)ShimPoolBytes() / 1024.0, ruleSets.count);
+    shared = shared && ruleSets.count == 0;
+
+    printf("%u sandboxes, %u rules each: %.1f KB of rules per sandbox private, %.1f KB sealed, %.1fx smaller\n",
+        sandboxes, rules + 1, (double)privateRules / sandboxes / 1024.0, (double)sealedRules / sandboxes / 1024.0,
+        sealedRules ? (double)privateRules / (double)sealedRules : 0.0);
+    printf("bytes per rule: %.1f private, %.1f in the shared set\n",
+        (double)privateRules / sandboxes / (rules + 1), (double)setBytes / (rules + 1));
+
+    ShimDisconnect(client);
+    ShimUnloadDriver();
+    return wrongDecisions != 0 || !shared;
+}
@@ -0,0 +1,179 @@
+/*
+ * Checks of the latency histogram bucketing, merging and quantiles.
+ *
+ * Every bucket boundary is checked both ways: the lower bound of a bucket
+ * maps back to it, the value just under the next lower bound too, and no
+ * bucket is wider than 1/16 of its lower bound. Values up to 2^20 are then
+ * checked exhaustively, and the powers of two up to 2^63 around the
+ * saturation. Per-CPU histograms merged together must equal one histogram
+ * that recorded everything.
+ *
+ *   HistogramCheck
+ *
+ * Prints each failure and exits with 1 if there is any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Shim.h"
+#include "LatencyHistogram.h"
+
+#define CHECK_EXHAUSTIVE (1ull << 20)
+#define CHECK_MERGED 4
+#define CHECK_SAMPLES 1000000
+
+static UINT64 failures = 0;
+
+static VOID fail(CONST char* what, UINT64 value, UINT64 got, UINT64 expected) {
+    if (failures++ < 20) {
+        printf("%s: %llu gives %llu, expected %llu\n", what, (unsigned long long)value,
+            (unsigned long long)got, (unsigned long long)expected);
+    }
+}
+
+static UINT64 nextRandom(UINT64* state) {
+    UINT64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static VOID checkBoundaries() {
+    for (UINT16 i = 0; i < LATENCY_BUCKETS; i++) {
+        UINT64 lower = LatencyHistogram_lowerBound(i);
+        if (LatencyHistogram_index(lower) != i) {
+            fail("index of the lower bound", lower, LatencyHistogram_index(lower), i);
+        }
+        if (i + 1 == LATENCY_BUCKETS) {
+            break;
+        }
+
+        UINT64 next = LatencyHistogram_lowerBound(i + 1);
+        if (next <= lower) {
+            fail("lower bounds not increasing at bucket", i, next, lower + 1);
+            continue;
+        }
+        if (LatencyHistogram_index(next - 1) != i) {
+            fail("index of the last value", next - 1, LatencyHistogram_index(next - 1), i);
+        }
+        UINT64 width = lower < LATENCY_SUB_BUCKETS ? 1 : lower / LATENCY_SUB_BUCKETS;
+        if (next - lower > width) {
+            fail("width of the bucket starting at", lower, next - lower, width);
+        }
+    }
+}
+
+static VOID checkValues() {
+    UINT16 previous = 0;
+    for (UINT64 value = 0; value < CHECK_EXHAUSTIVE; value++) {
+        UINT16 index = LatencyHistogram_index(value);
+        if (index < previous || index > previous + 1) {
+            fail("index not contiguous", value, index, previous);
+        }
+        if (LatencyHistogram_lowerBound(index) > value) {
+            fail("lower bound above the value", value, LatencyHistogram_lowerBound(index), value);
+        }
+        previous = index;
+    }
+
+    // around every power of two, up to the saturation and past it
+    for (UINT8 bits = 1; bits < 64; bits++) {
+        UINT64 power = 1ull << bits;
+        UINT64 values[] = { power - 1, power, power + 1 };
+
+        for (UINT8 v = 0; v < 3; v++) {
+            UINT16 index = LatencyHistogram_index(values[v]);
+            if (values[v] >= (1ull << LATENCY_MAX_BITS)) {
+                if (index != LATENCY_BUCKETS - 1) {
+                    fail("saturated value", values[v], index, LATENCY_BUCKETS - 1);
+                }
+            }
+            else if (index >= LATENCY_BUCKETS || LatencyHistogram_lowerBound(index) > values[v] ||
+                (index + 1 < LATENCY_BUCKETS && LatencyHistogram_lowerBound(index + 1) <= values[v])) {
+                fail("bucket not holding the value", values[v], index, LatencyHistogram_index(values[v]));
+            }
+        }
+    }
+}
+
+static VOID checkMerge() {
+    LatencyHistogram* all = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+    LatencyHistogram* merged = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+    LatencyHistogram* perCpu = (LatencyHistogram*)calloc(CHECK_MERGED, sizeof(LatencyHistogram));
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+
+    for (UINT32 i = 0; i < CHECK_SAMPLES; i++) {
+        // log-uniform, so every decade up to the saturation gets samples
+        UINT64 value = nextRandom(&seed) >> (nextRandom(&seed) % 64);
+        LatencyHistogram_record(all, value);
+        LatencyHistogram_record(&perCpu[i % CHECK_MERGED], value);
+    }
+    for (UINT8 cpu = 0; cpu < CHECK_MERGED; cpu++) {
+        LatencyHistogram_merge(merged, &perCpu[cpu]);
+    }
+
+    if ((UINT64)merged->count != CHECK_SAMPLES) {
+        fail("merged count", CHECK_SAMPLES, (UINT64)merged->count, CHECK_SAMPLES);
+    }
+    for (UINT16 i = 0; i < LATENCY_BUCKETS; i++) {
+        if (merged->buckets[i] != all->buckets[i]) {
+            fail("merged bucket", i, (UINT64)merged->buckets[i], (UINT64)all->buckets[i]);
+        }
+    }
+    for (UINT32 perMillion = 0; perMillion <= 1000000; perMillion += 10000) {
+        UINT64 got = LatencyHistogram_quantile(merged, perMillion);
+        UINT64 expected = LatencyHistogram_quantile(all, perMillion);
+        if (got != expected) {
+            fail("merged quantile", perMillion, got, expected);
+        }
+    }
+
+    // merging into a histogram that already has samples adds them up
+    LatencyHistogram_merge(merged, all);
+    if ((UINT64)merged->count != 2 * CHECK_SAMPLES) {
+        fail("count merged twice", CHECK_SAMPLES, (UINT64)merged->count, 2 * CHECK_SAMPLES);
+    }
+
+    free(perCpu);
+    free(merged);
+    free(all);
+}
+
+static VOID checkQuantiles() {
+    LatencyHistogram* histogram = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+
+    if (LatencyHistogram_quantile(histogram, 500000) != 0) {
+        fail("quantile of an empty histogram", 500000, LatencyHistogram_quantile(histogram, 500000), 0);
+    }
+
+    // 1 to 1000 once each: the rank of pN is N * 10
+    for (UINT64 value = 1; value <= 1000; value++) {
+        LatencyHistogram_record(histogram, value);
+    }
+    UINT32 quantiles[] = { 0, 1000, 500000, 990000, 999000, 1000000 };
+    UINT64 ranks[] = { 1, 1, 500, 990, 999, 1000 };
+    for (UINT8 q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        UINT64 expected = LatencyHistogram_lowerBound(LatencyHistogram_index(ranks[q]));
+        UINT64 got = LatencyHistogram_quantile(histogram, quantiles[q]);
+        if (got != expected) {
+            fail("quantile per million", quantiles[q], got, expected);
+        }
+    }
+
+    free(histogram);
+}
+
+int main() {
+    checkBoundaries();
+    checkValues();
+    checkMerge();
+    checkQuantiles();
+
+    printf("%d buckets up to %llu ns, %llu failures\n", LATENCY_BUCKETS,
+        (unsigned long long)LatencyHistogram_lowerBound(LATENCY_BUCKETS - 1), (unsigned long long)failures);
+    return failures != 0;
+}
@@ -0,0 +1,687 @@
+/*
+ * Synthetic load generator for the filter callbacks.
+ *
+ * The driver is built as part of this translation unit and loaded through the
+ * shim: sandboxes are spawned with the process notify routine, rules are set
+ * through the communication port, then worker threads hammer the registered
+ * pre-operation callbacks with a mix of creates, reads, writes and deletes.
+ *
+ *   LoadGen [-t threads] [-d seconds] [-s sandboxes] [-f files] [-r rules] [-m read,write,create,delete] [-k controllers] [-c capture] [-h hot%] [-l] [-b ops,bytes] [-q bytes] [-e ttl]
+ *
+ * With -k the sandboxes are shared out between several controller
+ * connections, which set their rules in parallel; every event the driver sends
+ * is checked to reach the controller owning its sandbox. With -c the
+ * decisions are captured to a file, for Replay. With -h that share of the
+ * operations goes to a few hot files, which must come first in the hot paths
+ * the driver reports for the first sandbox, asked to track them before the
+ * load starts. With -l the first sandbox learns instead of being denied, and
+ * once the load is done reads, writes and deletes every file while still
+ * learning; its learned rules are then applied and none of these accesses may
+ * be denied. With -b the first sandbox gets an I/O budget, in operations and
+ * bytes per second for its reads and for its writes, and its I/O that gets
+ * through may not go over it. With -q the first sandbox gets a write
+ * quota; one of its writes in eight fails and one in eight writes half, and
+ * the bytes it wrote must be the usage the driver accounted. With
+ * -e the per-file rules expire after that many milliseconds, every one of them
+ * must be gone once the event worker caught up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define LOADGEN_LYCANITE_PID 100
+#define LOADGEN_FIRST_PID 1000
+#define LOADGEN_PATH_LENGTH 160
+#define LOADGEN_HOT_FILES 8
+#define LOADGEN_IO_SIZE 4096
+
+typedef struct loadGenPath_s {
+    WCHAR name[LOADGEN_PATH_LENGTH];
+    USHORT length;
+} loadGenPath;
+
+typedef struct loadGenWorker_s {
+    pthread_t thread;
+    UINT32 id;
+    UINT64 seed;
+    UINT64 operations;
+    UINT64 denied;
+    UINT64 budgeted[2]; // reads and writes of the first sandbox that got through
+    UINT64 written; // bytes the writes of the first sandbox completed with
+} loadGenWorker;
+
+static UINT32 threads = 4;
+static UINT32 seconds = 5;
+static UINT32 sandboxes = 16;
+static UINT32 files = 4096;
+static UINT32 rules = 64;
+static UINT32 mix[4] = { 60, 25, 10, 5 }; // read, write, create, delete
+static UINT32 controllerCount = 1;
+static CONST char* capturePath = NULL;
+static UINT32 hotShare = 0; // percent of the operations on the hot files
+static BOOLEAN learning = FALSE;
+static UINT64 budget[2] = { 0, 0 }; // operations and bytes per second
+static UINT64 writeQuota = 0; // bytes
+static UINT32 ruleTtl = 0; // milliseconds
+
+static loadGenPath* paths = NULL;
+static PFLT_PORT* clients = NULL;
+static volatile LONG running = 1;
+static volatile LONG64 events = 0;
+static volatile LONG64 misrouted = 0;
+
+static UINT64 nextRandom(UINT64* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// The controllers connect in order, the n-th one gets slot n
+static UINT32 controllerIndex(PFLT_PORT client) {
+    for (UINT32 i = 0; i < controllerCount; i++) {
+        if (clients[i] == client) {
+            return i;
+        }
+    }
+    return controllerCount;
+}
+
+// An event batch: serialized events ended by a 0 type byte
+static VOID countEvents(PVOID Context, PFLT_PORT ClientPort, PVOID Buffer, ULONG Length) {
+    UNREFERENCED_PARAMETER(Context);
+    CONST unsigned char* batch = (CONST unsigned char*)Buffer;
+    UINT32 index = controllerIndex(ClientPort);
+    ULONG offset = 0;
+
+    InterlockedIncrement64(&events);
+    while (offset < Length && batch[offset] != 0) {
+        UINT8 type = batch[offset];
+        ULONG size = type == PROCESS_CREATE ? 17 : type == PROCESS_REQPERM ? 19 + batch[offset + 18] * sizeof(WCHAR) : 9;
+        UINT64 uuid = type == PROCESS_CREATE ? readUINT64(batch + offset + 9) : readUINT64(batch + offset + 1);
+
+        if (type != EVENTS_LOST && LYCANITE_CONTROLLER_SLOT(uuid) != index) {
+            InterlockedIncrement64(&misrouted);
+        }
+        offset += size;
+    }
+}
+
+/*
+ * Half the files live under a folder every sandbox may read and write, the
+ * other half are only reachable through per-file rules (or not at all).
+ */
+static VOID buildPaths() {
+    paths = (loadGenPath*)calloc(files, sizeof(loadGenPath));
+    for (UINT32 i = 0; i < files; i++) {
+        char name[LOADGEN_PATH_LENGTH];
+        snprintf(name, sizeof(name), "\\Device\\HarddiskVolume2\\Users\\bench\\%s\\dir%02u\\file%05u.dat",
+            i % 2 == 0 ? "shared" : "private", i % 64, i);
+        paths[i].length = ShimWiden(name, paths[i].name, LOADGEN_PATH_LENGTH);
+    }
+}
+
+// With a ttl, wrapped in a SET_AUTHORIZATION_TTL
+static VOID sendRule(PFLT_PORT client, UINT64 uuid, UINT64 permissions, CONST char* path, UINT32 ttl) {
+    unsigned char buffer[5 + 19 + LOADGEN_PATH_LENGTH];
+    unsigned char* message = buffer + 5;
+    UINT16 length = (UINT16)strlen(path);
+
+    message[0] = SET_AUTHORIZATION_PID;
+    writeUINT64(message + 1, uuid);
+    writeUINT64(message + 9, permissions);
+    message[17] = (unsigned char)(length & 0xFF);
+    message[18] = (unsigned char)(length >> 8);
+    memcpy(message + 19, path, length);
+    if (ttl == 0) {
+        ShimSendMessage(client, message, 19 + length, NULL, 0, NULL);
+        return;
+    }
+
+    buffer[0] = SET_AUTHORIZATION_TTL;
+    writeUINT32(buffer + 1, ttl);
+    ShimSendMessage(client, buffer, 5 + 19 + length, NULL, 0, NULL);
+}
+
+// Sandbox i is opened by controller i % controllerCount
+static UINT64 controllerPid(UINT32 controller) {
+    return LOADGEN_LYCANITE_PID + controller * 4;
+}
+
+// Rules of the sandboxes of one controller, sent from its own thread
+static PVOID setRules(PVOID Context) {
+    UINT32 controller = (UINT32)(ULONG_PTR)Context;
+
+    for (UINT32 i = controller; i < sandboxes; i += controllerCount) {
+        UINT64 uuid = processSandbox(LOADGEN_FIRST_PID + i)->uuid;
+
+        sendRule(clients[controller], uuid, LYCANITE_READ | LYCANITE_WRITE, "\\Device\\HarddiskVolume2\\Users\\bench\\shared", 0);
+        for (UINT32 r = 0; r < rules; r++) {
+            char path[LOADGEN_PATH_LENGTH];
+            UINT32 file = (r * 2 + 1 + i * 2) % files;
+            snprintf(path, sizeof(path), "\\Device\\HarddiskVolume2\\Users\\bench\\private\\dir%02u\\file%05u.dat", file % 64, file);
+            sendRule(clients[controller], uuid, LYCANITE_READ, path, ruleTtl);
+        }
+    }
+    return NULL;
+}
+
+static VOID setupSandboxes() {
+    for (UINT32 c = 0; c < controllerCount; c++) {
+        unsigned char message[9];
+        message[0] = SET_LYCANITE_PID;
+        writeUINT64(message + 1, controllerPid(c));
+        ShimSendMessage(clients[c], message, sizeof(message), NULL, 0, NULL);
+    }
+
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        UINT64 pid = LOADGEN_FIRST_PID + i;
+        ShimNotifyProcess(controllerPid(i % controllerCount), pid, TRUE);
+        processInfos* pinfo = processSandbox(pid);
+        if (pinfo == NULL || LYCANITE_CONTROLLER_SLOT(pinfo->uuid) != i % controllerCount) {
+            fprintf(stderr, "sandbox %llu was not created by its controller\n", (unsigned long long)pid);
+            exit(1);
+        }
+    }
+
+    pthread_t* setters = (pthread_t*)calloc(controllerCount, sizeof(pthread_t));
+    UINT64 start = ShimNanoseconds();
+    for (UINT32 c = 0; c < controllerCount; c++) {
+        pthread_create(&setters[c], NULL, setRules, (PVOID)(ULONG_PTR)c);
+    }
+    for (UINT32 c = 0; c < controllerCount; c++) {
+        pthread_join(setters[c], NULL);
+    }
+    printf("%llu rules set by %u controllers in %.2fms\n", (unsigned long long)sandboxes * (rules + 1), controllerCount,
+        (double)(ShimNanoseconds() - start) / 1e6);
+    free(setters);
+}
+
+// Completes a write the filter asked to see completed: one in eight fails, one in eight writes half. Returns the bytes written
+static UINT64 completeWrite(PFLT_CALLBACK_DATA data, UINT64 random) {
+    switch ((random >> 32) & 7) {
+    case 0:
+        ShimCompleteOperation(data, STATUS_DISK_FULL, 0);
+        return 0;
+    case 1:
+        ShimCompleteOperation(data, STATUS_SUCCESS, LOADGEN_IO_SIZE / 2);
+        return LOADGEN_IO_SIZE / 2;
+    default:
+        ShimCompleteOperation(data, STATUS_SUCCESS, LOADGEN_IO_SIZE);
+        return LOADGEN_IO_SIZE;
+    }
+}
+
+static PVOID runWorker(PVOID Context) {
+    loadGenWorker* worker = (loadGenWorker*)Context;
+    UINT32 total = mix[0] + mix[1] + mix[2] + mix[3];
+    FILE_DISPOSITION_INFORMATION_EX disposition = { FILE_DISPOSITION_DELETE };
+    FLT_CALLBACK_DATA data;
+    FLT_IO_PARAMETER_BLOCK iopb;
+
+    while (ReadNoFence(&running)) {
+        for (UINT32 batch = 0; batch < 1024; batch++) {
+            UINT64 random = nextRandom(&worker->seed);
+            loadGenPath* path = &paths[(random >> 16) % files];
+            if (hotShare > 0 && (random >> 8) % 100 < hotShare) {
+                path = &paths[nextRandom(&worker->seed) % LOADGEN_HOT_FILES % files];
+            }
+            ULONG pid = LOADGEN_FIRST_PID + (ULONG)((random >> 40) % sandboxes);
+            UINT32 pick = (UINT32)(random % total);
+
+            if (pick < mix[0]) {
+                ShimInitCallbackData(&data, &iopb, IRP_MJ_READ, pid, path->name, path->length);
+                iopb.Parameters.Read.Length = LOADGEN_IO_SIZE;
+            }
+            else if (pick < mix[0] + mix[1]) {
+                ShimInitCallbackData(&data, &iopb, IRP_MJ_WRITE, pid, path->name, path->length);
+                iopb.Parameters.Write.Length = LOADGEN_IO_SIZE;
+            }
+            else if (pick < mix[0] + mix[1] + mix[2]) {
+                ShimInitCallbackData(&data, &iopb, IRP_MJ_CREATE, pid, path->name, path->length);
+                iopb.Parameters.Create.Options = (random & 0x100) ? (FILE_OPEN << 24) : (FILE_OPEN_IF << 24);
+            }
+            else {
+                ShimInitCallbackData(&data, &iopb, IRP_MJ_SET_INFORMATION, pid, path->name, path->length);
+                iopb.Parameters.SetFileInformation.FileInformationClass = FileDispositionInformationEx;
+                iopb.Parameters.SetFileInformation.InfoBuffer = &disposition;
+            }
+
+            FLT_PREOP_CALLBACK_STATUS status = ShimPreOperation(&data);
+            UINT64 written = LOADGEN_IO_SIZE;
+            if (status == FLT_PREOP_SUCCESS_WITH_CALLBACK) {
+                written = completeWrite(&data, random);
+            }
+
+            if (status == FLT_PREOP_COMPLETE) {
+                worker->denied++;
+            }
+            else if (pid == LOADGEN_FIRST_PID && pick < mix[0] + mix[1]) {
+                worker->budgeted[pick < mix[0] ? 0 : 1]++;
+                worker->written += pick < mix[0] ? 0 : written;
+            }
+            worker->operations++;
+        }
+    }
+    return NULL;
+}
+
+static VOID setCapture(PFLT_PORT client, UINT8 enable) {
+    unsigned char message[2] = { SET_CAPTURE, enable };
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+// Moves what the driver captured so far to the file, returns the bytes written
+static UINT64 drainCapture(PFLT_PORT client, FILE* file) {
+    static unsigned char chunk[256 * 1024];
+    unsigned char message[1] = { READ_CAPTURE };
+    UINT64 total = 0;
+    ULONG read;
+
+    do {
+        read = 0;
+        ShimSendMessage(client, message, sizeof(message), chunk, sizeof(chunk), &read);
+        fwrite(chunk, 1, read, file);
+        total += read;
+    } while (read == sizeof(chunk));
+    return total;
+}
+
+// GET_HOT_PATHS for the first sandbox, the driver tracks them from the first one on
+static ULONG getHotPaths(PFLT_PORT client, unsigned char* reply) {
+    unsigned char message[10] = { GET_HOT_PATHS };
+    ULONG length = 0;
+
+    writeUINT64(message + 1, processSandbox(LOADGEN_FIRST_PID)->uuid);
+    message[9] = LOADGEN_HOT_FILES;
+    ShimSendMessage(client, message, sizeof(message), reply, LYCANITE_HOT_PATHS_REPLY_SIZE, &length);
+    return length;
+}
+
+/*
+ * The hot paths of the first sandbox, the hot files should be all of the top
+ * ones. FALSE if one is missing while each makes more than 1/HOTPATHS_ENTRIES
+ * of the operations, the share the summaries never miss.
+ */
+static BOOLEAN checkHotPaths(PFLT_PORT client) {
+    unsigned char reply[LYCANITE_HOT_PATHS_REPLY_SIZE];
+    ULONG length = getHotPaths(client, reply);
+
+    UINT32 count = length >= 9 ? reply[8] : 0;
+    UINT32 found = 0;
+    ULONG offset = 9;
+    printf("hot paths of sandbox 0, %llu samples dropped:\n", (unsigned long long)readUINT64(reply));
+    for (UINT32 i = 0; i < count; i++) {
+        UINT32 hash = (UINT32)(readUINT64(reply + offset) & 0xFFFFFFFF);
+        UINT64 hits = readUINT64(reply + offset + 4);
+        UINT64 error = readUINT64(reply + offset + 12);
+        UINT8 tail = reply[offset + 20];
+        char name[HOTPATHS_TAIL + 1];
+        for (UINT8 c = 0; c < tail; c++) {
+            name[c] = (char)reply[offset + 21 + c * 2];
+        }
+        name[tail] = 0;
+        offset += 21 + tail * 2;
+
+        for (UINT32 f = 0; f < LOADGEN_HOT_FILES && f < files; f++) {
+            if (hashPath(paths[f].name, paths[f].length) == hash) {
+                found++;
+                break;
+            }
+        }
+        printf("  %10llu (error %llu) ...%s\n", (unsigned long long)hits, (unsigned long long)error, name);
+    }
+    printf("hot files in the top %d: %u\n", LOADGEN_HOT_FILES, found);
+
+    UINT32 hotFiles = files < LOADGEN_HOT_FILES ? files : LOADGEN_HOT_FILES;
+    return found == hotFiles || hotShare * HOTPATHS_ENTRIES <= 100 * hotFiles;
+}
+
+static VOID setLearning(PFLT_PORT client, UINT64 uuid, UINT8 enable) {
+    unsigned char message[10] = { SET_LEARNING };
+    writeUINT64(message + 1, uuid);
+    message[9] = enable;
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+// Applies the rules the sandbox learned, returns how many, folders in `folders`
+static UINT32 applyLearnedRules(PFLT_PORT client, UINT64 uuid, UINT32* folders, UINT64* dropped) {
+    static unsigned char reply[LYCANITE_LEARNED_REPLY_MIN];
+    unsigned char message[13] = { GET_LEARNED_RULES };
+    UINT32 cursor = 0;
+    UINT32 applied = 0;
+
+    *folders = 0;
+    writeUINT64(message + 1, uuid);
+    while (cursor != LEARNEDRULES_END) {
+        ULONG length = 0;
+        writeUINT32(message + 9, cursor);
+        ShimSendMessage(client, message, sizeof(message), reply, sizeof(reply), &length);
+        if (length < LYCANITE_LEARNED_HEADER_SIZE) {
+            break;
+        }
+        *dropped = readUINT64(reply);
+        cursor = readUINT32(reply + 8);
+
+        UINT32 count = readUINT32(reply + 12);
+        ULONG offset = LYCANITE_LEARNED_HEADER_SIZE;
+        for (UINT32 i = 0; i < count; i++) {
+            UINT8 permissions = reply[offset];
+            UINT16 pathLength = (UINT16)(reply[offset + 1] | (reply[offset + 2] << 8));
+            char path[LOADGEN_PATH_LENGTH];
+            for (UINT16 c = 0; c < pathLength && c < LOADGEN_PATH_LENGTH - 1; c++) {
+                path[c] = (char)reply[offset + 3 + c * 2];
+            }
+            path[pathLength < LOADGEN_PATH_LENGTH - 1 ? pathLength : LOADGEN_PATH_LENGTH - 1] = 0;
+            offset += 3 + pathLength * 2;
+
+            *folders += strstr(path, ".dat") == NULL;
+            sendRule(client, uuid, permissions, path, 0);
+            applied++;
+        }
+    }
+    return applied;
+}
+
+// A read, a write and a delete of every file by the first sandbox, returns how many were denied
+static UINT32 accessEveryFile() {
+    FILE_DISPOSITION_INFORMATION_EX disposition = { FILE_DISPOSITION_DELETE };
+    FLT_CALLBACK_DATA data;
+    FLT_IO_PARAMETER_BLOCK iopb;
+    UINT32 denied = 0;
+
+    for (UINT32 f = 0; f < files; f++) {
+        ShimInitCallbackData(&data, &iopb, IRP_MJ_READ, LOADGEN_FIRST_PID, paths[f].name, paths[f].length);
+        iopb.Parameters.Read.Length = LOADGEN_IO_SIZE;
+        denied += ShimPreOperation(&data) == FLT_PREOP_COMPLETE;
+        ShimInitCallbackData(&data, &iopb, IRP_MJ_WRITE, LOADGEN_FIRST_PID, paths[f].name, paths[f].length);
+        iopb.Parameters.Write.Length = LOADGEN_IO_SIZE;
+        FLT_PREOP_CALLBACK_STATUS status = ShimPreOperation(&data);
+        if (status == FLT_PREOP_SUCCESS_WITH_CALLBACK) {
+            ShimCompleteOperation(&data, STATUS_SUCCESS, LOADGEN_IO_SIZE);
+        }
+        denied += status == FLT_PREOP_COMPLETE;
+        ShimInitCallbackData(&data, &iopb, IRP_MJ_SET_INFORMATION, LOADGEN_FIRST_PID, paths[f].name, paths[f].length);
+        iopb.Parameters.SetFileInformation.FileInformationClass = FileDispositionInformationEx;
+        iopb.Parameters.SetFileInformation.InfoBuffer = &disposition;
+        denied += ShimPreOperation(&data) == FLT_PREOP_COMPLETE;
+    }
+    return denied;
+}
+
+// No I/O budget and no write quota for the sandbox any more, its rules alone deny
+static VOID liftLimits(PFLT_PORT client, UINT64 uuid) {
+    unsigned char budgetMessage[41] = { SET_IO_BUDGET };
+    writeUINT64(budgetMessage + 1, uuid);
+    ShimSendMessage(client, budgetMessage, sizeof(budgetMessage), NULL, 0, NULL);
+
+    unsigned char quotaMessage[26] = { WRITE_QUOTA };
+    unsigned char reply[LYCANITE_WRITE_QUOTA_REPLY_SIZE];
+    ULONG length = 0;
+    writeUINT64(quotaMessage + 1, uuid);
+    quotaMessage[9] = 0b01;
+    ShimSendMessage(client, quotaMessage, sizeof(quotaMessage), reply, sizeof(reply), &length);
+}
+
+/*
+ * The random load may miss some file or operation, so the first sandbox
+ * reads, writes and deletes every file once more while it learns. It then
+ * gets its learned rules and the same accesses are checked again: FALSE if
+ * any is denied. Its budget and quota are lifted first, they would refuse
+ * accesses its rules allow.
+ */
+static BOOLEAN checkLearnedRules(PFLT_PORT client) {
+    UINT64 uuid = processSandbox(LOADGEN_FIRST_PID)->uuid;
+    UINT32 folders = 0;
+    UINT64 dropped = 0;
+
+    if (budget[0] != 0 || budget[1] != 0 || writeQuota != 0) {
+        liftLimits(client, uuid);
+    }
+    UINT32 learned = accessEveryFile();
+    setLearning(client, uuid, 0);
+    UINT32 applied = applyLearnedRules(client, uuid, &folders, &dropped);
+
+    UINT32 denied = accessEveryFile();
+    printf("sandbox 0 learned %u rules (%u folders), %llu accesses dropped, %u of %u accesses denied while learning, %u once applied\n",
+        applied, folders, (unsigned long long)dropped, learned, files * 3, denied);
+    return learned == 0 && denied == 0;
+}
+
+static VOID setBudget(PFLT_PORT client, UINT64 uuid) {
+    unsigned char message[41] = { SET_IO_BUDGET };
+    writeUINT64(message + 1, uuid);
+    writeUINT64(message + 9, budget[0]);
+    writeUINT64(message + 17, budget[1]);
+    writeUINT64(message + 25, budget[0]);
+    writeUINT64(message + 33, budget[1]);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+// I/O of the first sandbox against its budget, which starts full: a second of I/O more. FALSE if it went over
+static BOOLEAN checkBudget(PFLT_PORT client, loadGenWorker* workers, double elapsed) {
+    unsigned char message[9] = { GET_PROCESS_STATS };
+    unsigned char reply[LYCANITE_STATS_REPLY_SIZE];
+    ULONG length = 0;
+    writeUINT64(message + 1, processSandbox(LOADGEN_FIRST_PID)->uuid);
+    ShimSendMessage(client, message, sizeof(message), reply, sizeof(reply), &length);
+
+    UINT64 done[2] = { 0, 0 };
+    for (UINT32 i = 0; i < threads; i++) {
+        done[0] += workers[i].budgeted[0];
+        done[1] += workers[i].budgeted[1];
+    }
+    // reads and writes get the same budget
+    double byOps = budget[0] ? (double)budget[0] * (elapsed + 1) : 0;
+    double byBytes = budget[1] ? (double)budget[1] * (elapsed + 1) / LOADGEN_IO_SIZE : 0;
+    double allowed = byOps == 0 ? byBytes : byBytes == 0 ? byOps : byOps < byBytes ? byOps : byBytes;
+    printf("sandbox 0 got %llu reads and %llu writes through, its budget allows %.0f of each, %llu throttled, %llu failed\n",
+        (unsigned long long)done[0], (unsigned long long)done[1], allowed,
+        (unsigned long long)(length == sizeof(reply) ? readUINT64(reply + (3 * STATS_OPERATIONS + 2) * sizeof(UINT64)) : 0),
+        (unsigned long long)(length == sizeof(reply) ? readUINT64(reply + (3 * STATS_OPERATIONS + 3) * sizeof(UINT64)) : 0));
+    return (double)done[0] <= allowed && (double)done[1] <= allowed;
+}
+
+static VOID setWriteQuota(PFLT_PORT client, UINT64 uuid) {
+    unsigned char message[26] = { WRITE_QUOTA };
+    unsigned char reply[LYCANITE_WRITE_QUOTA_REPLY_SIZE];
+    ULONG length = 0;
+    writeUINT64(message + 1, uuid);
+    message[9] = 0b11;
+    writeUINT64(message + 10, writeQuota);
+    ShimSendMessage(client, message, sizeof(message), reply, sizeof(reply), &length);
+}
+
+// FALSE if the usage the driver accounted isn't what the first sandbox wrote
+static BOOLEAN checkWriteQuota(PFLT_PORT client, loadGenWorker* workers) {
+    unsigned char message[26] = { WRITE_QUOTA };
+    unsigned char reply[LYCANITE_WRITE_QUOTA_REPLY_SIZE] = { 0 };
+    ULONG length = 0;
+    writeUINT64(message + 1, processSandbox(LOADGEN_FIRST_PID)->uuid);
+    ShimSendMessage(client, message, sizeof(message), reply, sizeof(reply), &length);
+
+    UINT64 written = 0;
+    for (UINT32 i = 0; i < threads; i++) {
+        written += workers[i].written;
+    }
+    printf("sandbox 0 wrote %llu bytes, the driver accounted %llu of its %llu quota, %llu writes refused\n",
+        (unsigned long long)written, (unsigned long long)readUINT64(reply + 8),
+        (unsigned long long)readUINT64(reply), (unsigned long long)readUINT64(reply + 16));
+    return length == sizeof(reply) && readUINT64(reply + 8) == written;
+}
+
+// Waits out the TTL, then every sandbox must be left with its folder rule only: FALSE if not
+static BOOLEAN checkExpiredRules() {
+    UINT64 deadline = ShimNanoseconds() + ((UINT64)ruleTtl + 1000) * 1000000ull;
+    while (ReadNoFence(&timedRules) != 0 && ShimNanoseconds() < deadline) {
+        usleep(1000);
+    }
+
+    UINT32 left = 0;
+    for (UINT32 i = 0; i < sandboxes; i++) {
+        processInfos* pinfo = processSandbox(LOADGEN_FIRST_PID + i);
+        left += hashmap_num_entries(pinfo->permissions) - 1;
+    }
+    printf("%llu rules set with a %ums TTL, %u left, %ld still armed\n",
+        (unsigned long long)sandboxes * rules, ruleTtl, left, (long)ReadNoFence(&timedRules));
+    return left == 0 && ReadNoFence(&timedRules) == 0;
+}
+
+static BOOLEAN parseArguments(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "t:d:s:f:r:m:k:c:h:lb:q:e:")) != -1) {
+        switch (option) {
+        case 't': threads = (UINT32)atoi(optarg); break;
+        case 'd': seconds = (UINT32)atoi(optarg); break;
+        case 's': sandboxes = (UINT32)atoi(optarg); break;
+        case 'f': files = (UINT32)atoi(optarg); break;
+        case 'r': rules = (UINT32)atoi(optarg); break;
+        case 'k': controllerCount = (UINT32)atoi(optarg); break;
+        case 'c': capturePath = optarg; break;
+        case 'h': hotShare = (UINT32)atoi(optarg); break;
+        case 'l': learning = TRUE; break;
+        case 'q': writeQuota = strtoull(optarg, NULL, 10); break;
+        case 'e': ruleTtl = (UINT32)atoi(optarg); break;
+        case 'b':
+            if (sscanf(optarg, "%llu,%llu", (unsigned long long*)&budget[0], (unsigned long long*)&budget[1]) != 2) {
+                return FALSE;
+            }
+            break;
+        case 'm':
+            if (sscanf(optarg, "%u,%u,%u,%u", &mix[0], &mix[1], &mix[2], &mix[3]) != 4) {
+                return FALSE;
+            }
+            break;
+        default:
+            return FALSE;
+        }
+    }
+    return threads > 0 && sandboxes > 0 && files > 0 && mix[0] + mix[1] + mix[2] + mix[3] > 0 &&
+        controllerCount > 0 && controllerCount <= LYCANITE_MAX_CONTROLLERS && hotShare <= 100;
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
+        fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-s sandboxes] [-f files] [-r rules] [-m read,write,create,delete] [-k controllers] [-c capture] [-h hot%%] [-l] [-b ops,bytes] [-q bytes] [-e ttl]\n", argv[0]);
+        return 1;
+    }
+
+    ShimSetMessageSink(countEvents, NULL);
+    if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        return 1;
+    }
+
+    clients = (PFLT_PORT*)calloc(controllerCount, sizeof(PFLT_PORT));
+    for (UINT32 c = 0; c < controllerCount; c++) {
+        clients[c] = ShimConnect();
+        if (clients[c] == NULL) {
+            fprintf(stderr, "could not connect to the driver\n");
+            return 1;
+        }
+    }
+    PFLT_PORT client = clients[0];
+
+    buildPaths();
+    setupSandboxes();
+    if (learning) {
+        setLearning(clients[0], processSandbox(LOADGEN_FIRST_PID)->uuid, 1);
+    }
+    if (budget[0] != 0 || budget[1] != 0) {
+        setBudget(clients[0], processSandbox(LOADGEN_FIRST_PID)->uuid);
+    }
+    if (writeQuota != 0) {
+        setWriteQuota(clients[0], processSandbox(LOADGEN_FIRST_PID)->uuid);
+    }
+    if (hotShare > 0) {
+        unsigned char reply[LYCANITE_HOT_PATHS_REPLY_SIZE];
+        getHotPaths(clients[0], reply);
+    }
+
+    FILE* captureFile = NULL;
+    UINT64 captured = 0;
+    if (capturePath != NULL) {
+        captureFile = fopen(capturePath, "wb");
+        if (captureFile == NULL) {
+            perror(capturePath);
+            return 1;
+        }
+        setCapture(client, 1);
+    }
+
+    loadGenWorker* workers = (loadGenWorker*)calloc(threads, sizeof(loadGenWorker));
+    UINT64 start = ShimNanoseconds();
+    for (UINT32 i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].seed = 0x9E3779B97F4A7C15ull * (i + 1);
+        pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+    }
+
+    if (captureFile != NULL) {
+        while (ShimNanoseconds() - start < (UINT64)seconds * 1000000000ull) {
+            captured += drainCapture(client, captureFile);
+            usleep(10000);
+        }
+    }
+    else {
+        sleep(seconds);
+    }
+    InterlockedExchange(&running, 0);
+
+    UINT64 operations = 0;
+    UINT64 denied = 0;
+    for (UINT32 i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        operations += workers[i].operations;
+        denied += workers[i].denied;
+    }
+    double elapsed = (double)(ShimNanoseconds() - start) / 1e9;
+
+    for (UINT32 i = 0; i < threads; i++) {
+        printf("thread %2u: %12.0f ops/s\n", i, (double)workers[i].operations / elapsed);
+    }
+
+    printf("total: %llu ops in %.2fs, %.0f ops/s, %.1f%% denied, %lld messages, %lld events misrouted\n",
+        (unsigned long long)operations, elapsed, (double)operations / elapsed,
+        operations ? 100.0 * (double)denied / (double)operations : 0.0, (long long)ReadNoFence64(&events),
+        (long long)ReadNoFence64(&misrouted));
+
+    BOOLEAN passed = TRUE;
+    if (hotShare > 0) {
+        passed = checkHotPaths(client) && passed;
+    }
+    if (budget[0] != 0 || budget[1] != 0) {
+        passed = checkBudget(client, workers, elapsed) && passed;
+    }
+    if (writeQuota != 0) {
+        passed = checkWriteQuota(client, workers) && passed;
+    }
+    if (ruleTtl != 0) {
+        passed = checkExpiredRules() && passed;
+    }
+    // last, it adds I/O and rules of its own
+    if (learning) {
+        passed = checkLearnedRules(client) && passed;
+    }
+
+    if (captureFile != NULL) {
+        setCapture(client, 0);
+        captured += drainCapture(client, captureFile);
+        fclose(captureFile);
+        printf("captured %llu bytes to %s\n", (unsigned long long)captured, capturePath);
+    }
+
+    for (UINT32 c = 0; c < controllerCount; c++) {
+        ShimDisconnect(clients[c]);
+    }
+    ShimUnloadDriver();
+    free(workers);
+    free(paths);
+    free(clients);
+    return ReadNoFence64(&misrouted) != 0 || !passed;
+}
@@ -0,0 +1,1077 @@
+/*
+ * Microbenchmarks of the driver data structures: Kashmap, IKashmap,
+ * UUIDRecycler, ProcessTree, the permission lookups of Permissions.h and
+ * PathTrie.h, ProcessStats, TokenBucket, WriteQuota and DenialTable shared by
+ * `n` threads, and TimerWheel with `n` timed rules.
+ *
+ * Only the headers are built, on top of the shim. Results are printed as JSON,
+ * one benchmark per line; with -c the ns/op of a previous run is added to each
+ * line with the ratio against it, so a stored baseline can be compared to.
+ *
+ *   MicroBench [-f filter] [-r repeats] [-c baseline.json] > results.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Shim.h"
+#include "Permissions.h"
+#include "UUIDRecycler.h"
+#include "ProcessTree.h"
+#include "PathTrie.h"
+#include "ProcessStats.h"
+#include "TokenBucket.h"
+#include "WriteQuota.h"
+#include "TimerWheel.h"
+#include "DenialTable.h"
+
+#define BENCH_PATH_LENGTH 256
+#define BENCH_MIN_OPS (1u << 18)
+#define BENCH_BASELINES 256
+#define BENCH_BUCKET_OPS (1u << 20)
+#define BENCH_WRITE_SIZE 4096
+#define BENCH_TIMER_SPAN 65536 // ticks, 11 minutes of 10ms
+#define BENCH_EXPIRY_BATCH 256
+#define BENCH_DENIAL_WINDOW (10000LL * 1000) // 1s of 100ns
+#define BENCH_DENIAL_FILES 4096
+
+typedef struct benchTiming_s {
+    UINT64 ops;
+    UINT64 nanoseconds;
+} benchTiming;
+
+typedef VOID (*benchFunction)(UINT32 n, benchTiming* timing);
+
+typedef struct benchBaseline_s {
+    char name[64];
+    UINT64 n;
+    double nsPerOp;
+} benchBaseline;
+
+static UINT32 repeats = 5;
+static CONST char* filter = NULL;
+static benchBaseline baselines[BENCH_BASELINES];
+static UINT32 baselineCount = 0;
+static BOOLEAN first = TRUE;
+static volatile UINT64 sink = 0;
+
+static UINT64 nextRandom(UINT64* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* ======================================================
+*                       Paths
+*  ======================================================*/
+
+static CONST char* pathRoots[] = {
+    "\\Device\\HarddiskVolume3\\Users\\bench\\AppData\\Local\\Packages\\Microsoft.WindowsTerminal_8wekyb3d8bbwe\\LocalState",
+    "\\Device\\HarddiskVolume3\\Users\\bench\\source\\repos\\lycanite\\build\\x64\\Release\\obj",
+    "\\Device\\HarddiskVolume3\\Program Files\\Microsoft Visual Studio\\2022\\Community\\VC\\Tools\\MSVC\\14.38.33130\\include",
+    "\\Device\\HarddiskVolume3\\Windows\\WinSxS\\amd64_microsoft-windows-servicingstack_31bf3856ad364e35_10.0.22621.2567_none"
+};
+
+/*
+ * Deep file path number `i`: a root, three levels of folders, a file.
+ * Folder `d` of the first level is shared by the files i with i / 256 == d.
+ */
+static USHORT buildPath(UINT32 i, PWCHAR path, USHORT capacity) {
+    char name[BENCH_PATH_LENGTH];
+    snprintf(name, sizeof(name), "%s\\module%03u\\src\\part%02u\\file%06u.cpp",
+        pathRoots[i % 4], (i / 256) % 1000, (i / 16) % 16, i);
+    return ShimWiden(name, path, capacity);
+}
+
+// Folder holding file `i` at the given depth below its root (1 to 3)
+static USHORT buildFolder(UINT32 i, UINT32 depth, PWCHAR path, USHORT capacity) {
+    USHORT length = buildPath(i, path, capacity);
+    for (UINT32 level = depth; level < 4; level++) {
+        while (length > 0 && path[length - 1] != '\\') {
+            length--;
+        }
+        path[--length] = 0;
+    }
+    return length;
+}
+
+static PWCHAR* buildPaths(UINT32 n, UINT32 offset) {
+    PWCHAR* paths = (PWCHAR*)calloc(n, sizeof(PWCHAR));
+    for (UINT32 i = 0; i < n; i++) {
+        paths[i] = (PWCHAR)calloc(BENCH_PATH_LENGTH, sizeof(WCHAR));
+        buildPath(i + offset, paths[i], BENCH_PATH_LENGTH);
+    }
+    return paths;
+}
+
+static VOID freePaths(PWCHAR* paths, UINT32 n) {
+    for (UINT32 i = 0; i < n; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+// Rounds of `n` operations needed to reach BENCH_MIN_OPS
+static UINT32 rounds(UINT32 n) {
+    return n >= BENCH_MIN_OPS ? 1 : (BENCH_MIN_OPS + n - 1) / n;
+}
+
+/* ======================================================
+*                       Kashmap
+*  ======================================================*/
+
+static UINT32 tableSize(UINT32 n) {
+    UINT32 size = 16;
+    while (size < n * 2) {
+        size <<= 1;
+    }
+    return size;
+}
+
+static VOID fillKashmap(struct hashmap_s* map, PWCHAR* keys, UINT32 n) {
+    hashmap_create(tableSize(n), map);
+    for (UINT32 i = 0; i < n; i++) {
+        hashmap_put(map, keys[i], my_strlen(keys[i]), keys[i]);
+    }
+}
+
+static VOID benchKashmapPut(UINT32 n, benchTiming* timing) {
+    PWCHAR* keys = buildPaths(n, 0);
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        struct hashmap_s map;
+        hashmap_create(16, &map);
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            hashmap_put(&map, keys[i], my_strlen(keys[i]), keys[i]);
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+        hashmap_destroy(&map);
+    }
+    freePaths(keys, n);
+}
+
+static VOID benchKashmapGet(UINT32 n, benchTiming* timing, BOOLEAN hit) {
+    PWCHAR* keys = buildPaths(n, 0);
+    PWCHAR* queries = hit ? keys : buildPaths(n, n);
+    struct hashmap_s map;
+    fillKashmap(&map, keys, n);
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            sink += (UINT64)hashmap_get(&map, queries[i], my_strlen(queries[i]));
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+    }
+
+    hashmap_destroy(&map);
+    if (!hit) {
+        freePaths(queries, n);
+    }
+    freePaths(keys, n);
+}
+
+static VOID benchKashmapGetHit(UINT32 n, benchTiming* timing) {
+    benchKashmapGet(n, timing, TRUE);
+}
+
+static VOID benchKashmapGetMiss(UINT32 n, benchTiming* timing) {
+    benchKashmapGet(n, timing, FALSE);
+}
+
+static VOID benchKashmapRemove(UINT32 n, benchTiming* timing) {
+    PWCHAR* keys = buildPaths(n, 0);
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        struct hashmap_s map;
+        fillKashmap(&map, keys, n);
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            hashmap_remove(&map, keys[i], my_strlen(keys[i]), NULL, NULL);
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+        hashmap_destroy(&map);
+    }
+    freePaths(keys, n);
+}
+
+static INT8 countElement(PVOID CONST context, struct hashmap_element_s* CONST e) {
+    *(UINT64*)context += e->key_len;
+    return 0;
+}
+
+static VOID benchKashmapIterate(UINT32 n, benchTiming* timing) {
+    PWCHAR* keys = buildPaths(n, 0);
+    struct hashmap_s map;
+    UINT64 total = 0;
+    fillKashmap(&map, keys, n);
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        UINT64 start = ShimNanoseconds();
+        hashmap_iterate_pairs(&map, countElement, &total);
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+    }
+    sink += total;
+
+    hashmap_destroy(&map);
+    freePaths(keys, n);
+}
+
+static VOID benchKashmapRehash(UINT32 n, benchTiming* timing) {
+    PWCHAR* keys = buildPaths(n, 0);
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        struct hashmap_s map;
+        fillKashmap(&map, keys, n);
+        UINT64 start = ShimNanoseconds();
+        hashmap_rehash_helper(&map);
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+        hashmap_destroy(&map);
+    }
+    freePaths(keys, n);
+}
+
+/* ======================================================
+*                       IKashmap
+*  ======================================================*/
+
+// Process ids are multiples of 4 on Windows
+static UINT64 processId(UINT32 i) {
+    return 4 + (UINT64)i * 4;
+}
+
+static map_t fillIKashmap(UINT32 n) {
+    map_t map = ihashmap_new();
+    for (UINT32 i = 0; i < n; i++) {
+        ihashmap_put(map, processId(i), (any_t)(ULONG_PTR)(i + 1));
+    }
+    return map;
+}
+
+static VOID benchIKashmapPut(UINT32 n, benchTiming* timing) {
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        map_t map = ihashmap_new();
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            ihashmap_put(map, processId(i), (any_t)(ULONG_PTR)(i + 1));
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+        ihashmap_free(map);
+    }
+}
+
+static VOID benchIKashmapGet(UINT32 n, benchTiming* timing, BOOLEAN hit) {
+    map_t map = fillIKashmap(n);
+    any_t value;
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            // misses are odd, never a process id
+            ihashmap_get(map, hit ? processId(i) : processId(i) + 1, &value);
+            sink += (UINT64)value;
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+    }
+    ihashmap_free(map);
+}
+
+static VOID benchIKashmapGetHit(UINT32 n, benchTiming* timing) {
+    benchIKashmapGet(n, timing, TRUE);
+}
+
+static VOID benchIKashmapGetMiss(UINT32 n, benchTiming* timing) {
+    benchIKashmapGet(n, timing, FALSE);
+}
+
+static VOID benchIKashmapRemove(UINT32 n, benchTiming* timing) {
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        map_t map = fillIKashmap(n);
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            ihashmap_remove(map, processId(i), NULL);
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+        ihashmap_free(map);
+    }
+}
+
+static INT countValue(any_t item, any_t data) {
+    *(UINT64*)item += (UINT64)data;
+    return MAP_OK;
+}
+
+static VOID benchIKashmapIterate(UINT32 n, benchTiming* timing) {
+    map_t map = fillIKashmap(n);
+    UINT64 total = 0;
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        UINT64 start = ShimNanoseconds();
+        ihashmap_iterate(map, countValue, &total);
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+    }
+    sink += total;
+    ihashmap_free(map);
+}
+
+// `n` elements in a half full table, rehashed into one twice as large
+static VOID benchIKashmapRehash(UINT32 n, benchTiming* timing) {
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        hashmap_map* map = (hashmap_map*)calloc(1, sizeof(hashmap_map));
+        map->data = (hashmap_element*)calloc(2 * n, sizeof(hashmap_element));
+        map->table_size = (INT)(2 * n);
+        for (UINT32 i = 0; i < n; i++) {
+            ihashmap_put(map, processId(i), (any_t)(ULONG_PTR)(i + 1));
+        }
+
+        UINT64 start = ShimNanoseconds();
+        ihashmap_rehash(map);
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+        ihashmap_free(map);
+    }
+}
+
+/* ======================================================
+*                       UUIDRecycler
+*  ======================================================*/
+
+/*
+ * `n` sandboxes alive, one is closed and another opened per operation.
+ */
+static VOID benchUUIDChurn(UINT32 n, benchTiming* timing) {
+    UUIDRecycler* recycler = UUIDRecycler_create(16);
+    UUID* live = (UUID*)calloc(n, sizeof(UUID));
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+
+    for (UINT32 i = 0; i < n; i++) {
+        live[i] = UUIDRecycler_getUUID(recycler);
+    }
+
+    UINT64 ops = (UINT64)rounds(n) * n;
+    UINT64 start = ShimNanoseconds();
+    for (UINT64 i = 0; i < ops; i++) {
+        UINT32 slot = (UINT32)(nextRandom(&seed) % n);
+        UUIDRecycler_recycleUUID(recycler, live[slot]);
+        live[slot] = UUIDRecycler_getUUID(recycler);
+    }
+    timing->nanoseconds += ShimNanoseconds() - start;
+    timing->ops += ops;
+
+    free(live);
+    UUIDRecycler_destroy(recycler);
+}
+
+/* ======================================================
+*                       ProcessTree
+*  ======================================================*/
+
+/*
+ * `n` processes of one sandbox, each the child of a random earlier one, as
+ * process ids 4, 8, ...
+ */
+static VOID fillProcessTree(ProcessTree* tree, ProcessSet* set, UINT32 n, UINT64* seed) {
+    ProcessNode** nodes = (ProcessNode**)calloc(n, sizeof(ProcessNode*));
+
+    ProcessTree_init(tree);
+    for (UINT32 i = 0; i < n; i++) {
+        ProcessNode* parent = i == 0 ? NULL : nodes[nextRandom(seed) % i];
+        nodes[i] = ProcessTree_add(tree, processId(i), parent, set, set);
+    }
+    free(nodes);
+}
+
+static VOID benchProcessTreeSandbox(UINT32 n, benchTiming* timing) {
+    ProcessTree tree;
+    ProcessSet set = { NULL, 0 };
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+    fillProcessTree(&tree, &set, n, &seed);
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            sink += (UINT64)ProcessTree_sandbox(&tree, processId(i));
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+    }
+    ProcessTree_destroy(&tree);
+}
+
+static VOID benchProcessTreeIsAncestor(UINT32 n, benchTiming* timing) {
+    ProcessTree tree;
+    ProcessSet set = { NULL, 0 };
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+    fillProcessTree(&tree, &set, n, &seed);
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            UINT64 random = nextRandom(&seed);
+            sink += ProcessTree_isAncestor(&tree, processId((UINT32)(random % n)), processId((UINT32)((random >> 32) % n)));
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+    }
+    ProcessTree_destroy(&tree);
+}
+
+/*
+ * A process created and exited under a random live one, `n` live.
+ */
+static VOID benchProcessTreeChurn(UINT32 n, benchTiming* timing) {
+    ProcessTree tree;
+    ProcessSet set = { NULL, 0 };
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+    fillProcessTree(&tree, &set, n, &seed);
+
+    UINT64 ops = (UINT64)rounds(n) * n;
+    UINT64 start = ShimNanoseconds();
+    for (UINT64 i = 0; i < ops; i++) {
+        ProcessNode* parent = ProcessTree_find(&tree, processId((UINT32)(nextRandom(&seed) % n)));
+        ProcessNode* node = ProcessTree_add(&tree, processId(n), parent, &set, &set);
+        ProcessTree_remove(&tree, node);
+    }
+    timing->nanoseconds += ShimNanoseconds() - start;
+    timing->ops += ops;
+    ProcessTree_destroy(&tree);
+}
+
+/* ======================================================
+*                       Permissions
+*  ======================================================*/
+
+/*
+ * `n` rules on folders at every depth. Queries are files granted by a rule on
+ * their deepest folder, on their top one, or files of another volume that no
+ * rule covers and whose walk goes up to the root. `interned` looks them up in
+ * the PathTrie of the rules instead of the Kashmap.
+ */
+static VOID benchPermissions(UINT32 n, benchTiming* timing, UINT32 depth, BOOLEAN interned) {
+    struct hashmap_s rules;
+    PathTrie trie;
+    UINT64 permissions = 2; // LYCANITE_READ, Driver.h is not part of the build
+    UINT32 queries = 4096;
+
+    hashmap_create(tableSize(n), &rules);
+    for (UINT32 i = 0; i < n; i++) {
+        PWCHAR folder = (PWCHAR)calloc(BENCH_PATH_LENGTH, sizeof(WCHAR));
+        // spread over files far apart so rules don't share folders
+        USHORT length = buildFolder(i * 4099, depth == 0 ? 1 + i % 3 : depth, folder, BENCH_PATH_LENGTH);
+        if (hashmap_get(&rules, folder, length) == HASHMAP_NULL) {
+            hashmap_put(&rules, folder, length, &permissions);
+        }
+        else {
+            free(folder);
+        }
+    }
+
+    PWCHAR* paths = (PWCHAR*)calloc(queries, sizeof(PWCHAR));
+    for (UINT32 i = 0; i < queries; i++) {
+        paths[i] = (PWCHAR)calloc(BENCH_PATH_LENGTH, sizeof(WCHAR));
+        buildPath((i % n) * 4099, paths[i], BENCH_PATH_LENGTH);
+        if (depth == 0) {
+            // same file on another volume, no rule covers it
+            paths[i][22] = '4';
+        }
+    }
+
+    USHORT* lengths = (USHORT*)calloc(queries, sizeof(USHORT));
+    for (UINT32 i = 0; i < queries; i++) {
+        lengths[i] = (USHORT)my_strlen(paths[i]);
+    }
+    if (interned) {
+        PathTrie_build(&trie, &rules);
+    }
+
+    UINT32 r = rounds(queries) / 4 + 1;
+    for (UINT32 round = 0; round < r; round++) {
+        UINT64 start = ShimNanoseconds();
+        if (interned) {
+            for (UINT32 i = 0; i < queries; i++) {
+                sink += PathTrie_permission(&trie, paths[i], lengths[i], NULL);
+            }
+        }
+        else {
+            for (UINT32 i = 0; i < queries; i++) {
+                sink += getFilePermission(paths[i], &rules, NULL);
+            }
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += queries;
+    }
+
+    if (interned) {
+        PathTrie_destroy(&trie);
+    }
+    free(lengths);
+    freePaths(paths, queries);
+    UINT64 total = 0;
+    hashmap_iterate_pairs(&rules, countElement, &total);
+    sink += total;
+    for (UINT32 i = 0; i < rules.table_size; i++) {
+        if (rules.data[i].in_use) {
+            free(rules.data[i].key);
+        }
+    }
+    hashmap_destroy(&rules);
+}
+
+static VOID benchPermissionsDeep(UINT32 n, benchTiming* timing) {
+    benchPermissions(n, timing, 3, FALSE);
+}
+
+static VOID benchPermissionsShallow(UINT32 n, benchTiming* timing) {
+    benchPermissions(n, timing, 1, FALSE);
+}
+
+static VOID benchPermissionsMiss(UINT32 n, benchTiming* timing) {
+    benchPermissions(n, timing, 0, FALSE);
+}
+
+static VOID benchPathTrieDeep(UINT32 n, benchTiming* timing) {
+    benchPermissions(n, timing, 3, TRUE);
+}
+
+static VOID benchPathTrieShallow(UINT32 n, benchTiming* timing) {
+    benchPermissions(n, timing, 1, TRUE);
+}
+
+static VOID benchPathTrieMiss(UINT32 n, benchTiming* timing) {
+    benchPermissions(n, timing, 0, TRUE);
+}
+
+/* ======================================================
+*                       ProcessStats
+*  ======================================================*/
+
+typedef struct benchStatsThread_s {
+    pthread_t thread;
+    ProcessStats* stats;
+    UINT64 ops;
+} benchStatsThread;
+
+// What countCheck does for every checked operation
+static PVOID countChecks(PVOID Context) {
+    benchStatsThread* worker = (benchStatsThread*)Context;
+    for (UINT64 i = 0; i < worker->ops; i++) {
+        processStatsCounters* counters = ProcessStats_local(worker->stats);
+        UINT8 op = (UINT8)(i % STATS_OPERATIONS);
+        InterlockedIncrement64(&counters->checks[op]);
+        InterlockedIncrement64((i & 1) ? &counters->denies[op] : &counters->allows[op]);
+        InterlockedExchangeAdd64(&counters->lookupProbes, 2);
+    }
+    return NULL;
+}
+
+/*
+ * `n` threads counting checks in the counters of one sandbox. ns/op is the
+ * wall time over the checks of all threads. With oneSlot every thread shares
+ * the slot of a single CPU: the interlocked counters shared by all CPUs the
+ * per-CPU slots replace.
+ */
+static VOID benchProcessStats(UINT32 n, benchTiming* timing, BOOLEAN oneSlot) {
+    ProcessStats* stats = ProcessStats_create();
+    if (oneSlot) {
+        stats->cpuCount = 1;
+    }
+
+    benchStatsThread* workers = (benchStatsThread*)calloc(n, sizeof(benchStatsThread));
+    UINT64 start = ShimNanoseconds();
+    for (UINT32 i = 0; i < n; i++) {
+        workers[i].stats = stats;
+        workers[i].ops = BENCH_BUCKET_OPS / n;
+        pthread_create(&workers[i].thread, NULL, countChecks, &workers[i]);
+    }
+    for (UINT32 i = 0; i < n; i++) {
+        pthread_join(workers[i].thread, NULL);
+        timing->ops += workers[i].ops;
+    }
+    timing->nanoseconds += ShimNanoseconds() - start;
+
+    processStatsCounters total;
+    ProcessStats_sum(stats, &total);
+    sink += (UINT64)total.lookupProbes;
+    free(workers);
+    ProcessStats_destroy(stats);
+}
+
+static VOID benchProcessStatsPerCpu(UINT32 n, benchTiming* timing) {
+    benchProcessStats(n, timing, FALSE);
+}
+
+static VOID benchProcessStatsSharedCounters(UINT32 n, benchTiming* timing) {
+    benchProcessStats(n, timing, TRUE);
+}
+
+/* ======================================================
+*                       TokenBucket
+*  ======================================================*/
+
+typedef struct benchBucketThread_s {
+    pthread_t thread;
+    TokenBucket* bucket;
+    UINT64 ops;
+    UINT64 granted;
+} benchBucketThread;
+
+static PVOID acquireTokens(PVOID Context) {
+    benchBucketThread* worker = (benchBucketThread*)Context;
+    for (UINT64 i = 0; i < worker->ops; i++) {
+        worker->granted += TokenBucket_acquire(worker->bucket, 1, (LONG64)KeQueryInterruptTime());
+    }
+    return NULL;
+}
+
+/*
+ * `n` threads acquiring a token at a time, the clock read included. ns/op is
+ * the wall time over the acquires of all threads. With oneSlot every thread
+ * shares the slot of a single CPU, as a bucket without per-CPU slots would.
+ */
+static VOID benchTokenBucket(UINT32 n, benchTiming* timing, UINT64 rate, UINT64 burst, BOOLEAN oneSlot) {
+    TokenBucket bucket;
+    TokenBucket_create(&bucket);
+    if (oneSlot) {
+        bucket.cpuCount = 1;
+    }
+    TokenBucket_setRate(&bucket, rate, burst, (LONG64)KeQueryInterruptTime());
+
+    benchBucketThread* workers = (benchBucketThread*)calloc(n, sizeof(benchBucketThread));
+    UINT64 start = ShimNanoseconds();
+    for (UINT32 i = 0; i < n; i++) {
+        workers[i].bucket = &bucket;
+        workers[i].ops = BENCH_BUCKET_OPS / n;
+        pthread_create(&workers[i].thread, NULL, acquireTokens, &workers[i]);
+    }
+    for (UINT32 i = 0; i < n; i++) {
+        pthread_join(workers[i].thread, NULL);
+        timing->ops += workers[i].ops;
+        sink += workers[i].granted;
+    }
+    timing->nanoseconds += ShimNanoseconds() - start;
+
+    free(workers);
+    TokenBucket_destroy(&bucket);
+}
+
+// The bucket never runs dry: the per-CPU slots, refilled in batches
+static VOID benchTokenBucketPerCpu(UINT32 n, benchTiming* timing) {
+    benchTokenBucket(n, timing, TOKENBUCKET_MAX_RATE, 0, FALSE);
+}
+
+static VOID benchTokenBucketOneSlot(UINT32 n, benchTiming* timing) {
+    benchTokenBucket(n, timing, TOKENBUCKET_MAX_RATE, 0, TRUE);
+}
+
+// A million tokens a second, 10ms of burst, for more acquires than that: most fail on the shared bucket
+static VOID benchTokenBucketThrottled(UINT32 n, benchTiming* timing) {
+    benchTokenBucket(n, timing, 1000000, 10000, FALSE);
+}
+
+/* ======================================================
+*                       WriteQuota
+*  ======================================================*/
+
+typedef struct benchQuotaThread_s {
+    pthread_t thread;
+    WriteQuota* quota; // NULL for the shared counter
+    volatile LONG64* counter;
+    UINT64 ops;
+    UINT64 allowed;
+} benchQuotaThread;
+
+static PVOID chargeWrites(PVOID Context) {
+    benchQuotaThread* worker = (benchQuotaThread*)Context;
+    for (UINT64 i = 0; i < worker->ops; i++) {
+        worker->allowed += WriteQuota_charge(worker->quota, BENCH_WRITE_SIZE);
+    }
+    return NULL;
+}
+
+// What the quota replaces: every write added to one counter shared by all CPUs
+static PVOID addWrites(PVOID Context) {
+    benchQuotaThread* worker = (benchQuotaThread*)Context;
+    for (UINT64 i = 0; i < worker->ops; i++) {
+        LONG64 written = InterlockedExchangeAdd64(worker->counter, BENCH_WRITE_SIZE) + BENCH_WRITE_SIZE;
+        worker->allowed += written <= WRITEQUOTA_MAX;
+    }
+    return NULL;
+}
+
+/*
+ * `n` threads accounting writes of BENCH_WRITE_SIZE bytes. ns/op is the wall
+ * time over the writes of all threads. With oneSlot every thread shares the
+ * allowance of a single CPU; without a quota, a shared counter is added to.
+ */
+static VOID benchWriteQuota(UINT32 n, benchTiming* timing, WriteQuota* quota, BOOLEAN oneSlot) {
+    volatile LONG64 counter = 0;
+    if (quota != NULL && oneSlot) {
+        quota->cpuCount = 1;
+    }
+
+    benchQuotaThread* workers = (benchQuotaThread*)calloc(n, sizeof(benchQuotaThread));
+    UINT64 start = ShimNanoseconds();
+    for (UINT32 i = 0; i < n; i++) {
+        workers[i].quota = quota;
+        workers[i].counter = &counter;
+        workers[i].ops = BENCH_BUCKET_OPS / n;
+        pthread_create(&workers[i].thread, NULL, quota != NULL ? chargeWrites : addWrites, &workers[i]);
+    }
+    for (UINT32 i = 0; i < n; i++) {
+        pthread_join(workers[i].thread, NULL);
+        timing->ops += workers[i].ops;
+        sink += workers[i].allowed;
+    }
+    timing->nanoseconds += ShimNanoseconds() - start;
+
+    free(workers);
+    WriteQuota_destroy(quota);
+}
+
+// No limit: the allowances are the largest, folded every WRITEQUOTA_MAX_ALLOWANCE bytes
+static VOID benchWriteQuotaPerCpu(UINT32 n, benchTiming* timing) {
+    benchWriteQuota(n, timing, WriteQuota_create(), FALSE);
+}
+
+static VOID benchWriteQuotaOneSlot(UINT32 n, benchTiming* timing) {
+    benchWriteQuota(n, timing, WriteQuota_create(), TRUE);
+}
+
+static VOID benchWriteQuotaSharedCounter(UINT32 n, benchTiming* timing) {
+    benchWriteQuota(n, timing, NULL, FALSE);
+}
+
+// A quota of half the writes: allowances shrink as it runs out, the other half is refused
+static VOID benchWriteQuotaExhausted(UINT32 n, benchTiming* timing) {
+    WriteQuota* quota = WriteQuota_create();
+    WriteQuota_setQuota(quota, (UINT64)BENCH_BUCKET_OPS / 2 * BENCH_WRITE_SIZE);
+    benchWriteQuota(n, timing, quota, FALSE);
+}
+
+/* ======================================================
+*                       DenialTable
+*  ======================================================*/
+
+typedef struct benchDenialThread_s {
+    pthread_t thread;
+    DenialTable* table;
+    PWCHAR* paths;
+    UINT32* hashes;
+    UINT32* lengths;
+    UINT32 files;
+    UINT64 ops;
+} benchDenialThread;
+
+static volatile LONG64 denialsEmitted = 0;
+
+static VOID countDenial(lycaniteEvent* event) {
+    InterlockedExchangeAdd64(&denialsEmitted, event->count);
+}
+
+// A process denied in a loop, the clock read included as in isRestricted
+static PVOID recordDenials(PVOID Context) {
+    benchDenialThread* worker = (benchDenialThread*)Context;
+    UINT64 uuid = (UINT64)(ULONG_PTR)worker;
+    for (UINT64 i = 0; i < worker->ops; i++) {
+        UINT32 f = (UINT32)(i % worker->files);
+        DenialTable_record(worker->table, uuid, 1, worker->hashes[f], worker->paths[f], worker->lengths[f],
+            (LONG64)KeQueryInterruptTime());
+    }
+    return NULL;
+}
+
+/*
+ * `n` threads, each a process denied on `files` files over and over. ns/op is
+ * the wall time over the denials of all threads. With one file every repeat
+ * is coalesced in its window; with BENCH_DENIAL_FILES the threads keep
+ * evicting each other's slots.
+ */
+static VOID benchDenialTable(UINT32 n, benchTiming* timing, UINT32 files) {
+    DenialTable* table = DenialTable_create(1024, BENCH_DENIAL_WINDOW, countDenial);
+    PWCHAR* paths = buildPaths(files, 0);
+    UINT32* hashes = (UINT32*)calloc(files, sizeof(UINT32));
+    UINT32* lengths = (UINT32*)calloc(files, sizeof(UINT32));
+    for (UINT32 i = 0; i < files; i++) {
+        lengths[i] = (UINT32)my_strlen(paths[i]);
+        hashes[i] = hashPath(paths[i], lengths[i]);
+    }
+
+    benchDenialThread* workers = (benchDenialThread*)calloc(n, sizeof(benchDenialThread));
+    UINT64 start = ShimNanoseconds();
+    for (UINT32 i = 0; i < n; i++) {
+        workers[i].table = table;
+        workers[i].paths = paths;
+        workers[i].hashes = hashes;
+        workers[i].lengths = lengths;
+        workers[i].files = files;
+        workers[i].ops = BENCH_BUCKET_OPS / n;
+        pthread_create(&workers[i].thread, NULL, recordDenials, &workers[i]);
+    }
+    for (UINT32 i = 0; i < n; i++) {
+        pthread_join(workers[i].thread, NULL);
+        timing->ops += workers[i].ops;
+    }
+    timing->nanoseconds += ShimNanoseconds() - start;
+
+    DenialTable_flush(table, 0, TRUE);
+    sink += (UINT64)InterlockedExchange64(&denialsEmitted, 0);
+    free(workers);
+    free(hashes);
+    free(lengths);
+    freePaths(paths, files);
+    DenialTable_destroy(table);
+}
+
+static VOID benchDenialTableSameFile(UINT32 n, benchTiming* timing) {
+    benchDenialTable(n, timing, 1);
+}
+
+static VOID benchDenialTableManyFiles(UINT32 n, benchTiming* timing) {
+    benchDenialTable(n, timing, BENCH_DENIAL_FILES);
+}
+
+/* ======================================================
+*                       TimerWheel
+*  ======================================================*/
+
+// `n` timers armed at random in the BENCH_TIMER_SPAN ticks after `now`
+static TimerWheelNode* armTimers(TimerWheel* wheel, UINT32 n, UINT64 now, UINT64* seed) {
+    TimerWheelNode* nodes = (TimerWheelNode*)calloc(n, sizeof(TimerWheelNode));
+    TimerWheel_init(wheel, now);
+    for (UINT32 i = 0; i < n; i++) {
+        TimerWheel_insert(wheel, &nodes[i], now + 1 + nextRandom(seed) % BENCH_TIMER_SPAN);
+    }
+    return nodes;
+}
+
+static VOID benchTimerWheelInsert(UINT32 n, benchTiming* timing) {
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+    TimerWheelNode* nodes = (TimerWheelNode*)calloc(n, sizeof(TimerWheelNode));
+    TimerWheel wheel;
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        TimerWheel_init(&wheel, 0);
+        UINT64 start = ShimNanoseconds();
+        for (UINT32 i = 0; i < n; i++) {
+            TimerWheel_insert(&wheel, &nodes[i], 1 + nextRandom(&seed) % BENCH_TIMER_SPAN);
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += n;
+    }
+    free(nodes);
+}
+
+/*
+ * `n` rules set again with a new TTL at random, one tick passing every 64 of
+ * them: the rules expiring are popped in batches and set again too. An
+ * operation is a rule set again, or popped.
+ */
+static VOID benchTimerWheelChurn(UINT32 n, benchTiming* timing) {
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+    TimerWheel wheel;
+    TimerWheelNode* nodes = armTimers(&wheel, n, 0, &seed);
+    UINT64 now = 0;
+
+    UINT64 ops = (UINT64)rounds(n) * n;
+    UINT64 popped = 0;
+    UINT64 start = ShimNanoseconds();
+    for (UINT64 i = 0; i < ops; i++) {
+        TimerWheelNode* node = &nodes[nextRandom(&seed) % n];
+        if (node->link != NULL) {
+            TimerWheel_remove(&wheel, node);
+        }
+        TimerWheel_insert(&wheel, node, now + 1 + nextRandom(&seed) % BENCH_TIMER_SPAN);
+
+        if ((i & 63) == 63) {
+            now++;
+            for (;;) {
+                UINT32 budget = BENCH_EXPIRY_BATCH;
+                while ((node = TimerWheel_pop(&wheel, now, &budget)) != NULL) {
+                    TimerWheel_insert(&wheel, node, now + 1 + nextRandom(&seed) % BENCH_TIMER_SPAN);
+                    popped++;
+                }
+                if (budget != 0) {
+                    break;
+                }
+            }
+        }
+    }
+    timing->nanoseconds += ShimNanoseconds() - start;
+    timing->ops += ops + popped;
+    free(nodes);
+}
+
+// `n` rules expiring over BENCH_TIMER_SPAN ticks, all popped in batches once over
+static VOID benchTimerWheelExpire(UINT32 n, benchTiming* timing) {
+    UINT64 seed = 0x9E3779B97F4A7C15ull;
+    TimerWheel wheel;
+
+    for (UINT32 r = 0; r < rounds(n); r++) {
+        TimerWheelNode* nodes = armTimers(&wheel, n, 0, &seed);
+        UINT64 popped = 0;
+        UINT64 start = ShimNanoseconds();
+        while (wheel.count != 0) {
+            UINT32 budget = BENCH_EXPIRY_BATCH;
+            while (TimerWheel_pop(&wheel, BENCH_TIMER_SPAN, &budget) != NULL) {
+                popped++;
+            }
+        }
+        timing->nanoseconds += ShimNanoseconds() - start;
+        timing->ops += popped;
+        free(nodes);
+    }
+}
+
+/* ======================================================
+*                       Harness
+*  ======================================================*/
+
+static VOID loadBaseline(CONST char* path) {
+    char line[512];
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL && baselineCount < BENCH_BASELINES) {
+        benchBaseline* baseline = &baselines[baselineCount];
+        unsigned long long n;
+        CONST char* object = strstr(line, "{\"name\"");
+        if (object != NULL && sscanf(object, "{\"name\": \"%63[^\"]\", \"n\": %llu, \"ns_per_op\": %lf",
+            baseline->name, &n, &baseline->nsPerOp) == 3) {
+            baseline->n = n;
+            baselineCount++;
+        }
+    }
+    fclose(file);
+}
+
+static CONST benchBaseline* findBaseline(CONST char* name, UINT32 n) {
+    for (UINT32 i = 0; i < baselineCount; i++) {
+        if (baselines[i].n == n && strcmp(baselines[i].name, name) == 0) {
+            return &baselines[i];
+        }
+    }
+    return NULL;
+}
+
+// Best of `repeats` runs
+static VOID run(CONST char* name, benchFunction function, UINT32 n) {
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    double best = 0;
+    UINT64 ops = 0;
+    for (UINT32 i = 0; i < repeats; i++) {
+        benchTiming timing = { 0, 0 };
+        function(n, &timing);
+        double nsPerOp = (double)timing.nanoseconds / (double)timing.ops;
+        if (i == 0 || nsPerOp < best) {
+            best = nsPerOp;
+            ops = timing.ops;
+        }
+    }
+
+    printf("%s    {\"name\": \"%s\", \"n\": %u, \"ns_per_op\": %.2f, \"ops\": %llu",
+        first ? "" : ",\n", name, n, best, (unsigned long long)ops);
+    CONST benchBaseline* baseline = findBaseline(name, n);
+    if (baseline != NULL) {
+        printf(", \"baseline_ns_per_op\": %.2f, \"ratio\": %.3f", baseline->nsPerOp, best / baseline->nsPerOp);
+    }
+    printf("}");
+    fflush(stdout);
+    first = FALSE;
+}
+
+int main(int argc, char** argv) {
+    static CONST UINT32 mapSizes[] = { 64, 1024, 16384 };
+    static CONST UINT32 processCounts[] = { 16, 256, 4096 };
+    static CONST UINT32 ruleCounts[] = { 10, 100, 1000, 10000 };
+    static CONST UINT32 threadCounts[] = { 1, 2, 4, 8 };
+    static CONST UINT32 timerCounts[] = { 1000, 1000000 };
+    int option;
+
+    while ((option = getopt(argc, argv, "f:r:c:")) != -1) {
+        switch (option) {
+        case 'f': filter = optarg; break;
+        case 'r': repeats = (UINT32)atoi(optarg); break;
+        case 'c': loadBaseline(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-f filter] [-r repeats] [-c baseline.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (repeats == 0) {
+        repeats = 1;
+    }
+
+    printf("{\n  \"suite\": \"MicroBench\",\n  \"version\": 1,\n  \"results\": [\n");
+
+    for (UINT32 i = 0; i < sizeof(mapSizes) / sizeof(mapSizes[0]); i++) {
+        run("kashmap/put", benchKashmapPut, mapSizes[i]);
+        run("kashmap/get_hit", benchKashmapGetHit, mapSizes[i]);
+        run("kashmap/get_miss", benchKashmapGetMiss, mapSizes[i]);
+        run("kashmap/remove", benchKashmapRemove, mapSizes[i]);
+        run("kashmap/iterate", benchKashmapIterate, mapSizes[i]);
+        run("kashmap/rehash", benchKashmapRehash, mapSizes[i]);
+    }
+    for (UINT32 i = 0; i < sizeof(processCounts) / sizeof(processCounts[0]); i++) {
+        run("ikashmap/put", benchIKashmapPut, processCounts[i]);
+        run("ikashmap/get_hit", benchIKashmapGetHit, processCounts[i]);
+        run("ikashmap/get_miss", benchIKashmapGetMiss, processCounts[i]);
+        run("ikashmap/remove", benchIKashmapRemove, processCounts[i]);
+        run("ikashmap/iterate", benchIKashmapIterate, processCounts[i]);
+        run("ikashmap/rehash", benchIKashmapRehash, processCounts[i]);
+        run("uuid/churn", benchUUIDChurn, processCounts[i]);
+        run("processtree/sandbox", benchProcessTreeSandbox, processCounts[i]);
+        run("processtree/is_ancestor", benchProcessTreeIsAncestor, processCounts[i]);
+        run("processtree/churn", benchProcessTreeChurn, processCounts[i]);
+    }
+    for (UINT32 i = 0; i < sizeof(ruleCounts) / sizeof(ruleCounts[0]); i++) {
+        run("permissions/deep_rule", benchPermissionsDeep, ruleCounts[i]);
+        run("permissions/shallow_rule", benchPermissionsShallow, ruleCounts[i]);
+        run("permissions/no_rule", benchPermissionsMiss, ruleCounts[i]);
+        run("pathtrie/deep_rule", benchPathTrieDeep, ruleCounts[i]);
+        run("pathtrie/shallow_rule", benchPathTrieShallow, ruleCounts[i]);
+        run("pathtrie/no_rule", benchPathTrieMiss, ruleCounts[i]);
+    }
+    for (UINT32 i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+        run("processstats/per_cpu", benchProcessStatsPerCpu, threadCounts[i]);
+        run("processstats/shared_counters", benchProcessStatsSharedCounters, threadCounts[i]);
+    }
+    for (UINT32 i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+        run("tokenbucket/per_cpu", benchTokenBucketPerCpu, threadCounts[i]);
+        run("tokenbucket/one_slot", benchTokenBucketOneSlot, threadCounts[i]);
+        run("tokenbucket/throttled", benchTokenBucketThrottled, threadCounts[i]);
+    }
+    for (UINT32 i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+        run("writequota/per_cpu", benchWriteQuotaPerCpu, threadCounts[i]);
+        run("writequota/one_slot", benchWriteQuotaOneSlot, threadCounts[i]);
+        run("writequota/shared_counter", benchWriteQuotaSharedCounter, threadCounts[i]);
+        run("writequota/exhausted", benchWriteQuotaExhausted, threadCounts[i]);
+    }
+    for (UINT32 i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+        run("denialtable/same_file", benchDenialTableSameFile, threadCounts[i]);
+        run("denialtable/many_files", benchDenialTableManyFiles, threadCounts[i]);
+    }
+    for (UINT32 i = 0; i < sizeof(timerCounts) / sizeof(timerCounts[0]); i++) {
+        run("timerwheel/insert", benchTimerWheelInsert, timerCounts[i]);
+        run("timerwheel/churn", benchTimerWheelChurn, timerCounts[i]);
+        run("timerwheel/expire", benchTimerWheelExpire, timerCounts[i]);
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
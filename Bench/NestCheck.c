@@ -0,0 +1,151 @@
+/*
+ * Checks of sandboxes nested in the sandbox of their controller.
+ *
+ * A first controller opens a sandbox around a second controller's process,
+ * which then opens a sandbox of its own: the nested sandbox grants more than
+ * the one enclosing it, and every access must still be held to both. The
+ * controller process exits first, which must keep its sandbox enforced until
+ * the nested one closes too, then both must be gone.
+ *
+ *   NestCheck
+ *
+ * Prints each failure and exits with 1 if there is any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define NEST_OUTER_CONTROLLER 100
+#define NEST_INNER_CONTROLLER 200 // sandboxed by the outer controller
+#define NEST_PROCESS 300 // sandboxed by the inner controller
+#define NEST_PATH_LENGTH 160
+
+#define NEST_SHARED "\\Device\\HarddiskVolume2\\Users\\nest\\shared\\file.dat"
+#define NEST_OTHER "\\Device\\HarddiskVolume2\\Users\\nest\\other\\file.dat"
+
+static UINT32 failures = 0;
+
+static VOID ignoreEvents(PVOID Context, PFLT_PORT ClientPort, PVOID Buffer, ULONG Length) {
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(ClientPort);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+}
+
+static VOID setPid(PFLT_PORT client, UINT64 pid) {
+    unsigned char message[9];
+    message[0] = SET_LYCANITE_PID;
+    writeUINT64(message + 1, pid);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+static VOID sendRule(PFLT_PORT client, UINT64 uuid, UINT64 permissions, CONST char* path) {
+    unsigned char message[19 + NEST_PATH_LENGTH];
+    UINT16 length = (UINT16)strlen(path);
+
+    message[0] = SET_AUTHORIZATION_PID;
+    writeUINT64(message + 1, uuid);
+    writeUINT64(message + 9, permissions);
+    message[17] = (unsigned char)(length & 0xFF);
+    message[18] = (unsigned char)(length >> 8);
+    memcpy(message + 19, path, length);
+    ShimSendMessage(client, message, 19 + length, NULL, 0, NULL);
+}
+
+// TRUE if the driver lets the read or write through
+static BOOLEAN allowed(ULONG pid, UCHAR major, CONST char* path) {
+    WCHAR name[NEST_PATH_LENGTH];
+    USHORT length = ShimWiden(path, name, NEST_PATH_LENGTH);
+    FLT_CALLBACK_DATA data;
+    FLT_IO_PARAMETER_BLOCK iopb;
+
+    ShimInitCallbackData(&data, &iopb, major, pid, name, length);
+    if (major == IRP_MJ_READ) {
+        iopb.Parameters.Read.Length = 4096;
+    }
+    else {
+        iopb.Parameters.Write.Length = 4096;
+    }
+    return ShimPreOperation(&data) != FLT_PREOP_COMPLETE;
+}
+
+static VOID expect(CONST char* what, BOOLEAN got, BOOLEAN expected) {
+    if (got != expected) {
+        printf("%s: %s, expected %s\n", what, got ? "yes" : "no", expected ? "yes" : "no");
+        failures++;
+    }
+}
+
+static BOOLEAN opened(UINT32 slot, UINT64 uuid) {
+    processInfos* pinfo = NULL;
+    FltAcquirePushLockShared(&controllers[slot].lock);
+    BOOLEAN found = ihashmap_get(controllers[slot].sandboxes, uuid, (any_t*)&pinfo) == MAP_OK;
+    FltReleasePushLock(&controllers[slot].lock);
+    return found;
+}
+
+int main() {
+    ShimSetMessageSink(ignoreEvents, NULL);
+    if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        return 1;
+    }
+
+    PFLT_PORT outer = ShimConnect();
+    PFLT_PORT inner = ShimConnect();
+    if (outer == NULL || inner == NULL) {
+        fprintf(stderr, "could not connect to the driver\n");
+        return 1;
+    }
+
+    setPid(outer, NEST_OUTER_CONTROLLER);
+    ShimNotifyProcess(NEST_OUTER_CONTROLLER, NEST_INNER_CONTROLLER, TRUE);
+    processInfos* enclosing = processSandbox(NEST_INNER_CONTROLLER);
+    if (enclosing == NULL) {
+        fprintf(stderr, "the inner controller was not sandboxed\n");
+        return 1;
+    }
+    UINT64 enclosingUuid = enclosing->uuid;
+    sendRule(outer, enclosingUuid, LYCANITE_READ, NEST_SHARED);
+
+    setPid(inner, NEST_INNER_CONTROLLER);
+    ShimNotifyProcess(NEST_INNER_CONTROLLER, NEST_PROCESS, TRUE);
+    processInfos* nested = processSandbox(NEST_PROCESS);
+    if (nested == NULL || nested == enclosing) {
+        fprintf(stderr, "the inner controller could not open a sandbox\n");
+        return 1;
+    }
+    UINT64 nestedUuid = nested->uuid;
+    sendRule(inner, nestedUuid, LYCANITE_READ | LYCANITE_WRITE, NEST_SHARED);
+    sendRule(inner, nestedUuid, LYCANITE_READ, NEST_OTHER);
+
+    expect("nested sandbox encloses", nested->enclosing == enclosing, TRUE);
+    expect("read granted by both", allowed(NEST_PROCESS, IRP_MJ_READ, NEST_SHARED), TRUE);
+    expect("write granted by the nested sandbox only", allowed(NEST_PROCESS, IRP_MJ_WRITE, NEST_SHARED), FALSE);
+    expect("read granted by the nested sandbox only", allowed(NEST_PROCESS, IRP_MJ_READ, NEST_OTHER), FALSE);
+    expect("controller read in its own sandbox", allowed(NEST_INNER_CONTROLLER, IRP_MJ_READ, NEST_SHARED), TRUE);
+    expect("controller write in its own sandbox", allowed(NEST_INNER_CONTROLLER, IRP_MJ_WRITE, NEST_SHARED), FALSE);
+
+    // the controller goes first, its sandbox still holds the nested one
+    ShimNotifyProcess(NEST_OUTER_CONTROLLER, NEST_INNER_CONTROLLER, FALSE);
+    expect("enclosing sandbox open after its last process", opened(0, enclosingUuid), TRUE);
+    expect("write still denied by the enclosing sandbox", allowed(NEST_PROCESS, IRP_MJ_WRITE, NEST_SHARED), FALSE);
+    expect("read still granted by both", allowed(NEST_PROCESS, IRP_MJ_READ, NEST_SHARED), TRUE);
+
+    ShimNotifyProcess(NEST_INNER_CONTROLLER, NEST_PROCESS, FALSE);
+    expect("nested sandbox open after its last process", opened(1, nestedUuid), FALSE);
+    expect("enclosing sandbox open after the nested one", opened(0, enclosingUuid), FALSE);
+    expect("process sandboxed after its exit", processSandbox(NEST_PROCESS) != NULL, FALSE);
+
+    printf("nested sandboxes: %u failures\n", failures);
+
+    ShimDisconnect(inner);
+    ShimDisconnect(outer);
+    ShimUnloadDriver();
+    return failures != 0;
+}
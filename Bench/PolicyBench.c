@@ -0,0 +1,380 @@
+/*
+ * Policy snapshot benchmark: compile and load a large global policy.
+ *
+ * Rules are generated into a text file and compiled with PolicyCompile, in
+ * each layout: hashed, front-coded. Each snapshot is mapped and opened in
+ * place, the way a user-mode reader would, and loaded by DriverEntry through
+ * the PolicySnapshot value. Exact
+ * paths, files below a rule and paths outside of every rule are looked up in
+ * the mapping and checked against the generated permissions, and a sandboxed
+ * process is checked to be denied by the loaded rules. Wildcard rules are
+ * generated too: paths they match are looked up in the snapshot automaton and,
+ * on a sample, by matching every pattern in turn. For comparison the
+ * same rules are then set one by one over the communication port, once in
+ * each CompactPolicy mode: paths, fingerprints, fingerprints verified.
+ *
+ *   PolicyBench [-n rules] [-g patterns] [-l lookups] [-c compiler] [-p] [-m mode]
+ *
+ * -p skips the port comparison, which takes a while with a million rules,
+ * -m runs it in a single mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define POLICY_LYCANITE_PID 100
+#define POLICY_SANDBOX_PID 1000
+#define POLICY_PATH_LENGTH 128
+#define POLICY_BATCH 1024 // lookups timed together
+#define POLICY_NAIVE_LOOKUPS 2000 // a pattern at a time is slow
+
+enum PolicyLookup {
+    POLICY_EXACT = 0,
+    POLICY_BELOW = 1,
+    POLICY_OUTSIDE = 2,
+    POLICY_PATTERN = 3,
+    POLICY_LOOKUPS = 4
+};
+
+static CONST char* lookupNames[POLICY_LOOKUPS] = { "exact", "below", "outside", "pattern" };
+
+static UINT32 ruleCount = 1000000;
+static UINT32 patternCount = 10000;
+static UINT32 lookups = 1000000;
+static CONST char* compiler = "./PolicyCompile";
+static BOOLEAN skipPort = FALSE;
+static INT32 onlyMode = -1;
+static UINT64 mismatches = 0;
+
+static double ms(UINT64 start) {
+    return (double)(ShimNanoseconds() - start) / 1e6;
+}
+
+static UINT64 rulePermissions(UINT32 rule) {
+    return rule % 7 + 1;
+}
+
+static int rulePath(UINT32 rule, char* path) {
+    return snprintf(path, POLICY_PATH_LENGTH, "\\Device\\HarddiskVolume2\\corp\\d%03u\\t%03u\\u%07u",
+        rule % 97, rule / 97 % 101, rule);
+}
+
+// Each pattern has its own number, none matches the paths of another or of an exact rule
+static int patternText(UINT32 pattern, char* text) {
+    switch (pattern % 4) {
+    case 0: return snprintf(text, POLICY_PATH_LENGTH, "*\\AppData\\Local\\Temp\\t%05u\\*", pattern);
+    case 1: return snprintf(text, POLICY_PATH_LENGTH, "*.x%05u", pattern);
+    case 2: return snprintf(text, POLICY_PATH_LENGTH, "\\Device\\HarddiskVolume4\\*\\cache%05u\\*", pattern);
+    default: return snprintf(text, POLICY_PATH_LENGTH, "*\\build?%05u\\*.obj", pattern);
+    }
+}
+
+// A path the pattern matches, or one it almost does
+static VOID patternPath(UINT32 pattern, BOOLEAN miss, char* path) {
+    switch (pattern % 4) {
+    case 0:
+        snprintf(path, POLICY_PATH_LENGTH, "\\Device\\HarddiskVolume4\\Users\\u%03u\\AppData\\Local\\Temp\\t%05u%s",
+            pattern % 997, pattern, miss ? "" : "\\setup.log");
+        break;
+    case 1:
+        snprintf(path, POLICY_PATH_LENGTH, "\\Device\\HarddiskVolume4\\Users\\u%03u\\setup.x%05u%s", pattern % 997, pattern, miss ? ".bak" : "");
+        break;
+    case 2:
+        snprintf(path, POLICY_PATH_LENGTH, "\\Device\\HarddiskVolume4\\Users\\%s%05u\\blob", miss ? "cached" : "cache", pattern);
+        break;
+    default:
+        snprintf(path, POLICY_PATH_LENGTH, "\\Device\\HarddiskVolume4\\src\\build7%05u\\main.%s", pattern, miss ? "c" : "obj");
+        break;
+    }
+}
+
+// A path of the given kind and the permissions the policy gives it
+static USHORT lookupPath(UINT8 kind, UINT32 sample, WCHAR* path, UINT64* expected) {
+    char narrow[POLICY_PATH_LENGTH];
+    UINT32 rule = (UINT32)(((UINT64)sample * 2654435761u) % ruleCount);
+
+    *expected = kind == POLICY_OUTSIDE ? 0 : rulePermissions(rule);
+    if (kind == POLICY_PATTERN) {
+        UINT32 pattern = (UINT32)(((UINT64)sample * 2654435761u) % patternCount);
+        BOOLEAN miss = sample % 4 == 3;
+        *expected = miss ? 0 : rulePermissions(pattern);
+        patternPath(pattern, miss, narrow);
+    }
+    else if (kind == POLICY_OUTSIDE) {
+        snprintf(narrow, sizeof(narrow), "\\Device\\HarddiskVolume3\\home\\u%07u\\notes.txt", rule);
+    }
+    else {
+        int length = rulePath(rule, narrow);
+        if (kind == POLICY_BELOW) {
+            snprintf(narrow + length, sizeof(narrow) - length, "\\src\\main%u.c", sample % 10);
+        }
+    }
+    return ShimWiden(narrow, path, POLICY_PATH_LENGTH);
+}
+
+static BOOLEAN generateRules(CONST char* file) {
+    FILE* rules = fopen(file, "w");
+    if (rules == NULL) {
+        perror(file);
+        return FALSE;
+    }
+    fprintf(rules, "# %u generated rules\n", ruleCount);
+    for (UINT32 rule = 0; rule < ruleCount; rule++) {
+        char path[POLICY_PATH_LENGTH];
+        UINT64 permissions = rulePermissions(rule);
+        rulePath(rule, path);
+        fprintf(rules, "%s%s%s %s\n", permissions & LYCANITE_READ ? "r" : "", permissions & LYCANITE_WRITE ? "w" : "",
+            permissions & LYCANITE_DELETE ? "d" : "", path);
+    }
+    for (UINT32 pattern = 0; pattern < patternCount; pattern++) {
+        char text[POLICY_PATH_LENGTH];
+        UINT64 permissions = rulePermissions(pattern);
+        patternText(pattern, text);
+        fprintf(rules, "%s%s%s %s\n", permissions & LYCANITE_READ ? "r" : "", permissions & LYCANITE_WRITE ? "w" : "",
+            permissions & LYCANITE_DELETE ? "d" : "", text);
+    }
+    return fclose(rules) == 0;
+}
+
+static WCHAR batchPaths[POLICY_BATCH][POLICY_PATH_LENGTH];
+static USHORT batchLengths[POLICY_BATCH];
+static UINT64 batchExpected[POLICY_BATCH];
+static UINT64 batchPermissions[POLICY_BATCH];
+
+// Lookups of the kinds from first to last, count of each
+static VOID timeLookups(CONST char* source, UINT64 (*lookup)(WCHAR* path, USHORT length, UINT32* probes), UINT8 firstKind, UINT8 lastKind, UINT32 total) {
+    for (UINT8 kind = firstKind; kind <= lastKind; kind++) {
+        UINT64 elapsed = 0;
+        UINT32 probes = 0;
+        for (UINT32 first = 0; first < total; first += POLICY_BATCH) {
+            UINT32 count = total - first < POLICY_BATCH ? total - first : POLICY_BATCH;
+            for (UINT32 i = 0; i < count; i++) {
+                batchLengths[i] = lookupPath(kind, first + i, batchPaths[i], &batchExpected[i]);
+            }
+
+            UINT64 start = ShimNanoseconds();
+            for (UINT32 i = 0; i < count; i++) {
+                batchPermissions[i] = lookup(batchPaths[i], batchLengths[i], &probes);
+            }
+            elapsed += ShimNanoseconds() - start;
+
+            for (UINT32 i = 0; i < count; i++) {
+                if (batchPermissions[i] != batchExpected[i]) {
+                    mismatches++;
+                }
+            }
+        }
+        printf("  %-8s %-8s %8.1f ns/lookup %6.2f probes\n", source, lookupNames[kind],
+            (double)elapsed / total, (double)probes / total);
+    }
+}
+
+static PolicySnapshot mapped;
+
+// PolicyCompile flags of each layout
+static CONST char* layoutNames[] = { "hashed", "coded" };
+static CONST char* layoutFlags[] = { "", "-f " };
+
+static UINT64 mappedLookup(WCHAR* path, USHORT length, UINT32* probes) {
+    return PolicySnapshot_permission(&mapped, path, length, probes);
+}
+
+static WCHAR** patterns;
+static USHORT* patternLengths;
+
+// Every pattern in turn, the last matching one wins
+static UINT64 naiveLookup(WCHAR* path, USHORT length, UINT32* probes) {
+    for (UINT32 pattern = patternCount; pattern-- > 0; ) {
+        *probes += 1;
+        if (PatternRules_glob(patterns[pattern], patternLengths[pattern], path, length)) {
+            return rulePermissions(pattern);
+        }
+    }
+    return 0;
+}
+
+static BOOLEAN widenPatterns() {
+    patterns = (WCHAR**)calloc(patternCount + 1, sizeof(WCHAR*));
+    patternLengths = (USHORT*)calloc(patternCount + 1, sizeof(USHORT));
+    for (UINT32 pattern = 0; patterns != NULL && patternLengths != NULL && pattern < patternCount; pattern++) {
+        char text[POLICY_PATH_LENGTH];
+        patternText(pattern, text);
+        patterns[pattern] = (WCHAR*)malloc(POLICY_PATH_LENGTH * sizeof(WCHAR));
+        if (patterns[pattern] == NULL) {
+            return FALSE;
+        }
+        patternLengths[pattern] = ShimWiden(text, patterns[pattern], POLICY_PATH_LENGTH);
+    }
+    return patterns != NULL && patternLengths != NULL;
+}
+
+static CONST char* modeNames[] = { "paths", "compact", "verified" };
+
+static UINT64 portLookup(WCHAR* path, USHORT length, UINT32* probes) {
+    return VolumeRules_permission(&globalPerm, path, length, VolumeRules_volumeLength(path, length), probes);
+}
+
+// A sandboxed process reads below a write-only rule and below a read-only one
+static VOID checkDecisions(PFLT_PORT client) {
+    unsigned char message[9] = { SET_LYCANITE_PID };
+    writeUINT64(message + 1, POLICY_LYCANITE_PID);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+    ShimNotifyProcess(POLICY_LYCANITE_PID, POLICY_SANDBOX_PID, TRUE);
+
+    for (UINT32 rule = 0; rule < 7; rule++) {
+        char narrow[POLICY_PATH_LENGTH];
+        WCHAR path[POLICY_PATH_LENGTH];
+        int length = rulePath(rule, narrow);
+        snprintf(narrow + length, sizeof(narrow) - length, "\\readme.txt");
+
+        FLT_CALLBACK_DATA data;
+        FLT_IO_PARAMETER_BLOCK iopb;
+        ShimInitCallbackData(&data, &iopb, IRP_MJ_READ, POLICY_SANDBOX_PID, path, ShimWiden(narrow, path, POLICY_PATH_LENGTH));
+        BOOLEAN denied = ShimPreOperation(&data) == FLT_PREOP_COMPLETE;
+        if (denied != ((rulePermissions(rule) & LYCANITE_READ) == 0)) {
+            mismatches++;
+        }
+    }
+    ShimNotifyProcess(0, POLICY_SANDBOX_PID, FALSE);
+}
+
+static BOOLEAN parseArguments(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "n:g:l:c:pm:")) != -1) {
+        switch (option) {
+        case 'n': ruleCount = (UINT32)atoi(optarg); break;
+        case 'g': patternCount = (UINT32)atoi(optarg); break;
+        case 'l': lookups = (UINT32)atoi(optarg); break;
+        case 'c': compiler = optarg; break;
+        case 'p': skipPort = TRUE; break;
+        case 'm': onlyMode = atoi(optarg); break;
+        default:
+            return FALSE;
+        }
+    }
+    return ruleCount > 0 && lookups > 0 && onlyMode <= VOLUMERULES_VERIFIED;
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
+        fprintf(stderr, "usage: %s [-n rules] [-g patterns] [-l lookups] [-c compiler] [-p] [-m mode]\n", argv[0]);
+        return 1;
+    }
+
+    char rulesFile[256];
+    char snapshotFile[256];
+    char command[600];
+    CONST char* tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    snprintf(rulesFile, sizeof(rulesFile), "%s/lycanite-rules-%d.txt", tmp, (int)getpid());
+    snprintf(snapshotFile, sizeof(snapshotFile), "%s/lycanite-policy-%d.bin", tmp, (int)getpid());
+
+    UINT64 start = ShimNanoseconds();
+    if (!generateRules(rulesFile)) {
+        return 1;
+    }
+    printf("generate %u rules, %u patterns: %.1fms\n", ruleCount, patternCount, ms(start));
+    if (!widenPatterns()) {
+        return 1;
+    }
+
+    PFLT_PORT client;
+    for (UINT8 layout = 0; layout < 2; layout++) {
+        snprintf(command, sizeof(command), "%s %s%s %s", compiler, layoutFlags[layout], rulesFile, snapshotFile);
+        start = ShimNanoseconds();
+        int compiled = system(command);
+        printf("compile %s: %.1fms\n", layoutNames[layout], ms(start));
+        if (compiled != 0) {
+            fprintf(stderr, "%s failed\n", command);
+            unlink(rulesFile);
+            return 1;
+        }
+
+        // user-mode load, the snapshot used where it is mapped
+        start = ShimNanoseconds();
+        int fd = open(snapshotFile, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(snapshotFile);
+            return 1;
+        }
+        PVOID image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED || !PolicySnapshot_open(&mapped, image, (UINT64)st.st_size)) {
+            fprintf(stderr, "%s: not a policy snapshot\n", snapshotFile);
+            return 1;
+        }
+        printf("mmap and open %.1f MB, %.1f bytes/rule: %.1fms\n", (double)st.st_size / 1e6,
+            (double)st.st_size / ruleCount, ms(start));
+        timeLookups(layoutNames[layout], mappedLookup, POLICY_EXACT, patternCount > 0 ? POLICY_PATTERN : POLICY_OUTSIDE, lookups);
+        munmap(image, (size_t)st.st_size);
+
+        // driver load, read from the file named in the service key
+        setenv("LYCANITE_PolicySnapshot", snapshotFile, 1);
+        start = ShimNanoseconds();
+        if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+            fprintf(stderr, "DriverEntry failed\n");
+            return 1;
+        }
+        printf("DriverEntry with the snapshot: %.1fms, %u rules loaded\n", ms(start),
+            policyImage != NULL ? policySnapshot.header->ruleCount : 0);
+        if (policyImage == NULL || policySnapshot.header->ruleCount != ruleCount) {
+            mismatches++;
+        }
+        client = ShimConnect();
+        checkDecisions(client);
+        ShimDisconnect(client);
+        ShimUnloadDriver();
+        unsetenv("LYCANITE_PolicySnapshot");
+        unlink(snapshotFile);
+    }
+    unlink(rulesFile);
+    if (patternCount > 0) {
+        timeLookups("naive", naiveLookup, POLICY_PATTERN, POLICY_PATTERN, lookups < POLICY_NAIVE_LOOKUPS ? lookups : POLICY_NAIVE_LOOKUPS);
+    }
+
+    for (UINT8 mode = VOLUMERULES_STRINGS; mode <= VOLUMERULES_VERIFIED && !skipPort; mode++) {
+        if (onlyMode >= 0 && mode != onlyMode) {
+            continue;
+        }
+        char value[4];
+        snprintf(value, sizeof(value), "%u", mode);
+        setenv("LYCANITE_CompactPolicy", value, 1);
+        if (!NT_SUCCESS(ShimLoadDriver(DriverEntry)) || globalPerm.mode != mode) {
+            fprintf(stderr, "DriverEntry failed\n");
+            return 1;
+        }
+
+        client = ShimConnect();
+        unsigned char message[11 + POLICY_PATH_LENGTH] = { SET_AUTHORIZATION_GLOBAL };
+        UINT64 allocations = ShimAllocations();
+        UINT64 bytes = ShimPoolBytes();
+        start = ShimNanoseconds();
+        for (UINT32 rule = 0; rule < ruleCount; rule++) {
+            int length = rulePath(rule, (char*)message + 11);
+            writeUINT64(message + 1, rulePermissions(rule));
+            message[9] = (unsigned char)(length & 0xFF);
+            message[10] = (unsigned char)(length >> 8);
+            ShimSendMessage(client, message, 11 + length, NULL, 0, NULL);
+        }
+        printf("set over the port, %s: %.1fms, %.2f allocations/rule, %.1f bytes/rule\n", modeNames[mode], ms(start),
+            (double)(ShimAllocations() - allocations) / ruleCount, (double)(ShimPoolBytes() - bytes) / ruleCount);
+        if (globalPerm.count != ruleCount) {
+            mismatches++;
+        }
+        timeLookups(modeNames[mode], portLookup, POLICY_EXACT, POLICY_OUTSIDE, lookups);
+        ShimDisconnect(client);
+        ShimUnloadDriver();
+    }
+    unsetenv("LYCANITE_CompactPolicy");
+
+    printf("%llu mismatches\n", (unsigned long long)mismatches);
+    return mismatches != 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Many-producer stress test of the event queue of the process notify routine.
+ *
+ * Producer threads push numbered events as fast as they can into a small
+ * queue the main thread drains, the way the event worker does: it sleeps on a
+ * doorbell when the queue is empty and the producers ring it. Every event
+ * carries its producer and sequence number and a payload derived from them.
+ *
+ *   QueueStress [-t producers] [-n events] [-c capacity]
+ *
+ * A producer whose push fails on a full queue counts the drop and pushes the
+ * same event again, so every event must come out exactly once, in order for
+ * its producer and intact; the drops counted by the producers must be the
+ * drops the queue counted. A doorbell that never rings while events are
+ * waiting is a lost wakeup. Exits with 1 on any error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "Shim.h"
+#include "EventQueue.h"
+
+#define STRESS_WAKEUP_TIMEOUT_MS 1000
+
+typedef struct stressProducer_s {
+    pthread_t thread;
+    UINT32 id;
+    UINT64 drops; // failed pushes
+    UINT64 next; // sequence expected by the consumer
+} stressProducer;
+
+static UINT32 producerCount = 8;
+static UINT64 events = 1000000; // per producer
+static UINT64 capacity = 1024;
+
+static EventQueue* queue = NULL;
+static KEVENT wake;
+static volatile LONG started = 0;
+
+// Payload of an event, checked on the consumer side for torn copies
+static VOID fillEvent(lycaniteEvent* event, UINT32 producer, UINT64 sequence) {
+    Kmemset(event, 0, sizeof(lycaniteEvent));
+    event->type = 1;
+    event->processId = producer;
+    event->uuid = sequence;
+    event->pathHash = (UINT32)(sequence * 2654435761u) ^ producer;
+    event->count = (UINT32)sequence;
+    event->tailLength = (UINT8)(sequence % EVENT_PATH_TAIL_LENGTH);
+    for (UINT32 i = 0; i < event->tailLength; i++) {
+        event->tail[i] = (WCHAR)(producer + sequence + i);
+    }
+}
+
+static BOOLEAN checkEvent(CONST lycaniteEvent* event) {
+    lycaniteEvent expected;
+    fillEvent(&expected, (UINT32)event->processId, event->uuid);
+    return Kmemcmp((PVOID)event, &expected, sizeof(lycaniteEvent)) == 0;
+}
+
+static PVOID produce(PVOID Context) {
+    stressProducer* producer = (stressProducer*)Context;
+    lycaniteEvent event;
+
+    while (!ReadNoFence(&started)) {
+        sched_yield();
+    }
+    for (UINT64 sequence = 0; sequence < events; sequence++) {
+        fillEvent(&event, producer->id, sequence);
+        while (!EventQueue_push(queue, &event)) {
+            producer->drops++;
+            sched_yield();
+        }
+        if (EventQueue_claimWakeup(queue)) {
+            KeSetEvent(&wake, 0, FALSE);
+        }
+    }
+    return NULL;
+}
+
+static BOOLEAN parseArguments(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "t:n:c:")) != -1) {
+        switch (option) {
+        case 't': producerCount = (UINT32)atoi(optarg); break;
+        case 'n': events = strtoull(optarg, NULL, 10); break;
+        case 'c': capacity = strtoull(optarg, NULL, 10); break;
+        default:
+            return FALSE;
+        }
+    }
+    return producerCount > 0 && events > 0 && capacity > 0;
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
+        fprintf(stderr, "usage: %s [-t producers] [-n events] [-c capacity]\n", argv[0]);
+        return 1;
+    }
+
+    queue = EventQueue_create(capacity);
+    if (queue == NULL) {
+        fprintf(stderr, "could not allocate the queue\n");
+        return 1;
+    }
+    KeInitializeEvent(&wake, SynchronizationEvent, FALSE);
+
+    stressProducer* producers = (stressProducer*)calloc(producerCount, sizeof(stressProducer));
+    for (UINT32 i = 0; i < producerCount; i++) {
+        producers[i].id = i;
+        pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+    }
+
+    UINT64 total = (UINT64)producerCount * events;
+    UINT64 received = 0;
+    UINT64 misordered = 0;
+    UINT64 corrupted = 0;
+    UINT64 sleeps = 0;
+    UINT64 lostWakeups = 0;
+    lycaniteEvent event;
+
+    UINT64 start = ShimNanoseconds();
+    InterlockedExchange(&started, 1);
+    while (received < total) {
+        if (EventQueue_pop(queue, &event)) {
+            received++;
+            if (event.processId >= producerCount || !checkEvent(&event)) {
+                corrupted++;
+                continue;
+            }
+            stressProducer* producer = &producers[event.processId];
+            if (event.uuid != producer->next) {
+                misordered++;
+            }
+            producer->next = event.uuid + 1;
+            continue;
+        }
+
+        // the event worker's doorbell: announce the sleep, then look again
+        EventQueue_sleep(queue);
+        if (!EventQueue_isEmpty(queue)) {
+            EventQueue_awake(queue);
+            continue;
+        }
+        sleeps++;
+        LARGE_INTEGER timeout;
+        timeout.QuadPart = -10000LL * STRESS_WAKEUP_TIMEOUT_MS;
+        if (KeWaitForSingleObject(&wake, Executive, KernelMode, FALSE, &timeout) == STATUS_TIMEOUT && !EventQueue_isEmpty(queue)) {
+            lostWakeups++;
+        }
+        EventQueue_awake(queue);
+    }
+    double elapsed = (double)(ShimNanoseconds() - start) / 1e9;
+
+    UINT64 drops = 0;
+    UINT64 missing = 0;
+    for (UINT32 i = 0; i < producerCount; i++) {
+        pthread_join(producers[i].thread, NULL);
+        drops += producers[i].drops;
+        missing += producers[i].next != events;
+    }
+    UINT64 extra = !EventQueue_isEmpty(queue);
+    UINT64 counted = (UINT64)ReadNoFence64(&queue->dropped);
+
+    printf("%u producers, %llu events in %.2fs, %.0f events/s, %llu pushes failed on a full queue of %llu, %llu sleeps\n",
+        producerCount, (unsigned long long)received, elapsed, (double)received / elapsed,
+        (unsigned long long)drops, (unsigned long long)queue->capacity, (unsigned long long)sleeps);
+    printf("%llu out of order, %llu corrupted, %llu producers short, %llu left over, %llu drops not counted, %llu lost wakeups\n",
+        (unsigned long long)misordered, (unsigned long long)corrupted, (unsigned long long)missing,
+        (unsigned long long)extra, (unsigned long long)(drops > counted ? drops - counted : counted - drops),
+        (unsigned long long)lostWakeups);
+
+    EventQueue_destroy(queue);
+    free(producers);
+    return misordered != 0 || corrupted != 0 || missing != 0 || extra != 0 || drops != counted || lostWakeups != 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * Replays a decision capture (see DecisionCapture.h) through the policy
+ * lookup of the driver.
+ *
+ * Processes and rules of the capture are applied through the process notify
+ * routine and the communication port, so the policy is the one in place when
+ * each decision was taken. Every decision is fed to isRestricted again, timed,
+ * and checked against the captured outcome.
+ *
+ *   Replay [-o] capture
+ *
+ * Decisions are replayed as fast as possible, or with -o at their original
+ * pace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define REPLAY_LYCANITE_PID 100
+
+typedef struct replayPath_s {
+    PWCHAR name;
+    USHORT length;
+} replayPath;
+
+typedef struct replayReader_s {
+    CONST unsigned char* data;
+    UINT64 size;
+    UINT64 offset;
+    BOOLEAN truncated;
+} replayReader;
+
+static replayPath* dictionary = NULL;
+static UINT32 dictionarySize = 0;
+static map_t sandboxes = NULL; // captured uuid -> replayed uuid
+
+static UINT64 readVarint(replayReader* reader) {
+    UINT64 value = 0;
+    for (UINT8 shift = 0; shift < 64; shift += 7) {
+        if (reader->offset >= reader->size) {
+            reader->truncated = TRUE;
+            return 0;
+        }
+        unsigned char byte = reader->data[reader->offset++];
+        value |= (UINT64)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return value;
+}
+
+static UINT8 readByte(replayReader* reader) {
+    if (reader->offset >= reader->size) {
+        reader->truncated = TRUE;
+        return 0;
+    }
+    return reader->data[reader->offset++];
+}
+
+// Reads `length` UTF-16 code units into a new NUL terminated buffer
+static PWCHAR readPath(replayReader* reader, UINT64 length) {
+    if (length > 0x7FFF || reader->size - reader->offset < length * 2) {
+        reader->truncated = TRUE;
+        return NULL;
+    }
+
+    PWCHAR path = (PWCHAR)calloc(length + 1, sizeof(WCHAR));
+    for (UINT64 i = 0; path != NULL && i < length; i++) {
+        path[i] = (WCHAR)(reader->data[reader->offset] | (reader->data[reader->offset + 1] << 8));
+        reader->offset += 2;
+    }
+    return path;
+}
+
+static VOID resetDictionary() {
+    for (UINT32 i = 0; i < dictionarySize; i++) {
+        free(dictionary[i].name);
+    }
+    free(dictionary);
+    dictionary = NULL;
+    dictionarySize = 0;
+}
+
+static VOID definePath(UINT64 id, PWCHAR path, UINT64 length) {
+    if (id >= dictionarySize) {
+        UINT32 size = dictionarySize ? dictionarySize : 1024;
+        while (size <= id) {
+            size *= 2;
+        }
+        dictionary = (replayPath*)realloc(dictionary, size * sizeof(replayPath));
+        memset(dictionary + dictionarySize, 0, (size - dictionarySize) * sizeof(replayPath));
+        dictionarySize = size;
+    }
+    free(dictionary[id].name);
+    dictionary[id].name = path;
+    dictionary[id].length = (USHORT)length;
+}
+
+/*
+ * Rules travel as narrow strings over the port, like the controller sends
+ * them; code units above 0xFF don't survive the trip.
+ */
+static VOID applyRule(PFLT_PORT client, UINT64 uuid, UINT64 permissions, PWCHAR path, UINT64 length) {
+    unsigned char* message = (unsigned char*)calloc(19 + length, sizeof(unsigned char));
+    UINT64 size = 0;
+    any_t replayed = NULL;
+
+    if (uuid != 0) {
+        if (ihashmap_get(sandboxes, uuid, &replayed) != MAP_OK) {
+            free(message);
+            return;
+        }
+        message[0] = permissions != 0 ? SET_AUTHORIZATION_PID : DELETE_AUTHORIZATION_PID;
+        writeUINT64(message + 1, (UINT64)replayed);
+        size = 9;
+    }
+    else {
+        message[0] = permissions != 0 ? SET_AUTHORIZATION_GLOBAL : DELETE_AUTHORIZATION_GLOBAL;
+        size = 1;
+    }
+
+    if (permissions != 0) {
+        writeUINT64(message + size, permissions);
+        size += 8;
+    }
+    message[size++] = (unsigned char)(length & 0xFF);
+    message[size++] = (unsigned char)(length >> 8);
+    for (UINT64 i = 0; i < length; i++) {
+        message[size++] = (unsigned char)path[i];
+    }
+
+    ShimSendMessage(client, message, (ULONG)size, NULL, 0, NULL);
+    free(message);
+}
+
+static VOID applyProcess(UINT64 processId, UINT64 parentId, UINT64 uuid, BOOLEAN created) {
+    if (!created) {
+        ShimNotifyProcess(0, processId, FALSE);
+        return;
+    }
+
+    if (parentId != 0) {
+        ShimNotifyProcess(parentId, processId, TRUE);
+        return;
+    }
+
+    ShimNotifyProcess(REPLAY_LYCANITE_PID, processId, TRUE);
+    processInfos* pinfo = processSandbox(processId);
+    if (pinfo != NULL) {
+        ihashmap_put(sandboxes, uuid, (any_t)pinfo->uuid);
+    }
+}
+
+static VOID waitUntil(UINT64 deadline) {
+    UINT64 now = ShimNanoseconds();
+    if (deadline > now + 100000) {
+        usleep((useconds_t)((deadline - now) / 1000));
+    }
+    while (ShimNanoseconds() < deadline) {
+    }
+}
+
+int main(int argc, char** argv) {
+    BOOLEAN original = FALSE;
+    int option;
+
+    while ((option = getopt(argc, argv, "o")) != -1) {
+        if (option == 'o') {
+            original = TRUE;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-o] capture\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    replayReader reader = { NULL, (UINT64)st.st_size, 0, FALSE };
+    reader.data = st.st_size > 0 ? (CONST unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (reader.data == NULL || reader.data == MAP_FAILED || reader.size < CAPTURE_HEADER_SIZE ||
+        (reader.data[0] | reader.data[1] << 8 | reader.data[2] << 16 | (UINT32)reader.data[3] << 24) != CAPTURE_MAGIC) {
+        fprintf(stderr, "%s: not a capture\n", argv[optind]);
+        return 1;
+    }
+    if (reader.data[4] != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u\n", argv[optind], reader.data[4]);
+        return 1;
+    }
+    UINT64 ticksPerSecond = readUINT64(reader.data + 8);
+    reader.offset = CAPTURE_HEADER_SIZE;
+
+    if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        return 1;
+    }
+    PFLT_PORT client = ShimConnect();
+    unsigned char message[9] = { SET_LYCANITE_PID };
+    writeUINT64(message + 1, REPLAY_LYCANITE_PID);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+    sandboxes = ihashmap_new();
+
+    LatencyHistogram* latency = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+    UINT64 decisions = 0;
+    UINT64 mismatches = 0;
+    UINT64 unknownPaths = 0;
+    UINT64 lost = 0;
+    UINT64 maximum = 0;
+    UINT64 busy = 0;
+    UINT64 ticks = 0;
+    UINT64 start = ShimNanoseconds();
+    FLT_CALLBACK_DATA data;
+    FLT_IO_PARAMETER_BLOCK iopb;
+
+    while (reader.offset < reader.size && !reader.truncated) {
+        UINT8 tag = readByte(&reader);
+
+        if (tag == CAPTURE_PATH) {
+            UINT64 id = readVarint(&reader);
+            UINT64 length = readVarint(&reader);
+            PWCHAR path = readPath(&reader, length);
+            if (path != NULL) {
+                definePath(id, path, length);
+            }
+        }
+        else if (tag == CAPTURE_DECISION) {
+            ticks += readVarint(&reader);
+            UINT64 processId = readVarint(&reader);
+            UINT64 id = readVarint(&reader);
+            UINT8 operation = readByte(&reader);
+            UINT8 restricted = readByte(&reader);
+
+            if (reader.truncated) {
+                break;
+            }
+            if (id >= dictionarySize || dictionary[id].name == NULL) {
+                unknownPaths++;
+                continue;
+            }
+            if (original) {
+                waitUntil(start + ticks * 1000000000ull / ticksPerSecond);
+            }
+
+            ShimInitCallbackData(&data, &iopb, IRP_MJ_READ, (ULONG)processId, dictionary[id].name, dictionary[id].length);
+
+            UINT64 before = ShimNanoseconds();
+            UINT8 replayed = isRestricted(&data, processSandbox(processId), &data.ShimNameInformation, operation);
+            UINT64 elapsed = ShimNanoseconds() - before;
+
+            LatencyHistogram_record(latency, elapsed);
+            maximum = elapsed > maximum ? elapsed : maximum;
+            busy += elapsed;
+            decisions++;
+            if (replayed != restricted) {
+                mismatches++;
+            }
+        }
+        else if (tag == CAPTURE_PROCESS) {
+            ticks += readVarint(&reader);
+            UINT64 processId = readVarint(&reader);
+            UINT64 parentId = readVarint(&reader);
+            UINT64 uuid = readVarint(&reader);
+            UINT8 created = readByte(&reader);
+            if (!reader.truncated) {
+                applyProcess(processId, parentId, uuid, created);
+            }
+        }
+        else if (tag == CAPTURE_RULE) {
+            UINT64 uuid = readVarint(&reader);
+            UINT64 permissions = readVarint(&reader);
+            UINT64 length = readVarint(&reader);
+            PWCHAR path = readPath(&reader, length);
+            if (path != NULL) {
+                applyRule(client, uuid, permissions, path, length);
+                free(path);
+            }
+        }
+        else if (tag == CAPTURE_LOST) {
+            lost += readVarint(&reader);
+        }
+        else if (tag == CAPTURE_DICTIONARY_RESET) {
+            resetDictionary();
+        }
+        else {
+            fprintf(stderr, "unknown record %u at offset %llu\n", tag, (unsigned long long)(reader.offset - 1));
+            break;
+        }
+    }
+    double wall = (double)(ShimNanoseconds() - start) / 1e9;
+
+    if (reader.truncated) {
+        fprintf(stderr, "capture truncated at offset %llu\n", (unsigned long long)reader.offset);
+    }
+
+    printf("decisions: %llu in %.3fs of lookups (%.3fs wall), %.0f decisions/s\n",
+        (unsigned long long)decisions, (double)busy / 1e9, wall, busy ? (double)decisions * 1e9 / (double)busy : 0.0);
+    printf("latency ns: p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+        (unsigned long long)LatencyHistogram_quantile(latency, 500000),
+        (unsigned long long)LatencyHistogram_quantile(latency, 900000),
+        (unsigned long long)LatencyHistogram_quantile(latency, 990000),
+        (unsigned long long)LatencyHistogram_quantile(latency, 999000),
+        (unsigned long long)maximum);
+    printf("mismatches: %llu  unknown paths: %llu  lost in capture: %llu\n",
+        (unsigned long long)mismatches, (unsigned long long)unknownPaths, (unsigned long long)lost);
+
+    ShimDisconnect(client);
+    ShimUnloadDriver();
+    resetDictionary();
+    ihashmap_free(sandboxes);
+    free(latency);
+    munmap((PVOID)reader.data, (size_t)st.st_size);
+    close(fd);
+    return mismatches != 0;
+}
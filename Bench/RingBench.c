@@ -0,0 +1,243 @@
+/*
+ * Throughput and latency of the event ring shared with the controller.
+ *
+ * A producer thread writes numbered, timestamped entries of event-like sizes
+ * with SharedRing_write and rings the doorbell when the ring was empty, the
+ * way the event worker does; the main thread consumes them in place with
+ * SharedRing_peek and SharedRing_release and sleeps on the doorbell when the
+ * ring is empty, the way the controller does.
+ *
+ *   RingBench [-n entries] [-c capacity]
+ *
+ * Latency is from the write to the peek of an entry. Every entry must come
+ * out once, in order and intact, and a doorbell that never rings while
+ * entries are waiting is a lost wakeup.
+ *
+ * A hostile controller is played first: it rewrites the capacity and the
+ * producer index in the header between writes, and sometimes an impossible
+ * consumer index. The writes must stay in the ring, the entries intact, and
+ * an impossible consumer index must read as a full ring. Exits with 1 on any
+ * error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "Shim.h"
+#include "SharedRing.h"
+#include "LatencyHistogram.h"
+
+#define RING_WAKEUP_TIMEOUT_MS 1000
+#define RING_ENTRY_MIN 16 // sequence number and timestamp
+#define RING_ENTRY_SPREAD 48 // up to the largest serialized event
+#define RING_HOSTILE_CAPACITY 4096
+#define RING_HOSTILE_WRITES 100000
+#define RING_CANARY 0xA5
+
+static UINT64 entries = 10000000;
+static UINT32 capacity = 64 * 1024;
+
+static SharedRingHeader* ring = NULL;
+static SharedRingProducer ringProducer;
+static KEVENT doorbell;
+static volatile LONG started = 0;
+static UINT64 fullRing = 0;
+
+static UINT16 entrySize(UINT64 sequence) {
+    return (UINT16)(RING_ENTRY_MIN + sequence % RING_ENTRY_SPREAD);
+}
+
+static VOID fillEntry(PUCHAR entry, UINT64 sequence) {
+    UINT64 now = ShimNanoseconds();
+    UINT16 size = entrySize(sequence);
+
+    Kmemcpy(entry, &sequence, sizeof(UINT64));
+    Kmemcpy(entry + 8, &now, sizeof(UINT64));
+    for (UINT16 i = RING_ENTRY_MIN; i < size; i++) {
+        entry[i] = (UCHAR)(sequence + i);
+    }
+}
+
+static BOOLEAN checkEntry(CONST PUCHAR entry, UINT16 size, UINT64 sequence) {
+    UINT64 written;
+
+    Kmemcpy(&written, entry, sizeof(UINT64));
+    if (written != sequence || size != entrySize(sequence)) {
+        return FALSE;
+    }
+    for (UINT16 i = RING_ENTRY_MIN; i < size; i++) {
+        if (entry[i] != (UCHAR)(sequence + i)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static PVOID produce(PVOID Context) {
+    UNREFERENCED_PARAMETER(Context);
+    UCHAR entry[RING_ENTRY_MIN + RING_ENTRY_SPREAD];
+
+    while (!ReadNoFence(&started)) {
+        sched_yield();
+    }
+    for (UINT64 sequence = 0; sequence < entries; sequence++) {
+        UINT8 status;
+
+        fillEntry(entry, sequence);
+        while ((status = SharedRing_write(&ringProducer, entry, entrySize(sequence))) == SHARED_RING_FULL) {
+            fullRing++;
+            sched_yield();
+            fillEntry(entry, sequence);
+        }
+        if (status == SHARED_RING_OK_WAKE) {
+            KeSetEvent(&doorbell, 0, FALSE);
+        }
+    }
+    return NULL;
+}
+
+// Returns the writes that went wrong under a controller rewriting the header
+static UINT64 hostileHeader(VOID) {
+    SIZE_T size = SHARED_RING_HEADER_SIZE + RING_HOSTILE_CAPACITY;
+    // as much again past the ring, which no write may touch
+    PUCHAR memory = (PUCHAR)calloc(1, size + RING_HOSTILE_CAPACITY);
+    SharedRingProducer hostile;
+    SharedRingHeader* header = SharedRing_init(memory, RING_HOSTILE_CAPACITY, &hostile);
+    UCHAR entry[RING_ENTRY_MIN + RING_ENTRY_SPREAD];
+    UINT64 failures = 0;
+
+    if (header == NULL) {
+        fprintf(stderr, "could not allocate the hostile ring\n");
+        exit(1);
+    }
+    memset(memory + size, RING_CANARY, RING_HOSTILE_CAPACITY);
+
+    for (UINT64 sequence = 0; sequence < RING_HOSTILE_WRITES; sequence++) {
+        UINT64 noise = sequence * 0x9E3779B97F4A7C15ULL;
+        UINT64 head = hostile.head;
+        BOOLEAN impossible = sequence % 4 == 3;
+
+        // ahead of the producer, or further behind than the ring holds
+        header->consumer = (LONG64)(!impossible ? head : (noise & 1) ? head + 1 + (noise >> 40) : head - 2 * RING_HOSTILE_CAPACITY);
+        header->capacity = (UINT32)(noise >> 32) | 1;
+        header->producer = (LONG64)noise;
+
+        fillEntry(entry, sequence);
+        UINT8 status = SharedRing_write(&hostile, entry, entrySize(sequence));
+        if (impossible) {
+            failures += status != SHARED_RING_FULL || hostile.head != head;
+            continue;
+        }
+        if ((status != SHARED_RING_OK && status != SHARED_RING_OK_WAKE) || (UINT64)header->producer != hostile.head) {
+            failures++;
+            continue;
+        }
+
+        // read back as the controller would, with the header it was given
+        PUCHAR data;
+        UINT16 size;
+        header->capacity = RING_HOSTILE_CAPACITY;
+        if (!SharedRing_peek(header, &data, &size) || size != entrySize(sequence) || memcmp(data, entry, size) != 0) {
+            failures++;
+            continue;
+        }
+        SharedRing_release(header, size);
+    }
+
+    for (UINT32 i = 0; i < RING_HOSTILE_CAPACITY; i++) {
+        if (memory[size + i] != RING_CANARY) {
+            failures++;
+        }
+    }
+    free(memory);
+    return failures;
+}
+
+static BOOLEAN parseArguments(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "n:c:")) != -1) {
+        switch (option) {
+        case 'n': entries = strtoull(optarg, NULL, 10); break;
+        case 'c': capacity = (UINT32)strtoul(optarg, NULL, 10); break;
+        default:
+            return FALSE;
+        }
+    }
+    return entries > 0;
+}
+
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
+        fprintf(stderr, "usage: %s [-n entries] [-c capacity]\n", argv[0]);
+        return 1;
+    }
+
+    UINT64 hostileFailures = hostileHeader();
+    printf("hostile header: %llu failures in %u writes\n", (unsigned long long)hostileFailures, RING_HOSTILE_WRITES);
+
+    ring = SharedRing_init(calloc(1, SHARED_RING_HEADER_SIZE + (SIZE_T)capacity), capacity, &ringProducer);
+    LatencyHistogram* latency = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+    if (ring == NULL || latency == NULL) {
+        fprintf(stderr, "could not allocate the ring, the capacity must be a power of two\n");
+        return 1;
+    }
+    KeInitializeEvent(&doorbell, SynchronizationEvent, FALSE);
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, produce, NULL);
+
+    UINT64 received = 0;
+    UINT64 corrupted = 0;
+    UINT64 sleeps = 0;
+    UINT64 lostWakeups = 0;
+    UINT64 bytes = 0;
+    PUCHAR data;
+    UINT16 size;
+
+    UINT64 start = ShimNanoseconds();
+    InterlockedExchange(&started, 1);
+    while (received < entries) {
+        if (SharedRing_peek(ring, &data, &size)) {
+            UINT64 written;
+            Kmemcpy(&written, data + 8, sizeof(UINT64));
+            LatencyHistogram_record(latency, ShimNanoseconds() - written);
+
+            if (!checkEntry(data, size, received)) {
+                corrupted++;
+            }
+            received++;
+            bytes += size;
+            SharedRing_release(ring, size);
+            continue;
+        }
+
+        sleeps++;
+        LARGE_INTEGER timeout;
+        timeout.QuadPart = -10000LL * RING_WAKEUP_TIMEOUT_MS;
+        if (KeWaitForSingleObject(&doorbell, Executive, KernelMode, FALSE, &timeout) == STATUS_TIMEOUT &&
+            SharedRing_peek(ring, &data, &size)) {
+            lostWakeups++;
+        }
+    }
+    double elapsed = (double)(ShimNanoseconds() - start) / 1e9;
+    pthread_join(producer, NULL);
+    UINT64 extra = SharedRing_peek(ring, &data, &size);
+
+    printf("%llu entries, %.1f MB in %.2fs, %.0f entries/s, %llu writes on a full ring of %u bytes, %llu sleeps\n",
+        (unsigned long long)received, (double)bytes / 1e6, elapsed, (double)received / elapsed,
+        (unsigned long long)fullRing, capacity, (unsigned long long)sleeps);
+    printf("latency p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+        (unsigned long long)LatencyHistogram_quantile(latency, 500000),
+        (unsigned long long)LatencyHistogram_quantile(latency, 990000),
+        (unsigned long long)LatencyHistogram_quantile(latency, 999000),
+        (unsigned long long)LatencyHistogram_quantile(latency, 1000000));
+    printf("%llu corrupted or out of order, %llu left over, %llu lost wakeups\n",
+        (unsigned long long)corrupted, (unsigned long long)extra, (unsigned long long)lostWakeups);
+
+    free(latency);
+    free(ring);
+    return corrupted != 0 || extra != 0 || lostWakeups != 0 || hostileFailures != 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Checks changing a sandbox's rules while its process keeps checking accesses.
+ *
+ * Reader threads read a file a rule grants, in a loop. The controller first
+ * sets thousands of private rules next to it and deletes them, twice: the
+ * private table is rebuilt under the readers, the second time over the
+ * tombstones of the first. It then adds a rule and seals the sandbox again
+ * and again: every seal swaps the private table and drops the previous
+ * shared set under the readers. None of the reads may be denied, and make
+ * check builds it with -fsanitize=address, none may touch a table already
+ * freed.
+ *
+ *   SealCheck [-s seals] [-n rules] [-t threads]
+ *
+ * Prints each failure and exits with 1 if there is any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "Shim.h"
+#include "KMDFLycaniteFileFilter.c"
+
+#define CHECK_CONTROLLER 100
+#define CHECK_PROCESS 200
+#define CHECK_PATH_LENGTH 160
+#define CHECK_MAX_THREADS 16
+
+#define CHECK_FILE "\\Device\\HarddiskVolume2\\Users\\seal\\granted\\file.dat"
+
+static volatile LONG stop = 0;
+static volatile LONG64 reads = 0;
+static volatile LONG64 denied = 0;
+
+static VOID ignoreEvents(PVOID Context, PFLT_PORT ClientPort, PVOID Buffer, ULONG Length) {
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(ClientPort);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+}
+
+static VOID setPid(PFLT_PORT client, UINT64 pid) {
+    unsigned char message[9];
+    message[0] = SET_LYCANITE_PID;
+    writeUINT64(message + 1, pid);
+    ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+// Sets the rule, or deletes it with 0 permissions; FALSE if the driver refused
+static BOOLEAN sendRule(PFLT_PORT client, UINT64 uuid, UINT64 permissions, CONST char* path) {
+    unsigned char message[19 + CHECK_PATH_LENGTH];
+    UINT16 length = (UINT16)strlen(path);
+    UINT32 size = 9;
+
+    message[0] = permissions != 0 ? SET_AUTHORIZATION_PID : DELETE_AUTHORIZATION_PID;
+    writeUINT64(message + 1, uuid);
+    if (permissions != 0) {
+        writeUINT64(message + size, permissions);
+        size += 8;
+    }
+    message[size++] = (unsigned char)(length & 0xFF);
+    message[size++] = (unsigned char)(length >> 8);
+    memcpy(message + size, path, length);
+    return NT_SUCCESS(ShimSendMessage(client, message, size + length, NULL, 0, NULL));
+}
+
+// FALSE if one was refused
+static BOOLEAN privateRules(PFLT_PORT client, UINT64 uuid, UINT32 rules) {
+    BOOLEAN applied = TRUE;
+
+    for (UINT32 round = 0; round < 2; round++) {
+        for (UINT64 permissions = LYCANITE_READ; ; permissions = 0) {
+            for (UINT32 r = 0; r < rules; r++) {
+                char path[CHECK_PATH_LENGTH];
+                snprintf(path, sizeof(path), "\\Device\\HarddiskVolume2\\Users\\seal\\private\\%u", r);
+                applied = sendRule(client, uuid, permissions, path) && applied;
+            }
+            if (permissions == 0) {
+                break;
+            }
+        }
+    }
+    return applied;
+}
+
+static NTSTATUS seal(PFLT_PORT client, UINT64 uuid) {
+    unsigned char message[9];
+    message[0] = SEAL_AUTHORIZATION_PID;
+    writeUINT64(message + 1, uuid);
+    return ShimSendMessage(client, message, sizeof(message), NULL, 0, NULL);
+}
+
+static PVOID reader(PVOID context) {
+    UNREFERENCED_PARAMETER(context);
+    WCHAR name[CHECK_PATH_LENGTH];
+    USHORT length = ShimWiden(CHECK_FILE, name, CHECK_PATH_LENGTH);
+
+    while (!ReadAcquire(&stop)) {
+        FLT_CALLBACK_DATA data;
+        FLT_IO_PARAMETER_BLOCK iopb;
+        ShimInitCallbackData(&data, &iopb, IRP_MJ_READ, CHECK_PROCESS, name, length);
+        iopb.Parameters.Read.Length = 4096;
+        if (ShimPreOperation(&data) == FLT_PREOP_COMPLETE) {
+            InterlockedIncrement64(&denied);
+        }
+        InterlockedIncrement64(&reads);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    UINT32 seals = 300;
+    UINT32 rules = 5000;
+    UINT32 threads = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:t:")) != -1) {
+        switch (opt) {
+        case 's': seals = (UINT32)strtoul(optarg, NULL, 10); break;
+        case 'n': rules = (UINT32)strtoul(optarg, NULL, 10); break;
+        case 't': threads = (UINT32)strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-s seals] [-n rules] [-t threads]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (threads == 0 || threads > CHECK_MAX_THREADS) {
+        threads = CHECK_MAX_THREADS;
+    }
+
+    ShimSetMessageSink(ignoreEvents, NULL);
+    if (!NT_SUCCESS(ShimLoadDriver(DriverEntry))) {
+        fprintf(stderr, "DriverEntry failed\n");
+        return 1;
+    }
+    PFLT_PORT client = ShimConnect();
+    if (client == NULL) {
+        fprintf(stderr, "could not connect to the driver\n");
+        return 1;
+    }
+    setPid(client, CHECK_CONTROLLER);
+    ShimNotifyProcess(CHECK_CONTROLLER, CHECK_PROCESS, TRUE);
+    processInfos* pinfo = processSandbox(CHECK_PROCESS);
+    if (pinfo == NULL) {
+        fprintf(stderr, "the process was not sandboxed\n");
+        return 1;
+    }
+    UINT64 uuid = pinfo->uuid;
+    sendRule(client, uuid, LYCANITE_READ, CHECK_FILE);
+
+    pthread_t readers[CHECK_MAX_THREADS];
+    for (UINT32 t = 0; t < threads; t++) {
+        pthread_create(&readers[t], NULL, reader, NULL);
+    }
+
+    BOOLEAN applied = privateRules(client, uuid, rules);
+    LONG64 deniedPrivate = ReadAcquire64(&denied);
+    printf("%u private rules set and deleted twice, %lld reads so far, %lld denied%s\n", rules,
+        (long long)ReadAcquire64(&reads), (long long)deniedPrivate, applied ? "" : ", some refused");
+
+    // a new rule each round, so every seal makes a new set and drops the last one
+    UINT32 failedSeals = 0;
+    for (UINT32 s = 0; s < seals; s++) {
+        char path[CHECK_PATH_LENGTH];
+        snprintf(path, sizeof(path), "\\Device\\HarddiskVolume2\\Users\\seal\\round%u", s);
+        sendRule(client, uuid, LYCANITE_READ | LYCANITE_WRITE, path);
+        failedSeals += seal(client, uuid) != STATUS_SUCCESS;
+    }
+
+    InterlockedExchange(&stop, 1);
+    for (UINT32 t = 0; t < threads; t++) {
+        pthread_join(readers[t], NULL);
+    }
+
+    printf("%u seals, %lld reads, %lld denied, %u seals failed\n", seals,
+        (long long)reads, (long long)denied, failedSeals);
+
+    ShimNotifyProcess(CHECK_CONTROLLER, CHECK_PROCESS, FALSE);
+    ShimDisconnect(client);
+    ShimUnloadDriver();
+    return denied != 0 || failedSeals != 0 || !applied;
+}
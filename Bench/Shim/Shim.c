@@ -0,0 +1,847 @@
+/*
+ * User-mode implementation of the WDK subset used by the driver sources.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Shim.h"
+
+#undef malloc
+#undef calloc
+#undef free
+
+/* ======================================================
+*                       State
+*  ======================================================*/
+
+static const FLT_REGISTRATION* shimRegistration = NULL;
+static PCREATE_PROCESS_NOTIFY_ROUTINE shimProcessNotify = NULL;
+static PFLT_CONNECT_NOTIFY shimConnectNotify = NULL;
+static PFLT_DISCONNECT_NOTIFY shimDisconnectNotify = NULL;
+static PFLT_MESSAGE_NOTIFY shimMessageNotify = NULL;
+static PVOID shimServerCookie = NULL;
+static ShimMessageSink shimSink = NULL;
+static PVOID shimSinkContext = NULL;
+static LONG shimMaxConnections = 0;
+static LONG shimConnections = 0;
+
+struct _FLT_PORT {
+    PVOID ConnectionCookie;
+};
+
+struct _FLT_FILTER {
+    INT Unused;
+};
+
+static struct _FLT_FILTER shimFilter;
+static struct _FLT_PORT shimServerPort;
+
+static POBJECT_TYPE shimEventType = (POBJECT_TYPE)1;
+static POBJECT_TYPE shimThreadType = (POBJECT_TYPE)2;
+POBJECT_TYPE* ExEventObjectType = &shimEventType;
+POBJECT_TYPE* PsThreadType = &shimThreadType;
+
+static __thread KIRQL shimIrql = PASSIVE_LEVEL;
+static volatile LONG64 shimAllocations = 0;
+static volatile LONG64 shimPoolBytes = 0;
+
+/* ======================================================
+*                       Memory
+*  ======================================================*/
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag) {
+    (void)PoolType;
+    (void)Tag;
+    PVOID mem = NULL;
+    if (posix_memalign(&mem, 16, NumberOfBytes ? NumberOfBytes : 1) != 0) {
+        return NULL;
+    }
+    InterlockedIncrement64(&shimAllocations);
+    InterlockedExchangeAdd64(&shimPoolBytes, (LONG64)malloc_usable_size(mem));
+    return mem;
+}
+
+UINT64 ShimAllocations(void) {
+    return (UINT64)ReadNoFence64(&shimAllocations);
+}
+
+UINT64 ShimPoolBytes(void) {
+    return (UINT64)ReadNoFence64(&shimPoolBytes);
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag) {
+    (void)Tag;
+    if (P != NULL) {
+        InterlockedExchangeAdd64(&shimPoolBytes, -(LONG64)malloc_usable_size(P));
+    }
+    free(P);
+}
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PIRP Irp) {
+    (void)SecondaryBuffer;
+    (void)ChargeQuota;
+    (void)Irp;
+    PMDL mdl = (PMDL)malloc(sizeof(MDL));
+    if (mdl != NULL) {
+        mdl->StartVa = VirtualAddress;
+        mdl->ByteCount = Length;
+    }
+    return mdl;
+}
+
+VOID IoFreeMdl(PMDL Mdl) {
+    free(Mdl);
+}
+
+VOID MmBuildMdlForNonPagedPool(PMDL MemoryDescriptorList) {
+    (void)MemoryDescriptorList;
+}
+
+PVOID MmMapLockedPagesSpecifyCache(PMDL MemoryDescriptorList, KPROCESSOR_MODE AccessMode, MEMORY_CACHING_TYPE CacheType, PVOID RequestedAddress, ULONG BugCheckOnFailure, ULONG Priority) {
+    (void)AccessMode;
+    (void)CacheType;
+    (void)RequestedAddress;
+    (void)BugCheckOnFailure;
+    (void)Priority;
+    /* Kernel and "user" share one address space here. */
+    return MemoryDescriptorList->StartVa;
+}
+
+VOID MmUnmapLockedPages(PVOID BaseAddress, PMDL MemoryDescriptorList) {
+    (void)BaseAddress;
+    (void)MemoryDescriptorList;
+}
+
+/* ======================================================
+*                       Strings
+*  ======================================================*/
+
+NTSTATUS RtlAnsiStringToUnicodeString(PUNICODE_STRING DestinationString, PCANSI_STRING SourceString, BOOLEAN AllocateDestinationString) {
+    USHORT len = SourceString->Length;
+    if (AllocateDestinationString) {
+        DestinationString->Buffer = (PWCH)malloc(((SIZE_T)len + 1) * sizeof(WCHAR));
+        if (DestinationString->Buffer == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        DestinationString->MaximumLength = (USHORT)((len + 1) * sizeof(WCHAR));
+    }
+    for (USHORT i = 0; i < len; i++) {
+        DestinationString->Buffer[i] = (UCHAR)SourceString->Buffer[i];
+    }
+    DestinationString->Buffer[len] = 0;
+    DestinationString->Length = (USHORT)(len * sizeof(WCHAR));
+    return STATUS_SUCCESS;
+}
+
+VOID RtlFreeUnicodeString(PUNICODE_STRING UnicodeString) {
+    free(UnicodeString->Buffer);
+    UnicodeString->Buffer = NULL;
+    UnicodeString->Length = 0;
+    UnicodeString->MaximumLength = 0;
+}
+
+VOID RtlInitUnicodeString(PUNICODE_STRING DestinationString, PCWSTR SourceString) {
+    USHORT len = 0;
+    while (SourceString != NULL && SourceString[len] != 0) {
+        len++;
+    }
+    DestinationString->Buffer = (PWCH)SourceString;
+    DestinationString->Length = (USHORT)(len * sizeof(WCHAR));
+    DestinationString->MaximumLength = (USHORT)((len + 1) * sizeof(WCHAR));
+}
+
+USHORT ShimWiden(PCSZ Source, PWCHAR Destination, USHORT Capacity) {
+    USHORT len = 0;
+    while (Source[len] != 0 && len + 1 < Capacity) {
+        Destination[len] = (UCHAR)Source[len];
+        len++;
+    }
+    Destination[len] = 0;
+    return len;
+}
+
+/* ======================================================
+*                       Dispatcher
+*  ======================================================*/
+
+#define SHIM_OBJECT_EVENT  1
+#define SHIM_OBJECT_THREAD 2
+#define SHIM_OBJECT_PROCESS 3
+
+#define SHIM_MAX_FILE_HANDLE 0x10000
+
+typedef struct _KTHREAD {
+    SHIM_DISPATCHER_HEADER Header;
+    pthread_t Thread;
+    PKSTART_ROUTINE StartRoutine;
+    PVOID StartContext;
+    LONG References;
+} SHIM_THREAD;
+
+static VOID shimHeaderInit(SHIM_DISPATCHER_HEADER* header, INT type, INT signaled) {
+    header->Type = type;
+    header->Signaled = signaled;
+    pthread_mutex_init(&header->Mutex, NULL);
+    pthread_cond_init(&header->Condition, NULL);
+}
+
+static struct timespec shimDeadline(PLARGE_INTEGER Timeout) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    /* Relative (negative) timeouts in 100ns units are all the driver uses. */
+    LONGLONG ns = (Timeout->QuadPart < 0 ? -Timeout->QuadPart : Timeout->QuadPart) * 100;
+    ts.tv_sec += ns / 1000000000LL;
+    ts.tv_nsec += ns % 1000000000LL;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State) {
+    shimHeaderInit(&Event->Header, SHIM_OBJECT_EVENT, State);
+    Event->EventType = Type;
+}
+
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait) {
+    (void)Increment;
+    (void)Wait;
+    pthread_mutex_lock(&Event->Header.Mutex);
+    LONG previous = Event->Header.Signaled;
+    Event->Header.Signaled = 1;
+    if (Event->EventType == NotificationEvent) {
+        pthread_cond_broadcast(&Event->Header.Condition);
+    }
+    else {
+        pthread_cond_signal(&Event->Header.Condition);
+    }
+    pthread_mutex_unlock(&Event->Header.Mutex);
+    return previous;
+}
+
+VOID KeClearEvent(PRKEVENT Event) {
+    pthread_mutex_lock(&Event->Header.Mutex);
+    Event->Header.Signaled = 0;
+    pthread_mutex_unlock(&Event->Header.Mutex);
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout) {
+    (void)WaitReason;
+    (void)WaitMode;
+    (void)Alertable;
+    SHIM_DISPATCHER_HEADER* header = (SHIM_DISPATCHER_HEADER*)Object;
+    NTSTATUS status = STATUS_WAIT_0;
+    struct timespec deadline;
+    if (Timeout != NULL) {
+        deadline = shimDeadline(Timeout);
+    }
+
+    pthread_mutex_lock(&header->Mutex);
+    while (!header->Signaled) {
+        if (Timeout == NULL) {
+            pthread_cond_wait(&header->Condition, &header->Mutex);
+        }
+        else if (pthread_cond_timedwait(&header->Condition, &header->Mutex, &deadline) == ETIMEDOUT) {
+            status = STATUS_TIMEOUT;
+            break;
+        }
+    }
+    if (status == STATUS_WAIT_0 && header->Type == SHIM_OBJECT_EVENT &&
+        ((PKEVENT)Object)->EventType == SynchronizationEvent) {
+        header->Signaled = 0;
+    }
+    pthread_mutex_unlock(&header->Mutex);
+    return status;
+}
+
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Interval) {
+    (void)WaitMode;
+    (void)Alertable;
+    LONGLONG ns = (Interval->QuadPart < 0 ? -Interval->QuadPart : Interval->QuadPart) * 100;
+    struct timespec ts = { (time_t)(ns / 1000000000LL), (long)(ns % 1000000000LL) };
+    nanosleep(&ts, NULL);
+    return STATUS_SUCCESS;
+}
+
+KIRQL KeGetCurrentIrql(void) {
+    return shimIrql;
+}
+
+VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql) {
+    *OldIrql = shimIrql;
+    shimIrql = NewIrql;
+}
+
+VOID KeLowerIrql(KIRQL NewIrql) {
+    shimIrql = NewIrql;
+}
+
+VOID KeEnterCriticalRegion(void) {
+}
+
+VOID KeLeaveCriticalRegion(void) {
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber) {
+    INT cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = 0;
+    }
+    if (ProcNumber != NULL) {
+        ProcNumber->Group = 0;
+        ProcNumber->Number = (UCHAR)cpu;
+        ProcNumber->Reserved = 0;
+    }
+    return (ULONG)cpu;
+}
+
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber) {
+    (void)GroupNumber;
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    return count > 0 ? (ULONG)count : 1;
+}
+
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber) {
+    (void)GroupNumber;
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (ULONG)count : 1;
+}
+
+UINT64 ShimNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * 1000000000ULL + (UINT64)ts.tv_nsec;
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency) {
+    LARGE_INTEGER counter;
+    if (PerformanceFrequency != NULL) {
+        PerformanceFrequency->QuadPart = 1000000000LL;
+    }
+    counter.QuadPart = (LONGLONG)ShimNanoseconds();
+    return counter;
+}
+
+ULONGLONG KeQueryInterruptTime(void) {
+    return ShimNanoseconds() / 100;
+}
+
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    /* 100ns intervals since 1601-01-01. */
+    CurrentTime->QuadPart = ((LONGLONG)ts.tv_sec + 11644473600LL) * 10000000LL + ts.tv_nsec / 100;
+}
+
+/* ======================================================
+*                       Objects & Threads
+*  ======================================================*/
+
+static VOID shimThreadRelease(SHIM_THREAD* thread);
+
+static PVOID shimThreadStart(PVOID Context) {
+    SHIM_THREAD* thread = (SHIM_THREAD*)Context;
+    thread->StartRoutine(thread->StartContext);
+
+    pthread_mutex_lock(&thread->Header.Mutex);
+    thread->Header.Signaled = 1;
+    pthread_cond_broadcast(&thread->Header.Condition);
+    pthread_mutex_unlock(&thread->Header.Mutex);
+    shimThreadRelease(thread);
+    return NULL;
+}
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes, HANDLE ProcessHandle, PVOID ClientId, PKSTART_ROUTINE StartRoutine, PVOID StartContext) {
+    (void)DesiredAccess;
+    (void)ObjectAttributes;
+    (void)ProcessHandle;
+    (void)ClientId;
+    SHIM_THREAD* thread = (SHIM_THREAD*)calloc(1, sizeof(SHIM_THREAD));
+    if (thread == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    shimHeaderInit(&thread->Header, SHIM_OBJECT_THREAD, 0);
+    thread->StartRoutine = StartRoutine;
+    thread->StartContext = StartContext;
+    /* One for the handle, one for the running thread. */
+    thread->References = 2;
+    if (pthread_create(&thread->Thread, NULL, shimThreadStart, thread) != 0) {
+        free(thread);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    pthread_detach(thread->Thread);
+    *ThreadHandle = thread;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus) {
+    (void)ExitStatus;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess, POBJECT_TYPE ObjectType, KPROCESSOR_MODE AccessMode, PVOID* Object, PVOID HandleInformation) {
+    (void)DesiredAccess;
+    (void)ObjectType;
+    (void)AccessMode;
+    (void)HandleInformation;
+    if (Handle == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (((SHIM_DISPATCHER_HEADER*)Handle)->Type == SHIM_OBJECT_THREAD) {
+        __atomic_add_fetch(&((SHIM_THREAD*)Handle)->References, 1, __ATOMIC_SEQ_CST);
+    }
+    *Object = Handle;
+    return STATUS_SUCCESS;
+}
+
+static VOID shimThreadRelease(SHIM_THREAD* thread) {
+    if (__atomic_sub_fetch(&thread->References, 1, __ATOMIC_SEQ_CST) == 0) {
+        free(thread);
+    }
+}
+
+VOID ObDereferenceObject(PVOID Object) {
+    if (((SHIM_DISPATCHER_HEADER*)Object)->Type == SHIM_OBJECT_THREAD) {
+        shimThreadRelease((SHIM_THREAD*)Object);
+    }
+}
+
+NTSTATUS ZwClose(HANDLE Handle) {
+    if (Handle == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    // file handles are descriptors + 1, far below any object
+    if ((ULONG_PTR)Handle > SHIM_MAX_FILE_HANDLE && ((SHIM_DISPATCHER_HEADER*)Handle)->Type == SHIM_OBJECT_THREAD) {
+        shimThreadRelease((SHIM_THREAD*)Handle);
+        return STATUS_SUCCESS;
+    }
+    close((INT)(LONG_PTR)Handle - 1);
+    return STATUS_SUCCESS;
+}
+
+static SHIM_DISPATCHER_HEADER shimProcess = { .Type = SHIM_OBJECT_PROCESS };
+
+PEPROCESS PsGetCurrentProcess(void) {
+    return (PEPROCESS)&shimProcess;
+}
+
+VOID ObReferenceObject(PVOID Object) {
+    if (((SHIM_DISPATCHER_HEADER*)Object)->Type == SHIM_OBJECT_THREAD) {
+        __atomic_add_fetch(&((SHIM_THREAD*)Object)->References, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+VOID KeStackAttachProcess(PRKPROCESS Process, PRKAPC_STATE ApcState) {
+    ApcState->Process = Process;
+}
+
+VOID KeUnstackDetachProcess(PRKAPC_STATE ApcState) {
+    ApcState->Process = NULL;
+}
+
+HANDLE PsGetCurrentProcessId(void) {
+    return (HANDLE)(LONG_PTR)getpid();
+}
+
+/*
+ * Files are opened by their narrowed NT name so harnesses can point the driver
+ * at any regular file.
+ */
+NTSTATUS ZwCreateFile(PHANDLE FileHandle, ACCESS_MASK DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes, PIO_STATUS_BLOCK IoStatusBlock, PLARGE_INTEGER AllocationSize, ULONG FileAttributes, ULONG ShareAccess, ULONG CreateDisposition, ULONG CreateOptions, PVOID EaBuffer, ULONG EaLength) {
+    (void)DesiredAccess;
+    (void)AllocationSize;
+    (void)FileAttributes;
+    (void)ShareAccess;
+    (void)CreateDisposition;
+    (void)CreateOptions;
+    (void)EaBuffer;
+    (void)EaLength;
+    char path[1024];
+    PUNICODE_STRING name = ObjectAttributes->ObjectName;
+    USHORT len = name->Length / sizeof(WCHAR);
+    if (len >= sizeof(path)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    for (USHORT i = 0; i < len; i++) {
+        path[i] = (char)name->Buffer[i];
+    }
+    path[len] = 0;
+    INT fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        IoStatusBlock->Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+    *FileHandle = (HANDLE)(LONG_PTR)(fd + 1);
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwReadFile(HANDLE FileHandle, HANDLE Event, PVOID ApcRoutine, PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer, ULONG Length, PLARGE_INTEGER ByteOffset, PULONG Key) {
+    (void)Event;
+    (void)ApcRoutine;
+    (void)ApcContext;
+    (void)Key;
+    INT fd = (INT)(LONG_PTR)FileHandle - 1;
+    SIZE_T done = 0;
+    off_t offset = ByteOffset != NULL ? (off_t)ByteOffset->QuadPart : 0;
+    while (done < Length) {
+        ssize_t r = pread(fd, (PCHAR)Buffer + done, Length - done, offset + (off_t)done);
+        if (r <= 0) {
+            break;
+        }
+        done += (SIZE_T)r;
+    }
+    IoStatusBlock->Information = done;
+    IoStatusBlock->Status = done == 0 && Length != 0 ? STATUS_END_OF_FILE : STATUS_SUCCESS;
+    return IoStatusBlock->Status;
+}
+
+NTSTATUS ZwQueryInformationFile(HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation, ULONG Length, FILE_INFORMATION_CLASS FileInformationClass) {
+    struct stat st;
+    if (FileInformationClass != FileStandardInformation || Length < sizeof(FILE_STANDARD_INFORMATION)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (fstat((INT)(LONG_PTR)FileHandle - 1, &st) != 0) {
+        return STATUS_UNSUCCESSFUL;
+    }
+    PFILE_STANDARD_INFORMATION info = (PFILE_STANDARD_INFORMATION)FileInformation;
+    memset(info, 0, sizeof(*info));
+    info->EndOfFile.QuadPart = st.st_size;
+    info->AllocationSize.QuadPart = st.st_size;
+    info->NumberOfLinks = 1;
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = sizeof(*info);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Registry values come from LYCANITE_<ValueName> environment variables.
+ */
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo, PCWSTR Path, PRTL_QUERY_REGISTRY_TABLE QueryTable, PVOID Context, PVOID Environment) {
+    (void)RelativeTo;
+    (void)Path;
+    (void)Context;
+    (void)Environment;
+    for (PRTL_QUERY_REGISTRY_TABLE entry = QueryTable; entry->Name != NULL; entry++) {
+        char variable[128] = "LYCANITE_";
+        SIZE_T pos = strlen(variable);
+        for (SIZE_T i = 0; entry->Name[i] != 0 && pos + 1 < sizeof(variable); i++) {
+            variable[pos++] = (char)entry->Name[i];
+        }
+        variable[pos] = 0;
+        const char* value = getenv(variable);
+        if (value == NULL) {
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+        if ((entry->Flags & RTL_QUERY_REGISTRY_DIRECT) && (entry->DefaultType >> RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) == REG_DWORD) {
+            *(ULONG*)entry->EntryContext = (ULONG)strtoul(value, NULL, 0);
+        }
+        else if (entry->Flags & RTL_QUERY_REGISTRY_DIRECT) {
+            PUNICODE_STRING target = (PUNICODE_STRING)entry->EntryContext;
+            SIZE_T len = strlen(value);
+            if (target->Buffer == NULL) {
+                target->Buffer = (PWCH)malloc((len + 1) * sizeof(WCHAR));
+                if (target->Buffer == NULL) {
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                target->MaximumLength = (USHORT)((len + 1) * sizeof(WCHAR));
+            }
+            if ((len + 1) * sizeof(WCHAR) > target->MaximumLength) {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+            for (SIZE_T i = 0; i < len; i++) {
+                target->Buffer[i] = (UCHAR)value[i];
+            }
+            target->Buffer[len] = 0;
+            target->Length = (USHORT)(len * sizeof(WCHAR));
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+/* ======================================================
+*                       Process Notify
+*  ======================================================*/
+
+NTSTATUS PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE NotifyRoutine, BOOLEAN Remove) {
+    if (Remove) {
+        if (shimProcessNotify != NotifyRoutine) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        shimProcessNotify = NULL;
+    }
+    else {
+        shimProcessNotify = NotifyRoutine;
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID ShimNotifyProcess(UINT64 ParentId, UINT64 ProcessId, BOOLEAN Create) {
+    if (shimProcessNotify != NULL) {
+        shimProcessNotify((HANDLE)(ULONG_PTR)ParentId, (HANDLE)(ULONG_PTR)ProcessId, Create);
+    }
+}
+
+/* ======================================================
+*                       Filter Manager
+*  ======================================================*/
+
+NTSTATUS FltRegisterFilter(PDRIVER_OBJECT Driver, const FLT_REGISTRATION* Registration, PFLT_FILTER* RetFilter) {
+    (void)Driver;
+    shimRegistration = Registration;
+    *RetFilter = &shimFilter;
+    return STATUS_SUCCESS;
+}
+
+VOID FltUnregisterFilter(PFLT_FILTER Filter) {
+    (void)Filter;
+    shimRegistration = NULL;
+}
+
+NTSTATUS FltStartFiltering(PFLT_FILTER Filter) {
+    (void)Filter;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS FltBuildDefaultSecurityDescriptor(PSECURITY_DESCRIPTOR* SecurityDescriptor, ACCESS_MASK DesiredAccess) {
+    (void)DesiredAccess;
+    *SecurityDescriptor = (PSECURITY_DESCRIPTOR)&shimFilter;
+    return STATUS_SUCCESS;
+}
+
+VOID FltFreeSecurityDescriptor(PSECURITY_DESCRIPTOR SecurityDescriptor) {
+    (void)SecurityDescriptor;
+}
+
+NTSTATUS FltCreateCommunicationPort(PFLT_FILTER Filter, PFLT_PORT* ServerPort, POBJECT_ATTRIBUTES ObjectAttributes, PVOID ServerPortCookie, PFLT_CONNECT_NOTIFY ConnectNotifyCallback, PFLT_DISCONNECT_NOTIFY DisconnectNotifyCallback, PFLT_MESSAGE_NOTIFY MessageNotifyCallback, LONG MaxConnections) {
+    (void)Filter;
+    (void)ObjectAttributes;
+    shimServerCookie = ServerPortCookie;
+    shimConnectNotify = ConnectNotifyCallback;
+    shimDisconnectNotify = DisconnectNotifyCallback;
+    shimMessageNotify = MessageNotifyCallback;
+    shimMaxConnections = MaxConnections;
+    *ServerPort = &shimServerPort;
+    return STATUS_SUCCESS;
+}
+
+VOID FltCloseCommunicationPort(PFLT_PORT ServerPort) {
+    (void)ServerPort;
+    shimConnectNotify = NULL;
+    shimMessageNotify = NULL;
+}
+
+VOID FltCloseClientPort(PFLT_FILTER Filter, PFLT_PORT* ClientPort) {
+    (void)Filter;
+    *ClientPort = NULL;
+}
+
+NTSTATUS FltSendMessage(PFLT_FILTER Filter, PFLT_PORT* ClientPort, PVOID SenderBuffer, ULONG SenderBufferLength, PVOID ReplyBuffer, PULONG ReplyLength, PLARGE_INTEGER Timeout) {
+    (void)Filter;
+    (void)ReplyBuffer;
+    (void)Timeout;
+    if (ClientPort == NULL || *ClientPort == NULL) {
+        return STATUS_PORT_DISCONNECTED;
+    }
+    if (shimSink != NULL) {
+        shimSink(shimSinkContext, *ClientPort, SenderBuffer, SenderBufferLength);
+    }
+    if (ReplyLength != NULL) {
+        *ReplyLength = 0;
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID ShimSetMessageSink(ShimMessageSink Sink, PVOID Context) {
+    shimSinkContext = Context;
+    shimSink = Sink;
+}
+
+PFLT_PORT ShimConnect(void) {
+    if (shimConnectNotify == NULL || shimConnections >= shimMaxConnections) {
+        return NULL;
+    }
+    PFLT_PORT client = (PFLT_PORT)calloc(1, sizeof(struct _FLT_PORT));
+    if (client == NULL) {
+        return NULL;
+    }
+    if (!NT_SUCCESS(shimConnectNotify(client, shimServerCookie, NULL, 0, &client->ConnectionCookie))) {
+        free(client);
+        return NULL;
+    }
+    shimConnections++;
+    return client;
+}
+
+VOID ShimDisconnect(PFLT_PORT ClientPort) {
+    if (ClientPort != NULL) {
+        if (shimDisconnectNotify != NULL) {
+            shimDisconnectNotify(ClientPort->ConnectionCookie);
+        }
+        shimConnections--;
+        free(ClientPort);
+    }
+}
+
+NTSTATUS ShimSendMessage(PFLT_PORT ClientPort, PVOID Input, ULONG InputLength, PVOID Output, ULONG OutputLength, PULONG ReturnLength) {
+    ULONG returned = 0;
+    if (shimMessageNotify == NULL || ClientPort == NULL) {
+        return STATUS_PORT_DISCONNECTED;
+    }
+    NTSTATUS status = shimMessageNotify(ClientPort->ConnectionCookie, Input, InputLength, Output, OutputLength, &returned);
+    if (ReturnLength != NULL) {
+        *ReturnLength = returned;
+    }
+    return status;
+}
+
+NTSTATUS FltGetFileNameInformation(PFLT_CALLBACK_DATA CallbackData, FLT_FILE_NAME_OPTIONS NameOptions, PFLT_FILE_NAME_INFORMATION* FileNameInformation) {
+    (void)NameOptions;
+    if (CallbackData->ShimNameInformation.Name.Buffer == NULL) {
+        *FileNameInformation = NULL;
+        return STATUS_FLT_INVALID_NAME_REQUEST;
+    }
+    *FileNameInformation = &CallbackData->ShimNameInformation;
+    return STATUS_SUCCESS;
+}
+
+static VOID shimSlice(PUNICODE_STRING Target, PWCH Buffer, USHORT Start, USHORT End) {
+    Target->Buffer = Buffer + Start;
+    Target->Length = (USHORT)((End - Start) * sizeof(WCHAR));
+    Target->MaximumLength = Target->Length;
+}
+
+/*
+ * Splits "\Device\HarddiskVolumeN\dir\file.ext" the way the filter manager does.
+ */
+NTSTATUS FltParseFileNameInformation(PFLT_FILE_NAME_INFORMATION FileNameInformation) {
+    PWCH name = FileNameInformation->Name.Buffer;
+    USHORT len = FileNameInformation->Name.Length / sizeof(WCHAR);
+    USHORT separators = 0;
+    USHORT volumeEnd = len;
+    USHORT lastSeparator = 0;
+    USHORT extension = len;
+
+    for (USHORT i = 0; i < len; i++) {
+        if (name[i] == '\\') {
+            separators++;
+            if (separators == 3) {
+                volumeEnd = i;
+            }
+            lastSeparator = i;
+            extension = len;
+        }
+        else if (name[i] == '.') {
+            extension = i + 1;
+        }
+    }
+
+    shimSlice(&FileNameInformation->Volume, name, 0, volumeEnd);
+    shimSlice(&FileNameInformation->Share, name, 0, 0);
+    shimSlice(&FileNameInformation->ParentDir, name, volumeEnd, (USHORT)(lastSeparator + 1 > volumeEnd ? lastSeparator + 1 : volumeEnd));
+    shimSlice(&FileNameInformation->FinalComponent, name, (USHORT)(lastSeparator + 1 < len ? lastSeparator + 1 : len), len);
+    shimSlice(&FileNameInformation->Extension, name, extension, len);
+    shimSlice(&FileNameInformation->Stream, name, len, len);
+    FileNameInformation->NamesParsed = 0xF;
+    return STATUS_SUCCESS;
+}
+
+VOID FltReleaseFileNameInformation(PFLT_FILE_NAME_INFORMATION FileNameInformation) {
+    (void)FileNameInformation;
+}
+
+ULONG FltGetRequestorProcessId(PFLT_CALLBACK_DATA CallbackData) {
+    return CallbackData->ShimRequestorProcessId;
+}
+
+VOID FltInitializePushLock(PEX_PUSH_LOCK PushLock) {
+    pthread_rwlock_init(&PushLock->Lock, NULL);
+}
+
+VOID FltDeletePushLock(PEX_PUSH_LOCK PushLock) {
+    pthread_rwlock_destroy(&PushLock->Lock);
+}
+
+VOID FltAcquirePushLockShared(PEX_PUSH_LOCK PushLock) {
+    pthread_rwlock_rdlock(&PushLock->Lock);
+}
+
+VOID FltAcquirePushLockExclusive(PEX_PUSH_LOCK PushLock) {
+    pthread_rwlock_wrlock(&PushLock->Lock);
+}
+
+VOID FltReleasePushLock(PEX_PUSH_LOCK PushLock) {
+    pthread_rwlock_unlock(&PushLock->Lock);
+}
+
+/* ======================================================
+*                       Harness Helpers
+*  ======================================================*/
+
+NTSTATUS ShimLoadDriver(DRIVER_INITIALIZE* Entry) {
+    static DRIVER_OBJECT driver;
+    static UNICODE_STRING registry;
+    return Entry(&driver, &registry);
+}
+
+NTSTATUS ShimUnloadDriver(void) {
+    if (shimRegistration == NULL || shimRegistration->FilterUnloadCallback == NULL) {
+        return STATUS_UNSUCCESSFUL;
+    }
+    return shimRegistration->FilterUnloadCallback(0);
+}
+
+VOID ShimInitCallbackData(PFLT_CALLBACK_DATA Data, PFLT_IO_PARAMETER_BLOCK Iopb, UCHAR MajorFunction, ULONG ProcessId, PWCHAR Name, USHORT NameLength) {
+    memset(Data, 0, sizeof(*Data));
+    memset(Iopb, 0, sizeof(*Iopb));
+    Iopb->MajorFunction = MajorFunction;
+    Data->Iopb = Iopb;
+    Data->ShimRequestorProcessId = ProcessId;
+    Data->ShimNameInformation.Size = sizeof(FLT_FILE_NAME_INFORMATION);
+    Data->ShimNameInformation.Name.Buffer = Name;
+    Data->ShimNameInformation.Name.Length = (USHORT)(NameLength * sizeof(WCHAR));
+    Data->ShimNameInformation.Name.MaximumLength = (USHORT)(NameLength * sizeof(WCHAR));
+}
+
+FLT_PREOP_CALLBACK_STATUS ShimPreOperation(PFLT_CALLBACK_DATA Data) {
+    FLT_RELATED_OBJECTS objects;
+    memset(&objects, 0, sizeof(objects));
+    objects.Size = sizeof(objects);
+    objects.Filter = &shimFilter;
+    Data->ShimCompletionContext = NULL;
+
+    for (const FLT_OPERATION_REGISTRATION* op = shimRegistration->OperationRegistration;
+         op->MajorFunction != IRP_MJ_OPERATION_END; op++) {
+        if (op->MajorFunction == Data->Iopb->MajorFunction && op->PreOperation != NULL) {
+            return op->PreOperation(Data, &objects, &Data->ShimCompletionContext);
+        }
+    }
+    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+}
+
+FLT_POSTOP_CALLBACK_STATUS ShimCompleteOperation(PFLT_CALLBACK_DATA Data, NTSTATUS Status, ULONG_PTR Information) {
+    FLT_RELATED_OBJECTS objects;
+    memset(&objects, 0, sizeof(objects));
+    objects.Size = sizeof(objects);
+    objects.Filter = &shimFilter;
+    Data->IoStatus.Status = Status;
+    Data->IoStatus.Information = Information;
+
+    for (const FLT_OPERATION_REGISTRATION* op = shimRegistration->OperationRegistration;
+         op->MajorFunction != IRP_MJ_OPERATION_END; op++) {
+        if (op->MajorFunction == Data->Iopb->MajorFunction && op->PostOperation != NULL) {
+            return op->PostOperation(Data, &objects, Data->ShimCompletionContext, 0);
+        }
+    }
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
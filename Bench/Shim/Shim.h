@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Entry points the user-mode harnesses use to drive the driver through the shim.
+ */
+
+#include "fltkernel.h"
+
+typedef VOID (*ShimMessageSink)(PVOID Context, PFLT_PORT ClientPort, PVOID Buffer, ULONG Length);
+
+/* Run DriverEntry / the registered unload callback. */
+NTSTATUS ShimLoadDriver(DRIVER_INITIALIZE* Entry);
+NTSTATUS ShimUnloadDriver(void);
+
+/* Connect a controller to the communication port; returns its client port. */
+PFLT_PORT ShimConnect(void);
+VOID ShimDisconnect(PFLT_PORT ClientPort);
+
+/* Send a request as the given controller connection. */
+NTSTATUS ShimSendMessage(PFLT_PORT ClientPort, PVOID Input, ULONG InputLength, PVOID Output, ULONG OutputLength, PULONG ReturnLength);
+
+/* Receive every FltSendMessage addressed to a connected controller. */
+VOID ShimSetMessageSink(ShimMessageSink Sink, PVOID Context);
+
+/* Fire the registered process notify routine. */
+VOID ShimNotifyProcess(UINT64 ParentId, UINT64 ProcessId, BOOLEAN Create);
+
+/* Build a request the way the filter manager would hand it to a pre-op callback. */
+VOID ShimInitCallbackData(PFLT_CALLBACK_DATA Data, PFLT_IO_PARAMETER_BLOCK Iopb, UCHAR MajorFunction, ULONG ProcessId, PWCHAR Name, USHORT NameLength);
+
+/* Dispatch a request through the registered pre-operation callback. */
+FLT_PREOP_CALLBACK_STATUS ShimPreOperation(PFLT_CALLBACK_DATA Data);
+
+/* Complete a request its pre-operation passed on with FLT_PREOP_SUCCESS_WITH_CALLBACK: the registered post-operation callback sees Status and Information. */
+FLT_POSTOP_CALLBACK_STATUS ShimCompleteOperation(PFLT_CALLBACK_DATA Data, NTSTATUS Status, ULONG_PTR Information);
+
+/* Monotonic nanoseconds. */
+UINT64 ShimNanoseconds(void);
+
+/* Pool allocations made by the driver so far. */
+UINT64 ShimAllocations(void);
+
+/* Bytes of pool the driver holds right now, allocator rounding included. */
+UINT64 ShimPoolBytes(void);
+
+/* Narrow <-> UTF-16 helpers for building paths. */
+USHORT ShimWiden(PCSZ Source, PWCHAR Destination, USHORT Capacity);
@@ -0,0 +1,617 @@
+#pragma once
+
+/*
+ * User-mode stand-in for the subset of the WDK used by the driver sources.
+ *
+ * Only what KMDFLycaniteFileFilter.c and its headers touch is declared, with
+ * the field names and layouts the driver relies on. Anything the filter
+ * manager would derive from a real request (requestor, file name) is carried
+ * in Shim* fields of FLT_CALLBACK_DATA, see ShimInitCallbackData.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Utils.h defines its own malloc/calloc/free on top of the pool allocator. */
+#define malloc LycaniteShimMalloc
+#define calloc LycaniteShimCalloc
+#define free   LycaniteShimFree
+
+/* ======================================================
+*                       SAL & Pragmas
+*  ======================================================*/
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _Outptr_result_maybenull_
+#define _In_reads_bytes_(x)
+#define _In_reads_bytes_opt_(x)
+#define _Out_writes_bytes_to_opt_(x, y)
+#define _Flt_CompletionContext_Outptr_
+#define _IRQL_requires_max_(x)
+#define _Function_class_(x)
+#define _Use_decl_annotations_
+#define PAGED_CODE()
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define KdPrint(_x_)
+#define DbgPrint(...) ((void)0)
+
+/* ======================================================
+*                       Base Types
+*  ======================================================*/
+
+#define CONST const
+#define VOID void
+#define TRUE 1
+#define FALSE 0
+
+typedef void* PVOID;
+typedef void* HANDLE;
+typedef HANDLE* PHANDLE;
+typedef char CHAR;
+typedef CHAR* PCHAR;
+typedef const CHAR* PCSZ;
+typedef unsigned char UCHAR;
+typedef UCHAR* PUCHAR;
+typedef UCHAR BOOLEAN;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int8_t INT8;
+typedef int16_t INT16;
+typedef int32_t INT32;
+typedef int64_t INT64;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef INT32* PINT32;
+typedef UINT32* PUINT32;
+typedef UINT64* PUINT64;
+
+#define MAXUINT32 ((UINT32)~((UINT32)0))
+#define MAXUINT64 ((UINT64)~((UINT64)0))
+#define MAXUSHORT 0xffff
+
+typedef int16_t SHORT;
+typedef uint16_t USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef ULONG* PULONG;
+typedef LONG* PLONG;
+typedef int64_t LONG64;
+typedef uint64_t ULONG64;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef intptr_t LONG_PTR;
+typedef size_t SIZE_T;
+typedef uint16_t WCHAR;
+typedef WCHAR* PWCHAR;
+typedef WCHAR* PWCH;
+typedef WCHAR* PWSTR;
+typedef const WCHAR* PCWSTR;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL;
+typedef KIRQL* PKIRQL;
+typedef LONG KPRIORITY;
+typedef ULONG ACCESS_MASK;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define FlagOn(_F, _SF) ((_F) & (_SF))
+#define ALIGN_UP_BY(length, alignment) (((ULONG_PTR)(length) + (alignment) - 1) & ~((ULONG_PTR)(alignment) - 1))
+#define CONTAINING_RECORD(address, type, field) ((type*)((PCHAR)(address) - __builtin_offsetof(type, field)))
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define FORCEINLINE static inline __attribute__((always_inline))
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_WAIT_0                   ((NTSTATUS)0x00000000L)
+#define STATUS_ABANDONED                ((NTSTATUS)0x00000080L)
+#define STATUS_TIMEOUT                  ((NTSTATUS)0x00000102L)
+#define STATUS_DEVICE_BUSY              ((NTSTATUS)0x80000011L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_END_OF_FILE              ((NTSTATUS)0xC0000011L)
+#define STATUS_ACCESS_DENIED            ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034L)
+#define STATUS_PORT_DISCONNECTED        ((NTSTATUS)0xC0000037L)
+#define STATUS_QUOTA_EXCEEDED           ((NTSTATUS)0xC0000044L)
+#define STATUS_DISK_FULL                ((NTSTATUS)0xC000007FL)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_FILE_CORRUPT_ERROR       ((NTSTATUS)0xC0000102L)
+#define STATUS_NOT_FOUND                ((NTSTATUS)0xC0000225L)
+#define STATUS_FLT_INVALID_NAME_REQUEST ((NTSTATUS)0xC01C0005L)
+
+/* ======================================================
+*                       Strings
+*  ======================================================*/
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+typedef struct _STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PCHAR Buffer;
+} ANSI_STRING, *PANSI_STRING;
+typedef ANSI_STRING CANSI_STRING;
+typedef const ANSI_STRING* PCANSI_STRING;
+
+#define RTL_CONSTANT_STRING(s) { sizeof(s) - sizeof((s)[0]), sizeof(s), (PWCH)(s) }
+
+NTSTATUS RtlAnsiStringToUnicodeString(PUNICODE_STRING DestinationString, PCANSI_STRING SourceString, BOOLEAN AllocateDestinationString);
+VOID RtlFreeUnicodeString(PUNICODE_STRING UnicodeString);
+VOID RtlInitUnicodeString(PUNICODE_STRING DestinationString, PCWSTR SourceString);
+
+void* memcpy(void* destination, const void* source, size_t size);
+void* memset(void* destination, int value, size_t size);
+int memcmp(const void* pointer1, const void* pointer2, size_t size);
+
+#define RtlCopyMemory(d, s, l) memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l) memmove((d), (s), (l))
+#define RtlZeroMemory(d, l) memset((d), 0, (l))
+#define RtlFillMemory(d, l, f) memset((d), (f), (l))
+#define RtlEqualMemory(a, b, l) (memcmp((a), (b), (l)) == 0)
+void* memmove(void* destination, const void* source, size_t size);
+
+/* ======================================================
+*                       Memory
+*  ======================================================*/
+
+typedef enum _POOL_TYPE {
+    NonPagedPool = 0,
+    PagedPool = 1,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+typedef enum _LOCK_OPERATION { IoReadAccess, IoWriteAccess, IoModifyAccess } LOCK_OPERATION;
+typedef enum _MODE { KernelMode, UserMode } KPROCESSOR_MODE, MODE;
+typedef enum _MEMORY_CACHING_TYPE { MmNonCached, MmCached, MmWriteCombined } MEMORY_CACHING_TYPE;
+typedef enum _MM_PAGE_PRIORITY { LowPagePriority, NormalPagePriority = 16, HighPagePriority = 32 } MM_PAGE_PRIORITY;
+#define MdlMappingNoExecute 0x40000000
+
+typedef struct _MDL {
+    PVOID StartVa;
+    ULONG ByteCount;
+} MDL, *PMDL;
+
+typedef struct _IRP* PIRP;
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PIRP Irp);
+VOID IoFreeMdl(PMDL Mdl);
+VOID MmBuildMdlForNonPagedPool(PMDL MemoryDescriptorList);
+PVOID MmMapLockedPagesSpecifyCache(PMDL MemoryDescriptorList, KPROCESSOR_MODE AccessMode, MEMORY_CACHING_TYPE CacheType, PVOID RequestedAddress, ULONG BugCheckOnFailure, ULONG Priority);
+VOID MmUnmapLockedPages(PVOID BaseAddress, PMDL MemoryDescriptorList);
+
+/* ======================================================
+*                       Interlocked
+*  ======================================================*/
+
+#define InterlockedIncrement(p)                 __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)                 __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(p)               __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement64(p)               __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)            __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(p, v)          __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(p, v)                  __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v)               __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(p, v)             __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr(p, v)                     __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, x, c)     __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedCompareExchange64(p, x, c)   __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedCompareExchangePointer(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#define ReadNoFence(p)                          __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ReadPointerNoFence(p)                   __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ReadNoFence64(p)                        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ReadAcquire(p)                          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadAcquire64(p)                        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadPointerAcquire(p)                   __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define WriteRelease(p, v)                      __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteRelease64(p, v)                    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WritePointerRelease(p, v)               __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteNoFence64(p, v)                    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define C_ASSERT(e) typedef char __C_ASSERT__[(e) ? 1 : -1]
+#define KeMemoryBarrier()                       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define YieldProcessor()                        __builtin_ia32_pause()
+
+/* A function, not a macro: callers drop the previous pointer, which -Wunused-value flags on the builtin. */
+FORCEINLINE PVOID InterlockedExchangePointer(PVOID volatile* Target, PVOID Value) {
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+/* ======================================================
+*                       Dispatcher
+*  ======================================================*/
+
+#define PASSIVE_LEVEL  0
+#define APC_LEVEL      1
+#define DISPATCH_LEVEL 2
+
+typedef enum _EVENT_TYPE { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum _KWAIT_REASON { Executive = 0 } KWAIT_REASON;
+
+typedef struct _SHIM_DISPATCHER_HEADER {
+    INT Type;
+    pthread_mutex_t Mutex;
+    pthread_cond_t Condition;
+    INT Signaled;
+} SHIM_DISPATCHER_HEADER;
+
+typedef struct _KEVENT {
+    SHIM_DISPATCHER_HEADER Header;
+    EVENT_TYPE EventType;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KTHREAD* PKTHREAD;
+typedef struct _KTHREAD* PETHREAD;
+typedef struct _EPROCESS* PEPROCESS;
+typedef PVOID POBJECT_TYPE;
+extern POBJECT_TYPE* ExEventObjectType;
+extern POBJECT_TYPE* PsThreadType;
+
+typedef VOID KSTART_ROUTINE(PVOID StartContext);
+typedef KSTART_ROUTINE* PKSTART_ROUTINE;
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait);
+VOID KeClearEvent(PRKEVENT Event);
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Interval);
+
+KIRQL KeGetCurrentIrql(void);
+VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql);
+VOID KeLowerIrql(KIRQL NewIrql);
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR Number;
+    UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+#define ALL_PROCESSOR_GROUPS 0xffff
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber);
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber);
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+ULONGLONG KeQueryInterruptTime(void);
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+
+/* ======================================================
+*                       Objects & Threads
+*  ======================================================*/
+
+#define OBJ_CASE_INSENSITIVE 0x00000040L
+#define OBJ_KERNEL_HANDLE    0x00000200L
+#define THREAD_ALL_ACCESS    0x001FFFFF
+#define EVENT_MODIFY_STATE   0x0002
+#define SYNCHRONIZE          0x00100000L
+#define GENERIC_READ         0x80000000L
+#define FILE_SHARE_READ      0x00000001
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define FILE_OPEN            0x00000001
+#define FILE_OPEN_IF         0x00000003
+#define FILE_SYNCHRONOUS_IO_NONALERT 0x00000020
+#define FILE_NON_DIRECTORY_FILE      0x00000040
+#define FILE_DELETE_ON_CLOSE         0x00001000
+
+typedef PVOID PSECURITY_DESCRIPTOR;
+
+typedef struct _OBJECT_ATTRIBUTES {
+    ULONG Length;
+    HANDLE RootDirectory;
+    PUNICODE_STRING ObjectName;
+    ULONG Attributes;
+    PVOID SecurityDescriptor;
+    PVOID SecurityQualityOfService;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define InitializeObjectAttributes(p, n, a, r, s) { \
+    (p)->Length = sizeof(OBJECT_ATTRIBUTES);        \
+    (p)->RootDirectory = r;                         \
+    (p)->Attributes = a;                            \
+    (p)->ObjectName = n;                            \
+    (p)->SecurityDescriptor = s;                    \
+    (p)->SecurityQualityOfService = NULL;           \
+}
+
+typedef struct _IO_STATUS_BLOCK {
+    union {
+        NTSTATUS Status;
+        PVOID Pointer;
+    };
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes, HANDLE ProcessHandle, PVOID ClientId, PKSTART_ROUTINE StartRoutine, PVOID StartContext);
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus);
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess, POBJECT_TYPE ObjectType, KPROCESSOR_MODE AccessMode, PVOID* Object, PVOID HandleInformation);
+VOID ObDereferenceObject(PVOID Object);
+#define ObfDereferenceObject ObDereferenceObject
+NTSTATUS ZwClose(HANDLE Handle);
+HANDLE PsGetCurrentProcessId(void);
+PEPROCESS PsGetCurrentProcess(void);
+VOID ObReferenceObject(PVOID Object);
+
+typedef PEPROCESS PRKPROCESS;
+typedef struct _KAPC_STATE { PEPROCESS Process; } KAPC_STATE, *PRKAPC_STATE;
+VOID KeStackAttachProcess(PRKPROCESS Process, PRKAPC_STATE ApcState);
+VOID KeUnstackDetachProcess(PRKAPC_STATE ApcState);
+
+/* Structured exceptions: the shim never raises, the handler never runs. */
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define __try if (1)
+#define __except(filter) else
+
+NTSTATUS ZwCreateFile(PHANDLE FileHandle, ACCESS_MASK DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes, PIO_STATUS_BLOCK IoStatusBlock, PLARGE_INTEGER AllocationSize, ULONG FileAttributes, ULONG ShareAccess, ULONG CreateDisposition, ULONG CreateOptions, PVOID EaBuffer, ULONG EaLength);
+NTSTATUS ZwReadFile(HANDLE FileHandle, HANDLE Event, PVOID ApcRoutine, PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer, ULONG Length, PLARGE_INTEGER ByteOffset, PULONG Key);
+
+typedef enum _FILE_INFORMATION_CLASS {
+    FileBasicInformation = 4,
+    FileStandardInformation = 5,
+    FileRenameInformation = 10,
+    FileDispositionInformation = 13,
+    FileEndOfFileInformation = 20,
+    FileDispositionInformationEx = 64
+} FILE_INFORMATION_CLASS;
+
+typedef struct _FILE_STANDARD_INFORMATION {
+    LARGE_INTEGER AllocationSize;
+    LARGE_INTEGER EndOfFile;
+    ULONG NumberOfLinks;
+    BOOLEAN DeletePending;
+    BOOLEAN Directory;
+} FILE_STANDARD_INFORMATION, *PFILE_STANDARD_INFORMATION;
+
+NTSTATUS ZwQueryInformationFile(HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation, ULONG Length, FILE_INFORMATION_CLASS FileInformationClass);
+
+#define FILE_DISPOSITION_DELETE 0x00000001
+
+typedef struct _FILE_DISPOSITION_INFORMATION_EX {
+    ULONG Flags;
+} FILE_DISPOSITION_INFORMATION_EX, *PFILE_DISPOSITION_INFORMATION_EX;
+
+/* ======================================================
+*                       Registry
+*  ======================================================*/
+
+#define RTL_REGISTRY_ABSOLUTE   0
+#define RTL_QUERY_REGISTRY_DIRECT 0x00000020
+#define RTL_QUERY_REGISTRY_TYPECHECK 0x00000100
+#define RTL_QUERY_REGISTRY_TYPECHECK_SHIFT 24
+#define REG_NONE 0
+#define REG_SZ   1
+#define REG_DWORD 4
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE {
+    PVOID QueryRoutine;
+    ULONG Flags;
+    PWSTR Name;
+    PVOID EntryContext;
+    ULONG DefaultType;
+    PVOID DefaultData;
+    ULONG DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE, *PRTL_QUERY_REGISTRY_TABLE;
+
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo, PCWSTR Path, PRTL_QUERY_REGISTRY_TABLE QueryTable, PVOID Context, PVOID Environment);
+
+/* ======================================================
+*                       Process Notify
+*  ======================================================*/
+
+typedef VOID (*PCREATE_PROCESS_NOTIFY_ROUTINE)(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
+NTSTATUS PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE NotifyRoutine, BOOLEAN Remove);
+
+/* ======================================================
+*                       Filter Manager
+*  ======================================================*/
+
+typedef struct _DRIVER_OBJECT {
+    PVOID DriverExtension;
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+
+typedef struct _FLT_FILTER* PFLT_FILTER;
+typedef struct _FLT_PORT* PFLT_PORT;
+typedef struct _FLT_INSTANCE* PFLT_INSTANCE;
+typedef struct _FLT_VOLUME* PFLT_VOLUME;
+typedef struct _FILE_OBJECT* PFILE_OBJECT;
+typedef PVOID PFLT_CONTEXT;
+typedef ULONG FLT_FILTER_UNLOAD_FLAGS;
+typedef ULONG FLT_FILE_NAME_OPTIONS;
+typedef USHORT FLT_FILE_NAME_PARSED_FLAGS;
+
+#define FLT_FILE_NAME_NORMALIZED    0x01
+#define FLT_FILE_NAME_OPENED        0x02
+#define FLT_FILE_NAME_QUERY_DEFAULT 0x0100
+#define FLT_PORT_ALL_ACCESS         0x001F0001
+#define FLT_REGISTRATION_VERSION    0x0203
+#define FLTFL_CALLBACK_DATA_PAGING_IO 0x00000002
+#define IRP_PAGING_IO               0x00000002
+#define IRP_NOCACHE                 0x00000001
+#define IRP_MJ_CREATE               0x00
+#define IRP_MJ_READ                 0x03
+#define IRP_MJ_WRITE                0x04
+#define IRP_MJ_SET_INFORMATION      0x06
+#define IRP_MJ_OPERATION_END        ((UCHAR)0x80)
+
+typedef enum _FLT_PREOP_CALLBACK_STATUS {
+    FLT_PREOP_SUCCESS_WITH_CALLBACK,
+    FLT_PREOP_SUCCESS_NO_CALLBACK,
+    FLT_PREOP_PENDING,
+    FLT_PREOP_DISALLOW_FASTIO,
+    FLT_PREOP_COMPLETE,
+    FLT_PREOP_SYNCHRONIZE
+} FLT_PREOP_CALLBACK_STATUS;
+
+typedef enum _FLT_POSTOP_CALLBACK_STATUS {
+    FLT_POSTOP_FINISHED_PROCESSING,
+    FLT_POSTOP_MORE_PROCESSING_REQUIRED
+} FLT_POSTOP_CALLBACK_STATUS;
+
+typedef union _FLT_PARAMETERS {
+    struct {
+        PVOID SecurityContext;
+        ULONG Options;
+        USHORT FileAttributes;
+        USHORT ShareAccess;
+        ULONG EaLength;
+        PVOID EaBuffer;
+        LARGE_INTEGER AllocationSize;
+    } Create;
+    struct {
+        ULONG Length;
+        ULONG Key;
+        LARGE_INTEGER ByteOffset;
+        PVOID ReadBuffer;
+        PMDL MdlAddress;
+    } Read;
+    struct {
+        ULONG Length;
+        ULONG Key;
+        LARGE_INTEGER ByteOffset;
+        PVOID WriteBuffer;
+        PMDL MdlAddress;
+    } Write;
+    struct {
+        ULONG Length;
+        FILE_INFORMATION_CLASS FileInformationClass;
+        PFILE_OBJECT ParentOfTarget;
+        PVOID DeleteHandle;
+        PVOID InfoBuffer;
+    } SetFileInformation;
+} FLT_PARAMETERS, *PFLT_PARAMETERS;
+
+typedef struct _FLT_IO_PARAMETER_BLOCK {
+    ULONG IrpFlags;
+    UCHAR MajorFunction;
+    UCHAR MinorFunction;
+    UCHAR OperationFlags;
+    UCHAR Reserved;
+    PFILE_OBJECT TargetFileObject;
+    PFLT_INSTANCE TargetInstance;
+    FLT_PARAMETERS Parameters;
+} FLT_IO_PARAMETER_BLOCK, *PFLT_IO_PARAMETER_BLOCK;
+
+typedef struct _FLT_FILE_NAME_INFORMATION {
+    USHORT Size;
+    FLT_FILE_NAME_PARSED_FLAGS NamesParsed;
+    FLT_FILE_NAME_OPTIONS Format;
+    UNICODE_STRING Name;
+    UNICODE_STRING Volume;
+    UNICODE_STRING Share;
+    UNICODE_STRING Extension;
+    UNICODE_STRING Stream;
+    UNICODE_STRING FinalComponent;
+    UNICODE_STRING ParentDir;
+} FLT_FILE_NAME_INFORMATION, *PFLT_FILE_NAME_INFORMATION;
+
+typedef struct _FLT_CALLBACK_DATA {
+    ULONG Flags;
+    PETHREAD Thread;
+    PFLT_IO_PARAMETER_BLOCK Iopb;
+    IO_STATUS_BLOCK IoStatus;
+
+    /* Shim only: what the filter manager would derive from the request. */
+    ULONG ShimRequestorProcessId;
+    FLT_FILE_NAME_INFORMATION ShimNameInformation;
+    PVOID ShimCompletionContext; /* what the pre-operation handed its post-operation */
+} FLT_CALLBACK_DATA, *PFLT_CALLBACK_DATA;
+
+typedef struct _FLT_RELATED_OBJECTS {
+    USHORT Size;
+    USHORT TransactionContext;
+    PFLT_FILTER Filter;
+    PFLT_VOLUME Volume;
+    PFLT_INSTANCE Instance;
+    PFILE_OBJECT FileObject;
+} FLT_RELATED_OBJECTS, *PFLT_RELATED_OBJECTS;
+typedef const FLT_RELATED_OBJECTS* PCFLT_RELATED_OBJECTS;
+
+typedef FLT_PREOP_CALLBACK_STATUS (*PFLT_PRE_OPERATION_CALLBACK)(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID* CompletionContext);
+typedef ULONG FLT_POST_OPERATION_FLAGS;
+#define FLTFL_POST_OPERATION_DRAINING 0x00000001
+typedef FLT_POSTOP_CALLBACK_STATUS (*PFLT_POST_OPERATION_CALLBACK)(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags);
+typedef NTSTATUS (*PFLT_FILTER_UNLOAD_CALLBACK)(FLT_FILTER_UNLOAD_FLAGS Flags);
+
+typedef struct _FLT_OPERATION_REGISTRATION {
+    UCHAR MajorFunction;
+    ULONG Flags;
+    PFLT_PRE_OPERATION_CALLBACK PreOperation;
+    PFLT_POST_OPERATION_CALLBACK PostOperation;
+    PVOID Reserved1;
+} FLT_OPERATION_REGISTRATION;
+
+typedef struct _FLT_REGISTRATION {
+    USHORT Size;
+    USHORT Version;
+    ULONG Flags;
+    const PVOID ContextRegistration;
+    const FLT_OPERATION_REGISTRATION* OperationRegistration;
+    PFLT_FILTER_UNLOAD_CALLBACK FilterUnloadCallback;
+    PVOID InstanceSetupCallback;
+    PVOID InstanceQueryTeardownCallback;
+    PVOID InstanceTeardownStartCallback;
+    PVOID InstanceTeardownCompleteCallback;
+    PVOID GenerateFileNameCallback;
+    PVOID NormalizeNameComponentCallback;
+    PVOID NormalizeContextCleanupCallback;
+    PVOID TransactionNotificationCallback;
+    PVOID NormalizeNameComponentExCallback;
+    PVOID SectionNotificationCallback;
+} FLT_REGISTRATION;
+
+typedef NTSTATUS (*PFLT_CONNECT_NOTIFY)(PFLT_PORT ClientPort, PVOID ServerPortCookie, PVOID ConnectionContext, ULONG SizeOfContext, PVOID* ConnectionPortCookie);
+typedef VOID (*PFLT_DISCONNECT_NOTIFY)(PVOID ConnectionCookie);
+typedef NTSTATUS (*PFLT_MESSAGE_NOTIFY)(PVOID PortCookie, PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength, PULONG ReturnOutputBufferLength);
+
+NTSTATUS FltRegisterFilter(PDRIVER_OBJECT Driver, const FLT_REGISTRATION* Registration, PFLT_FILTER* RetFilter);
+VOID FltUnregisterFilter(PFLT_FILTER Filter);
+NTSTATUS FltStartFiltering(PFLT_FILTER Filter);
+NTSTATUS FltBuildDefaultSecurityDescriptor(PSECURITY_DESCRIPTOR* SecurityDescriptor, ACCESS_MASK DesiredAccess);
+VOID FltFreeSecurityDescriptor(PSECURITY_DESCRIPTOR SecurityDescriptor);
+NTSTATUS FltCreateCommunicationPort(PFLT_FILTER Filter, PFLT_PORT* ServerPort, POBJECT_ATTRIBUTES ObjectAttributes, PVOID ServerPortCookie, PFLT_CONNECT_NOTIFY ConnectNotifyCallback, PFLT_DISCONNECT_NOTIFY DisconnectNotifyCallback, PFLT_MESSAGE_NOTIFY MessageNotifyCallback, LONG MaxConnections);
+VOID FltCloseCommunicationPort(PFLT_PORT ServerPort);
+VOID FltCloseClientPort(PFLT_FILTER Filter, PFLT_PORT* ClientPort);
+NTSTATUS FltSendMessage(PFLT_FILTER Filter, PFLT_PORT* ClientPort, PVOID SenderBuffer, ULONG SenderBufferLength, PVOID ReplyBuffer, PULONG ReplyLength, PLARGE_INTEGER Timeout);
+
+NTSTATUS FltGetFileNameInformation(PFLT_CALLBACK_DATA CallbackData, FLT_FILE_NAME_OPTIONS NameOptions, PFLT_FILE_NAME_INFORMATION* FileNameInformation);
+NTSTATUS FltParseFileNameInformation(PFLT_FILE_NAME_INFORMATION FileNameInformation);
+VOID FltReleaseFileNameInformation(PFLT_FILE_NAME_INFORMATION FileNameInformation);
+ULONG FltGetRequestorProcessId(PFLT_CALLBACK_DATA CallbackData);
+
+typedef struct _EX_PUSH_LOCK {
+    pthread_rwlock_t Lock;
+} EX_PUSH_LOCK, *PEX_PUSH_LOCK;
+
+VOID FltInitializePushLock(PEX_PUSH_LOCK PushLock);
+VOID FltDeletePushLock(PEX_PUSH_LOCK PushLock);
+VOID FltAcquirePushLockShared(PEX_PUSH_LOCK PushLock);
+VOID FltAcquirePushLockExclusive(PEX_PUSH_LOCK PushLock);
+VOID FltReleasePushLock(PEX_PUSH_LOCK PushLock);
+
+VOID KeEnterCriticalRegion(void);
+VOID KeLeaveCriticalRegion(void);
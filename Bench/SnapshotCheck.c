@@ -0,0 +1,128 @@
+/*
+ * Checks that malformed policy snapshots are refused.
+ *
+ * A small hashed snapshot is built in memory and opened, then the header and
+ * index are corrupted one way at a time: section offsets chosen so their end
+ * wraps around back inside the image, an index with more slots in use than
+ * rules, and one with no empty slot, which a lookup would probe forever.
+ * Every one of them must fail to open; the intact image must open and answer.
+ *
+ *   SnapshotCheck
+ *
+ * Prints each failure and exits with 1 if there is any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Shim.h"
+#include "PolicySnapshot.h"
+
+#define CHECK_RULES 2
+#define CHECK_INDEX 4
+#define CHECK_PATH_LENGTH 64
+
+typedef struct checkImage_s {
+    PolicySnapshotHeader header;
+    PolicySnapshotRule rules[CHECK_RULES];
+    UINT32 index[CHECK_INDEX];
+    WCHAR paths[2 * CHECK_PATH_LENGTH];
+} checkImage;
+
+static CONST char* checkPaths[CHECK_RULES] = {
+    "\\Device\\HarddiskVolume2\\Users\\snapshot\\a",
+    "\\Device\\HarddiskVolume2\\Users\\snapshot\\b",
+};
+
+static UINT32 failures = 0;
+
+static VOID buildImage(checkImage* image) {
+    Kmemset(image, 0, sizeof(checkImage));
+    image->header.magic = POLICY_SNAPSHOT_MAGIC;
+    image->header.version = POLICY_SNAPSHOT_HASHED;
+    image->header.headerSize = sizeof(PolicySnapshotHeader);
+    image->header.ruleCount = CHECK_RULES;
+    image->header.indexSize = CHECK_INDEX;
+    image->header.rulesOffset = offsetof(checkImage, rules);
+    image->header.indexOffset = offsetof(checkImage, index);
+    image->header.pathsOffset = offsetof(checkImage, paths);
+    image->header.totalSize = sizeof(checkImage);
+
+    UINT32 used = 0;
+    for (UINT32 r = 0; r < CHECK_RULES; r++) {
+        PolicySnapshotRule* rule = &image->rules[r];
+        rule->permissions = 1ull << r;
+        rule->path = used;
+        rule->length = ShimWiden(checkPaths[r], &image->paths[used], CHECK_PATH_LENGTH);
+        rule->hash = hashPath(&image->paths[used], rule->length);
+        used += rule->length;
+
+        UINT32 slot = rule->hash & (CHECK_INDEX - 1);
+        while (image->index[slot] != 0) {
+            slot = (slot + 1) & (CHECK_INDEX - 1);
+        }
+        image->index[slot] = r + 1;
+    }
+    image->header.pathsLength = used;
+}
+
+static VOID expectRefused(CONST char* what, checkImage* image) {
+    PolicySnapshot snapshot;
+    if (PolicySnapshot_open(&snapshot, image, sizeof(checkImage))) {
+        printf("%s: opened\n", what);
+        failures++;
+    }
+    buildImage(image);
+}
+
+int main() {
+    checkImage* image = (checkImage*)calloc(1, sizeof(checkImage));
+    PolicySnapshot snapshot;
+
+    buildImage(image);
+    if (!PolicySnapshot_open(&snapshot, image, sizeof(checkImage))) {
+        printf("intact snapshot: refused\n");
+        failures++;
+    }
+    else {
+        for (UINT32 r = 0; r < CHECK_RULES; r++) {
+            WCHAR path[CHECK_PATH_LENGTH];
+            USHORT length = ShimWiden(checkPaths[r], path, CHECK_PATH_LENGTH);
+            if (PolicySnapshot_permission(&snapshot, path, length, NULL) != 1ull << r) {
+                printf("intact snapshot: wrong permissions for %s\n", checkPaths[r]);
+                failures++;
+            }
+        }
+    }
+
+    // ends wrapping around 2^64, back to the start of the image
+    image->header.rulesOffset = 0 - (UINT64)CHECK_RULES * sizeof(PolicySnapshotRule) + 8;
+    expectRefused("rules wrapping around", image);
+    image->header.indexOffset = 0 - (UINT64)CHECK_INDEX * sizeof(UINT32) + offsetof(checkImage, index);
+    expectRefused("index wrapping around", image);
+    image->header.pathsOffset = 0 - (UINT64)sizeof(WCHAR) * 4;
+    image->header.pathsLength = 4 + sizeof(checkImage) / sizeof(WCHAR);
+    expectRefused("paths wrapping around", image);
+
+    image->header.version = POLICY_SNAPSHOT_FRONT_CODED;
+    image->header.rulesOffset = 0;
+    image->header.indexSize = 1;
+    image->header.pathsOffset = 0 - (UINT64)sizeof(WCHAR) * 4;
+    image->header.pathsLength = 4 + sizeof(checkImage) / sizeof(WCHAR);
+    expectRefused("front-coded data wrapping around", image);
+
+    // indexes lookups could loop on, or with rules listed twice
+    for (UINT32 slot = 0; slot < CHECK_INDEX; slot++) {
+        image->index[slot] = 1 + slot % CHECK_RULES;
+    }
+    expectRefused("index without an empty slot", image);
+    for (UINT32 slot = 1; slot < CHECK_INDEX; slot++) {
+        image->index[slot] = 1 + slot % CHECK_RULES;
+    }
+    expectRefused("index with more slots in use than rules", image);
+
+    printf("policy snapshots: %u failures\n", failures);
+    free(image);
+    return failures != 0;
+}
@@ -0,0 +1,355 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Capture of the filter decisions, for offline replay.
+ *
+ * The capture is a byte stream: a header followed by tagged records whose
+ * integers are LEB128 varints. Paths are dictionary compressed: the first
+ * decision on a path emits a PATH record giving it an id, later ones only
+ * carry the id. When the dictionary is full it is reset, and ids start over
+ * after a DICTIONARY_RESET record.
+ *
+ *   header   magic u32, version u16, reserved u16, ticks per second u64, start (system time) u64
+ *   PATH     [1] id, length, length UTF-16 code units
+ *   DECISION [2] time delta, process id, path id, operation u8, restricted u8
+ *   PROCESS  [3] time delta, process id, parent id (0 opens a sandbox), uuid, created u8
+ *   RULE     [4] uuid (0 is global), permissions (0 deletes), length, length UTF-16 code units
+ *   LOST     [5] records dropped because the buffer was full
+ *   DICTIONARY_RESET [6]
+ *
+ * Records go to a byte ring under a push lock and are drained by the
+ * controller; a record is written whole or dropped. The dictionary keys on a
+ * 64-bit path hash only, a collision would replay the wrong path.
+ */
+
+#define CAPTURE_MAGIC 0x5043594C // "LYCP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 24
+#define CAPTURE_TICKS_PER_SECOND 10000000ull // KeQueryInterruptTime
+
+// tag and the varints of the largest fixed part of a record
+#define CAPTURE_RECORD_OVERHEAD 48
+
+enum CaptureRecord {
+    CAPTURE_PATH = 1,
+    CAPTURE_DECISION = 2,
+    CAPTURE_PROCESS = 3,
+    CAPTURE_RULE = 4,
+    CAPTURE_LOST = 5,
+    CAPTURE_DICTIONARY_RESET = 6
+};
+
+typedef struct captureDictionaryEntry_s {
+    UINT64 hash; // 0 is a free entry
+    UINT32 id;
+} captureDictionaryEntry;
+
+typedef struct DecisionCapture_s {
+    EX_PUSH_LOCK lock;
+    unsigned char* buffer;
+    UINT64 capacity;
+    UINT64 head; // written
+    UINT64 tail; // read
+    UINT64 lost;
+    UINT64 lastTime;
+
+    captureDictionaryEntry* dictionary;
+    UINT32 dictionaryMask;
+    UINT32 nextId;
+} DecisionCapture;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static DecisionCapture* DecisionCapture_create(UINT64 capacity, UINT32 dictionarySize);
+    static VOID DecisionCapture_begin(DecisionCapture* capture);
+    static VOID DecisionCapture_decision(DecisionCapture* capture, UINT64 processId, UINT8 operation, UINT8 restricted, CONST WCHAR* path, UINT32 length);
+    static VOID DecisionCapture_process(DecisionCapture* capture, UINT64 processId, UINT64 parentId, UINT64 uuid, BOOLEAN created);
+    static VOID DecisionCapture_rule(DecisionCapture* capture, UINT64 uuid, UINT64 permissions, CONST WCHAR* path, UINT32 length);
+    static UINT64 DecisionCapture_read(DecisionCapture* capture, unsigned char* output, UINT64 size);
+    static VOID DecisionCapture_destroy(DecisionCapture* capture);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*
+ * Capacity (bytes) and dictionary size (paths) are rounded up to powers of two.
+ */
+DecisionCapture* DecisionCapture_create(UINT64 capacity, UINT32 dictionarySize) {
+    UINT64 size = 4096;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    UINT32 entries = 64;
+    while (entries < dictionarySize) {
+        entries <<= 1;
+    }
+
+    DecisionCapture* capture = (DecisionCapture*)calloc(1, sizeof(DecisionCapture));
+    if (capture == NULL) {
+        return NULL;
+    }
+
+    capture->buffer = (unsigned char*)calloc(size, sizeof(unsigned char));
+    capture->dictionary = (captureDictionaryEntry*)calloc(entries, sizeof(captureDictionaryEntry));
+    if (capture->buffer == NULL || capture->dictionary == NULL) {
+        free(capture->buffer);
+        free(capture->dictionary);
+        free(capture);
+        return NULL;
+    }
+
+    capture->capacity = size;
+    capture->dictionaryMask = entries - 1;
+    FltInitializePushLock(&capture->lock);
+    return capture;
+}
+
+static UINT8 DecisionCapture_varint(unsigned char* output, UINT64 value) {
+    UINT8 size = 0;
+    while (value >= 0x80) {
+        output[size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    output[size++] = (unsigned char)value;
+    return size;
+}
+
+static UINT64 DecisionCapture_hashPath(CONST WCHAR* path, UINT32 length) {
+    UINT64 hash = 0xCBF29CE484222325ull;
+    for (UINT32 i = 0; i < length; i++) {
+        hash ^= path[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash | 1;
+}
+
+// Lock held
+static BOOLEAN DecisionCapture_fits(DecisionCapture* capture, UINT64 size) {
+    return capture->capacity - (capture->head - capture->tail) >= size;
+}
+
+// Lock held, space checked
+static VOID DecisionCapture_put(DecisionCapture* capture, CONST unsigned char* data, UINT64 size) {
+    UINT64 offset = capture->head & (capture->capacity - 1);
+    UINT64 first = capture->capacity - offset < size ? capture->capacity - offset : size;
+
+    Kmemcpy(capture->buffer + offset, (CONST PVOID)data, first);
+    Kmemcpy(capture->buffer, (CONST PVOID)(data + first), size - first);
+    capture->head += size;
+}
+
+// Lock held, space checked: UTF-16 little endian, whatever the host order
+static VOID DecisionCapture_putPath(DecisionCapture* capture, CONST WCHAR* path, UINT32 length) {
+    unsigned char chunk[128];
+    UINT32 used = 0;
+
+    for (UINT32 i = 0; i < length; i++) {
+        chunk[used++] = (unsigned char)(path[i] & 0xFF);
+        chunk[used++] = (unsigned char)(path[i] >> 8);
+        if (used == sizeof(chunk)) {
+            DecisionCapture_put(capture, chunk, used);
+            used = 0;
+        }
+    }
+    DecisionCapture_put(capture, chunk, used);
+}
+
+/*
+ * Lock held. Writes the pending LOST record first; FALSE if the record and it
+ * don't both fit, in which case the record counts as lost too.
+ */
+static BOOLEAN DecisionCapture_reserve(DecisionCapture* capture, UINT64 size) {
+    unsigned char lost[1 + 10];
+    UINT8 lostSize = 0;
+
+    if (capture->lost != 0) {
+        lost[0] = CAPTURE_LOST;
+        lostSize = 1 + DecisionCapture_varint(lost + 1, capture->lost);
+    }
+
+    if (!DecisionCapture_fits(capture, size + lostSize)) {
+        capture->lost++;
+        return FALSE;
+    }
+
+    if (lostSize != 0) {
+        DecisionCapture_put(capture, lost, lostSize);
+        capture->lost = 0;
+    }
+    return TRUE;
+}
+
+// Lock held
+static UINT64 DecisionCapture_delta(DecisionCapture* capture) {
+    UINT64 now = KeQueryInterruptTime();
+    UINT64 delta = now > capture->lastTime ? now - capture->lastTime : 0;
+    capture->lastTime = now;
+    return delta;
+}
+
+/*
+ * Starts a new stream: drops what wasn't read, clears the dictionary and
+ * writes the header. The caller then records the policy snapshot.
+ */
+VOID DecisionCapture_begin(DecisionCapture* capture) {
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    LARGE_INTEGER start;
+
+    KeQuerySystemTimePrecise(&start);
+    Kmemset(header, 0, sizeof(header));
+    header[0] = (unsigned char)(CAPTURE_MAGIC & 0xFF);
+    header[1] = (unsigned char)((CAPTURE_MAGIC >> 8) & 0xFF);
+    header[2] = (unsigned char)((CAPTURE_MAGIC >> 16) & 0xFF);
+    header[3] = (unsigned char)((CAPTURE_MAGIC >> 24) & 0xFF);
+    header[4] = CAPTURE_VERSION;
+    for (UINT8 i = 0; i < 8; i++) {
+        header[8 + i] = (unsigned char)((CAPTURE_TICKS_PER_SECOND >> (i * 8)) & 0xFF);
+        header[16 + i] = (unsigned char)(((UINT64)start.QuadPart >> (i * 8)) & 0xFF);
+    }
+
+    FltAcquirePushLockExclusive(&capture->lock);
+    capture->head = 0;
+    capture->tail = 0;
+    capture->lost = 0;
+    capture->lastTime = KeQueryInterruptTime();
+    capture->nextId = 0;
+    Kmemset(capture->dictionary, 0, ((SIZE_T)capture->dictionaryMask + 1) * sizeof(captureDictionaryEntry));
+    DecisionCapture_put(capture, header, sizeof(header));
+    FltReleasePushLock(&capture->lock);
+}
+
+VOID DecisionCapture_decision(DecisionCapture* capture, UINT64 processId, UINT8 operation, UINT8 restricted, CONST WCHAR* path, UINT32 length) {
+    unsigned char record[CAPTURE_RECORD_OVERHEAD];
+    unsigned char definition[CAPTURE_RECORD_OVERHEAD];
+    UINT64 hash = DecisionCapture_hashPath(path, length);
+
+    FltAcquirePushLockExclusive(&capture->lock);
+
+    captureDictionaryEntry* entry = NULL;
+    UINT32 slot = (UINT32)(hash ^ (hash >> 32)) & capture->dictionaryMask;
+    for (UINT32 probe = 0; probe <= capture->dictionaryMask; probe++, slot = (slot + 1) & capture->dictionaryMask) {
+        entry = &capture->dictionary[slot];
+        if (entry->hash == hash || entry->hash == 0) {
+            break;
+        }
+    }
+
+    // keep the table at most 3/4 full so probes stay short
+    if (entry->hash == 0 && capture->nextId > capture->dictionaryMask - capture->dictionaryMask / 4) {
+        unsigned char reset = CAPTURE_DICTIONARY_RESET;
+        if (!DecisionCapture_reserve(capture, 1)) {
+            FltReleasePushLock(&capture->lock);
+            return;
+        }
+        DecisionCapture_put(capture, &reset, 1);
+        Kmemset(capture->dictionary, 0, ((SIZE_T)capture->dictionaryMask + 1) * sizeof(captureDictionaryEntry));
+        capture->nextId = 0;
+        entry = &capture->dictionary[(UINT32)(hash ^ (hash >> 32)) & capture->dictionaryMask];
+    }
+
+    BOOLEAN known = entry->hash == hash;
+    UINT32 id = known ? entry->id : capture->nextId;
+    UINT64 definitionSize = 0;
+
+    if (!known) {
+        definition[0] = CAPTURE_PATH;
+        definitionSize = 1;
+        definitionSize += DecisionCapture_varint(definition + definitionSize, id);
+        definitionSize += DecisionCapture_varint(definition + definitionSize, length);
+    }
+
+    UINT64 size = 1;
+    record[0] = CAPTURE_DECISION;
+    size += DecisionCapture_varint(record + size, DecisionCapture_delta(capture));
+    size += DecisionCapture_varint(record + size, processId);
+    size += DecisionCapture_varint(record + size, id);
+    record[size++] = operation;
+    record[size++] = restricted;
+
+    if (DecisionCapture_reserve(capture, definitionSize + (known ? 0 : (UINT64)length * sizeof(WCHAR)) + size)) {
+        if (!known) {
+            DecisionCapture_put(capture, definition, definitionSize);
+            DecisionCapture_putPath(capture, path, length);
+            entry->hash = hash;
+            entry->id = id;
+            capture->nextId++;
+        }
+        DecisionCapture_put(capture, record, size);
+    }
+
+    FltReleasePushLock(&capture->lock);
+}
+
+VOID DecisionCapture_process(DecisionCapture* capture, UINT64 processId, UINT64 parentId, UINT64 uuid, BOOLEAN created) {
+    unsigned char record[CAPTURE_RECORD_OVERHEAD];
+
+    FltAcquirePushLockExclusive(&capture->lock);
+
+    UINT64 size = 1;
+    record[0] = CAPTURE_PROCESS;
+    size += DecisionCapture_varint(record + size, DecisionCapture_delta(capture));
+    size += DecisionCapture_varint(record + size, processId);
+    size += DecisionCapture_varint(record + size, parentId);
+    size += DecisionCapture_varint(record + size, uuid);
+    record[size++] = created ? 1 : 0;
+
+    if (DecisionCapture_reserve(capture, size)) {
+        DecisionCapture_put(capture, record, size);
+    }
+
+    FltReleasePushLock(&capture->lock);
+}
+
+VOID DecisionCapture_rule(DecisionCapture* capture, UINT64 uuid, UINT64 permissions, CONST WCHAR* path, UINT32 length) {
+    unsigned char record[CAPTURE_RECORD_OVERHEAD];
+
+    FltAcquirePushLockExclusive(&capture->lock);
+
+    UINT64 size = 1;
+    record[0] = CAPTURE_RULE;
+    size += DecisionCapture_varint(record + size, uuid);
+    size += DecisionCapture_varint(record + size, permissions);
+    size += DecisionCapture_varint(record + size, length);
+
+    if (DecisionCapture_reserve(capture, size + (UINT64)length * sizeof(WCHAR))) {
+        DecisionCapture_put(capture, record, size);
+        DecisionCapture_putPath(capture, path, length);
+    }
+
+    FltReleasePushLock(&capture->lock);
+}
+
+/*
+ * Moves up to `size` bytes of the stream to `output`, returns how many.
+ */
+UINT64 DecisionCapture_read(DecisionCapture* capture, unsigned char* output, UINT64 size) {
+    FltAcquirePushLockExclusive(&capture->lock);
+
+    UINT64 available = capture->head - capture->tail;
+    if (size > available) {
+        size = available;
+    }
+
+    UINT64 offset = capture->tail & (capture->capacity - 1);
+    UINT64 first = capture->capacity - offset < size ? capture->capacity - offset : size;
+    Kmemcpy(output, capture->buffer + offset, first);
+    Kmemcpy(output + first, capture->buffer, size - first);
+    capture->tail += size;
+
+    FltReleasePushLock(&capture->lock);
+    return size;
+}
+
+VOID DecisionCapture_destroy(DecisionCapture* capture) {
+    if (capture != NULL) {
+        FltDeletePushLock(&capture->lock);
+        free(capture->buffer);
+        free(capture->dictionary);
+        free(capture);
+    }
+}
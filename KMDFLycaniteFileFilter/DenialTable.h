@@ -0,0 +1,195 @@
+#pragma once
+
+#include "Utils.h"
+#include "EventQueue.h"
+
+/*
+ * Coalesces repeated denials before they reach the event queue.
+ *
+ * Denials are keyed by (uuid, path hash, operation) into a direct-mapped
+ * table. The first denial of a key opens a window and is emitted right away
+ * with a count of 1; repeats inside the window only bump the slot counter
+ * (one interlocked increment, no allocation). The counter is emitted as a
+ * single record when the window is over: on the next denial of that key, when
+ * the slot gets evicted by another key, or by DenialTable_flush.
+ *
+ * Slots are rewritten under a per-slot try-lock: a denial that finds its slot
+ * busy is emitted on its own instead of waiting. Counts can be attributed to
+ * the wrong window if a repeat races an eviction of the same slot.
+ */
+
+#define DENIAL_TABLE_CACHE_LINE 64
+
+typedef VOID (*DenialTable_emit)(lycaniteEvent* event);
+
+typedef struct DenialSlot_s {
+    volatile LONG64 key;
+    volatile LONG64 expires;
+    volatile LONG pending;
+    volatile LONG busy;
+    lycaniteEvent event;
+} DenialSlot;
+
+typedef struct DenialTable_s {
+    UINT64 mask;
+    LONG64 window;
+    DenialTable_emit emit;
+    DenialSlot* slots;
+
+    UCHAR padDirty[DENIAL_TABLE_CACHE_LINE];
+    volatile LONG dirty;
+    UCHAR padEnd[DENIAL_TABLE_CACHE_LINE];
+} DenialTable;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static DenialTable* DenialTable_create(UINT64 capacity, LONG64 window, DenialTable_emit emit);
+    static VOID DenialTable_record(DenialTable* table, UINT64 uuid, UINT8 operation, UINT32 pathHash, CONST WCHAR* path, UINT32 length, LONG64 now);
+    static BOOLEAN DenialTable_hasPending(DenialTable* table);
+    static VOID DenialTable_flush(DenialTable* table, LONG64 now, BOOLEAN force);
+    static VOID DenialTable_destroy(DenialTable* table);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*
+ * Capacity is rounded up to a power of two, window is in the unit of `now`.
+ */
+DenialTable* DenialTable_create(UINT64 capacity, LONG64 window, DenialTable_emit emit) {
+    UINT64 size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    DenialTable* table = (DenialTable*)calloc(1, sizeof(DenialTable));
+    if (table != NULL) {
+        table->slots = (DenialSlot*)calloc(size, sizeof(DenialSlot));
+        if (table->slots != NULL) {
+            table->mask = size - 1;
+            table->window = window;
+            table->emit = emit;
+            return table;
+        }
+        free(table);
+    }
+    return NULL;
+}
+
+static LONG64 DenialTable_key(UINT64 uuid, UINT32 pathHash, UINT8 operation) {
+    UINT64 key = uuid * 0x9E3779B97F4A7C15ull;
+    key ^= ((UINT64)pathHash << 8) | operation;
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ull;
+    key ^= key >> 32;
+    return (LONG64)(key | 1);
+}
+
+static VOID DenialTable_markDirty(DenialTable* table) {
+    if (ReadNoFence(&table->dirty) == 0) {
+        InterlockedExchange(&table->dirty, 1);
+    }
+}
+
+// Slot lock held: emits what the slot coalesced since its last record
+static VOID DenialTable_flushSlot(DenialTable* table, DenialSlot* slot) {
+    LONG count = InterlockedExchange(&slot->pending, 0);
+    if (count > 0) {
+        lycaniteEvent event = slot->event;
+        event.count = (UINT32)count;
+        table->emit(&event);
+    }
+}
+
+/*
+ * Safe from any number of threads, at IRQL <= DISPATCH_LEVEL. `pathHash` is
+ * the hashPath of the path the caller already computed; the path itself is
+ * only read when a window opens.
+ */
+VOID DenialTable_record(DenialTable* table, UINT64 uuid, UINT8 operation, UINT32 pathHash, CONST WCHAR* path, UINT32 length, LONG64 now) {
+    LONG64 key = DenialTable_key(uuid, pathHash, operation);
+    DenialSlot* slot = &table->slots[(UINT64)key & table->mask];
+
+    if (ReadAcquire64(&slot->key) == key && now < ReadNoFence64(&slot->expires)) {
+        InterlockedIncrement(&slot->pending);
+        DenialTable_markDirty(table);
+        return;
+    }
+
+    lycaniteEvent event;
+    UINT32 tail = length < EVENT_PATH_TAIL_LENGTH ? length : EVENT_PATH_TAIL_LENGTH;
+
+    Kmemset(&event, 0, sizeof(lycaniteEvent));
+    event.uuid = uuid;
+    event.operation = operation;
+    event.pathHash = pathHash;
+    event.count = 1;
+    event.tailLength = (UINT8)tail;
+    Kmemcpy(event.tail, (CONST PVOID)(path + length - tail), tail * sizeof(WCHAR));
+
+    if (InterlockedCompareExchange(&slot->busy, 1, 0) != 0) {
+        table->emit(&event);
+        return;
+    }
+
+    WriteRelease64(&slot->key, 0);
+    DenialTable_flushSlot(table, slot);
+    slot->event = event;
+    WriteNoFence64(&slot->expires, now + table->window);
+    WriteRelease64(&slot->key, key);
+    InterlockedExchange(&slot->busy, 0);
+
+    DenialTable_markDirty(table);
+    table->emit(&event);
+}
+
+/*
+ * TRUE while a window is open or a count is waiting to be emitted.
+ */
+BOOLEAN DenialTable_hasPending(DenialTable* table) {
+    return ReadNoFence(&table->dirty) != 0;
+}
+
+/*
+ * Emits the counters of windows that are over, all of them if `force`.
+ * Meant for a single sweeper; slots being rewritten are left for the next
+ * sweep.
+ */
+VOID DenialTable_flush(DenialTable* table, LONG64 now, BOOLEAN force) {
+    BOOLEAN remaining = FALSE;
+
+    InterlockedExchange(&table->dirty, 0);
+
+    for (UINT64 i = 0; i <= table->mask; i++) {
+        DenialSlot* slot = &table->slots[i];
+
+        // an open window can still coalesce repeats, keep sweeping until it's over
+        if (!force && now < ReadNoFence64(&slot->expires)) {
+            remaining = TRUE;
+            continue;
+        }
+        if (ReadNoFence(&slot->pending) == 0) {
+            continue;
+        }
+        if (InterlockedCompareExchange(&slot->busy, 1, 0) != 0) {
+            remaining = TRUE;
+            continue;
+        }
+
+        DenialTable_flushSlot(table, slot);
+        InterlockedExchange(&slot->busy, 0);
+    }
+
+    if (remaining) {
+        DenialTable_markDirty(table);
+    }
+}
+
+VOID DenialTable_destroy(DenialTable* table) {
+    if (table != NULL) {
+        free(table->slots);
+        free(table);
+    }
+}
@@ -12,6 +12,24 @@
 #include "IKashmap.h"
 #include "UUIDRecycler.h"
 #include "Permissions.h"
+#include "EventQueue.h"
+#include "SharedRing.h"
+#include "DenialTable.h"
+#include "ProcessStats.h"
+#include "HotPaths.h"
+#include "LearnedRules.h"
+#include "TokenBucket.h"
+#include "WriteQuota.h"
+#include "TimerWheel.h"
+#include "LatencyHistogram.h"
+#include "TraceBuffer.h"
+#include "DecisionCapture.h"
+#include "ReclaimQueue.h"
+#include "GracePeriod.h"
+#include "ProcessTree.h"
+#include "PolicySnapshot.h"
+#include "RuleSet.h"
+#include "VolumeRules.h"
 
 /* ======================================================
 *                       DEFINES & MACROS
@@ -19,12 +37,201 @@
 
 #define PermFlag(x, y) ((x & y) != y)
 
+// events queued per controller
+#define LYCANITE_EVENT_QUEUE_SIZE 1024
+
+// controllers connected at once, each with its own sandboxes
+#define LYCANITE_MAX_CONTROLLERS 8
+
+// low bits of a sandbox uuid: the slot of the controller that owns it
+#define LYCANITE_CONTROLLER_BITS 3
+#define LYCANITE_CONTROLLER_SLOT(uuid) ((UINT32)((uuid) & (LYCANITE_MAX_CONTROLLERS - 1)))
+
+// sandbox records kept allocated, with their rule tables, for the next sandboxes
+#define LYCANITE_SANDBOX_POOL_SIZE 64
+
+// process tree nodes reserved along with the sandbox pool
+#define LYCANITE_PROCESS_NODES 1024
+
+// rule table slots of closed sandboxes the event worker frees between two event drains
+#define LYCANITE_RECLAIM_BATCH 512
+
+// granularity of rule TTLs, a tick of the timer wheels
+#define LYCANITE_RULE_TICK_MS 10
+#define LYCANITE_RULE_TICK (10000ull * LYCANITE_RULE_TICK_MS)
+
+// timed rules the event worker expires, and wheel ticks it steps, between two event drains
+#define LYCANITE_EXPIRY_BATCH 256
+
+// FilterGetMessage buffer on the controller side minus its FILTER_MESSAGE_HEADER
+#define LYCANITE_EVENT_BATCH_SIZE (4096 - 16)
+
+// largest serialized event: a denial carrying a full path tail
+#define LYCANITE_EVENT_MAX_SIZE (19 + EVENT_PATH_TAIL_LENGTH * sizeof(WCHAR))
+
+// denials coalesced at once, a key evicts the previous one sharing its slot
+#define LYCANITE_DENIAL_TABLE_SIZE 1024
+
+// repeats of a denial inside the window are reported as one event with a count
+#define LYCANITE_DENIAL_WINDOW_MS 1000
+
+// GET_PROCESS_STATS reply: checks, allows and denies per operation, name query failures, lookup probes,
+// operations throttled, operations refused by the throttle
+#define LYCANITE_STATS_REPLY_SIZE ((3 * STATS_OPERATIONS + 4) * sizeof(UINT64))
+
+// GET_HOT_PATHS reply: dropped samples UINT64, count UINT8, then per path hash UINT32, count UINT64, error UINT64, tail length UINT8, tail
+#define LYCANITE_HOT_PATH_SIZE (21 + HOTPATHS_TAIL * sizeof(WCHAR))
+#define LYCANITE_HOT_PATHS_REPLY_SIZE (9 + HOTPATHS_ENTRIES * LYCANITE_HOT_PATH_SIZE)
+
+// learned rules table of a learning sandbox, allocated when it starts learning: slots and WCHARs of path text
+#define LYCANITE_LEARNING_SLOTS 8192
+#define LYCANITE_LEARNING_TEXT (256 * 1024)
+
+// files learned in a folder before they are collapsed into a rule on the folder
+#define LYCANITE_LEARNING_FOLDER_FILES 16
+
+// GET_LEARNED_RULES reply: dropped accesses UINT64, next cursor UINT32, rule count UINT32, then the rules
+#define LYCANITE_LEARNED_HEADER_SIZE 16
+#define LYCANITE_LEARNED_REPLY_MIN (LYCANITE_LEARNED_HEADER_SIZE + LEARNEDRULES_RECORD_MAX)
+#define LYCANITE_LEARNED_REPLY_MAX (256 * 1024)
+
+// a read or write over its sandbox's I/O budget waits for the budget to refill in steps of
+#define LYCANITE_THROTTLE_STEP_MS 10
+
+// and fails with STATUS_DEVICE_BUSY after waiting that long
+#define LYCANITE_THROTTLE_MAX_WAIT_MS 1000
+
+// WRITE_QUOTA reply: quota UINT64, bytes written UINT64, writes refused UINT64
+#define LYCANITE_WRITE_QUOTA_REPLY_SIZE (3 * sizeof(UINT64))
+
+// Define (here or in the project) to time the pre-operation callbacks into
+// per-CPU latency histograms, read back with GET_LATENCY_HISTOGRAM
+// #define LYCANITE_LATENCY
+
+// GET_LATENCY_HISTOGRAM reply: sub-bucket bits, count, number of buckets, then (index UINT16, count UINT64) pairs
+#define LYCANITE_LATENCY_REPLY_SIZE (11 + LATENCY_BUCKETS * 10)
+
+#ifdef LYCANITE_LATENCY
+#define LATENCY_START(name) UINT64 name = latencyNow()
+#define LATENCY_RECORD(data, stage, start) latencyRecord(data, stage, start)
+#define LYCANITE_PRE_OPERATION(callback) AvPreTimed
+#else
+#define LATENCY_START(name)
+#define LATENCY_RECORD(data, stage, start)
+#define LYCANITE_PRE_OPERATION(callback) callback
+#endif
+
+// Define (here or in the project) to record binary tracepoints into per-CPU
+// rings, read back with GET_TRACE. Disabled tracepoints don't evaluate their arguments
+// #define LYCANITE_TRACE
+
+// records kept per CPU
+#define LYCANITE_TRACE_RECORDS 4096
+
+// GET_TRACE reply header: cpu count UINT16, frequency UINT64, next index UINT64, record count UINT16
+#define LYCANITE_TRACE_REPLY_HEADER 20
+
+#ifdef LYCANITE_TRACE
+#define LYCANITE_TRACEPOINT(event, arg0, arg1, pathHash) TraceBuffer_write(traceBuffer, event, arg0, arg1, pathHash)
+#else
+#define LYCANITE_TRACEPOINT(event, arg0, arg1, pathHash)
+#endif
+
+// decision capture buffer, allocated when a capture is first started
+#define LYCANITE_CAPTURE_SIZE (4 * 1024 * 1024)
+
+// distinct paths before the capture dictionary is reset
+#define LYCANITE_CAPTURE_PATHS 65536
+
+// data bytes of the ring shared with the controller, must be a power of two
+#define LYCANITE_EVENT_RING_SIZE (64 * 1024)
+
+// how long the worker waits before retrying a full shared ring
+#define LYCANITE_EVENT_RING_RETRY_MS 10
+
+// value of the service key naming the compiled global rules loaded at boot
+#define LYCANITE_POLICY_SNAPSHOT_VALUE L"PolicySnapshot"
+
+// largest policy snapshot read at boot
+#define LYCANITE_POLICY_SNAPSHOT_MAX_SIZE (512 * 1024 * 1024)
+
+// value of the service key choosing how global rules are stored, a VolumeRulesMode
+#define LYCANITE_COMPACT_POLICY_VALUE L"CompactPolicy"
+
+struct controllerInfos_s;
+
+enum IoBudgetBucket {
+    BUDGET_READ_OPS = 0,
+    BUDGET_READ_BYTES = 1,
+    BUDGET_WRITE_OPS = 2,
+    BUDGET_WRITE_BYTES = 3,
+    BUDGET_BUCKETS = 4
+};
+
+// Operations and bytes per second a sandbox may read and write
+typedef struct ioBudget_s {
+    TokenBucket buckets[BUDGET_BUCKETS];
+} ioBudget;
+
+// Expiry of a rule set with a TTL, owned by its wheel
+typedef struct timedRule_s {
+    TimerWheelNode node;
+    UINT64 uuid; // 0 for a global rule
+    PWCHAR path; // key of the rule in its timed map
+    UINT32 length;
+} timedRule;
+
 typedef struct processInfos_s {
-    UINT16 referenceCount;
-    struct hashmap_s permissions;
+    ProcessSet processes; // live processes of the sandbox
+    struct hashmap_s* permissions; // rules set since the last seal, looked up first; replaced whole when rebuilt
+    RuleSet* base; // sealed rules, shared with the sandboxes sealing the same rules
+    volatile LONG sealing; // the private table is being swapped, readers look in the base alone
     UINT64 uuid;
+    struct controllerInfos_s* owner;
+    struct processInfos_s* enclosing; // sandbox of its controller when that one is sandboxed, enforced too
+    UINT32 nested; // open sandboxes it encloses, under processesLock
+    ProcessStats* stats;
+    HotPaths* hotPaths; // heaviest paths of its I/O, NULL until the first GET_HOT_PATHS
+    LearnedRules* learned; // NULL until it first learns
+    volatile LONG learning; // accesses its rules deny are allowed and learned
+    ioBudget* budget; // NULL until SET_IO_BUDGET
+    WriteQuota* writeQuota; // NULL until WRITE_QUOTA sets something
+    struct hashmap_s* timed; // path -> timedRule of its rules with a TTL, NULL until the first
+    struct processInfos_s* next; // sandbox pool
+    ReclaimEntry reclaim;
+    UINT32 reclaimCursor; // next rule table slot the event worker frees
 } processInfos;
 
+typedef struct eventRing_s {
+    SharedRingHeader* ring; // mapped in the controller, writable by it
+    SharedRingProducer producer;
+    PMDL mdl;
+    PVOID userAddress;
+    PEPROCESS process;
+    PKEVENT doorbell;
+} eventRing;
+
+/*
+ * A controller connection and the sandboxes it opened. The slot outlives the
+ * connection: its sandboxes stay enforced with the rules they had, and the
+ * slot is only handed to a new connection once they are all closed. The maps
+ * and queue are allocated on the first connection.
+ */
+typedef struct controllerInfos_s {
+    UINT32 slot;
+    PFLT_PORT clientPort; // NULL while nothing is connected
+    volatile LONG64 pid; // sandboxes are started from this process, 0 until SET_LYCANITE_PID
+    EX_PUSH_LOCK lock; // the sandboxes map, and the rule tables of its sandboxes for writers
+    map_t sandboxes; // uuid -> processInfos
+    TimerWheel timers; // expiries of its sandboxes' timed rules, under lock
+    UUIDRecycler* uuids; // under processesLock
+    EventQueue* events;
+    lycaniteEvent pendingEvent; // event worker
+    BOOLEAN hasPendingEvent;
+    eventRing ring;
+    EX_PUSH_LOCK ringLock;
+} controllerInfos;
+
 enum Permission {
     LYCANITE_WRITE  = 0b001,
     LYCANITE_READ   = 0b010,
@@ -37,19 +244,63 @@ enum LycaniteAction {
     SET_AUTHORIZATION_GLOBAL = 2,
     GET_PROCESS_STATS = 3,
     DELETE_AUTHORIZATION_PID = 4,
-    DELETE_AUTHORIZATION_GLOBAL = 5
+    DELETE_AUTHORIZATION_GLOBAL = 5,
+    SET_EVENT_RING = 6,
+    GET_LATENCY_HISTOGRAM = 7,
+    GET_TRACE = 8,
+    SET_CAPTURE = 9,
+    READ_CAPTURE = 10,
+    SEAL_AUTHORIZATION_PID = 11,
+    GET_HOT_PATHS = 12,
+    SET_LEARNING = 13,
+    GET_LEARNED_RULES = 14,
+    SET_IO_BUDGET = 15,
+    WRITE_QUOTA = 16,
+    SET_AUTHORIZATION_TTL = 17
 };
 
 enum comError {
     INVALID_REQUEST_SIZE = 1,
     UNKNOWN_REQUEST = 2,
-    BAD_ALLOC = 3
+    BAD_ALLOC = 3,
+    INVALID_HANDLE = 4,
+    MAPPING_FAILED = 5,
+    NOT_PRIMARY_CONTROLLER = 6
 };
 
 enum UserCallback {
     PROCESS_CREATE = 1,
     PROCESS_DESTROY = 2,
     PROCESS_REQPERM = 3,
+    EVENTS_LOST = 4,
+};
+
+enum LatencyCallback {
+    LATENCY_CREATE = 0,
+    LATENCY_READ = 1,
+    LATENCY_WRITE = 2,
+    LATENCY_SET_INFORMATION = 3,
+    LATENCY_CALLBACKS = 4
+};
+
+enum LatencyStage {
+    LATENCY_TOTAL = 0,
+    LATENCY_NAME_QUERY = 1,
+    LATENCY_PROCESS_LOOKUP = 2,
+    LATENCY_POLICY = 3,
+    LATENCY_STAGES = 4
+};
+
+// Keep in sync with the decoder in Tools/TraceDecode.c
+enum TraceEvent {
+    TRACE_CHECK = 1,        // process id, permissions | restricted << 32
+    TRACE_CHECK_GLOBAL = 2  // process id, permissions | restricted << 32
+};
+
+enum EventDrain {
+    EVENTS_EMPTY = 0,
+    EVENTS_DRAINED = 1,
+    EVENTS_BLOCKED = 2
 };
 
 /* ======================================================
@@ -66,7 +317,147 @@ DriverEntry(
 
 NTSTATUS CgUnload(FLT_FILTER_UNLOAD_FLAGS Flags);
 
+UINT8 readPolicyMode(PUNICODE_STRING RegistryPath);
+
+VOID loadPolicySnapshot(PUNICODE_STRING RegistryPath);
+
+VOID freePolicySnapshot();
+
+
+
+/* ======================================================
+*                       Sandboxes
+*  ======================================================*/
+
+processInfos* createSandbox();
+
+VOID destroySandbox(processInfos* pinfo);
+
+VOID fillSandboxPool();
+
+VOID freeSandboxPool();
+
+processInfos* acquireSandbox();
+
+VOID releaseSandbox(processInfos* pinfo);
+
+VOID recycleSandbox(processInfos* pinfo);
+
+VOID freeBudget(ioBudget* budget);
+
+VOID freeWriteQuota(WriteQuota* quota);
+
+BOOLEAN reclaimSandboxes(UINT32 budget);
+
+processInfos* processSandbox(UINT64 processId);
+
+VOID closeSandbox(processInfos* pinfo, UINT64 processId);
+
+VOID exitProcess(ProcessNode* node);
+
+UINT8 sealSandbox(processInfos* pinfo);
+
+VOID releaseSharedRules(processInfos* pinfo);
+
+BOOLEAN putSandboxRule(processInfos* pinfo, PWCHAR file, UINT64 len, UINT64* perms);
+
+UINT8 removeSandboxRule(processInfos* pinfo, PWCHAR file, UINT64 len, BOOLEAN* kept);
+
+VOID freeSandboxRules(struct hashmap_s* rules);
+
+/* ======================================================
+*                       Timed rules
+*  ======================================================*/
+
+UINT64 ruleTick(UINT64 interruptTime);
+
+timedRule* reserveRule(struct hashmap_s** timed, UINT64 uuid, CONST WCHAR* path, UINT64 length, BOOLEAN* added);
+
+VOID dropRule(struct hashmap_s* timed, timedRule* rule);
+
+VOID armRule(TimerWheel* wheel, timedRule* rule, UINT32 ttl);
+
+VOID disarmRule(TimerWheel* wheel, struct hashmap_s* timed, CONST WCHAR* path, UINT64 length);
+
+VOID freeTimedRule(TimerWheelNode* node);
+
+VOID freeTimedMap(struct hashmap_s** timed);
+
+BOOLEAN expireRules(UINT32 budget);
+
+LONG64 nextRuleExpiry();
+
+/* ======================================================
+*                       Controllers
+*  ======================================================*/
+
+VOID initControllers();
+
+BOOLEAN openController(controllerInfos* cinfo);
+
+VOID closeControllers();
+
+controllerInfos* controllerOf(UINT64 uuid);
+
+BOOLEAN isPrimaryController(controllerInfos* cinfo);
+
+BOOLEAN hasOpenSandboxes(controllerInfos* cinfo);
+
+controllerInfos* controllerFor(UINT64 processId);
+
+/* ======================================================
+*                       Instrumentation
+*  ======================================================*/
+
+VOID StartInstrumentation();
+
+VOID StopInstrumentation();
+
+VOID captureSnapshot();
+
+INT captureSandboxRules(any_t item, any_t data);
+
+BOOLEAN captureRulePath(PVOID context, CONST WCHAR* path, UINT32 length, UINT64 permissions);
+
+INT8 captureRuleElement(PVOID const context, struct hashmap_element_s* const e);
+
+VOID captureRule(UINT64 uuid, UINT64 permissions, CONST WCHAR* path, UINT64 length);
 
+/* ======================================================
+*                       Event Worker
+*  ======================================================*/
+
+NTSTATUS StartEventWorker();
+
+VOID StopEventWorker();
+
+VOID FreeEventWorker();
+
+VOID EventWorker(
+    _In_ PVOID StartContext
+);
+
+UINT8 drainEventsToPort(
+    _In_ controllerInfos* cinfo
+);
+
+UINT8 drainEventsToRing(
+    _In_ controllerInfos* cinfo
+);
+
+UINT8 drainController(
+    _In_ controllerInfos* cinfo
+);
+
+VOID sleepControllers(
+    _In_ BOOLEAN sleeping
+);
+
+BOOLEAN controllersIdle();
+
+VOID releaseEventRing(
+    _Inout_ eventRing* target
+);
 
 /* ======================================================
 *               Communication Callbacks
@@ -102,24 +493,82 @@ comMessageNotifyCallback(
 
 UINT8
 comSetLycanitePid(
+    _In_ controllerInfos* Controller,
     _In_ unsigned char* Input,
     _In_ ULONG InputBufferSize
 );
 
 UINT8
 comSetAuthorizationPid(
+    _In_ controllerInfos* Controller,
     _In_ unsigned char* Input,
-    _In_ UINT64 InputBufferSize
+    _In_ UINT64 InputBufferSize,
+    _In_ UINT32 Ttl
 );
 
 UINT8
 comSetAuthorizationGlobal(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _In_ UINT32 Ttl
+);
+
+UINT8
+comSetAuthorizationTtl(
+    _In_ controllerInfos* Controller,
     _In_ unsigned char* Input,
     _In_ UINT64 InputBufferSize
 );
 
 UINT8
 comGetProcessStats(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+);
+
+UINT8
+comGetHotPaths(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+);
+
+UINT8
+comSetLearning(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+);
+
+UINT8
+comGetLearnedRules(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+);
+
+UINT8
+comSetIoBudget(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+);
+
+UINT8
+comWriteQuota(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
     _Out_ unsigned char* Output,
     _In_ UINT64 OutputBufferSize,
     _Out_ PULONG ReturnOutputBufferLength
@@ -127,6 +576,14 @@ comGetProcessStats(
 
 UINT8
 comDeleteAuthorizationPid(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+);
+
+UINT8
+comSealAuthorizationPid(
+    _In_ controllerInfos* Controller,
     _In_ unsigned char* Input,
     _In_ UINT64 InputBufferSize
 );
@@ -137,6 +594,53 @@ comDeleteAuthorizationGlobal(
     _In_ UINT64 InputBufferSize
 );
 
+UINT8
+comSetEventRing(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+);
+
+UINT8
+comSetCapture(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+);
+
+UINT8
+comReadCapture(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+);
+
+#ifdef LYCANITE_TRACE
+UINT8
+comGetTrace(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+);
+#endif
+
+#ifdef LYCANITE_LATENCY
+UINT8
+comGetLatencyHistogram(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+);
+#endif
+
 /* ======================================================
 *                       Callbacks
 *  ======================================================*/
@@ -161,6 +665,14 @@ AvPreWrite(
     _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
 );
 
+FLT_POSTOP_CALLBACK_STATUS
+AvPostWrite(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+);
+
 FLT_PREOP_CALLBACK_STATUS
 AvPreRead(
     _Inout_ PFLT_CALLBACK_DATA Data,
@@ -175,6 +687,15 @@ AvPreSetInformation(
     _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
 );
 
+#ifdef LYCANITE_LATENCY
+FLT_PREOP_CALLBACK_STATUS
+AvPreTimed(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+);
+#endif
+
 /* ======================================================
 *                       Context
 *  ======================================================*/
@@ -191,6 +712,9 @@ AvPreSetInformation(
 #pragma alloc_text(PAGE, AvPreWrite)
 #pragma alloc_text(PAGE, AvPreRead)
 #pragma alloc_text(PAGE, AvPreSetInformation)
+#ifdef LYCANITE_LATENCY
+#pragma alloc_text(PAGE, AvPreTimed)
+#endif
 #endif
 
 #endif
\ No newline at end of file
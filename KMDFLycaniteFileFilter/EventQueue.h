@@ -0,0 +1,191 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Bounded lock-free multi-producer / single-consumer event ring.
+ *
+ * Producers (the process notify routine, any CPU) claim a slot by advancing
+ * tail with a CAS and publish it through the slot sequence number. The single
+ * consumer (the event worker) drains in order. When the ring is full the event
+ * is dropped and counted; the consumer reports the count once as a single
+ * "events lost" record instead of stalling the producer.
+ */
+
+#define EVENT_QUEUE_CACHE_LINE 64
+
+// trailing characters of the path carried by a denial
+#define EVENT_PATH_TAIL_LENGTH 32
+
+typedef struct lycaniteEvent_s {
+    UINT8 type;
+    UINT64 processId;
+    UINT64 uuid;
+
+    // denials
+    UINT8 operation;
+    UINT8 tailLength;
+    UINT32 pathHash;
+    UINT32 count;
+    WCHAR tail[EVENT_PATH_TAIL_LENGTH];
+} lycaniteEvent;
+
+typedef struct EventQueueSlot_s {
+    volatile LONG64 sequence;
+    lycaniteEvent event;
+} EventQueueSlot;
+
+typedef struct EventQueue_s {
+    UINT64 capacity;
+    UINT64 mask;
+    EventQueueSlot* slots;
+
+    // producers
+    UCHAR padTail[EVENT_QUEUE_CACHE_LINE];
+    volatile LONG64 tail;
+    volatile LONG64 pushed;
+    volatile LONG64 dropped;
+    volatile LONG64 unreported;
+
+    // consumer
+    UCHAR padHead[EVENT_QUEUE_CACHE_LINE];
+    LONG64 head;
+    volatile LONG sleeping;
+    UCHAR padEnd[EVENT_QUEUE_CACHE_LINE];
+} EventQueue;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static EventQueue* EventQueue_create(UINT64 capacity);
+    static BOOLEAN EventQueue_push(EventQueue* queue, CONST lycaniteEvent* event);
+    static BOOLEAN EventQueue_pop(EventQueue* queue, lycaniteEvent* event);
+    static BOOLEAN EventQueue_isEmpty(EventQueue* queue);
+    static UINT64 EventQueue_takeDropped(EventQueue* queue);
+    static VOID EventQueue_restoreDropped(EventQueue* queue, UINT64 count);
+    static VOID EventQueue_sleep(EventQueue* queue);
+    static VOID EventQueue_awake(EventQueue* queue);
+    static BOOLEAN EventQueue_claimWakeup(EventQueue* queue);
+    static VOID EventQueue_destroy(EventQueue* queue);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*
+ * Capacity is rounded up to a power of two.
+ */
+EventQueue* EventQueue_create(UINT64 capacity) {
+    UINT64 size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    EventQueue* queue = (EventQueue*)calloc(1, sizeof(EventQueue));
+    if (queue != NULL) {
+        queue->slots = (EventQueueSlot*)calloc(size, sizeof(EventQueueSlot));
+        if (queue->slots != NULL) {
+            queue->capacity = size;
+            queue->mask = size - 1;
+            for (UINT64 i = 0; i < size; i++) {
+                queue->slots[i].sequence = (LONG64)i;
+            }
+            return queue;
+        }
+        free(queue);
+    }
+    return NULL;
+}
+
+/*
+ * Safe from any number of concurrent producers. Returns FALSE if the ring was
+ * full and the event got dropped.
+ */
+BOOLEAN EventQueue_push(EventQueue* queue, CONST lycaniteEvent* event) {
+    LONG64 pos = ReadNoFence64(&queue->tail);
+
+    for (;;) {
+        EventQueueSlot* slot = &queue->slots[(UINT64)pos & queue->mask];
+        LONG64 diff = ReadAcquire64(&slot->sequence) - pos;
+
+        if (diff == 0) {
+            LONG64 prev = InterlockedCompareExchange64(&queue->tail, pos + 1, pos);
+            if (prev == pos) {
+                slot->event = *event;
+                WriteRelease64(&slot->sequence, pos + 1);
+                InterlockedIncrement64(&queue->pushed);
+                return TRUE;
+            }
+            pos = prev;
+        }
+        else if (diff < 0) {
+            InterlockedIncrement64(&queue->dropped);
+            InterlockedIncrement64(&queue->unreported);
+            return FALSE;
+        }
+        else {
+            pos = ReadNoFence64(&queue->tail);
+        }
+    }
+}
+
+/*
+ * Single consumer only.
+ */
+BOOLEAN EventQueue_pop(EventQueue* queue, lycaniteEvent* event) {
+    EventQueueSlot* slot = &queue->slots[(UINT64)queue->head & queue->mask];
+
+    if (ReadAcquire64(&slot->sequence) != queue->head + 1) {
+        return FALSE;
+    }
+
+    *event = slot->event;
+    WriteRelease64(&slot->sequence, queue->head + (LONG64)queue->capacity);
+    queue->head++;
+    return TRUE;
+}
+
+BOOLEAN EventQueue_isEmpty(EventQueue* queue) {
+    EventQueueSlot* slot = &queue->slots[(UINT64)queue->head & queue->mask];
+    return ReadAcquire64(&slot->sequence) != queue->head + 1;
+}
+
+/*
+ * Number of events dropped since the last call.
+ */
+UINT64 EventQueue_takeDropped(EventQueue* queue) {
+    return (UINT64)InterlockedExchange64(&queue->unreported, 0);
+}
+
+/*
+ * Hands back a count taken by EventQueue_takeDropped that could not be reported.
+ */
+VOID EventQueue_restoreDropped(EventQueue* queue, UINT64 count) {
+    InterlockedExchangeAdd64(&queue->unreported, (LONG64)count);
+}
+
+/*
+ * Doorbell: the consumer announces it is about to wait, then re-checks the
+ * ring. A producer that publishes after that only rings if it wins
+ * EventQueue_claimWakeup, so the consumer is signalled once per sleep.
+ */
+VOID EventQueue_sleep(EventQueue* queue) {
+    InterlockedExchange(&queue->sleeping, 1);
+}
+
+VOID EventQueue_awake(EventQueue* queue) {
+    InterlockedExchange(&queue->sleeping, 0);
+}
+
+BOOLEAN EventQueue_claimWakeup(EventQueue* queue) {
+    return ReadNoFence(&queue->sleeping) == 1 &&
+        InterlockedCompareExchange(&queue->sleeping, 0, 1) == 1;
+}
+
+VOID EventQueue_destroy(EventQueue* queue) {
+    if (queue != NULL) {
+        free(queue->slots);
+        free(queue);
+    }
+}
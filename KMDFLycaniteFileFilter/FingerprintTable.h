@@ -0,0 +1,303 @@
+#pragma once
+
+#include "Utils.h"
+#include "GracePeriod.h"
+
+/*
+ * Compact rule table: path -> permissions without the paths.
+ *
+ * An entry is the 128-bit fingerprint of its path and the permissions, 24
+ * bytes inline in one array, where a Kashmap element points to an owned copy
+ * of the path and to an allocated value. Distinct paths sharing a
+ * fingerprint are not told apart unless the table verifies: it then keeps
+ * the paths in a side-table of the same slots, only read when fingerprints
+ * match, and compares them.
+ *
+ * Open addressing with linear probing. Writers hold the caller's lock,
+ * lookups take none and run in a read section of the table's GracePeriod:
+ * - an entry is written in full before the low half of its fingerprint, the
+ *   word lookups test first, is stored with release;
+ * - a deletion leaves a tombstone lookups probe past, nothing moves under
+ *   them, and the path of a verifying table stays until the slots go;
+ * - slots filled with entries and tombstones past 3/4 are rebuilt without
+ *   the tombstones into new arrays, published at once, and the old ones are
+ *   freed once no lookup can be reading them.
+ */
+
+typedef struct PathFingerprint_s {
+    UINT64 low; // never FINGERPRINT_TABLE_EMPTY nor FINGERPRINT_TABLE_TOMBSTONE for a path
+    UINT64 high;
+} PathFingerprint;
+
+typedef struct FingerprintEntry_s {
+    PathFingerprint fingerprint;
+    UINT64 permissions;
+} FingerprintEntry;
+
+typedef struct FingerprintSlots_s {
+    FingerprintEntry* entries;
+    PWCHAR* paths; // verification side-table, terminated copies of the paths, NULL if not verifying
+    UINT32 mask;
+} FingerprintSlots;
+
+typedef struct FingerprintTable_s {
+    FingerprintSlots* slots; // replaced whole when rebuilt
+    GracePeriod* grace; // lookups' read sections
+    UINT32 count;
+    UINT32 tombstones;
+} FingerprintTable;
+
+typedef BOOLEAN (*FingerprintTableVisitor)(PVOID context, CONST WCHAR* path, UINT32 length, UINT64 permissions);
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN FingerprintTable_create(FingerprintTable* table, BOOLEAN verify, GracePeriod* grace);
+    static PathFingerprint FingerprintTable_fingerprint(CONST WCHAR* path, UINT32 length);
+    static UINT64* FingerprintTable_get(CONST FingerprintTable* table, CONST WCHAR* path, UINT32 length);
+    static BOOLEAN FingerprintTable_put(FingerprintTable* table, CONST WCHAR* path, UINT32 length, UINT64 permissions);
+    static BOOLEAN FingerprintTable_remove(FingerprintTable* table, CONST WCHAR* path, UINT32 length);
+    static BOOLEAN FingerprintTable_iterate(CONST FingerprintTable* table, FingerprintTableVisitor visitor, PVOID context);
+    static VOID FingerprintTable_destroy(FingerprintTable* table);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#define FINGERPRINT_TABLE_INITIAL_SIZE 16
+#define FINGERPRINT_TABLE_EMPTY 0
+#define FINGERPRINT_TABLE_TOMBSTONE 1
+
+static UINT64 FingerprintTable_rotate(UINT64 x, UINT8 r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static UINT64 FingerprintTable_finalize(UINT64 x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// Two lanes over four WCHARs at a time, the mixing of MurmurHash3 x64 128
+PathFingerprint FingerprintTable_fingerprint(CONST WCHAR* path, UINT32 length) {
+    CONST UINT64 c1 = 0x87C37B91114253D5ull;
+    CONST UINT64 c2 = 0x4CF5AD432745937Full;
+    UINT64 h1 = 0x6C796361ull ^ length; // "lyca"
+    UINT64 h2 = 0x6E697465ull; // "nite"
+
+    for (UINT32 i = 0; i < length; i += 4) {
+        UINT64 k = 0;
+        for (UINT32 j = 0; j < 4 && i + j < length; j++) {
+            k |= (UINT64)path[i + j] << (16 * j);
+        }
+
+        UINT64 k1 = FingerprintTable_rotate(k * c1, 31) * c2;
+        h1 = FingerprintTable_rotate(h1 ^ k1, 27) + h2;
+        h1 = h1 * 5 + 0x52DCE729;
+        UINT64 k2 = FingerprintTable_rotate(k * c2, 33) * c1;
+        h2 = FingerprintTable_rotate(h2 ^ k2, 31) + h1;
+        h2 = h2 * 5 + 0x38495AB5;
+    }
+
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = FingerprintTable_finalize(h1);
+    h2 = FingerprintTable_finalize(h2);
+    h1 += h2;
+    h2 += h1;
+
+    PathFingerprint fingerprint = { h1, h2 };
+    if (fingerprint.low <= FINGERPRINT_TABLE_TOMBSTONE) {
+        fingerprint.low += 2; // the low words of empty slots and tombstones
+    }
+    return fingerprint;
+}
+
+// Low word of the fingerprint, acquired: the rest of the entry is written once it is set
+static UINT64 FingerprintTable_low(CONST FingerprintEntry* entry) {
+    return (UINT64)ReadAcquire64((volatile LONG64*)&entry->fingerprint.low);
+}
+
+static BOOLEAN FingerprintTable_samePath(CONST WCHAR* stored, CONST WCHAR* path, UINT32 length) {
+    return my_strlen((PWCHAR)stored) == length && Kmemcmp((PVOID)stored, (PVOID)path, length * sizeof(WCHAR)) == 0;
+}
+
+static FingerprintSlots* FingerprintTable_allocate(UINT32 size, BOOLEAN verify) {
+    FingerprintSlots* slots = (FingerprintSlots*)calloc(1, sizeof(FingerprintSlots));
+    if (slots == NULL) {
+        return NULL;
+    }
+    slots->entries = (FingerprintEntry*)calloc(size, sizeof(FingerprintEntry));
+    slots->paths = verify ? (PWCHAR*)calloc(size, sizeof(PWCHAR)) : NULL;
+    if (slots->entries == NULL || (verify && slots->paths == NULL)) {
+        free(slots->entries);
+        free(slots->paths);
+        free(slots);
+        return NULL;
+    }
+    slots->mask = size - 1;
+    return slots;
+}
+
+// With the paths of its tombstones, and of its entries unless they moved to other slots
+static VOID FingerprintTable_free(FingerprintSlots* slots, BOOLEAN moved) {
+    if (slots->paths != NULL) {
+        for (UINT32 i = 0; i <= slots->mask; i++) {
+            if (!moved || slots->entries[i].fingerprint.low == FINGERPRINT_TABLE_TOMBSTONE) {
+                free(slots->paths[i]);
+            }
+        }
+    }
+    free(slots->entries);
+    free(slots->paths);
+    free(slots);
+}
+
+BOOLEAN FingerprintTable_create(FingerprintTable* table, BOOLEAN verify, GracePeriod* grace) {
+    Kmemset(table, 0, sizeof(FingerprintTable));
+    table->grace = grace;
+    table->slots = FingerprintTable_allocate(FINGERPRINT_TABLE_INITIAL_SIZE, verify);
+    return table->slots != NULL;
+}
+
+// Slot of the path, or of the empty slot ending its probe when it isn't there
+static UINT32 FingerprintTable_slot(CONST FingerprintSlots* slots, PathFingerprint fingerprint, CONST WCHAR* path, UINT32 length) {
+    UINT32 slot = (UINT32)fingerprint.low & slots->mask;
+    for (;; slot = (slot + 1) & slots->mask) {
+        CONST FingerprintEntry* entry = &slots->entries[slot];
+        UINT64 low = FingerprintTable_low(entry);
+        if (low == FINGERPRINT_TABLE_EMPTY) {
+            return slot;
+        }
+        if (low == fingerprint.low && entry->fingerprint.high == fingerprint.high &&
+            (slots->paths == NULL || FingerprintTable_samePath(slots->paths[slot], path, length))) {
+            return slot;
+        }
+    }
+}
+
+// In a read section of the table's GracePeriod, the permissions are valid until it ends
+UINT64* FingerprintTable_get(CONST FingerprintTable* table, CONST WCHAR* path, UINT32 length) {
+    FingerprintSlots* slots = (FingerprintSlots*)ReadPointerAcquire((PVOID volatile*)&table->slots);
+    UINT32 slot = FingerprintTable_slot(slots, FingerprintTable_fingerprint(path, length), path, length);
+    return FingerprintTable_low(&slots->entries[slot]) == FINGERPRINT_TABLE_EMPTY ? NULL : &slots->entries[slot].permissions;
+}
+
+/*
+ * The entries moved to new slots without the tombstones, twice as many when
+ * they would fill half of them. The old slots are freed with the tombstones'
+ * paths once the lookups that could be reading them are done.
+ */
+static BOOLEAN FingerprintTable_rebuild(FingerprintTable* table) {
+    FingerprintSlots* old = table->slots;
+    UINT32 size = old->mask + 1;
+    if ((table->count + 1) * 2 > size) {
+        size *= 2;
+    }
+    FingerprintSlots* slots = size != 0 ? FingerprintTable_allocate(size, old->paths != NULL) : NULL;
+    if (slots == NULL) {
+        return FALSE;
+    }
+
+    for (UINT32 i = 0; i <= old->mask; i++) {
+        FingerprintEntry* entry = &old->entries[i];
+        if (entry->fingerprint.low <= FINGERPRINT_TABLE_TOMBSTONE) {
+            continue;
+        }
+        UINT32 slot = (UINT32)entry->fingerprint.low & slots->mask;
+        while (slots->entries[slot].fingerprint.low != FINGERPRINT_TABLE_EMPTY) {
+            slot = (slot + 1) & slots->mask;
+        }
+        slots->entries[slot] = *entry;
+        if (old->paths != NULL) {
+            slots->paths[slot] = old->paths[i];
+        }
+    }
+
+    WritePointerRelease((PVOID volatile*)&table->slots, slots);
+    table->tombstones = 0;
+    GracePeriod_synchronize(table->grace);
+    FingerprintTable_free(old, TRUE);
+    return TRUE;
+}
+
+// FALSE if an allocation failed, the table is then left as it was
+BOOLEAN FingerprintTable_put(FingerprintTable* table, CONST WCHAR* path, UINT32 length, UINT64 permissions) {
+    PathFingerprint fingerprint = FingerprintTable_fingerprint(path, length);
+    UINT32 slot = FingerprintTable_slot(table->slots, fingerprint, path, length);
+    FingerprintEntry* entry = &table->slots->entries[slot];
+    if (entry->fingerprint.low != FINGERPRINT_TABLE_EMPTY) {
+        WriteNoFence64((volatile LONG64*)&entry->permissions, (LONG64)permissions);
+        return TRUE;
+    }
+
+    // an empty slot is left for every probe to end on
+    if ((table->count + table->tombstones + 1) * 4 > (table->slots->mask + 1) * 3) {
+        if (!FingerprintTable_rebuild(table)) {
+            return FALSE;
+        }
+        slot = FingerprintTable_slot(table->slots, fingerprint, path, length);
+        entry = &table->slots->entries[slot];
+    }
+
+    if (table->slots->paths != NULL) {
+        PWCHAR copy = (PWCHAR)malloc(((SIZE_T)length + 1) * sizeof(WCHAR));
+        if (copy == NULL) {
+            return FALSE;
+        }
+        Kmemcpy(copy, (PVOID)path, length * sizeof(WCHAR));
+        copy[length] = 0;
+        table->slots->paths[slot] = copy;
+    }
+    entry->permissions = permissions;
+    entry->fingerprint.high = fingerprint.high;
+    WriteRelease64((volatile LONG64*)&entry->fingerprint.low, (LONG64)fingerprint.low);
+    table->count++;
+    return TRUE;
+}
+
+// FALSE if the path is not in the table
+BOOLEAN FingerprintTable_remove(FingerprintTable* table, CONST WCHAR* path, UINT32 length) {
+    UINT32 slot = FingerprintTable_slot(table->slots, FingerprintTable_fingerprint(path, length), path, length);
+    FingerprintEntry* entry = &table->slots->entries[slot];
+    if (entry->fingerprint.low == FINGERPRINT_TABLE_EMPTY) {
+        return FALSE;
+    }
+
+    // the path stays with the tombstone, a lookup may be comparing it
+    WriteRelease64((volatile LONG64*)&entry->fingerprint.low, FINGERPRINT_TABLE_TOMBSTONE);
+    table->count--;
+    table->tombstones++;
+    return TRUE;
+}
+
+/*
+ * Calls the visitor with every rule. Only a verifying table knows its paths:
+ * FALSE without calling it otherwise, or when the visitor returns FALSE.
+ */
+BOOLEAN FingerprintTable_iterate(CONST FingerprintTable* table, FingerprintTableVisitor visitor, PVOID context) {
+    CONST FingerprintSlots* slots = table->slots;
+    if (slots->paths == NULL) {
+        return table->count == 0;
+    }
+    for (UINT32 i = 0; i <= slots->mask; i++) {
+        if (slots->entries[i].fingerprint.low > FINGERPRINT_TABLE_TOMBSTONE &&
+            !visitor(context, slots->paths[i], my_strlen(slots->paths[i]), slots->entries[i].permissions)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+VOID FingerprintTable_destroy(FingerprintTable* table) {
+    if (table->slots != NULL) {
+        FingerprintTable_free(table->slots, FALSE);
+    }
+    Kmemset(table, 0, sizeof(FingerprintTable));
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Sorted rule store, front-coded in blocks.
+ *
+ * Rules are sorted by path, UTF-16 units compared as unsigned, and cut into
+ * blocks of FRONTCODED_BLOCK. The first rule of a block is stored whole, the
+ * next ones as the number of units shared with the previous path and the rest
+ * of theirs:
+ *
+ *   first   permissions, length, path[length]
+ *   next    permissions, shared, suffix length, suffix
+ *
+ * every field a WCHAR. The sparse index holds where each block starts. A
+ * lookup binary searches the first paths of the blocks and decodes a single
+ * block, comparing as it goes, so nothing is copied or allocated.
+ *
+ * The store is read only and validated once by FrontCoded_open; it is used
+ * in place, from a policy snapshot.
+ */
+
+#define FRONTCODED_BLOCK 16
+
+typedef struct FrontCoded_s {
+    CONST UINT32* blocks; // first unit of each block in data
+    CONST WCHAR* data;
+    UINT64 length; // units of data
+    UINT32 blockCount;
+    UINT32 ruleCount;
+} FrontCoded;
+
+// Greatest rule not after a path
+typedef struct FrontCodedMatch_s {
+    UINT64 permissions;
+    UINT32 length; // of the rule's path
+    UINT32 common; // units the rule's path shares with the path
+} FrontCodedMatch;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN FrontCoded_open(FrontCoded* store, CONST UINT32* blocks, UINT32 blockCount, CONST WCHAR* data, UINT64 length, UINT32 ruleCount);
+    static BOOLEAN FrontCoded_floor(CONST FrontCoded* store, CONST WCHAR* path, UINT32 length, FrontCodedMatch* match);
+    static BOOLEAN FrontCoded_find(CONST FrontCoded* store, CONST WCHAR* path, UINT32 length, UINT64* permissions);
+    static UINT64 FrontCoded_permission(CONST FrontCoded* store, CONST WCHAR* path, UINT32 length, UINT32* probes);
+
+#if defined(__cplusplus)
+}
+#endif
+
+static UINT32 FrontCoded_blockRules(CONST FrontCoded* store, UINT32 block) {
+    UINT32 first = block * FRONTCODED_BLOCK;
+    return store->ruleCount - first < FRONTCODED_BLOCK ? store->ruleCount - first : FRONTCODED_BLOCK;
+}
+
+/*
+ * FALSE if a block is out of bounds or a rule overflows its block. The order
+ * of the paths is not checked, a misordered store answers wrong but reads
+ * only its own data.
+ */
+BOOLEAN FrontCoded_open(FrontCoded* store, CONST UINT32* blocks, UINT32 blockCount, CONST WCHAR* data, UINT64 length, UINT32 ruleCount) {
+    Kmemset(store, 0, sizeof(FrontCoded));
+    if ((UINT64)blockCount * FRONTCODED_BLOCK < ruleCount || (blockCount > 0 && (UINT64)(blockCount - 1) * FRONTCODED_BLOCK >= ruleCount)) {
+        return FALSE;
+    }
+    store->blocks = blocks;
+    store->data = data;
+    store->length = length;
+    store->blockCount = blockCount;
+    store->ruleCount = ruleCount;
+
+    for (UINT32 block = 0; block < blockCount; block++) {
+        UINT64 position = blocks[block];
+        UINT64 end = block + 1 < blockCount ? blocks[block + 1] : length;
+        if (end > length || position >= end) {
+            return FALSE;
+        }
+
+        UINT32 previous = 0;
+        for (UINT32 rule = 0; rule < FrontCoded_blockRules(store, block); rule++) {
+            UINT32 header = rule == 0 ? 2 : 3;
+            if (position + header > end) {
+                return FALSE;
+            }
+            UINT32 shared = rule == 0 ? 0 : data[position + 1];
+            UINT32 suffix = data[position + header - 1];
+            if (shared > previous || position + header + suffix > end) {
+                return FALSE;
+            }
+            previous = shared + suffix;
+            position += header + suffix;
+        }
+        if (position != end) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Order of the first path of the block against the path, its common units in `*common`
+static INT32 FrontCoded_compareFirst(CONST FrontCoded* store, UINT32 block, CONST WCHAR* path, UINT32 length, UINT32* common) {
+    CONST WCHAR* first = &store->data[store->blocks[block] + 2];
+    UINT32 firstLength = store->data[store->blocks[block] + 1];
+    UINT32 i = 0;
+    while (i < firstLength && i < length && first[i] == path[i]) {
+        i++;
+    }
+    *common = i;
+    if (i == firstLength || i == length) {
+        return firstLength < length ? -1 : firstLength > length;
+    }
+    return first[i] < path[i] ? -1 : 1;
+}
+
+/*
+ * The greatest rule whose path is not after `path`, FALSE if every rule is.
+ * The paths of a block are compared against `path` as they are decoded:
+ * knowing how much of it the previous path matched is enough to order the
+ * next one.
+ */
+BOOLEAN FrontCoded_floor(CONST FrontCoded* store, CONST WCHAR* path, UINT32 length, FrontCodedMatch* match) {
+    UINT32 low = 0;
+    UINT32 high = store->blockCount;
+    UINT32 common = 0;
+
+    // last block starting at or before the path
+    while (low < high) {
+        UINT32 middle = low + (high - low) / 2;
+        if (FrontCoded_compareFirst(store, middle, path, length, &common) <= 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return FALSE;
+    }
+
+    UINT32 block = low - 1;
+    UINT64 position = store->blocks[block];
+    FrontCoded_compareFirst(store, block, path, length, &common);
+    match->permissions = store->data[position];
+    match->length = store->data[position + 1];
+    match->common = common;
+    position += 2 + (UINT64)match->length;
+
+    for (UINT32 rule = 1; rule < FrontCoded_blockRules(store, block); rule++) {
+        UINT32 permissions = store->data[position];
+        UINT32 shared = store->data[position + 1];
+        UINT32 suffixLength = store->data[position + 2];
+        CONST WCHAR* suffix = &store->data[position + 3];
+        position += 3 + (UINT64)suffixLength;
+
+        if (shared < match->common) {
+            // differs from the previous path where that one still matched: after the path
+            return TRUE;
+        }
+        if (shared == match->common) {
+            UINT32 i = 0;
+            while (i < suffixLength && shared + i < length && suffix[i] == path[shared + i]) {
+                i++;
+            }
+            if (i < suffixLength && (shared + i == length || suffix[i] > path[shared + i])) {
+                return TRUE;
+            }
+            common = shared + i;
+        }
+        else {
+            // same first difference with the path as the previous one
+            common = match->common;
+        }
+        match->permissions = permissions;
+        match->length = shared + suffixLength;
+        match->common = common;
+    }
+    return TRUE;
+}
+
+BOOLEAN FrontCoded_find(CONST FrontCoded* store, CONST WCHAR* path, UINT32 length, UINT64* permissions) {
+    FrontCodedMatch match;
+    if (!FrontCoded_floor(store, path, length, &match) || match.length != length || match.common != length) {
+        return FALSE;
+    }
+    *permissions = match.permissions;
+    return TRUE;
+}
+
+/*
+ * Permissions of the deepest rule on the path or one of its parent folders,
+ * 0 if none: the same rules as getFilePermission's walk. A rule on a parent
+ * folder sorts between it and the path, so it shares at least its own length
+ * with the floor of the path; the next search starts from there instead of
+ * the next parent. One probe per floor search.
+ */
+UINT64 FrontCoded_permission(CONST FrontCoded* store, CONST WCHAR* path, UINT32 length, UINT32* probes) {
+    while (length > 0) {
+        FrontCodedMatch match;
+        if (probes != NULL) {
+            *probes += 1;
+        }
+        if (!FrontCoded_floor(store, path, length, &match)) {
+            return 0;
+        }
+        if (match.common == match.length && (match.length == length || path[match.length] == '\\')) {
+            return match.permissions;
+        }
+
+        // the rule sought is no longer than the common part
+        length = match.common < length ? match.common : length - 1;
+        while (length > 0 && path[length] != '\\') {
+            length--;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Deferred frees for structures read without a lock.
+ *
+ * Readers enter a read section before following a pointer a writer may
+ * replace, and exit it once done with what it points to. A writer unpublishes
+ * the old memory first, then GracePeriod_synchronize waits for every section
+ * that could still have found it, and only then frees it. Sections must be
+ * short and must not sleep: the writer waits for them.
+ *
+ * Readers count themselves in a cache-line aligned slot of their CPU, in one
+ * of two counters picked by the parity of the epoch. Synchronizing flips the
+ * epoch and waits for the counters of the old parity to drain; sections that
+ * start after the flip count in the other ones and are not waited for. A
+ * thread may move to another CPU inside its section, which is why it exits
+ * on the counter it entered on, and why the counters are interlocked. The
+ * slots are fixed, CPUs past GRACE_PERIOD_SLOTS share them.
+ */
+
+#define GRACE_PERIOD_CACHE_LINE 64
+#define GRACE_PERIOD_SLOTS 64
+
+// spins on the readers before sleeping between checks
+#define GRACE_PERIOD_SPINS 64
+#define GRACE_PERIOD_SLEEP_MS 1
+
+typedef union gracePeriodSlot_u {
+    volatile LONG readers[2]; // by parity of the epoch they entered in
+    UCHAR pad[GRACE_PERIOD_CACHE_LINE];
+} gracePeriodSlot;
+
+typedef struct GracePeriod_s {
+    DECLSPEC_CACHEALIGN gracePeriodSlot slots[GRACE_PERIOD_SLOTS];
+    volatile LONG epoch;
+    EX_PUSH_LOCK lock; // writers, one epoch flip at a time
+} GracePeriod;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static VOID GracePeriod_init(GracePeriod* grace);
+    static volatile LONG* GracePeriod_enter(GracePeriod* grace);
+    static VOID GracePeriod_exit(volatile LONG* section);
+    static VOID GracePeriod_synchronize(GracePeriod* grace);
+    static VOID GracePeriod_destroy(GracePeriod* grace);
+
+#if defined(__cplusplus)
+}
+#endif
+
+VOID GracePeriod_init(GracePeriod* grace) {
+    Kmemset((PVOID)grace->slots, 0, sizeof(grace->slots));
+    grace->epoch = 0;
+    FltInitializePushLock(&grace->lock);
+}
+
+/*
+ * Starts a read section, returns what GracePeriod_exit ends it with. The
+ * epoch is read again once counted: a section counted in the old parity
+ * after a writer already flipped it could outlive that writer's wait.
+ */
+volatile LONG* GracePeriod_enter(GracePeriod* grace) {
+    gracePeriodSlot* slot = &grace->slots[KeGetCurrentProcessorNumberEx(NULL) % GRACE_PERIOD_SLOTS];
+
+    for (;;) {
+        LONG parity = ReadAcquire(&grace->epoch) & 1;
+        volatile LONG* section = &slot->readers[parity];
+        InterlockedIncrement(section);
+        if ((ReadAcquire(&grace->epoch) & 1) == parity) {
+            return section;
+        }
+        InterlockedDecrement(section);
+    }
+}
+
+VOID GracePeriod_exit(volatile LONG* section) {
+    InterlockedDecrement(section);
+}
+
+/*
+ * At PASSIVE_LEVEL, outside any read section. Returns once every section
+ * started before the call has ended.
+ */
+VOID GracePeriod_synchronize(GracePeriod* grace) {
+    FltAcquirePushLockExclusive(&grace->lock);
+    LONG parity = (InterlockedIncrement(&grace->epoch) - 1) & 1;
+
+    LARGE_INTEGER sleep;
+    sleep.QuadPart = -(LONGLONG)GRACE_PERIOD_SLEEP_MS * 10000;
+    for (UINT32 round = 0;; round++) {
+        LONG readers = 0;
+        for (UINT32 i = 0; i < GRACE_PERIOD_SLOTS; i++) {
+            readers += ReadAcquire(&grace->slots[i].readers[parity]);
+        }
+        if (readers == 0) {
+            break;
+        }
+
+        if (round < GRACE_PERIOD_SPINS) {
+            YieldProcessor();
+        }
+        else {
+            KeDelayExecutionThread(KernelMode, FALSE, &sleep);
+        }
+    }
+
+    FltReleasePushLock(&grace->lock);
+}
+
+// Once no reader is left
+VOID GracePeriod_destroy(GracePeriod* grace) {
+    FltDeletePushLock(&grace->lock);
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Heavy hitters of a sandbox: the paths its I/O goes to most, in fixed
+ * memory.
+ *
+ * Every CPU keeps a Space-Saving summary of HOTPATHS_ENTRIES path hashes in
+ * its own cache-line aligned slot. A path already in the summary is counted;
+ * a new one replaces the smallest count and inherits it as its error. A count
+ * overestimates by at most its error, and a path making more than
+ * 1/HOTPATHS_ENTRIES of the accesses of a CPU is never evicted. The tail of
+ * the path is kept for the controller.
+ *
+ * Threads still get preempted between picking their slot and updating it:
+ * the update is guarded by a busy flag, and a thread finding it taken drops
+ * its sample, counted, rather than wait. Readers merge the slots while they
+ * are updated, an entry read as it changes is off by that update.
+ */
+
+#define HOTPATHS_ENTRIES 32
+#define HOTPATHS_TAIL 32
+#define HOTPATHS_CACHE_LINE 64
+
+typedef struct hotPathsSummary_s {
+    UINT32 hashes[HOTPATHS_ENTRIES];
+    UINT64 counts[HOTPATHS_ENTRIES]; // 0 for a free entry
+    UINT64 errors[HOTPATHS_ENTRIES];
+    UINT8 tailLengths[HOTPATHS_ENTRIES];
+    WCHAR tails[HOTPATHS_ENTRIES][HOTPATHS_TAIL];
+    volatile LONG busy;
+    volatile LONG64 dropped;
+} hotPathsSummary;
+
+typedef union hotPathsSlot_u {
+    hotPathsSummary summary;
+    UCHAR pad[(sizeof(hotPathsSummary) + HOTPATHS_CACHE_LINE - 1) & ~(HOTPATHS_CACHE_LINE - 1)];
+} hotPathsSlot;
+
+typedef struct HotPaths_s {
+    ULONG cpuCount;
+    PVOID allocation;
+    hotPathsSlot* slots;
+} HotPaths;
+
+// A path of the merged summaries
+typedef struct HotPath_s {
+    UINT64 count;
+    UINT64 error;
+    UINT32 hash;
+    UINT8 tailLength;
+    WCHAR tail[HOTPATHS_TAIL];
+} HotPath;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static HotPaths* HotPaths_create();
+    static VOID HotPaths_record(HotPaths* hot, UINT32 hash, CONST WCHAR* path, UINT32 length);
+    static UINT32 HotPaths_top(HotPaths* hot, HotPath* top, UINT32 count, UINT64* dropped);
+    static VOID HotPaths_destroy(HotPaths* hot);
+
+#if defined(__cplusplus)
+}
+#endif
+
+HotPaths* HotPaths_create() {
+    HotPaths* hot = (HotPaths*)calloc(1, sizeof(HotPaths));
+    if (hot == NULL) {
+        return NULL;
+    }
+
+    hot->cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    hot->allocation = calloc(1, hot->cpuCount * sizeof(hotPathsSlot) + HOTPATHS_CACHE_LINE);
+    if (hot->allocation == NULL) {
+        free(hot);
+        return NULL;
+    }
+
+    hot->slots = (hotPathsSlot*)(((ULONG_PTR)hot->allocation + HOTPATHS_CACHE_LINE - 1) & ~((ULONG_PTR)HOTPATHS_CACHE_LINE - 1));
+    return hot;
+}
+
+// One access to the path. NULL summaries are allowed, as with ProcessStats
+VOID HotPaths_record(HotPaths* hot, UINT32 hash, CONST WCHAR* path, UINT32 length) {
+    if (hot == NULL) {
+        return;
+    }
+
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+    hotPathsSummary* summary = &hot->slots[cpu < hot->cpuCount ? cpu : cpu % hot->cpuCount].summary;
+    if (InterlockedCompareExchange(&summary->busy, 1, 0) != 0) {
+        InterlockedIncrement64(&summary->dropped);
+        return;
+    }
+
+    // a free entry has a count of 0 and never a hash match that counts
+    for (UINT32 i = 0; i < HOTPATHS_ENTRIES; i++) {
+        if (summary->hashes[i] == hash && summary->counts[i] != 0) {
+            summary->counts[i]++;
+            InterlockedExchange(&summary->busy, 0);
+            return;
+        }
+    }
+
+    // free entries count 0, the smallest is one of them while there are some
+    UINT32 smallest = 0;
+    for (UINT32 i = 1; i < HOTPATHS_ENTRIES; i++) {
+        if (summary->counts[i] < summary->counts[smallest]) {
+            smallest = i;
+        }
+    }
+
+    UINT32 tail = length < HOTPATHS_TAIL ? length : HOTPATHS_TAIL;
+    summary->errors[smallest] = summary->counts[smallest];
+    summary->counts[smallest]++;
+    summary->hashes[smallest] = hash;
+    summary->tailLengths[smallest] = (UINT8)tail;
+    Kmemcpy(summary->tails[smallest], (PVOID)(path + length - tail), tail * sizeof(WCHAR));
+    InterlockedExchange(&summary->busy, 0);
+}
+
+/*
+ * The summaries of every CPU added up by hash, the `count` largest in `top`
+ * in decreasing order. Returns how many were written, 0 if out of memory.
+ */
+UINT32 HotPaths_top(HotPaths* hot, HotPath* top, UINT32 count, UINT64* dropped) {
+    *dropped = 0;
+    if (hot == NULL) {
+        return 0;
+    }
+
+    HotPath* merged = (HotPath*)calloc((SIZE_T)hot->cpuCount * HOTPATHS_ENTRIES, sizeof(HotPath));
+    if (merged == NULL) {
+        return 0;
+    }
+
+    UINT32 mergedCount = 0;
+    for (ULONG cpu = 0; cpu < hot->cpuCount; cpu++) {
+        hotPathsSummary* summary = &hot->slots[cpu].summary;
+        *dropped += (UINT64)ReadNoFence64(&summary->dropped);
+
+        for (UINT32 i = 0; i < HOTPATHS_ENTRIES; i++) {
+            UINT64 entryCount = summary->counts[i];
+            if (entryCount == 0) {
+                continue;
+            }
+
+            UINT32 m = 0;
+            while (m < mergedCount && merged[m].hash != summary->hashes[i]) {
+                m++;
+            }
+            if (m == mergedCount) {
+                UINT8 tail = summary->tailLengths[i] <= HOTPATHS_TAIL ? summary->tailLengths[i] : HOTPATHS_TAIL;
+                merged[m].hash = summary->hashes[i];
+                merged[m].tailLength = tail;
+                Kmemcpy(merged[m].tail, summary->tails[i], tail * sizeof(WCHAR));
+                mergedCount++;
+            }
+            merged[m].count += entryCount;
+            merged[m].error += summary->errors[i];
+        }
+    }
+
+    // a partial selection sort, count is small
+    UINT32 written = 0;
+    for (; written < count && written < mergedCount; written++) {
+        UINT32 largest = written;
+        for (UINT32 m = written + 1; m < mergedCount; m++) {
+            if (merged[m].count > merged[largest].count) {
+                largest = m;
+            }
+        }
+        top[written] = merged[largest];
+        merged[largest] = merged[written];
+    }
+
+    free(merged);
+    return written;
+}
+
+VOID HotPaths_destroy(HotPaths* hot) {
+    if (hot != NULL) {
+        free(hot->allocation);
+        free(hot);
+    }
+}
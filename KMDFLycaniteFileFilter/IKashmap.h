@@ -37,6 +37,14 @@ typedef any_t map_t;
 
 #define INITIAL_SIZE 1024
 
+/*
+ * Slot states. Removed slots become tombstones so the probe sequences going
+ * through them stay intact; lookups stop at the first empty slot.
+ */
+#define IHASHMAP_EMPTY 0
+#define IHASHMAP_USED 1
+#define IHASHMAP_DELETED 2
+
 // We need to keep keys and values
 typedef struct _hashmap_element {
     UINT64 key;
@@ -45,10 +53,11 @@ typedef struct _hashmap_element {
 } hashmap_element;
 
 // A hashmap has some maximum size and current size,
-// as well as the data to hold.
+// as well as the data to hold. The table size is always a power of two.
 typedef struct _hashmap_map {
     INT table_size;
     INT size;
+    INT deleted;
     hashmap_element* data;
 } hashmap_map;
 
@@ -73,7 +82,8 @@ extern "C" {
     static UINT64 ihashmap_hash(map_t in, UINT64 key, CODE* error_set);
 
     /*
-     * Doubles the size of the hashmap, and rehashes all the elements
+     * Rebuilds the table without its tombstones, doubling it when it is
+     * more than half full
      */
     static CODE ihashmap_rehash(map_t in);
 
@@ -126,6 +136,7 @@ map_t ihashmap_new() {
 
     map->table_size = INITIAL_SIZE;
     map->size = 0;
+    map->deleted = 0;
 
     return map;
 err:
@@ -145,15 +156,19 @@ UINT64 ihashmap_hash_int(hashmap_map* map, UINT64 key) {
     key = (key + (key << 2)) + (key << 4); // key * 21
     key = key ^ (key >> 28);
     key = key + (key << 31);
-    return key % map->table_size;
+    return key & (map->table_size - 1);
 }
 
 /*
  * Return the integer of the location in data
  * to store the point to the item, or MAP_FULL.
+ * That's the slot of the key if it is in the map, otherwise the first
+ * tombstone or empty slot of its probe sequence.
  */
 UINT64 ihashmap_hash(map_t in, UINT64 key, CODE* error_set) {
     UINT64 curr;
+    UINT64 free_slot;
+    INT found_free = 0;
     INT i;
 
     if (error_set != NULL)
@@ -162,44 +177,49 @@ UINT64 ihashmap_hash(map_t in, UINT64 key, CODE* error_set) {
     /* Cast the hashmap */
     hashmap_map* map = (hashmap_map*)in;
 
-    /* If full, return immediately */
-    if (map->size == map->table_size) {
-        if (error_set != NULL)
-            *error_set = MAP_FULL;
-        return 0;
-    }
-
     /* Find the best index */
     curr = ihashmap_hash_int(map, key);
+    free_slot = curr;
 
     /* Linear probling */
     for (i = 0; i < map->table_size; i++) {
-        if (map->data[curr].in_use == 0)
-            return curr;
+        if (map->data[curr].in_use == IHASHMAP_EMPTY)
+            return found_free ? free_slot : curr;
 
-        if (map->data[curr].key == key && map->data[curr].in_use == 1)
+        if (map->data[curr].in_use == IHASHMAP_USED && map->data[curr].key == key)
             return curr;
 
-        curr = (curr + 1) % map->table_size;
+        if (map->data[curr].in_use == IHASHMAP_DELETED && !found_free) {
+            free_slot = curr;
+            found_free = 1;
+        }
+
+        curr = (curr + 1) & (map->table_size - 1);
     }
 
+    if (found_free)
+        return free_slot;
+
     if (error_set != NULL)
         *error_set = MAP_FULL;
     return 0;
 }
 
 /*
- * Doubles the size of the hashmap, and rehashes all the elements
+ * Rebuilds the table without its tombstones, doubling it when it is
+ * more than half full
  */
 CODE ihashmap_rehash(map_t in) {
     INT i;
     INT old_size;
+    INT new_size;
     hashmap_element* curr;
 
     /* Setup the new elements */
     hashmap_map* map = (hashmap_map*)in;
+    new_size = (map->size + 1) * 2 > map->table_size ? 2 * map->table_size : map->table_size;
     hashmap_element* temp = (hashmap_element*)
-        calloc(2 * map->table_size, sizeof(hashmap_element));
+        calloc(new_size, sizeof(hashmap_element));
     if (!temp) return MAP_OMEM;
 
     /* Update the array */
@@ -208,14 +228,17 @@ CODE ihashmap_rehash(map_t in) {
 
     /* Update the size */
     old_size = map->table_size;
-    map->table_size = 2 * map->table_size;
-    map->size = 0;
+    map->table_size = new_size;
+    map->deleted = 0;
 
-    /* Rehash the elements */
+    /* Rehash the elements, keys are unique and there are no tombstones yet */
     for (i = 0; i < old_size; i++) {
-        CODE status = ihashmap_put(map, curr[i].key, curr[i].data);
-        if (status != MAP_OK)
-            return status;
+        if (curr[i].in_use == IHASHMAP_USED) {
+            UINT64 index = ihashmap_hash_int(map, curr[i].key);
+            while (temp[index].in_use != IHASHMAP_EMPTY)
+                index = (index + 1) & (new_size - 1);
+            temp[index] = curr[i];
+        }
     }
 
     free(curr);
@@ -234,20 +257,30 @@ CODE ihashmap_put(map_t in, UINT64 key, any_t value) {
     /* Cast the hashmap */
     map = (hashmap_map*)in;
 
-    /* Find a place to put our value */
-    index = ihashmap_hash(in, key, &status);
-    while (status == MAP_FULL) {
+    /* Keep a quarter of the slots empty so misses stop early */
+    if ((map->size + map->deleted + 1) * 4 > map->table_size * 3) {
         if (ihashmap_rehash(in) == MAP_OMEM) {
             return MAP_OMEM;
         }
-        index = ihashmap_hash(in, key, &status);
+    }
+
+    /* Find a place to put our value */
+    index = ihashmap_hash(in, key, &status);
+    if (status != MAP_OK) {
+        return status;
+    }
+
+    /* Updating a key doesn't change the size */
+    if (map->data[index].in_use != IHASHMAP_USED) {
+        if (map->data[index].in_use == IHASHMAP_DELETED)
+            map->deleted--;
+        map->size++;
     }
 
     /* Set the data */
     map->data[index].data = value;
     map->data[index].key = key;
-    map->data[index].in_use = 1;
-    map->size++;
+    map->data[index].in_use = IHASHMAP_USED;
 
     return MAP_OK;
 }
@@ -267,16 +300,16 @@ CODE ihashmap_get(map_t in, UINT64 key, any_t* arg) {
     curr = ihashmap_hash_int(map, key);
 
     /* Linear probing, if necessary */
-    for (i = 0; i < map->table_size; i++) {
+    for (i = 0; i < map->table_size && map->data[curr].in_use != IHASHMAP_EMPTY; i++) {
 
-        if (map->data[curr].key == key && map->data[curr].in_use == 1) {
+        if (map->data[curr].key == key && map->data[curr].in_use == IHASHMAP_USED) {
             if (arg != NULL) {
                 *arg = (PINT32)(map->data[curr].data);
             }
             return MAP_OK;
         }
 
-        curr = (curr + 1) % map->table_size;
+        curr = (curr + 1) & (map->table_size - 1);
     }
 
     if (arg != NULL) {
@@ -303,10 +336,11 @@ CODE ihashmap_get_one(map_t in, any_t* arg, INT remove) {
 
     /* Linear probing */
     for (i = 0; i < map->table_size; i++)
-        if (map->data[i].in_use != 0) {
+        if (map->data[i].in_use == IHASHMAP_USED) {
             *arg = (any_t)(map->data[i].data);
             if (remove) {
-                map->data[i].in_use = 0;
+                map->data[i].in_use = IHASHMAP_DELETED;
+                map->deleted++;
                 map->size--;
             }
             return MAP_OK;
@@ -332,7 +366,7 @@ CODE ihashmap_iterate(map_t in, PFany f, any_t item) {
 
     /* Linear probing */
     for (i = 0; i < map->table_size; i++)
-        if (map->data[i].in_use != 0) {
+        if (map->data[i].in_use == IHASHMAP_USED) {
             any_t data = (any_t)(map->data[i].data);
             INT status = f(item, data);
             if (status != MAP_OK) {
@@ -358,13 +392,19 @@ CODE ihashmap_remove(map_t in, UINT64 key, any_t* data_removed) {
     curr = ihashmap_hash_int(map, key);
 
     /* Linear probing, if necessary */
-    for (i = 0; i < map->table_size; i++) {
-        if (map->data[curr].key == key && map->data[curr].in_use == 1) {
+    for (i = 0; i < map->table_size && map->data[curr].in_use != IHASHMAP_EMPTY; i++) {
+        if (map->data[curr].key == key && map->data[curr].in_use == IHASHMAP_USED) {
             if (data_removed != NULL) {
                 *data_removed = map->data[curr].data;
             }
-            /* Blank out the fields */
-            map->data[curr].in_use = 0;
+            /* Blank out the fields, no probe sequence goes on past an empty slot */
+            if (map->data[(curr + 1) & (map->table_size - 1)].in_use == IHASHMAP_EMPTY) {
+                map->data[curr].in_use = IHASHMAP_EMPTY;
+            }
+            else {
+                map->data[curr].in_use = IHASHMAP_DELETED;
+                map->deleted++;
+            }
             map->data[curr].data = NULL;
             map->data[curr].key = 0;
 
@@ -372,7 +412,7 @@ CODE ihashmap_remove(map_t in, UINT64 key, any_t* data_removed) {
             map->size--;
             return MAP_OK;
         }
-        curr = (curr + 1) % map->table_size;
+        curr = (curr + 1) & (map->table_size - 1);
     }
 
     /* Data not found */
@@ -392,4 +432,4 @@ INT ihashmap_length(map_t in) {
     else return 0;
 }
 
-#endif __HASHMAP_H__
+#endif // __HASHMAP_H__
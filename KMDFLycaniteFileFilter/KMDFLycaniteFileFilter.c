@@ -8,29 +8,28 @@
 
 PFLT_FILTER gFilterInstance = NULL;
 PFLT_PORT port = NULL;
-PFLT_PORT clientPort = NULL;
 
 typedef hashmap_map ihashmap;
 
 const FLT_OPERATION_REGISTRATION Callbacks[] = {
     { IRP_MJ_CREATE, // Filter Action Name
       0,
-      AvPreCreate,  // Pointer to the function to execute before the action is executed
+      LYCANITE_PRE_OPERATION(AvPreCreate),  // Pointer to the function to execute before the action is executed
       NULL },       // Pointer to the function to execute after the action is executed
 
     { IRP_MJ_WRITE,
       0,
-      AvPreWrite,
-      NULL },
+      LYCANITE_PRE_OPERATION(AvPreWrite),
+      AvPostWrite },
 
       { IRP_MJ_READ,
       0,
-      AvPreRead,
+      LYCANITE_PRE_OPERATION(AvPreRead),
       NULL },
 
       { IRP_MJ_SET_INFORMATION,
       0,
-      AvPreSetInformation,
+      LYCANITE_PRE_OPERATION(AvPreSetInformation),
       NULL },
 
     { IRP_MJ_OPERATION_END }
@@ -62,13 +61,73 @@ const FLT_REGISTRATION FilterRegistration = {
 
 };
 
-ihashmap *ProcessesInfos = NULL;
-ihashmap* Processes = NULL;
+ProcessTree processTree; // sandboxed processes
+
+VolumeRules globalPerm;
+EX_PUSH_LOCK globalPermLock; // writers
+
+// expiries of the global timed rules, under globalPermLock
+TimerWheel globalTimers;
+struct hashmap_s* globalTimed = NULL; // path -> timedRule
+
+// timed rules armed in every wheel, the event worker skips expiry while there are none
+volatile LONG timedRules = 0;
+
+// sealed sandbox rules, by content
+RuleSets ruleSets;
+EX_PUSH_LOCK ruleSetsLock;
+
+// global and sandbox rules read lock-free by the checks, freed once they are done with them
+GracePeriod rulesGrace;
+
+// global rules compiled offline, read-only from DriverEntry to unload
+PVOID policyImage = NULL;
+PolicySnapshot policySnapshot;
+
+// a slot per connection, each owning its sandboxes
+controllerInfos controllers[LYCANITE_MAX_CONTROLLERS];
+EX_PUSH_LOCK controllersLock; // connects and disconnects
+controllerInfos* primaryController = NULL; // the only one setting global rules and capturing, under controllersLock
+volatile LONG registeredControllers = 0; // slots with a pid set
 
-struct hashmap_s globalPerm;
+PVOID eventWorkerThread = NULL;
+KEVENT eventWorkerWake;
+volatile LONG eventWorkerStop = 0;
+unsigned char* eventBatch = NULL;
+volatile LONG64 eventsSent = 0;
+volatile LONG64 eventsFailed = 0;
 
-UINT64 LPID = 0; // Lycanite PID
-UUIDRecycler* uuidRecycler = NULL;
+DenialTable* denials = NULL;
+
+#ifdef LYCANITE_LATENCY
+LatencyHistogram* latencies = NULL; // [cpu][callback][stage]
+ULONG latencyCpuCount = 0;
+UINT64 latencyFrequency = 0;
+#endif
+
+#ifdef LYCANITE_TRACE
+TraceBuffer* traceBuffer = NULL;
+#endif
+
+// allocated by the first SET_CAPTURE, kept until unload
+DecisionCapture* capture = NULL;
+volatile LONG captureEnabled = 0;
+EX_PUSH_LOCK captureLock; // SET_CAPTURE from several controllers
+
+// serializes the process notify routine, owns the sandbox pool
+EX_PUSH_LOCK processesLock;
+processInfos* sandboxPool = NULL;
+UINT32 sandboxPoolCount = 0;
+
+// sandboxes given an I/O budget, reads and writes skip the throttle while there are none
+volatile LONG budgetedSandboxes = 0;
+
+// sandboxes accounting their writes, writes skip the quota while there are none
+volatile LONG quotaSandboxes = 0;
+
+// closed sandboxes, freed by the event worker
+ReclaimQueue reclaimQueue;
+ReclaimEntry* reclaiming = NULL; // taken by the worker, oldest first
 
 
 
@@ -92,12 +151,185 @@ UINT8 ulong2chr(UINT64 value, char* str) {
     return pos;
 }
 
-UINT8 isRestricted(PFLT_CALLBACK_DATA Data, PFLT_FILE_NAME_INFORMATION filenameInfo, UINT64 permissions) {
+#ifdef LYCANITE_LATENCY
+UINT64 latencyNow() {
+    return (UINT64)KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+UINT8 latencyCallback(PFLT_CALLBACK_DATA Data) {
+    switch (Data->Iopb->MajorFunction) {
+    case IRP_MJ_READ:
+        return LATENCY_READ;
+    case IRP_MJ_WRITE:
+        return LATENCY_WRITE;
+    case IRP_MJ_SET_INFORMATION:
+        return LATENCY_SET_INFORMATION;
+    }
+    return LATENCY_CREATE;
+}
+
+VOID latencyRecord(PFLT_CALLBACK_DATA Data, UINT8 stage, UINT64 start) {
+    if (latencies != NULL) {
+        UINT64 elapsed = (latencyNow() - start) * 1000000000ull / latencyFrequency;
+        ULONG cpu = KeGetCurrentProcessorNumberEx(NULL) % latencyCpuCount;
+        LatencyHistogram_record(&latencies[(cpu * LATENCY_CALLBACKS + latencyCallback(Data)) * LATENCY_STAGES + stage], elapsed);
+    }
+}
+#endif
+
+// Permission bit to its ProcessStats counter index
+UINT8 statsOperation(UINT64 permissions) {
+    if (permissions & LYCANITE_READ) {
+        return STATS_READ;
+    }
+    if (permissions & LYCANITE_DELETE) {
+        return STATS_DELETE;
+    }
+    return STATS_WRITE;
+}
+
+VOID countCheck(processInfos* pinfo, UINT64 permissions, UINT8 restricted, UINT32 probes) {
+    processStatsCounters* counters = ProcessStats_local(pinfo->stats);
+    if (counters != NULL) {
+        UINT8 op = statsOperation(permissions);
+        InterlockedIncrement64(&counters->checks[op]);
+        InterlockedIncrement64(restricted ? &counters->denies[op] : &counters->allows[op]);
+        if (probes != 0) {
+            InterlockedExchangeAdd64(&counters->lookupProbes, probes);
+        }
+    }
+}
+
+// The sandbox of the process behind an operation, NULL for none. Looked up once per callback
+processInfos* requestorSandbox(PFLT_CALLBACK_DATA Data) {
+    LATENCY_START(lookup);
+    processInfos* pinfo = processSandbox(FltGetRequestorProcessId(Data));
+    LATENCY_RECORD(Data, LATENCY_PROCESS_LOOKUP, lookup);
+    return pinfo;
+}
+
+VOID countNameQueryFailure(processInfos* pinfo) {
+    if (pinfo != NULL) {
+        processStatsCounters* counters = ProcessStats_local(pinfo->stats);
+        if (counters != NULL) {
+            InterlockedIncrement64(&counters->nameQueryFailures);
+        }
+    }
+}
+
+/*
+ * Spends the operation and its bytes, nothing if one of the two is over
+ * budget; TRUE if the sandbox has no budget (any more). The budget is only
+ * followed in a read section, recycling the sandbox frees it.
+ */
+BOOLEAN acquireBudget(processInfos* pinfo, UINT8 opsBucket, UINT64 bytes, LONG64 now) {
+    volatile LONG* section = GracePeriod_enter(&rulesGrace);
+    ioBudget* budget = (ioBudget*)ReadPointerAcquire((PVOID volatile*)&pinfo->budget);
+    BOOLEAN acquired = TRUE;
+    if (budget != NULL && !TokenBucket_acquire(&budget->buckets[opsBucket], 1, now)) {
+        acquired = FALSE;
+    }
+    else if (budget != NULL && !TokenBucket_acquire(&budget->buckets[opsBucket + 1], bytes, now)) {
+        TokenBucket_release(&budget->buckets[opsBucket], 1);
+        acquired = FALSE;
+    }
+    GracePeriod_exit(section);
+    return acquired;
+}
+
+/*
+ * Holds a read or write of a sandbox over its I/O budget back until the
+ * budget refills. FALSE if it still is after LYCANITE_THROTTLE_MAX_WAIT_MS,
+ * or right away where the thread can't wait. Paging I/O is never held: the
+ * memory manager may be waiting on it. No read section is held while it
+ * waits, every try follows the budget again.
+ */
+BOOLEAN throttleIo(PFLT_CALLBACK_DATA Data, processInfos* pinfo, UINT8 opsBucket, UINT64 bytes) {
+    if (pinfo == NULL || ReadNoFence(&budgetedSandboxes) == 0 || (Data->Iopb->IrpFlags & IRP_PAGING_IO)) {
+        return TRUE;
+    }
+
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+    if (acquireBudget(pinfo, opsBucket, bytes, now)) {
+        return TRUE;
+    }
+
+    processStatsCounters* counters = ProcessStats_local(pinfo->stats);
+    if (counters != NULL) {
+        InterlockedIncrement64(&counters->throttled);
+    }
+
+    LONG64 deadline = now + (LONG64)LYCANITE_THROTTLE_MAX_WAIT_MS * 10000;
+    BOOLEAN acquired = FALSE;
+    if (KeGetCurrentIrql() <= APC_LEVEL) {
+        LARGE_INTEGER step;
+        step.QuadPart = -(LONGLONG)LYCANITE_THROTTLE_STEP_MS * 10000;
+        do {
+            KeDelayExecutionThread(KernelMode, FALSE, &step);
+            now = (LONG64)KeQueryInterruptTime();
+            acquired = acquireBudget(pinfo, opsBucket, bytes, now);
+        } while (!acquired && now < deadline);
+    }
+
+    if (!acquired && counters != NULL) {
+        InterlockedIncrement64(&counters->throttleFailures);
+    }
+    return acquired;
+}
+
+/*
+ * Accounts a write to its sandbox's write quota, FALSE if it would go over.
+ * Paging writes aren't: they flush cached writes already accounted, or
+ * mapped pages the memory manager can't be refused. `charged` gets the quota
+ * the bytes went to, referenced for refundWriteQuota, NULL if none did.
+ */
+BOOLEAN chargeWriteQuota(PFLT_CALLBACK_DATA Data, processInfos* pinfo, UINT64 bytes, WriteQuota** charged) {
+    *charged = NULL;
+    if (pinfo == NULL || bytes == 0 || ReadNoFence(&quotaSandboxes) == 0 || (Data->Iopb->IrpFlags & IRP_PAGING_IO)) {
+        return TRUE;
+    }
+
+    volatile LONG* section = GracePeriod_enter(&rulesGrace);
+    WriteQuota* quota = (WriteQuota*)ReadPointerAcquire((PVOID volatile*)&pinfo->writeQuota);
+    BOOLEAN allowed = quota == NULL || WriteQuota_charge(quota, bytes);
+    if (quota != NULL && allowed) {
+        WriteQuota_reference(quota);
+        *charged = quota;
+    }
+    GracePeriod_exit(section);
+    return allowed;
+}
+
+// Gives back the bytes of a charged write it didn't write, and its reference
+VOID refundWriteQuota(WriteQuota* quota, UINT64 bytes) {
+    WriteQuota_refund(quota, bytes);
+    WriteQuota_release(quota);
+}
+
+// The rules of one sandbox, ignoring the ones enclosing it
+UINT8 sandboxRestricts(processInfos* pinfo, CONST WCHAR* filename, UINT32 len, UINT64 permissions, UINT32* probes) {
+    // a sandbox being sealed has every rule in its new base, published before the flag
+    struct hashmap_s* rules = ReadAcquire(&pinfo->sealing) ? NULL :
+        (struct hashmap_s*)ReadPointerAcquire((PVOID volatile*)&pinfo->permissions);
+    RuleSet* base = (RuleSet*)ReadPointerAcquire((PVOID volatile*)&pinfo->base);
+    UINT64 perm = RuleSet_permission(rules, base, filename, len, probes);
+    UINT8 restricted = PermFlag(perm, permissions);
+
+    if (restricted && ReadNoFence(&pinfo->learning)) {
+        // let through, and learned on top of what the rules grant
+        UINT64 own = 0;
+        LearnedRules_record(pinfo->learned, filename, len, (UINT8)(perm | permissions),
+            RuleSet_find(rules, base, filename, len, &own));
+        restricted = 0;
+    }
+    return restricted;
+}
+
+UINT8 isRestricted(PFLT_CALLBACK_DATA Data, processInfos* pinfo, PFLT_FILE_NAME_INFORMATION filenameInfo, UINT64 permissions) {
     
     UINT64 processId = FltGetRequestorProcessId(Data);
 
-    processInfos* pinfo = NULL;
-    if (ihashmap_get(Processes, processId, (any_t*)&pinfo) == MAP_OK) {
+    if (pinfo != NULL) {
         UINT64 len = filenameInfo->Name.Length / sizeof(WCHAR);
         PWCHAR filename = (PWCHAR)calloc(len + 1, sizeof(WCHAR));
         if (filename != NULL) {
@@ -105,23 +337,133 @@ UINT8 isRestricted(PFLT_CALLBACK_DATA Data, PFLT_FILE_NAME_INFORMATION filenameI
             
             RtlCopyMemory(filename, filenameInfo->Name.Buffer, filenameInfo->Name.Length);
 
-            UINT64 gperm = getFilePermission(filename, &globalPerm);
+            UINT8 restricted;
+            processInfos* denying = pinfo;
+            UINT32 probes = 0;
+            UINT32 pathHash = hashPath(filename, (UINT32)len);
+            LATENCY_START(policy);
+            // the volume as the filter manager parsed it, rules are partitioned the same way
+            UINT32 volume = filenameInfo->Volume.Length != 0 && filenameInfo->Volume.Length <= filenameInfo->Name.Length ?
+                filenameInfo->Volume.Length / sizeof(WCHAR) : VolumeRules_volumeLength(filename, (UINT32)len);
+            volatile LONG* section = GracePeriod_enter(&rulesGrace);
+            UINT64 gperm = VolumeRules_permission(&globalPerm, filename, (UINT32)len, volume, &probes);
+            if (gperm == 0 && policyImage != NULL) {
+                gperm = PolicySnapshot_permission(&policySnapshot, filename, (UINT32)len, &probes);
+            }
             if (gperm == 0) {
-                UINT64 perm = getFilePermission(filename, &pinfo->permissions);
-                KdPrint(("Check %llu: [%llu: %d] %ws", processId, permissions, PermFlag(perm, permissions), filename));
-                free(filename);
-                return PermFlag(perm, permissions);
+                // a nested sandbox can't grant more than the ones enclosing it
+                restricted = 0;
+                for (processInfos* sandbox = pinfo; sandbox != NULL && !restricted; sandbox = sandbox->enclosing) {
+                    restricted = sandboxRestricts(sandbox, filename, (UINT32)len, permissions, &probes);
+                    denying = sandbox;
+                }
+                LYCANITE_TRACEPOINT(TRACE_CHECK, processId, permissions | ((UINT64)restricted << 32), pathHash);
+            }
+            else {
+                restricted = PermFlag(gperm, permissions);
+                LYCANITE_TRACEPOINT(TRACE_CHECK_GLOBAL, processId, permissions | ((UINT64)restricted << 32), pathHash);
+            }
+            LATENCY_RECORD(Data, LATENCY_POLICY, policy);
 
+            countCheck(restricted ? denying : pinfo, permissions, restricted, probes);
+            HotPaths_record((HotPaths*)ReadPointerAcquire((PVOID volatile*)&pinfo->hotPaths), pathHash, filename, (UINT32)len);
+            GracePeriod_exit(section);
+            if (ReadNoFence(&captureEnabled)) {
+                DecisionCapture_decision(capture, processId, (UINT8)permissions, restricted, filename, (UINT32)len);
+            }
+            if (restricted) {
+                DenialTable_record(denials, denying->uuid, (UINT8)permissions, pathHash, filename, (UINT32)len, (LONG64)KeQueryInterruptTime());
             }
-            KdPrint(("Check Global %llu: [%llu: %d] %ws", processId, permissions, PermFlag(gperm, permissions), filename));
             free(filename);
-            return PermFlag(gperm, permissions);
+            return restricted;
         }
+        countCheck(pinfo, permissions, 1, 0);
         return 1;
     }
     return 0;
 }
 
+VOID writeUINT64(unsigned char* buffer, UINT64 value) {
+    for (UINT8 i = 0; i < 8; i++) {
+        buffer[i] = (unsigned char)((value >> (i * 8)) & 0xFF);
+    }
+}
+
+VOID writeUINT32(unsigned char* buffer, UINT32 value) {
+    for (UINT8 i = 0; i < 4; i++) {
+        buffer[i] = (unsigned char)((value >> (i * 8)) & 0xFF);
+    }
+}
+
+UINT64 readUINT64(CONST unsigned char* buffer) {
+    UINT64 value = 0;
+    for (UINT8 i = 0; i < 8; i++) {
+        value |= (((UINT64)buffer[i]) & 0xFF) << (i * 8);
+    }
+    return value;
+}
+
+UINT32 readUINT32(CONST unsigned char* buffer) {
+    UINT32 value = 0;
+    for (UINT8 i = 0; i < 4; i++) {
+        value |= (((UINT32)buffer[i]) & 0xFF) << (i * 8);
+    }
+    return value;
+}
+
+// Returns the number of bytes written, the wire format is the one the controller parses
+ULONG serializeEvent(CONST lycaniteEvent* event, unsigned char* buffer) {
+    buffer[0] = event->type;
+
+    switch (event->type) {
+    case PROCESS_CREATE:
+        writeUINT64(buffer + 1, event->processId);
+        writeUINT64(buffer + 9, event->uuid);
+        return 17;
+    case PROCESS_DESTROY:
+        writeUINT64(buffer + 1, event->uuid);
+        return 9;
+    case PROCESS_REQPERM:
+        writeUINT64(buffer + 1, event->uuid);
+        buffer[9] = event->operation;
+        writeUINT32(buffer + 10, event->pathHash);
+        writeUINT32(buffer + 14, event->count);
+        buffer[18] = event->tailLength;
+        for (UINT8 i = 0; i < event->tailLength; i++) {
+            buffer[19 + i * 2] = (unsigned char)(event->tail[i] & 0xFF);
+            buffer[20 + i * 2] = (unsigned char)((event->tail[i] >> 8) & 0xFF);
+        }
+        return 19 + event->tailLength * sizeof(WCHAR);
+    case EVENTS_LOST:
+        writeUINT64(buffer + 1, event->processId);
+        return 9;
+    }
+    return 0;
+}
+
+// To the controller owning the sandbox
+VOID pushEvent(CONST lycaniteEvent* event) {
+    EventQueue* queue = controllerOf(event->uuid)->events;
+
+    if (EventQueue_push(queue, event) && EventQueue_claimWakeup(queue)) {
+        KeSetEvent(&eventWorkerWake, 0, FALSE);
+    }
+}
+
+VOID queueEvent(UINT8 type, UINT64 processId, UINT64 uuid) {
+    lycaniteEvent event;
+    event.type = type;
+    event.processId = processId;
+    event.uuid = uuid;
+    pushEvent(&event);
+}
+
+// Emitted by the denial table, possibly at DISPATCH_LEVEL
+VOID queueDenial(lycaniteEvent* event) {
+    event->type = PROCESS_REQPERM;
+    pushEvent(event);
+}
+
 INT8 cleanupHashmap(PVOID const context, struct hashmap_element_s * const e) {
     UNREFERENCED_PARAMETER(context);
 
@@ -132,607 +474,2682 @@ INT8 cleanupHashmap(PVOID const context, struct hashmap_element_s * const e) {
 
 INT cleanIHashmap(any_t item, any_t data) {
     UNREFERENCED_PARAMETER(item);
-    processInfos* pinfo = (processInfos*)data;
-    if (0 != hashmap_iterate_pairs(&pinfo->permissions, cleanupHashmap, NULL)) {
-        KdPrint(("%s\n", "failed to deallocate hashmap entries\n"));
-    }
-    hashmap_destroy(&pinfo->permissions);
-    free(data);
+    destroySandbox((processInfos*)data);
     return MAP_OK;
 }
 
 /* ======================================================
-*                       Main
+*                       Sandboxes
 *  ======================================================*/
 
-// Entry Point of the Driver
-NTSTATUS
-DriverEntry(
-    _In_ PDRIVER_OBJECT DriverObject,
-    _In_ PUNICODE_STRING RegistryPath
-) {
-    NTSTATUS status;
-    PSECURITY_DESCRIPTOR securityDescriptor;
-    OBJECT_ATTRIBUTES objectAttributes = { 0 };
-    UNICODE_STRING name = RTL_CONSTANT_STRING(L"\\LycaniteFF");
+processInfos* createSandbox() {
+    processInfos* pinfo = (processInfos*)calloc(1, sizeof(processInfos));
 
-    uuidRecycler = UUIDRecycler_create(16);
+    if (pinfo == NULL) {
+        return NULL;
+    }
 
-    if (uuidRecycler == NULL) {
-        KdPrint(("%s", "Failed to alloc UUIDRecycler"));
-        return STATUS_ABANDONED;
+    pinfo->permissions = (struct hashmap_s*)malloc(sizeof(struct hashmap_s));
+    if (pinfo->permissions == NULL || hashmap_create(8, pinfo->permissions)) { // Failed to alloc hashmap
+        free(pinfo->permissions);
+        free(pinfo);
+        return NULL;
     }
 
-    ProcessesInfos = (ihashmap*)ihashmap_new();
-    if (ProcessesInfos == NULL) {
-        KdPrint(("%s", "Failed to alloc ProcessesInfos map"));
-        return STATUS_ABANDONED;
+    // the sandbox works without its counters
+    pinfo->stats = ProcessStats_create();
+    return pinfo;
+}
+
+// A private rule table no check can be reading anymore, with its tombstones
+VOID freeSandboxRules(struct hashmap_s* rules) {
+    if (0 != hashmap_iterate_pairs(rules, cleanupHashmap, NULL)) {
+        KdPrint(("%s\n", "failed to deallocate hashmap entries\n"));
     }
+    hashmap_iterate_removed(rules, cleanupHashmap, NULL);
+    hashmap_destroy(rules);
+    free(rules);
+}
 
-    Processes = (ihashmap*)ihashmap_new();
-    if (Processes == NULL) {
-        KdPrint(("%s", "Failed to alloc Processes map"));
-        ihashmap_free(ProcessesInfos);
-        return STATUS_ABANDONED;
+VOID destroySandbox(processInfos* pinfo) {
+    freeSandboxRules(pinfo->permissions);
+    releaseSharedRules(pinfo);
+    ProcessStats_destroy(pinfo->stats);
+    HotPaths_destroy(pinfo->hotPaths);
+    LearnedRules_destroy(pinfo->learned);
+    freeBudget(pinfo->budget);
+    freeWriteQuota(pinfo->writeQuota);
+    freeTimedMap(&pinfo->timed);
+    free(pinfo);
+}
+
+VOID freeBudget(ioBudget* budget) {
+    if (budget != NULL) {
+        for (UINT8 i = 0; i < BUDGET_BUCKETS; i++) {
+            TokenBucket_destroy(&budget->buckets[i]);
+        }
+        free(budget);
+        InterlockedDecrement(&budgetedSandboxes);
     }
+}
 
-    if (hashmap_create(8, &globalPerm) != 0) {
-        KdPrint(("%s", "Failed to alloc globalPerm map"));
-        ihashmap_free(ProcessesInfos);
-        ihashmap_free(Processes);
-        return STATUS_ABANDONED;
+// Writes still in flight keep it until they complete
+VOID freeWriteQuota(WriteQuota* quota) {
+    if (quota != NULL) {
+        WriteQuota_release(quota);
+        InterlockedDecrement(&quotaSandboxes);
     }
+}
 
-    status = PsSetCreateProcessNotifyRoutine((PCREATE_PROCESS_NOTIFY_ROUTINE)CreateProcessNotify, FALSE);
-    if (!NT_SUCCESS(status))
-    {
-        KdPrint(("Faild to PsSetCreateProcessNotifyRoutineEx .status : 0x%X\n", status));
-        ihashmap_free(ProcessesInfos);
-        ihashmap_free(Processes);
-        hashmap_destroy(&globalPerm);
-        return STATUS_ABANDONED;
+/*
+ * Best effort: tops the pool up to LYCANITE_SANDBOX_POOL_SIZE records, so
+ * opening a sandbox doesn't allocate. Called when a controller registers.
+ */
+VOID fillSandboxPool() {
+    FltAcquirePushLockExclusive(&processesLock);
+    ProcessTree_reserve(&processTree, LYCANITE_PROCESS_NODES);
+    while (sandboxPoolCount < LYCANITE_SANDBOX_POOL_SIZE) {
+        processInfos* pinfo = createSandbox();
+        if (pinfo == NULL) {
+            break;
+        }
+        pinfo->next = sandboxPool;
+        sandboxPool = pinfo;
+        sandboxPoolCount++;
     }
+    FltReleasePushLock(&processesLock);
+}
 
-    // Delete the warning for unused parameter
-    UNREFERENCED_PARAMETER(RegistryPath);
+// Once the event worker is stopped
+VOID freeSandboxPool() {
+    while (reclaiming != NULL || !ReclaimQueue_isEmpty(&reclaimQueue)) {
+        if (reclaiming == NULL) {
+            reclaiming = ReclaimQueue_takeAll(&reclaimQueue);
+        }
+        processInfos* pinfo = CONTAINING_RECORD(reclaiming, processInfos, reclaim);
+        reclaiming = reclaiming->next;
+        destroySandbox(pinfo);
+    }
 
-    KdPrint(("%s", "Driver entered main function"));
+    while (sandboxPool != NULL) {
+        processInfos* pinfo = sandboxPool;
+        sandboxPool = pinfo->next;
+        destroySandbox(pinfo);
+    }
+    sandboxPoolCount = 0;
+}
 
-    //  Register the filter with it's callbacks and context
-    status = FltRegisterFilter(
-        DriverObject,
-        &FilterRegistration,
-        &gFilterInstance
-    );
+// Under processesLock. Falls back to the allocator once the pool is drained
+processInfos* acquireSandbox() {
+    processInfos* pinfo = sandboxPool;
 
-    if (!NT_SUCCESS(status)) {
-        ihashmap_free(ProcessesInfos);
-        ihashmap_free(Processes);
-        hashmap_destroy(&globalPerm);
-        return status;
+    if (pinfo == NULL) {
+        return createSandbox();
     }
 
+    sandboxPool = pinfo->next;
+    sandboxPoolCount--;
+    pinfo->next = NULL;
+    return pinfo;
+}
 
-    status = FltBuildDefaultSecurityDescriptor(&securityDescriptor, FLT_PORT_ALL_ACCESS);
-
-    // If Success
-    if (NT_SUCCESS(status)) {
+/*
+ * Under processesLock. The sandbox is already unlinked; its rules are left
+ * to the event worker so closing a sandbox costs the same whatever it holds.
+ */
+VOID releaseSandbox(processInfos* pinfo) {
+    pinfo->uuid = 0;
+    pinfo->reclaimCursor = 0;
 
-        InitializeObjectAttributes(&objectAttributes, &name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, securityDescriptor);
+    if (ReclaimQueue_push(&reclaimQueue, &pinfo->reclaim)) {
+        KeSetEvent(&eventWorkerWake, 0, FALSE);
+    }
+}
 
-        status = FltCreateCommunicationPort(
-            gFilterInstance,
-            &port,
-            &objectAttributes,
-            NULL, 
-            comConnectNotifyCallback,
-            comDisconnectNotifyCallback,
-            comMessageNotifyCallback,
-            1
-        );
+/*
+ * Event worker, once the rules are freed. The record keeps its rule table
+ * and counters allocated for the next sandbox.
+ */
+VOID recycleSandbox(processInfos* pinfo) {
+    pinfo->enclosing = NULL;
+    ProcessStats_reset(pinfo->stats);
+
+    // few sandboxes have hot paths, a budget or a quota; a check or an I/O may still be using them
+    HotPaths* hotPaths = pinfo->hotPaths;
+    ioBudget* budget = pinfo->budget;
+    WriteQuota* quota = pinfo->writeQuota;
+    if (hotPaths != NULL || budget != NULL || quota != NULL) {
+        WritePointerRelease((PVOID volatile*)&pinfo->hotPaths, NULL);
+        WritePointerRelease((PVOID volatile*)&pinfo->budget, NULL);
+        WritePointerRelease((PVOID volatile*)&pinfo->writeQuota, NULL);
+        GracePeriod_synchronize(&rulesGrace);
+        HotPaths_destroy(hotPaths);
+        freeBudget(budget);
+        freeWriteQuota(quota);
+    }
 
-        FltFreeSecurityDescriptor(securityDescriptor);
-        
-        if (NT_SUCCESS(status)) {
-            status = FltStartFiltering(gFilterInstance);
+    // the learned rules are large and few sandboxes learn
+    pinfo->learning = 0;
+    LearnedRules_destroy(pinfo->learned);
+    pinfo->learned = NULL;
 
-            if (NT_SUCCESS(status)) {
-                return status;
-            }
-            KdPrint(("[ERROR] FltStartFiltering FAILED. status = 0x%x\n", status));
-        }
-        KdPrint(("[ERROR] FltCreateCommunicationPort FAILED. status = 0x%x\n", status));
+    // its timed rules stay in the wheel until they expire, only the map goes
+    freeTimedMap(&pinfo->timed);
 
-        FltCloseCommunicationPort(port);
+    FltAcquirePushLockExclusive(&processesLock);
+    if (sandboxPoolCount < LYCANITE_SANDBOX_POOL_SIZE) {
+        pinfo->next = sandboxPool;
+        sandboxPool = pinfo;
+        sandboxPoolCount++;
+        pinfo = NULL;
+    }
+    FltReleasePushLock(&processesLock);
 
+    if (pinfo != NULL) {
+        destroySandbox(pinfo);
     }
+}
 
-    FltUnregisterFilter(gFilterInstance);
-    KdPrint(("[ERROR] FltBuildDefaultSecurityDescriptor FAILED. status = 0x%x\n", status));
+/*
+ * Event worker. Frees the rules of closed sandboxes, visiting at most
+ * `budget` table slots. Returns TRUE while some are left.
+ */
+BOOLEAN reclaimSandboxes(UINT32 budget) {
+    if (reclaiming == NULL) {
+        reclaiming = ReclaimQueue_takeAll(&reclaimQueue);
+    }
 
-    ihashmap_free(ProcessesInfos);
-    ihashmap_free(Processes);
-    hashmap_destroy(&globalPerm);
-    return status;
-}
+    while (reclaiming != NULL && budget > 0) {
+        processInfos* pinfo = CONTAINING_RECORD(reclaiming, processInfos, reclaim);
+        struct hashmap_s* rules = pinfo->permissions;
 
-/* ======================================================
-*                       Driver Methods
-*  ======================================================*/
+        for (; pinfo->reclaimCursor < rules->table_size && budget > 0; pinfo->reclaimCursor++, budget--) {
+            struct hashmap_element_s* e = &rules->data[pinfo->reclaimCursor];
+            if (e->in_use || e->key != NULL) { // tombstones too
+                rules->size -= e->in_use != 0;
+                cleanupHashmap(NULL, e);
+                Kmemset(e, 0, sizeof(struct hashmap_element_s));
+            }
+        }
 
-NTSTATUS CgUnload(FLT_FILTER_UNLOAD_FLAGS Flags) {
-    UNREFERENCED_PARAMETER(Flags);
+        if (pinfo->reclaimCursor < rules->table_size) {
+            break;
+        }
+        releaseSharedRules(pinfo);
+        reclaiming = reclaiming->next;
+        recycleSandbox(pinfo);
+    }
 
-    KdPrint(("%s", "Driver unload"));
-    FltCloseCommunicationPort(port);
-    FltUnregisterFilter(gFilterInstance);
+    return reclaiming != NULL || !ReclaimQueue_isEmpty(&reclaimQueue);
+}
 
-    ihashmap_iterate(ProcessesInfos, cleanIHashmap, NULL);
-    ihashmap_free(ProcessesInfos);
-    ihashmap_free(Processes);
+/*
+ * Innermost sandbox of the process, NULL when it isn't sandboxed. The index
+ * rehashes as processes come and go, under processesLock held exclusive.
+ */
+processInfos* processSandbox(UINT64 processId) {
+    FltAcquirePushLockShared(&processesLock);
+    processInfos* pinfo = (processInfos*)ProcessTree_sandbox(&processTree, processId);
+    FltReleasePushLock(&processesLock);
+    return pinfo;
+}
 
-    if (0 != hashmap_iterate_pairs(&globalPerm, cleanupHashmap, NULL)) {
-        KdPrint(("%s\n", "failed to deallocate hashmap entries\n"));
+/*
+ * Under processesLock, once the sandbox has no process and encloses no open
+ * sandbox left. The sandbox enclosing it closes along if that was its last.
+ */
+VOID closeSandbox(processInfos* pinfo, UINT64 processId) {
+    while (pinfo != NULL) {
+        controllerInfos* owner = pinfo->owner;
+        processInfos* enclosing = pinfo->enclosing;
+        queueEvent(PROCESS_DESTROY, processId, pinfo->uuid);
+
+        FltAcquirePushLockExclusive(&owner->lock);
+        ihashmap_remove(owner->sandboxes, pinfo->uuid, NULL);
+        FltReleasePushLock(&owner->lock);
+
+        UUIDRecycler_recycleUUID(owner->uuids, pinfo->uuid >> LYCANITE_CONTROLLER_BITS);
+        KdPrint(("Remove Reference %llu\n", pinfo->uuid));
+        releaseSandbox(pinfo);
+
+        if (enclosing == NULL || --enclosing->nested != 0 || enclosing->processes.count != 0) {
+            return;
+        }
+        pinfo = enclosing;
     }
-    hashmap_destroy(&globalPerm);
-
-    PsSetCreateProcessNotifyRoutine((PCREATE_PROCESS_NOTIFY_ROUTINE)CreateProcessNotify, TRUE);
-    UUIDRecycler_destroy(uuidRecycler);
-    return STATUS_SUCCESS;
 }
 
-FLT_PREOP_CALLBACK_STATUS AvPreCreate(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
+// Under processesLock. Closes the sandbox with its last process
+VOID exitProcess(ProcessNode* node) {
+    processInfos* pinfo = (processInfos*)node->sandbox;
+    UINT64 processId = node->processId;
 
-    NTSTATUS status;
-    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+    ProcessTree_remove(&processTree, node);
 
-    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
-    if (NT_SUCCESS(status)) {
-        status = FltParseFileNameInformation(FileNameInfo);
-        if (NT_SUCCESS(status)) {
-            ULONG Disposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0xFF;
-            if (Disposition == FILE_OPEN) {
-                if (Data->Iopb->Parameters.Create.Options & FILE_DELETE_ON_CLOSE) {
-                    if (isRestricted(Data, FileNameInfo, LYCANITE_DELETE)) {
-                        FltReleaseFileNameInformation(FileNameInfo);
-                        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                        Data->IoStatus.Information = 0;
+    if (ReadNoFence(&captureEnabled)) {
+        DecisionCapture_process(capture, processId, 0, pinfo->uuid, FALSE);
+    }
 
-                        return FLT_PREOP_COMPLETE;
-                    }
-                }
-                else {
-                    if (isRestricted(Data, FileNameInfo, LYCANITE_READ)) {
-                        FltReleaseFileNameInformation(FileNameInfo);
-                        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                        Data->IoStatus.Information = 0;
+    KdPrint(("Kill Process %llu -- %llu\n", processId, pinfo->uuid));
+    // a sandbox still enforced on nested sandboxes stays open until they close
+    if (pinfo->processes.count == 0 && pinfo->nested == 0) {
+        closeSandbox(pinfo, processId);
+    }
+}
 
-                        return FLT_PREOP_COMPLETE;
-                    }
-                }
-            }
-            else {
-                if (isRestricted(Data, FileNameInfo, LYCANITE_WRITE)) {
-                    FltReleaseFileNameInformation(FileNameInfo);
-                    Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                    Data->IoStatus.Information = 0;
+/*
+ * Under the owner's lock. The rules set so far, over the sealed ones if any,
+ * become a shared set: the set already holding the same rules when there is
+ * one, so identical sandboxes keep a single copy, else a new set compiled
+ * from them. The private table is left empty for later changes, the old
+ * tables are freed once no check can still be reading them.
+ */
+UINT8 sealSandbox(processInfos* pinfo) {
+    struct hashmap_s* changes = pinfo->permissions;
+    struct hashmap_s sealed;
+    struct hashmap_s* empty;
+    BOOLEAN merged = pinfo->base != NULL; // else the private table is sealed as is
+
+    if (!merged && changes->size == 0) {
+        return STATUS_SUCCESS;
+    }
+    empty = (struct hashmap_s*)malloc(sizeof(struct hashmap_s));
+    if (empty == NULL || hashmap_create(8, empty) != 0) {
+        free(empty);
+        return BAD_ALLOC;
+    }
+    if (!merged) {
+        Kmemcpy(&sealed, changes, sizeof(struct hashmap_s));
+    }
+    else if (!RuleSet_overlay(pinfo->base, changes, &sealed)) {
+        hashmap_destroy(empty);
+        free(empty);
+        return BAD_ALLOC;
+    }
 
-                    return FLT_PREOP_COMPLETE;
-                }
-            }
-            FltReleaseFileNameInformation(FileNameInfo);
+    RuleSet* unused = NULL;
+    FltAcquirePushLockExclusive(&ruleSetsLock);
+    RuleSet* set = RuleSets_intern(&ruleSets, &sealed);
+    if (set != NULL && merged) {
+        unused = RuleSets_release(&ruleSets, pinfo->base);
+    }
+    FltReleasePushLock(&ruleSetsLock);
+
+    if (set == NULL) {
+        if (merged) {
+            hashmap_iterate_pairs(&sealed, cleanupHashmap, NULL);
+            hashmap_destroy(&sealed);
         }
+        hashmap_destroy(empty);
+        free(empty);
+        return BAD_ALLOC;
     }
-    
 
-    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    /*
+     * Readers find the sealed rules before the private ones go. The table
+     * can't be swapped under them, they skip it while the flag is set: once
+     * the checks that could have missed the flag are done, it is swapped, and
+     * neither the old table nor the old set is reachable anymore.
+     */
+    WritePointerRelease((PVOID volatile*)&pinfo->base, set);
+    WriteRelease(&pinfo->sealing, 1);
+    GracePeriod_synchronize(&rulesGrace);
+    WritePointerRelease((PVOID volatile*)&pinfo->permissions, empty);
+    WriteRelease(&pinfo->sealing, 0);
+
+    if (merged) {
+        hashmap_iterate_pairs(&sealed, cleanupHashmap, NULL);
+        hashmap_destroy(&sealed);
+    }
+    freeSandboxRules(changes);
+    if (unused != NULL) {
+        RuleSet_destroy(unused);
+    }
+    return STATUS_SUCCESS;
 }
 
-FLT_PREOP_CALLBACK_STATUS AvPreRead(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
+// Drops the sandbox's reference on its sealed rules, freeing them with the last one
+VOID releaseSharedRules(processInfos* pinfo) {
+    RuleSet* set = pinfo->base;
+    if (set == NULL) {
+        return;
+    }
+    pinfo->base = NULL;
 
-    NTSTATUS status;
-    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+    FltAcquirePushLockExclusive(&ruleSetsLock);
+    set = RuleSets_release(&ruleSets, set);
+    FltReleasePushLock(&ruleSetsLock);
 
-    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
+    if (set != NULL) {
+        RuleSet_destroy(set);
+    }
+}
 
-    if (NT_SUCCESS(status)) {
-        status = FltParseFileNameInformation(FileNameInfo);
-        if (NT_SUCCESS(status)) {
-            if (isRestricted(Data, FileNameInfo, LYCANITE_READ)) {
-                FltReleaseFileNameInformation(FileNameInfo);
-                Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                Data->IoStatus.Information = 0;
+/*
+ * Under the owner's lock, a new rule in the sandbox's private table, `file`
+ * and `perms` its key and value then. Checks read the table without the
+ * lock, it is written with the _shared Kashmap functions: a table without
+ * room is rebuilt aside and published, and the old one freed with its
+ * tombstones once no check can still be reading it. FALSE if out of memory,
+ * the table is left as it was.
+ */
+BOOLEAN putSandboxRule(processInfos* pinfo, PWCHAR file, UINT64 len, UINT64* perms) {
+    struct hashmap_s* rules = pinfo->permissions;
+
+    // rebuilt without the tombstones, grown if that wasn't enough
+    for (INT8 grow = 0; hashmap_put_shared(rules, file, (UINT32)len, perms) != 0; grow = 1) {
+        struct hashmap_s* rebuilt = (struct hashmap_s*)malloc(sizeof(struct hashmap_s));
+        if (rebuilt == NULL || hashmap_rebuild(rules, rebuilt, grow) != 0) {
+            free(rebuilt);
+            return FALSE;
+        }
+        WritePointerRelease((PVOID volatile*)&pinfo->permissions, rebuilt);
+        GracePeriod_synchronize(&rulesGrace);
+        hashmap_iterate_removed(rules, cleanupHashmap, NULL);
+        hashmap_destroy(rules);
+        free(rules);
+        rules = rebuilt;
+    }
+    return TRUE;
+}
 
-                return FLT_PREOP_COMPLETE;
+/*
+ * Under the owner's lock. Deletes the sandbox's rule on the path; a sealed
+ * one is shared, it is hidden by a private deletion which keeps `file` as
+ * its key, `kept` is set then. A private rule removed stays in its tombstone
+ * until the table is rebuilt, sealed or freed.
+ */
+UINT8 removeSandboxRule(processInfos* pinfo, PWCHAR file, UINT64 len, BOOLEAN* kept) {
+    UINT8 status = STATUS_SUCCESS;
+    UINT64* perms = NULL;
+    *kept = FALSE;
+
+    if (pinfo->base != NULL && PathTrie_find(&pinfo->base->rules, file, (UINT32)len, NULL)) {
+        perms = (UINT64*)hashmap_get_shared(pinfo->permissions, file, (UINT32)len);
+        if (perms != NULL) {
+            *perms = RULESET_DELETED;
+        }
+        else {
+            perms = (UINT64*)malloc(sizeof(UINT64));
+            if (perms != NULL) {
+                *perms = RULESET_DELETED;
+            }
+            if (perms == NULL || !putSandboxRule(pinfo, file, len, perms)) {
+                free(perms);
+                status = BAD_ALLOC;
+            }
+            else {
+                *kept = TRUE;
             }
-            FltReleaseFileNameInformation(FileNameInfo);
         }
     }
+    else {
+        hashmap_remove_shared(pinfo->permissions, file, (UINT32)len, NULL, NULL);
+    }
+    if (status == STATUS_SUCCESS) {
+        captureRule(pinfo->uuid, 0, file, len);
+    }
 
+    return status;
+}
 
-    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+/* ======================================================
+*                       Timed rules
+*  ======================================================*/
+
+// Tick of the timer wheels at an interrupt time
+UINT64 ruleTick(UINT64 interruptTime) {
+    return interruptTime / LYCANITE_RULE_TICK;
 }
 
-FLT_PREOP_CALLBACK_STATUS AvPreWrite(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
+/*
+ * Under the lock guarding the wheel and the map, before the rule on the path
+ * is stored with a TTL. Returns the entry timing it, added to the map unarmed
+ * if it had none, `added` set then; NULL and nothing changed if out of
+ * memory. Setting a timed rule only allocates here: once the rule is stored
+ * arming it can't fail, and if storing it fails dropRule takes the entry
+ * back.
+ */
+timedRule* reserveRule(struct hashmap_s** timed, UINT64 uuid, CONST WCHAR* path, UINT64 length, BOOLEAN* added) {
+    timedRule* rule = *timed != NULL ? (timedRule*)hashmap_get(*timed, (PWCHAR)path, (UINT32)length) : NULL;
+    *added = FALSE;
+    if (rule != NULL) {
+        return rule;
+    }
 
-    NTSTATUS status;
-    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+    if (*timed == NULL) {
+        struct hashmap_s* map = (struct hashmap_s*)calloc(1, sizeof(struct hashmap_s));
+        if (map == NULL || hashmap_create(8, map) != 0) {
+            free(map);
+            return NULL;
+        }
+        *timed = map;
+    }
 
-    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
+    rule = (timedRule*)calloc(1, sizeof(timedRule));
+    PWCHAR key = (PWCHAR)calloc(length, sizeof(WCHAR));
+    if (rule == NULL || key == NULL) {
+        free(rule);
+        free(key);
+        return NULL;
+    }
+    Kmemcpy(key, (PVOID)path, length * sizeof(WCHAR));
+    if (hashmap_put(*timed, key, (UINT32)length, rule) != 0) {
+        free(rule);
+        free(key);
+        return NULL;
+    }
+    rule->uuid = uuid;
+    rule->path = key;
+    rule->length = (UINT32)length;
+    InterlockedIncrement(&timedRules);
+    *added = TRUE;
+    return rule;
+}
 
-    if (NT_SUCCESS(status)) {
-        status = FltParseFileNameInformation(FileNameInfo);
-        if (NT_SUCCESS(status)) {
-            if (isRestricted(Data, FileNameInfo, LYCANITE_WRITE)) {
-                FltReleaseFileNameInformation(FileNameInfo);
-                Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                Data->IoStatus.Information = 0;
+// Under the same lock. The entry reserveRule added for a rule that couldn't be stored
+VOID dropRule(struct hashmap_s* timed, timedRule* rule) {
+    hashmap_remove(timed, rule->path, rule->length, NULL, NULL);
+    freeTimedRule(&rule->node);
+}
 
-                return FLT_PREOP_COMPLETE;
-            }
-            FltReleaseFileNameInformation(FileNameInfo);
-        }
+/*
+ * Under the same lock, once the rule is stored. Its reserved entry now
+ * expires in `ttl` milliseconds, whatever expiry it had.
+ */
+VOID armRule(TimerWheel* wheel, timedRule* rule, UINT32 ttl) {
+    if (rule->node.link != NULL) {
+        TimerWheel_remove(wheel, &rule->node);
     }
 
-    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    UINT64 now = KeQueryInterruptTime();
+    if (wheel->count == 0) {
+        TimerWheel_init(wheel, ruleTick(now)); // the clock may have stood still since the last timer
+    }
+    TimerWheel_insert(wheel, &rule->node, ruleTick(now + (UINT64)ttl * 10000) + 1);
+
+    // the worker may be asleep until a later expiry
+    KeSetEvent(&eventWorkerWake, 0, FALSE);
 }
 
-FLT_PREOP_CALLBACK_STATUS AvPreSetInformation(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
-    UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
+// Under the same lock. The rule on the path is permanent again, or deleted
+VOID disarmRule(TimerWheel* wheel, struct hashmap_s* timed, CONST WCHAR* path, UINT64 length) {
+    timedRule* rule = timed != NULL ? (timedRule*)hashmap_get(timed, (PWCHAR)path, (UINT32)length) : NULL;
+    if (rule != NULL) {
+        TimerWheel_remove(wheel, &rule->node);
+        dropRule(timed, rule);
+    }
+}
 
-    NTSTATUS status;
-    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+VOID freeTimedRule(TimerWheelNode* node) {
+    timedRule* rule = CONTAINING_RECORD(node, timedRule, node);
+    free(rule->path);
+    free(rule);
+    InterlockedDecrement(&timedRules);
+}
 
-    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
+// The map only indexes the rules, they belong to their wheel
+VOID freeTimedMap(struct hashmap_s** timed) {
+    if (*timed != NULL) {
+        hashmap_destroy(*timed);
+        free(*timed);
+        *timed = NULL;
+    }
+}
 
-    if (NT_SUCCESS(status)) {
-        status = FltParseFileNameInformation(FileNameInfo);
-        if (NT_SUCCESS(status)) {
+/*
+ * Event worker. Deletes the rules whose TTL is over as their
+ * DELETE_AUTHORIZATION would, at most `budget` rules and wheel ticks.
+ * Returns TRUE while some may be left.
+ */
+BOOLEAN expireRules(UINT32 budget) {
+    if (ReadNoFence(&timedRules) == 0) {
+        return FALSE;
+    }
 
-            if ((Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformation) ||
-                (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformationEx)) {
+    UINT64 now = ruleTick(KeQueryInterruptTime());
+    TimerWheelNode* node;
+
+    FltAcquirePushLockExclusive(&globalPermLock);
+    while ((node = TimerWheel_pop(&globalTimers, now, &budget)) != NULL) {
+        timedRule* rule = CONTAINING_RECORD(node, timedRule, node);
+        hashmap_remove(globalTimed, rule->path, rule->length, NULL, NULL);
+        VolumeRules_remove(&globalPerm, rule->path, rule->length);
+        captureRule(0, 0, rule->path, rule->length);
+        KdPrint(("Expire Global Auth [%u] %ws\n", rule->length, rule->path));
+        freeTimedRule(node);
+    }
+    FltReleasePushLock(&globalPermLock);
 
-                ULONG flags = ((PFILE_DISPOSITION_INFORMATION_EX)Data->Iopb->Parameters.SetFileInformation.InfoBuffer)->Flags;
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS && budget > 0; slot++) {
+        controllerInfos* cinfo = &controllers[slot];
+        if (ReadNoFence64((volatile LONG64*)&cinfo->timers.count) == 0) {
+            continue;
+        }
 
-                if (FlagOn(flags, FILE_DISPOSITION_DELETE)) {
-                    if (isRestricted(Data, FileNameInfo, LYCANITE_DELETE)) {
-                        FltReleaseFileNameInformation(FileNameInfo);
-                        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                        Data->IoStatus.Information = 0;
+        FltAcquirePushLockExclusive(&cinfo->lock);
+        while ((node = TimerWheel_pop(&cinfo->timers, now, &budget)) != NULL) {
+            timedRule* rule = CONTAINING_RECORD(node, timedRule, node);
+            processInfos* pinfo = NULL;
 
-                        return FLT_PREOP_COMPLETE;
-                    }
+            // a closed sandbox left it behind, its uuid may be another sandbox's by now
+            if (ihashmap_get(cinfo->sandboxes, rule->uuid, (any_t*)&pinfo) == MAP_OK &&
+                pinfo->timed != NULL && hashmap_get(pinfo->timed, rule->path, rule->length) == rule) {
+                BOOLEAN kept = FALSE;
+                hashmap_remove(pinfo->timed, rule->path, rule->length, NULL, NULL);
+                removeSandboxRule(pinfo, rule->path, rule->length, &kept);
+                KdPrint(("Expire PID Auth [%u] %ws\n", rule->length, rule->path));
+                if (kept) {
+                    rule->path = NULL; // the key of the deletion now
                 }
             }
+            freeTimedRule(node);
+        }
+        FltReleasePushLock(&cinfo->lock);
+    }
 
-            FltReleaseFileNameInformation(FileNameInfo);
+    return budget == 0;
+}
+
+// Event worker. Interrupt time of the next expiry at the earliest, 0 without timed rules
+LONG64 nextRuleExpiry() {
+    if (ReadNoFence(&timedRules) == 0) {
+        return 0;
+    }
+
+    FltAcquirePushLockShared(&globalPermLock);
+    UINT64 next = TimerWheel_next(&globalTimers);
+    FltReleasePushLock(&globalPermLock);
+
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        controllerInfos* cinfo = &controllers[slot];
+        FltAcquirePushLockShared(&cinfo->lock);
+        UINT64 tick = TimerWheel_next(&cinfo->timers);
+        FltReleasePushLock(&cinfo->lock);
+        next = tick < next ? tick : next;
+    }
+
+    return next == TIMERWHEEL_NEVER ? 0 : (LONG64)(next * LYCANITE_RULE_TICK);
+}
+
+/* ======================================================
+*                       Controllers
+*  ======================================================*/
+
+VOID initControllers() {
+    Kmemset(controllers, 0, sizeof(controllers));
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        controllers[slot].slot = slot;
+        TimerWheel_init(&controllers[slot].timers, ruleTick(KeQueryInterruptTime()));
+        FltInitializePushLock(&controllers[slot].lock);
+        FltInitializePushLock(&controllers[slot].ringLock);
+    }
+    FltInitializePushLock(&controllersLock);
+}
+
+/*
+ * Under controllersLock, before the slot is handed to a connection. Allocates
+ * what a previous connection didn't; the event worker only looks at a slot
+ * once its queue is published, and is woken to arm the queue's doorbell.
+ */
+BOOLEAN openController(controllerInfos* cinfo) {
+    if (cinfo->sandboxes == NULL) {
+        cinfo->sandboxes = ihashmap_new();
+    }
+    if (cinfo->uuids == NULL) {
+        cinfo->uuids = UUIDRecycler_create(16);
+    }
+    if (cinfo->events == NULL) {
+        WritePointerRelease((PVOID volatile*)&cinfo->events, EventQueue_create(LYCANITE_EVENT_QUEUE_SIZE));
+        KeSetEvent(&eventWorkerWake, 0, FALSE);
+    }
+    return cinfo->sandboxes != NULL && cinfo->uuids != NULL && cinfo->events != NULL;
+}
+
+// Once the filter is unregistered and the event worker stopped
+VOID closeControllers() {
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        controllerInfos* cinfo = &controllers[slot];
+
+        if (cinfo->sandboxes != NULL) {
+            ihashmap_iterate(cinfo->sandboxes, cleanIHashmap, NULL);
+            ihashmap_free(cinfo->sandboxes);
         }
+        TimerWheel_clear(&cinfo->timers, freeTimedRule);
+        UUIDRecycler_destroy(cinfo->uuids);
+        EventQueue_destroy(cinfo->events);
+        releaseEventRing(&cinfo->ring);
+        FltDeletePushLock(&cinfo->lock);
+        FltDeletePushLock(&cinfo->ringLock);
+        cinfo->sandboxes = NULL;
+        cinfo->uuids = NULL;
+        cinfo->events = NULL;
     }
+    FltDeletePushLock(&controllersLock);
+}
 
-    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+// Owner of a sandbox
+controllerInfos* controllerOf(UINT64 uuid) {
+    return &controllers[LYCANITE_CONTROLLER_SLOT(uuid)];
+}
+
+// Global rules and the capture span every controller's sandboxes
+BOOLEAN isPrimaryController(controllerInfos* cinfo) {
+    return ReadPointerAcquire((PVOID volatile*)&primaryController) == cinfo;
+}
+
+// Under controllersLock. Sandboxes of the slot still open, from a previous connection
+BOOLEAN hasOpenSandboxes(controllerInfos* cinfo) {
+    if (cinfo->sandboxes == NULL) {
+        return FALSE;
+    }
+
+    FltAcquirePushLockShared(&cinfo->lock);
+    BOOLEAN open = ihashmap_length(cinfo->sandboxes) > 0;
+    FltReleasePushLock(&cinfo->lock);
+    return open;
 }
 
+// Controller registered with this process id, NULL if none
+controllerInfos* controllerFor(UINT64 processId) {
+    if (processId == 0) {
+        return NULL;
+    }
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        if ((UINT64)ReadNoFence64(&controllers[slot].pid) == processId) {
+            return &controllers[slot];
+        }
+    }
+    return NULL;
+}
 
 /* ======================================================
-*                 Communication Callbacks
+*                       Main
 *  ======================================================*/
 
+// Entry Point of the Driver
 NTSTATUS
-comConnectNotifyCallback(
-    _In_ PFLT_PORT ClientPort,
-    _In_ PVOID ServerPortCookie,
-    _In_reads_bytes_(SizeOfContext) PVOID ConnectionContext,
-    _In_ ULONG SizeOfContext,
-    _Outptr_result_maybenull_ PVOID* ConnectionCookie
+DriverEntry(
+    _In_ PDRIVER_OBJECT DriverObject,
+    _In_ PUNICODE_STRING RegistryPath
 ) {
+    NTSTATUS status;
+    PSECURITY_DESCRIPTOR securityDescriptor;
+    OBJECT_ATTRIBUTES objectAttributes = { 0 };
+    UNICODE_STRING name = RTL_CONSTANT_STRING(L"\\LycaniteFF");
 
-    UNREFERENCED_PARAMETER(ServerPortCookie);
-    UNREFERENCED_PARAMETER(ConnectionContext);
-    UNREFERENCED_PARAMETER(SizeOfContext);
-    
-    *ConnectionCookie = NULL;
+    if (!ProcessTree_init(&processTree)) {
+        KdPrint(("%s", "Failed to alloc process tree"));
+        return STATUS_ABANDONED;
+    }
 
-    if (clientPort == NULL) {
-        clientPort = ClientPort;
-        KdPrint(("Com Connect\n"));
-        return STATUS_SUCCESS;
+    GracePeriod_init(&rulesGrace);
+    if (!VolumeRules_init(&globalPerm, readPolicyMode(RegistryPath), &rulesGrace)) {
+        KdPrint(("%s", "Failed to alloc globalPerm map"));
+        ProcessTree_destroy(&processTree);
+        return STATUS_ABANDONED;
     }
-    KdPrint(("Com Connection refused\n"));
-    return STATUS_ABANDONED;
+
+    initControllers();
+    TimerWheel_init(&globalTimers, ruleTick(KeQueryInterruptTime()));
+    FltInitializePushLock(&globalPermLock);
+    FltInitializePushLock(&captureLock);
+    FltInitializePushLock(&processesLock);
+    FltInitializePushLock(&ruleSetsLock);
+    ReclaimQueue_init(&reclaimQueue);
+
+    status = StartEventWorker();
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("Failed to start event worker. status : 0x%X\n", status));
+        ProcessTree_destroy(&processTree);
+        VolumeRules_destroy(&globalPerm);
+        return STATUS_ABANDONED;
+    }
+
+    status = PsSetCreateProcessNotifyRoutine((PCREATE_PROCESS_NOTIFY_ROUTINE)CreateProcessNotify, FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("Faild to PsSetCreateProcessNotifyRoutineEx .status : 0x%X\n", status));
+        StopEventWorker();
+        FreeEventWorker();
+        ProcessTree_destroy(&processTree);
+        VolumeRules_destroy(&globalPerm);
+        return STATUS_ABANDONED;
+    }
+
+    loadPolicySnapshot(RegistryPath);
+
+    KdPrint(("%s", "Driver entered main function"));
+
+    StartInstrumentation();
+
+    //  Register the filter with it's callbacks and context
+    status = FltRegisterFilter(
+        DriverObject,
+        &FilterRegistration,
+        &gFilterInstance
+    );
+
+    if (!NT_SUCCESS(status)) {
+        StopInstrumentation();
+        freePolicySnapshot();
+        PsSetCreateProcessNotifyRoutine((PCREATE_PROCESS_NOTIFY_ROUTINE)CreateProcessNotify, TRUE);
+        StopEventWorker();
+        FreeEventWorker();
+        ProcessTree_destroy(&processTree);
+        VolumeRules_destroy(&globalPerm);
+        return status;
+    }
+
+
+    status = FltBuildDefaultSecurityDescriptor(&securityDescriptor, FLT_PORT_ALL_ACCESS);
+
+    // If Success
+    if (NT_SUCCESS(status)) {
+
+        InitializeObjectAttributes(&objectAttributes, &name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, securityDescriptor);
+
+        status = FltCreateCommunicationPort(
+            gFilterInstance,
+            &port,
+            &objectAttributes,
+            NULL, 
+            comConnectNotifyCallback,
+            comDisconnectNotifyCallback,
+            comMessageNotifyCallback,
+            LYCANITE_MAX_CONTROLLERS
+        );
+
+        FltFreeSecurityDescriptor(securityDescriptor);
+        
+        if (NT_SUCCESS(status)) {
+            status = FltStartFiltering(gFilterInstance);
+
+            if (NT_SUCCESS(status)) {
+                return status;
+            }
+            KdPrint(("[ERROR] FltStartFiltering FAILED. status = 0x%x\n", status));
+        }
+        KdPrint(("[ERROR] FltCreateCommunicationPort FAILED. status = 0x%x\n", status));
+
+        FltCloseCommunicationPort(port);
+
+    }
+
+    FltUnregisterFilter(gFilterInstance);
+    KdPrint(("[ERROR] FltBuildDefaultSecurityDescriptor FAILED. status = 0x%x\n", status));
+
+    StopInstrumentation();
+    freePolicySnapshot();
+
+    PsSetCreateProcessNotifyRoutine((PCREATE_PROCESS_NOTIFY_ROUTINE)CreateProcessNotify, TRUE);
+    StopEventWorker();
+    FreeEventWorker();
+    closeControllers();
+    ProcessTree_destroy(&processTree);
+    VolumeRules_destroy(&globalPerm);
+    return status;
 }
 
-VOID
-comDisconnectNotifyCallback(
-    _In_opt_ PVOID ConnectionCookie
-) {
-    UNREFERENCED_PARAMETER(ConnectionCookie);
+/* ======================================================
+*                       Driver Methods
+*  ======================================================*/
+
+NTSTATUS CgUnload(FLT_FILTER_UNLOAD_FLAGS Flags) {
+    UNREFERENCED_PARAMETER(Flags);
+
+    KdPrint(("%s", "Driver unload"));
+    PsSetCreateProcessNotifyRoutine((PCREATE_PROCESS_NOTIFY_ROUTINE)CreateProcessNotify, TRUE);
+    StopEventWorker();
+    FltCloseCommunicationPort(port);
+    FltUnregisterFilter(gFilterInstance);
+
+    // pre-operations may queue denials until the filter is unregistered
+    FreeEventWorker();
+
+    StopInstrumentation();
+
+    closeControllers();
+    ProcessTree_destroy(&processTree);
+    freeSandboxPool();
+    FltDeletePushLock(&processesLock);
+    FltDeletePushLock(&captureLock);
+
+    TimerWheel_clear(&globalTimers, freeTimedRule);
+    freeTimedMap(&globalTimed);
+    VolumeRules_destroy(&globalPerm);
+    FltDeletePushLock(&globalPermLock);
+    RuleSets_destroy(&ruleSets);
+    FltDeletePushLock(&ruleSetsLock);
+    GracePeriod_destroy(&rulesGrace);
+    freePolicySnapshot();
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Storage of the global rules from the CompactPolicy value of the service key:
+ * 0 or missing keeps the paths, 1 only their fingerprints, 2 fingerprints
+ * with the paths aside to verify matches.
+ */
+UINT8 readPolicyMode(PUNICODE_STRING RegistryPath) {
+    ULONG mode = VOLUMERULES_STRINGS;
+    RTL_QUERY_REGISTRY_TABLE query[2] = { 0 };
+    query[0].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    query[0].Name = LYCANITE_COMPACT_POLICY_VALUE;
+    query[0].EntryContext = &mode;
+    query[0].DefaultType = REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT | REG_NONE;
+
+    NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, RegistryPath->Buffer, query, NULL, NULL);
+    if (!NT_SUCCESS(status) || mode > VOLUMERULES_VERIFIED) {
+        return VOLUMERULES_STRINGS;
+    }
+    KdPrint(("Global rules stored in mode %lu\n", mode));
+    return (UINT8)mode;
+}
+
+/*
+ * Reads the snapshot named by the PolicySnapshot value of the service key in
+ * one allocation and looks rules up in place. Best effort, the filter runs
+ * with the rules set over the port only if it is missing or malformed.
+ */
+VOID loadPolicySnapshot(PUNICODE_STRING RegistryPath) {
+    UNICODE_STRING path = { 0 };
+    RTL_QUERY_REGISTRY_TABLE query[2] = { 0 };
+    query[0].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK;
+    query[0].Name = LYCANITE_POLICY_SNAPSHOT_VALUE;
+    query[0].EntryContext = &path;
+    query[0].DefaultType = REG_SZ << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT | REG_NONE;
+
+    NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, RegistryPath->Buffer, query, NULL, NULL);
+    if (!NT_SUCCESS(status) || path.Length == 0) {
+        RtlFreeUnicodeString(&path);
+        return;
+    }
+
+    HANDLE file = NULL;
+    IO_STATUS_BLOCK io = { 0 };
+    OBJECT_ATTRIBUTES attributes = { 0 };
+    InitializeObjectAttributes(&attributes, &path, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+    status = ZwCreateFile(&file, GENERIC_READ | SYNCHRONIZE, &attributes, &io, NULL, FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0);
+    RtlFreeUnicodeString(&path);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("Failed to open the policy snapshot. status : 0x%X\n", status));
+        return;
+    }
+
+    FILE_STANDARD_INFORMATION info = { 0 };
+    status = ZwQueryInformationFile(file, &io, &info, sizeof(info), FileStandardInformation);
+    if (NT_SUCCESS(status) && info.EndOfFile.QuadPart > 0 && info.EndOfFile.QuadPart <= LYCANITE_POLICY_SNAPSHOT_MAX_SIZE) {
+        ULONG size = (ULONG)info.EndOfFile.QuadPart;
+
+        // pre-operations run at APC_LEVEL at most, the image can be paged
+        PVOID image = ExAllocatePoolWithTag(PagedPool, size, 'plcy');
+        if (image != NULL) {
+            LARGE_INTEGER offset = { 0 };
+            status = ZwReadFile(file, NULL, NULL, NULL, &io, image, size, &offset, NULL);
+            if (NT_SUCCESS(status) && io.Information == size && PolicySnapshot_open(&policySnapshot, image, size)) {
+                policyImage = image;
+                KdPrint(("Policy snapshot loaded, %u rules, version %u\n", policySnapshot.header->ruleCount, policySnapshot.header->version));
+            }
+            else {
+                KdPrint(("%s", "Policy snapshot is malformed\n"));
+                ExFreePoolWithTag(image, 'plcy');
+            }
+        }
+    }
+    ZwClose(file);
+}
+
+// Once the filter is unregistered
+VOID freePolicySnapshot() {
+    if (policyImage != NULL) {
+        ExFreePoolWithTag(policyImage, 'plcy');
+        policyImage = NULL;
+    }
+}
+
+/* ======================================================
+*                       Instrumentation
+*  ======================================================*/
+
+// Best effort, the filter runs without its timing and tracing if this fails
+VOID StartInstrumentation() {
+#ifdef LYCANITE_LATENCY
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    latencyFrequency = (UINT64)frequency.QuadPart;
+    latencyCpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    latencies = (LatencyHistogram*)calloc((SIZE_T)latencyCpuCount * LATENCY_CALLBACKS * LATENCY_STAGES, sizeof(LatencyHistogram));
+#endif
+#ifdef LYCANITE_TRACE
+    traceBuffer = TraceBuffer_create(LYCANITE_TRACE_RECORDS);
+#endif
+}
+
+// Once the filter is unregistered
+VOID StopInstrumentation() {
+#ifdef LYCANITE_LATENCY
+    free(latencies);
+    latencies = NULL;
+#endif
+#ifdef LYCANITE_TRACE
+    TraceBuffer_destroy(traceBuffer);
+    traceBuffer = NULL;
+#endif
+    captureEnabled = 0;
+    DecisionCapture_destroy(capture);
+    capture = NULL;
+}
+
+/*
+ * Processes and rules in place when a capture starts. The first process found
+ * of a sandbox is recorded as opening it, the others as its children.
+ */
+VOID captureSnapshot() {
+    hashmap_map* processes = (hashmap_map*)processTree.index;
+    map_t roots = ihashmap_new();
+    UINT64 global = 0;
+
+    FltAcquirePushLockShared(&processesLock);
+    for (INT i = 0; i < processes->table_size; i++) {
+        if (processes->data[i].in_use != IHASHMAP_USED) {
+            continue;
+        }
+
+        processInfos* pinfo = (processInfos*)((ProcessNode*)processes->data[i].data)->sandbox;
+        UINT64 processId = processes->data[i].key;
+        any_t root = NULL;
+
+        if (roots != NULL && ihashmap_get(roots, pinfo->uuid, &root) == MAP_OK) {
+            DecisionCapture_process(capture, processId, (UINT64)root, pinfo->uuid, TRUE);
+        }
+        else {
+            if (roots != NULL) {
+                ihashmap_put(roots, pinfo->uuid, (any_t)processId);
+            }
+            DecisionCapture_process(capture, processId, 0, pinfo->uuid, TRUE);
+        }
+    }
+    FltReleasePushLock(&processesLock);
+    if (roots != NULL) {
+        ihashmap_free(roots);
+    }
+
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        controllerInfos* cinfo = &controllers[slot];
+        FltAcquirePushLockShared(&cinfo->lock);
+        if (cinfo->sandboxes != NULL) {
+            ihashmap_iterate(cinfo->sandboxes, captureSandboxRules, NULL);
+        }
+        FltReleasePushLock(&cinfo->lock);
+    }
+
+    FltAcquirePushLockShared(&globalPermLock);
+    VolumeRules_iterate(&globalPerm, captureRulePath, &global);
+    FltReleasePushLock(&globalPermLock);
+}
+
+INT captureSandboxRules(any_t item, any_t data) {
+    UNREFERENCED_PARAMETER(item);
+    processInfos* pinfo = (processInfos*)data;
+
+    if (pinfo->base != NULL) {
+        PathTrie_iterate(&pinfo->base->rules, captureRulePath, &pinfo->uuid);
+    }
+    hashmap_iterate_pairs(pinfo->permissions, captureRuleElement, &pinfo->uuid);
+    return MAP_OK;
+}
+
+BOOLEAN captureRulePath(PVOID context, CONST WCHAR* path, UINT32 length, UINT64 permissions) {
+    DecisionCapture_rule(capture, *(UINT64*)context, permissions, path, length);
+    return TRUE;
+}
+
+INT8 captureRuleElement(PVOID const context, struct hashmap_element_s* const e) {
+    UINT64 permissions = *(UINT64*)e->data;
+    DecisionCapture_rule(capture, *(UINT64*)context, permissions & RULESET_DELETED ? 0 : permissions, e->key, e->key_len);
+    return 0;
+}
+
+// Rule changes made while capturing, 0 permissions for a deletion
+VOID captureRule(UINT64 uuid, UINT64 permissions, CONST WCHAR* path, UINT64 length) {
+    if (ReadNoFence(&captureEnabled)) {
+        DecisionCapture_rule(capture, uuid, permissions, path, (UINT32)length);
+    }
+}
+
+/* ======================================================
+*                       Event Worker
+*  ======================================================*/
+
+NTSTATUS StartEventWorker() {
+    HANDLE threadHandle = NULL;
+
+    eventBatch = (unsigned char*)calloc(LYCANITE_EVENT_BATCH_SIZE, sizeof(unsigned char));
+    denials = DenialTable_create(LYCANITE_DENIAL_TABLE_SIZE, 10000LL * LYCANITE_DENIAL_WINDOW_MS, queueDenial);
+
+    if (eventBatch == NULL || denials == NULL) {
+        FreeEventWorker();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    eventWorkerStop = 0;
+    KeInitializeEvent(&eventWorkerWake, SynchronizationEvent, FALSE);
+
+    NTSTATUS status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, EventWorker, NULL);
+    if (!NT_SUCCESS(status)) {
+        FreeEventWorker();
+        return status;
+    }
+
+    // Can't fail for a handle we just got from PsCreateSystemThread
+    ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, &eventWorkerThread, NULL);
+    ZwClose(threadHandle);
+
+    return STATUS_SUCCESS;
+}
+
+VOID StopEventWorker() {
+    if (eventWorkerThread != NULL) {
+        InterlockedExchange(&eventWorkerStop, 1);
+        KeSetEvent(&eventWorkerWake, 0, FALSE);
+        KeWaitForSingleObject(eventWorkerThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(eventWorkerThread);
+        eventWorkerThread = NULL;
+    }
+}
+
+// Once nothing can queue events anymore
+VOID FreeEventWorker() {
+    DenialTable_destroy(denials);
+    free(eventBatch);
+    denials = NULL;
+    eventBatch = NULL;
+}
+
+BOOLEAN nextEvent(controllerInfos* cinfo, lycaniteEvent* event) {
+    if (cinfo->hasPendingEvent) {
+        *event = cinfo->pendingEvent;
+        cinfo->hasPendingEvent = FALSE;
+        return TRUE;
+    }
+    return EventQueue_pop(cinfo->events, event);
+}
+
+// Keep an event that couldn't be delivered, it goes out first on the next drain
+VOID holdEvent(controllerInfos* cinfo, CONST lycaniteEvent* event) {
+    cinfo->pendingEvent = *event;
+    cinfo->hasPendingEvent = TRUE;
+}
+
+/*
+ * Sends the queued events as batches over the communication port: a list of
+ * serialized events ended by a 0 type byte.
+ */
+UINT8 drainEventsToPort(controllerInfos* cinfo) {
+    ULONG size = 0;
+    ULONG count = 0;
+    lycaniteEvent event;
+
+    UINT64 lost = EventQueue_takeDropped(cinfo->events);
+    if (lost != 0) {
+        event.type = EVENTS_LOST;
+        event.processId = lost;
+        event.uuid = 0;
+        size += serializeEvent(&event, eventBatch + size);
+    }
+
+    while (size + LYCANITE_EVENT_MAX_SIZE < LYCANITE_EVENT_BATCH_SIZE && nextEvent(cinfo, &event)) {
+        size += serializeEvent(&event, eventBatch + size);
+        count++;
+    }
+
+    if (size == 0) {
+        return EVENTS_EMPTY;
+    }
+
+    eventBatch[size++] = 0;
+
+    LARGE_INTEGER time;
+    time.QuadPart = -10000000;
+    ULONG byterec = 0;
+    NTSTATUS status = FltSendMessage(gFilterInstance, &cinfo->clientPort, eventBatch, size, NULL, &byterec, &time);
+
+    if (status == STATUS_SUCCESS) {
+        InterlockedExchangeAdd64(&eventsSent, count);
+    }
+    else {
+        if (status == STATUS_TIMEOUT) {
+            KdPrint(("Failed to deliver message: Timedout"));
+        }
+        InterlockedExchangeAdd64(&eventsFailed, count);
+    }
+    return EVENTS_DRAINED;
+}
+
+BOOLEAN writeEventToRing(eventRing* target, CONST lycaniteEvent* event) {
+    unsigned char entry[LYCANITE_EVENT_MAX_SIZE];
+    UINT8 status = SharedRing_write(&target->producer, entry, (UINT16)serializeEvent(event, entry));
+
+    if (status == SHARED_RING_OK_WAKE) {
+        KeSetEvent(target->doorbell, 0, FALSE);
+    }
+    return status == SHARED_RING_OK || status == SHARED_RING_OK_WAKE;
+}
+
+/*
+ * Writes the queued events in place into the ring mapped in the controller.
+ * A full ring leaves the events in the queue, which drops and counts the
+ * overflow until the controller catches up.
+ */
+UINT8 drainEventsToRing(controllerInfos* cinfo) {
+    UINT8 drained = EVENTS_EMPTY;
+    lycaniteEvent event;
+
+    UINT64 lost = EventQueue_takeDropped(cinfo->events);
+    if (lost != 0) {
+        event.type = EVENTS_LOST;
+        event.processId = lost;
+        event.uuid = 0;
+        if (!writeEventToRing(&cinfo->ring, &event)) {
+            EventQueue_restoreDropped(cinfo->events, lost);
+            return EVENTS_BLOCKED;
+        }
+        drained = EVENTS_DRAINED;
+    }
+
+    while (nextEvent(cinfo, &event)) {
+        if (!writeEventToRing(&cinfo->ring, &event)) {
+            holdEvent(cinfo, &event);
+            return EVENTS_BLOCKED;
+        }
+        InterlockedIncrement64(&eventsSent);
+        drained = EVENTS_DRAINED;
+    }
+    return drained;
+}
+
+/*
+ * Delivers the events of a controller through the shared ring when it mapped
+ * one, its port otherwise. Slots never connected have no queue yet.
+ */
+UINT8 drainController(controllerInfos* cinfo) {
+    UINT8 drained;
+
+    if (ReadPointerAcquire((PVOID volatile*)&cinfo->events) == NULL) {
+        return EVENTS_EMPTY;
+    }
+
+    FltAcquirePushLockShared(&cinfo->ringLock);
+    if (cinfo->ring.ring != NULL) {
+        drained = drainEventsToRing(cinfo);
+        FltReleasePushLock(&cinfo->ringLock);
+    }
+    else {
+        FltReleasePushLock(&cinfo->ringLock);
+        drained = drainEventsToPort(cinfo);
+    }
+    return drained;
+}
+
+// Doorbells of every queue, see EventQueue_sleep
+VOID sleepControllers(BOOLEAN sleeping) {
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        EventQueue* queue = (EventQueue*)ReadPointerAcquire((PVOID volatile*)&controllers[slot].events);
+        if (queue != NULL) {
+            if (sleeping) {
+                EventQueue_sleep(queue);
+            }
+            else {
+                EventQueue_awake(queue);
+            }
+        }
+    }
+}
+
+BOOLEAN controllersIdle() {
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        EventQueue* queue = (EventQueue*)ReadPointerAcquire((PVOID volatile*)&controllers[slot].events);
+        if (queue != NULL && !EventQueue_isEmpty(queue)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Delivers queued events so process creation never waits on a controller.
+ * A controller whose ring is full only delays its own events.
+ */
+VOID EventWorker(_In_ PVOID StartContext) {
+    UNREFERENCED_PARAMETER(StartContext);
+
+    LONG64 window = 10000LL * LYCANITE_DENIAL_WINDOW_MS;
+    LONG64 nextSweep = 0;
+
+    while (!ReadNoFence(&eventWorkerStop)) {
+        BOOLEAN drained = FALSE;
+        BOOLEAN blocked = FALSE;
+        LONG64 now = (LONG64)KeQueryInterruptTime();
+        BOOLEAN reclaimPending = reclaimSandboxes(LYCANITE_RECLAIM_BATCH);
+        BOOLEAN expiryPending = expireRules(LYCANITE_EXPIRY_BATCH);
+
+        // report the counts of coalesced denials whose window is over
+        if (now >= nextSweep && DenialTable_hasPending(denials)) {
+            DenialTable_flush(denials, now, FALSE);
+            nextSweep = now + window / 2;
+        }
+
+        for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+            UINT8 result = drainController(&controllers[slot]);
+            drained |= result == EVENTS_DRAINED;
+            blocked |= result == EVENTS_BLOCKED;
+        }
+
+        if (!drained && !blocked && !reclaimPending && !expiryPending) {
+            sleepControllers(TRUE);
+            if (controllersIdle() && ReclaimQueue_isEmpty(&reclaimQueue) && !ReadNoFence(&eventWorkerStop)) {
+                // until the next sweep or rule expiry, whichever comes first
+                LONG64 wait = DenialTable_hasPending(denials) ? window / 2 : -1;
+                LONG64 expiry = nextRuleExpiry();
+                if (expiry != 0) {
+                    expiry = expiry > now ? expiry - now : 0;
+                    wait = wait < 0 || expiry < wait ? expiry : wait;
+                }
+
+                if (wait >= 0) {
+                    LARGE_INTEGER timeout;
+                    timeout.QuadPart = -wait;
+                    KeWaitForSingleObject(&eventWorkerWake, Executive, KernelMode, FALSE, &timeout);
+                }
+                else {
+                    KeWaitForSingleObject(&eventWorkerWake, Executive, KernelMode, FALSE, NULL);
+                }
+            }
+            sleepControllers(FALSE);
+        }
+        else if (!drained && blocked) {
+            LARGE_INTEGER retry;
+            retry.QuadPart = -10000LL * LYCANITE_EVENT_RING_RETRY_MS;
+            KeWaitForSingleObject(&eventWorkerWake, Executive, KernelMode, FALSE, &retry);
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/*
+ * Unmaps the ring from the controller, from its address space if we are
+ * called from another process (disconnect, unload).
+ */
+VOID releaseEventRing(eventRing* target) {
+    if (target->userAddress != NULL) {
+        KAPC_STATE apcState;
+        BOOLEAN attached = FALSE;
+
+        if (target->process != NULL && target->process != PsGetCurrentProcess()) {
+            KeStackAttachProcess((PRKPROCESS)target->process, &apcState);
+            attached = TRUE;
+        }
+        MmUnmapLockedPages(target->userAddress, target->mdl);
+        if (attached) {
+            KeUnstackDetachProcess(&apcState);
+        }
+    }
+    if (target->mdl != NULL) {
+        IoFreeMdl(target->mdl);
+    }
+    if (target->process != NULL) {
+        ObDereferenceObject(target->process);
+    }
+    if (target->doorbell != NULL) {
+        ObDereferenceObject(target->doorbell);
+    }
+    free(target->ring);
+    Kmemset(target, 0, sizeof(eventRing));
+}
+
+FLT_PREOP_CALLBACK_STATUS AvPreCreate(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
+    UNREFERENCED_PARAMETER(FltObjects);
+    UNREFERENCED_PARAMETER(CompletionContext);
+
+    processInfos* pinfo = requestorSandbox(Data);
+    NTSTATUS status;
+    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+
+    LATENCY_START(nameQuery);
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
+    if (NT_SUCCESS(status)) {
+        status = FltParseFileNameInformation(FileNameInfo);
+        LATENCY_RECORD(Data, LATENCY_NAME_QUERY, nameQuery);
+        if (NT_SUCCESS(status)) {
+            ULONG Disposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0xFF;
+            if (Disposition == FILE_OPEN) {
+                if (Data->Iopb->Parameters.Create.Options & FILE_DELETE_ON_CLOSE) {
+                    if (isRestricted(Data, pinfo, FileNameInfo, LYCANITE_DELETE)) {
+                        FltReleaseFileNameInformation(FileNameInfo);
+                        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+                        Data->IoStatus.Information = 0;
+
+                        return FLT_PREOP_COMPLETE;
+                    }
+                }
+                else {
+                    if (isRestricted(Data, pinfo, FileNameInfo, LYCANITE_READ)) {
+                        FltReleaseFileNameInformation(FileNameInfo);
+                        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+                        Data->IoStatus.Information = 0;
+
+                        return FLT_PREOP_COMPLETE;
+                    }
+                }
+            }
+            else {
+                if (isRestricted(Data, pinfo, FileNameInfo, LYCANITE_WRITE)) {
+                    FltReleaseFileNameInformation(FileNameInfo);
+                    Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+                    Data->IoStatus.Information = 0;
+
+                    return FLT_PREOP_COMPLETE;
+                }
+            }
+            FltReleaseFileNameInformation(FileNameInfo);
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        countNameQueryFailure(pinfo);
+    }
+
+    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+}
+
+FLT_PREOP_CALLBACK_STATUS AvPreRead(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
+    UNREFERENCED_PARAMETER(FltObjects);
+    UNREFERENCED_PARAMETER(CompletionContext);
+
+    processInfos* pinfo = requestorSandbox(Data);
+    NTSTATUS status;
+    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+
+    LATENCY_START(nameQuery);
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
+
+    if (NT_SUCCESS(status)) {
+        status = FltParseFileNameInformation(FileNameInfo);
+        LATENCY_RECORD(Data, LATENCY_NAME_QUERY, nameQuery);
+        if (NT_SUCCESS(status)) {
+            if (isRestricted(Data, pinfo, FileNameInfo, LYCANITE_READ)) {
+                FltReleaseFileNameInformation(FileNameInfo);
+                Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+                Data->IoStatus.Information = 0;
+
+                return FLT_PREOP_COMPLETE;
+            }
+            FltReleaseFileNameInformation(FileNameInfo);
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        countNameQueryFailure(pinfo);
+    }
+
+    // allowed, or not known to be denied: the I/O budget applies
+    if (!throttleIo(Data, pinfo, BUDGET_READ_OPS, Data->Iopb->Parameters.Read.Length)) {
+        Data->IoStatus.Status = STATUS_DEVICE_BUSY;
+        Data->IoStatus.Information = 0;
+
+        return FLT_PREOP_COMPLETE;
+    }
+
+    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+}
+
+FLT_PREOP_CALLBACK_STATUS AvPreWrite(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
+    UNREFERENCED_PARAMETER(FltObjects);
+
+    processInfos* pinfo = requestorSandbox(Data);
+    NTSTATUS status;
+    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+
+    LATENCY_START(nameQuery);
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
+
+    if (NT_SUCCESS(status)) {
+        status = FltParseFileNameInformation(FileNameInfo);
+        LATENCY_RECORD(Data, LATENCY_NAME_QUERY, nameQuery);
+        if (NT_SUCCESS(status)) {
+            if (isRestricted(Data, pinfo, FileNameInfo, LYCANITE_WRITE)) {
+                FltReleaseFileNameInformation(FileNameInfo);
+                Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+                Data->IoStatus.Information = 0;
+
+                return FLT_PREOP_COMPLETE;
+            }
+            FltReleaseFileNameInformation(FileNameInfo);
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        countNameQueryFailure(pinfo);
+    }
+
+    // allowed, or not known to be denied: a write crossing the quota is refused whole, before waiting on the I/O budget
+    UINT64 bytes = Data->Iopb->Parameters.Write.Length;
+    WriteQuota* charged;
+    if (!chargeWriteQuota(Data, pinfo, bytes, &charged)) {
+        Data->IoStatus.Status = STATUS_QUOTA_EXCEEDED;
+        Data->IoStatus.Information = 0;
+
+        return FLT_PREOP_COMPLETE;
+    }
+
+    if (!throttleIo(Data, pinfo, BUDGET_WRITE_OPS, bytes)) {
+        if (charged != NULL) {
+            refundWriteQuota(charged, bytes);
+        }
+        Data->IoStatus.Status = STATUS_DEVICE_BUSY;
+        Data->IoStatus.Information = 0;
+
+        return FLT_PREOP_COMPLETE;
+    }
+
+    if (charged != NULL) {
+        // what it doesn't write is given back once it completed
+        *CompletionContext = charged;
+        return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+    }
+    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+}
+
+/*
+ * Only for writes charged to a quota. A failed write is refunded whole, a
+ * short one what it didn't write.
+ */
+FLT_POSTOP_CALLBACK_STATUS AvPostWrite(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _In_opt_ PVOID CompletionContext, _In_ FLT_POST_OPERATION_FLAGS Flags) {
+    UNREFERENCED_PARAMETER(FltObjects);
+    UNREFERENCED_PARAMETER(Flags);
+
+    UINT64 bytes = Data->Iopb->Parameters.Write.Length;
+    UINT64 written = NT_SUCCESS(Data->IoStatus.Status) ? (UINT64)Data->IoStatus.Information : 0;
+    refundWriteQuota((WriteQuota*)CompletionContext, written < bytes ? bytes - written : 0);
+
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
+FLT_PREOP_CALLBACK_STATUS AvPreSetInformation(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
+    UNREFERENCED_PARAMETER(FltObjects);
+    UNREFERENCED_PARAMETER(CompletionContext);
+
+    processInfos* pinfo = requestorSandbox(Data);
+    NTSTATUS status;
+    PFLT_FILE_NAME_INFORMATION FileNameInfo;
+
+    LATENCY_START(nameQuery);
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &FileNameInfo);
+
+    if (NT_SUCCESS(status)) {
+        status = FltParseFileNameInformation(FileNameInfo);
+        LATENCY_RECORD(Data, LATENCY_NAME_QUERY, nameQuery);
+        if (NT_SUCCESS(status)) {
+
+            if ((Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformation) ||
+                (Data->Iopb->Parameters.SetFileInformation.FileInformationClass == FileDispositionInformationEx)) {
+
+                ULONG flags = ((PFILE_DISPOSITION_INFORMATION_EX)Data->Iopb->Parameters.SetFileInformation.InfoBuffer)->Flags;
+
+                if (FlagOn(flags, FILE_DISPOSITION_DELETE)) {
+                    if (isRestricted(Data, pinfo, FileNameInfo, LYCANITE_DELETE)) {
+                        FltReleaseFileNameInformation(FileNameInfo);
+                        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+                        Data->IoStatus.Information = 0;
+
+                        return FLT_PREOP_COMPLETE;
+                    }
+                }
+            }
+
+            FltReleaseFileNameInformation(FileNameInfo);
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        countNameQueryFailure(pinfo);
+    }
+
+    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+}
+
+#ifdef LYCANITE_LATENCY
+// Registered instead of the callbacks above to time the whole decision
+FLT_PREOP_CALLBACK_STATUS AvPreTimed(_Inout_ PFLT_CALLBACK_DATA Data, _In_ PCFLT_RELATED_OBJECTS FltObjects, _Flt_CompletionContext_Outptr_ PVOID* CompletionContext) {
+    FLT_PREOP_CALLBACK_STATUS status;
+    LATENCY_START(total);
+
+    switch (Data->Iopb->MajorFunction) {
+    case IRP_MJ_READ:
+        status = AvPreRead(Data, FltObjects, CompletionContext);
+        break;
+    case IRP_MJ_WRITE:
+        status = AvPreWrite(Data, FltObjects, CompletionContext);
+        break;
+    case IRP_MJ_SET_INFORMATION:
+        status = AvPreSetInformation(Data, FltObjects, CompletionContext);
+        break;
+    default:
+        status = AvPreCreate(Data, FltObjects, CompletionContext);
+        break;
+    }
+
+    LATENCY_RECORD(Data, LATENCY_TOTAL, total);
+    return status;
+}
+#endif
+
+/* ======================================================
+*                 Communication Callbacks
+*  ======================================================*/
+
+NTSTATUS
+comConnectNotifyCallback(
+    _In_ PFLT_PORT ClientPort,
+    _In_ PVOID ServerPortCookie,
+    _In_reads_bytes_(SizeOfContext) PVOID ConnectionContext,
+    _In_ ULONG SizeOfContext,
+    _Outptr_result_maybenull_ PVOID* ConnectionCookie
+) {
+
+    UNREFERENCED_PARAMETER(ServerPortCookie);
+    UNREFERENCED_PARAMETER(ConnectionContext);
+    UNREFERENCED_PARAMETER(SizeOfContext);
+    
+    *ConnectionCookie = NULL;
+
+    /*
+     * A slot whose sandboxes outlived their controller is skipped: a new
+     * connection must not take over their rules. The first connection, or
+     * the next one once it is gone, is the primary controller.
+     */
+    FltAcquirePushLockExclusive(&controllersLock);
+    for (UINT32 slot = 0; slot < LYCANITE_MAX_CONTROLLERS; slot++) {
+        controllerInfos* cinfo = &controllers[slot];
+
+        if (cinfo->clientPort == NULL && !hasOpenSandboxes(cinfo)) {
+            if (!openController(cinfo)) {
+                break;
+            }
+            cinfo->clientPort = ClientPort;
+            if (primaryController == NULL) {
+                WritePointerRelease((PVOID volatile*)&primaryController, cinfo);
+            }
+            *ConnectionCookie = cinfo;
+            FltReleasePushLock(&controllersLock);
+            KdPrint(("Com Connect [%u]\n", slot));
+            return STATUS_SUCCESS;
+        }
+    }
+    FltReleasePushLock(&controllersLock);
+
+    KdPrint(("Com Connection refused\n"));
+    return STATUS_ABANDONED;
+}
+
+VOID
+comDisconnectNotifyCallback(
+    _In_opt_ PVOID ConnectionCookie
+) {
+    controllerInfos* cinfo = (controllerInfos*)ConnectionCookie;
+    eventRing previous;
+
+    if (cinfo == NULL) {
+        return;
+    }
+
+    KdPrint(("Com Disconnect [%u]\n", cinfo->slot));
+    // no sandbox opens for the slot once the process notify routine is out
+    FltAcquirePushLockExclusive(&processesLock);
+    if (InterlockedExchange64(&cinfo->pid, 0) != 0) {
+        InterlockedDecrement(&registeredControllers);
+    }
+    FltReleasePushLock(&processesLock);
+
+    FltAcquirePushLockExclusive(&cinfo->ringLock);
+    previous = cinfo->ring;
+    Kmemset(&cinfo->ring, 0, sizeof(eventRing));
+    FltReleasePushLock(&cinfo->ringLock);
+    releaseEventRing(&previous);
+
+    // the slot is free for the next connection once its port is closed
+    FltAcquirePushLockExclusive(&controllersLock);
+    FltCloseClientPort(gFilterInstance, &cinfo->clientPort);
+    cinfo->clientPort = NULL;
+    if (primaryController == cinfo) {
+        WritePointerRelease((PVOID volatile*)&primaryController, NULL);
+    }
+    FltReleasePushLock(&controllersLock);
+}
+
+/*
+ * Processes created by `pid` open sandboxes owned by this controller. When
+ * several controllers register the same process, the lowest slot owns them.
+ */
+UINT8
+comSetLycanitePid(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ ULONG InputBufferSize
+) {
+    if (InputBufferSize != 9) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 pid = 0;
+
+    pid |= (((UINT64)Input[1]) & 0xFF);
+    pid |= (((UINT64)Input[2]) & 0xFF) << 8L;
+    pid |= (((UINT64)Input[3]) & 0xFF) << 16L;
+    pid |= (((UINT64)Input[4]) & 0xFF) << 24L;
+    pid |= (((UINT64)Input[5]) & 0xFF) << 32L;
+    pid |= (((UINT64)Input[6]) & 0xFF) << 40L;
+    pid |= (((UINT64)Input[7]) & 0xFF) << 48L;
+    pid |= (((UINT64)Input[8]) & 0xFF) << 56L;
+
+    KdPrint(("Set Lycanite PID [%u] [%llu]\n", Controller->slot, pid));
+
+    fillSandboxPool();
+    if (InterlockedExchange64(&Controller->pid, (LONG64)pid) == 0) {
+        InterlockedIncrement(&registeredControllers);
+    }
+    return STATUS_SUCCESS;
+}
+
+UINT8
+comSetAuthorizationPid(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _In_ UINT32 Ttl
+) {
+    if (InputBufferSize <= 18) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 len = 0;
+    UINT64 pid = 0;
+    UINT64 perms = 0;
+
+    pid |= (((UINT64)Input[1]) & 0xFF);
+    pid |= (((UINT64)Input[2]) & 0xFF) << 8L;
+    pid |= (((UINT64)Input[3]) & 0xFF) << 16L;
+    pid |= (((UINT64)Input[4]) & 0xFF) << 24L;
+    pid |= (((UINT64)Input[5]) & 0xFF) << 32L;
+    pid |= (((UINT64)Input[6]) & 0xFF) << 40L;
+    pid |= (((UINT64)Input[7]) & 0xFF) << 48L;
+    pid |= (((UINT64)Input[8]) & 0xFF) << 56L;
+
+    perms |= (((UINT64)Input[9]) & 0xFF);
+    perms |= (((UINT64)Input[10]) & 0xFF) << 8L;
+    perms |= (((UINT64)Input[11]) & 0xFF) << 16L;
+    perms |= (((UINT64)Input[12]) & 0xFF) << 24L;
+    perms |= (((UINT64)Input[13]) & 0xFF) << 32L;
+    perms |= (((UINT64)Input[14]) & 0xFF) << 40L;
+    perms |= (((UINT64)Input[15]) & 0xFF) << 48L;
+    perms |= (((UINT64)Input[16]) & 0xFF) << 56L;
+
+    len |= (((UINT16)Input[17]) & 0xFF);
+    len |= (((UINT16)Input[18]) & 0xFF) << 8L;
+
+
+    char* Message = (char*)calloc(len+1, sizeof(char));
+
+    if (Message == NULL) {
+        return BAD_ALLOC;
+    }
+
+    Message[len] = 0;
+    RtlCopyMemory(Message, (PCHAR)Input + 19, len);
+
+    PWCHAR file = wcharFromChar(Message, len, &len);
+    free(Message);
+
+    if (file == NULL) {
+        return BAD_ALLOC;
+    }
+
+    // only the sandboxes of this controller, the lock keeps them open meanwhile
+    UINT8 status = STATUS_SUCCESS;
+    processInfos* pinfo = NULL;
+    timedRule* expiry = NULL;
+    BOOLEAN added = FALSE;
+    PWCHAR unused = file; // not the key of a new rule
+    FltAcquirePushLockExclusive(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, pid, (any_t*)&pinfo) != MAP_OK) {
+        // unknown sandbox, or another controller's
+    }
+    // a rule whose expiry can't be kept isn't set
+    else if (Ttl != 0 && (expiry = reserveRule(&pinfo->timed, pid, file, len, &added)) == NULL) {
+        status = BAD_ALLOC;
+    }
+    else {
+        UINT64 *perm_ptr = (UINT64 *)hashmap_get_shared(pinfo->permissions, file, (UINT32)len);
+
+        if (perm_ptr != NULL) {
+            *perm_ptr = perms;
+        } else {
+            perm_ptr = (UINT64*)calloc(1, sizeof(UINT64));
+            if (perm_ptr == NULL) {
+                status = BAD_ALLOC;
+            }
+            else {
+                *perm_ptr = perms;
+                if (!putSandboxRule(pinfo, file, len, perm_ptr)) {
+                    free(perm_ptr);
+                    status = BAD_ALLOC;
+                }
+                else {
+                    unused = NULL;
+                }
+            }
+        }
+
+        if (status != STATUS_SUCCESS) {
+            if (added) {
+                dropRule(pinfo->timed, expiry);
+            }
+        }
+        else {
+            KdPrint(("Set PID Auth [%llu] %ws\n", len, file));
+            if (Ttl != 0) {
+                armRule(&Controller->timers, expiry, Ttl);
+            }
+            else {
+                disarmRule(&Controller->timers, pinfo->timed, file, len);
+            }
+            captureRule(pid, perms, file, len);
+        }
+    }
+    FltReleasePushLock(&Controller->lock);
+    free(unused);
+
+    return status;
+}
+
+UINT8
+comSetAuthorizationGlobal(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _In_ UINT32 Ttl
+) {
+    if (InputBufferSize <= 10) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 len = 0;
+    UINT64 perms = 0;
+
+    perms |= (((UINT64)Input[1]) & 0xFF);
+    perms |= (((UINT64)Input[2]) & 0xFF) << 8L;
+    perms |= (((UINT64)Input[3]) & 0xFF) << 16L;
+    perms |= (((UINT64)Input[4]) & 0xFF) << 24L;
+    perms |= (((UINT64)Input[5]) & 0xFF) << 32L;
+    perms |= (((UINT64)Input[6]) & 0xFF) << 40L;
+    perms |= (((UINT64)Input[7]) & 0xFF) << 48L;
+    perms |= (((UINT64)Input[8]) & 0xFF) << 56L;
+
+    len |= (((UINT16)Input[9]) & 0xFF);
+    len |= (((UINT16)Input[10]) & 0xFF) << 8L;
+
+    char* Message = (char*)calloc(len + 1, sizeof(char));
+
+    if (Message == NULL) {
+        return BAD_ALLOC;
+    }
+
+    Message[len] = 0;
+    RtlCopyMemory(Message, (PCHAR)Input + 11, len);
+
+    PWCHAR file = wcharFromChar(Message, len, &len);
+    free(Message);
+
+    if (file == NULL) {
+        return BAD_ALLOC;
+    }
+
+    UINT8 status = STATUS_SUCCESS;
+    timedRule* expiry = NULL;
+    BOOLEAN added = FALSE;
+    FltAcquirePushLockExclusive(&globalPermLock);
+    // a rule whose expiry can't be kept isn't set, one that can't be set keeps its expiry
+    if (Ttl != 0 && (expiry = reserveRule(&globalTimed, 0, file, len, &added)) == NULL) {
+        status = BAD_ALLOC;
+    }
+    else if (VolumeRules_set(&globalPerm, file, (UINT32)len, perms)) {
+        KdPrint(("Set Global Auth [%llu] %ws\n", len, file));
+        if (Ttl != 0) {
+            armRule(&globalTimers, expiry, Ttl);
+        }
+        else {
+            disarmRule(&globalTimers, globalTimed, file, len);
+        }
+        captureRule(0, perms, file, len);
+    }
+    else {
+        if (added) {
+            dropRule(globalTimed, expiry);
+        }
+        status = BAD_ALLOC;
+    }
+    FltReleasePushLock(&globalPermLock);
+    free(file);
+
+    return status;
+}
+
+/*
+ * A SET_AUTHORIZATION_PID or _GLOBAL message after the TTL of the rule in
+ * milliseconds: [17][ttl UINT32][message]. The rule expires as if deleted,
+ * in LYCANITE_RULE_TICK_MS steps; setting it again replaces its expiry, and
+ * setting it without a TTL makes it permanent.
+ */
+UINT8
+comSetAuthorizationTtl(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+) {
+    if (InputBufferSize < 6) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT32 ttl = readUINT32(Input + 1);
+    ttl = ttl == 0 ? 1 : ttl;
+
+    switch (Input[5]) {
+        case SET_AUTHORIZATION_PID:
+            return comSetAuthorizationPid(Controller, Input + 5, InputBufferSize - 5, ttl);
+        case SET_AUTHORIZATION_GLOBAL:
+            if (!isPrimaryController(Controller)) {
+                return NOT_PRIMARY_CONTROLLER;
+            }
+            return comSetAuthorizationGlobal(Input + 5, InputBufferSize - 5, ttl);
+        default:
+            return UNKNOWN_REQUEST;
+    }
+}
+
+UINT8
+comDeleteAuthorizationPid(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+) {
+    if (InputBufferSize <= 10) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 len = 0;
+    UINT64 pid = 0;
+
+    pid |= (((UINT64)Input[1]) & 0xFF);
+    pid |= (((UINT64)Input[2]) & 0xFF) << 8L;
+    pid |= (((UINT64)Input[3]) & 0xFF) << 16L;
+    pid |= (((UINT64)Input[4]) & 0xFF) << 24L;
+    pid |= (((UINT64)Input[5]) & 0xFF) << 32L;
+    pid |= (((UINT64)Input[6]) & 0xFF) << 40L;
+    pid |= (((UINT64)Input[7]) & 0xFF) << 48L;
+    pid |= (((UINT64)Input[8]) & 0xFF) << 56L;
+
+    len |= (((UINT16)Input[9]) & 0xFF);
+    len |= (((UINT16)Input[10]) & 0xFF) << 8L;
+
+    char* Message = (char*)calloc(len + 1, sizeof(char));
+
+    if (Message == NULL) {
+        return BAD_ALLOC;
+    }
+    Message[len] = 0;
+
+    RtlCopyMemory(Message, (PCHAR)Input + 11, len);
+
+    PWCHAR file = wcharFromChar(Message, len, &len);
+    free(Message);
+
+    if (file == NULL) {
+        return BAD_ALLOC;
+    }
+
+    UINT8 status = STATUS_SUCCESS;
+    BOOLEAN kept = FALSE;
+    processInfos* pinfo = NULL;
+    FltAcquirePushLockExclusive(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, pid, (any_t*)&pinfo) == MAP_OK) {
+        disarmRule(&Controller->timers, pinfo->timed, file, len);
+        status = removeSandboxRule(pinfo, file, len, &kept);
+
+        KdPrint(("Delete PID Auth [%d] %ws\n", len, file));
+    }
+    FltReleasePushLock(&Controller->lock);
+
+    if (!kept) {
+        free(file);
+    }
+    return status;
+}
+
+// Shares the sandbox's rules with the sandboxes sealed with the same ones
+UINT8
+comSealAuthorizationPid(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+) {
+    if (InputBufferSize != 9) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 uuid = readUINT64(Input + 1);
+    UINT8 status = STATUS_SUCCESS;
+    processInfos* pinfo = NULL;
+
+    FltAcquirePushLockExclusive(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, uuid, (any_t*)&pinfo) == MAP_OK) {
+        status = sealSandbox(pinfo);
+        KdPrint(("Seal PID Auth [%llu] %u shared rule sets\n", uuid, ruleSets.count));
+    }
+    FltReleasePushLock(&Controller->lock);
+
+    return status;
+}
+
+UINT8
+comDeleteAuthorizationGlobal(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+) {
+    if (InputBufferSize <= 2) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 len = 0;
+
+    len |= (((UINT16)Input[1]) & 0xFF);
+    len |= (((UINT16)Input[2]) & 0xFF) << 8L;
+
+    if (InputBufferSize < 3 + len) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    char* Message = (char*)calloc(len + 1, sizeof(char));
+
+    if (Message == NULL) {
+        return BAD_ALLOC;
+    }
+
+    Message[len] = 0;
+    RtlCopyMemory(Message, (PCHAR)Input + 3, len);
+
+    PWCHAR file = wcharFromChar(Message, len, &len);
+    free(Message);
+
+    if (file == NULL) {
+        return BAD_ALLOC;
+    }
+
+    FltAcquirePushLockExclusive(&globalPermLock);
+    disarmRule(&globalTimers, globalTimed, file, len);
+    VolumeRules_remove(&globalPerm, file, (UINT32)len);
+    captureRule(0, 0, file, len);
+    FltReleasePushLock(&globalPermLock);
+
+    KdPrint(("Delete Global Auth [%d] %ws\n", len, file));
+    free(file);
+
+    return STATUS_SUCCESS;
+}
+
+UINT8
+comGetProcessStats(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+) {
+    if (InputBufferSize != 9 || Output == NULL || OutputBufferSize < LYCANITE_STATS_REPLY_SIZE) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 uuid = readUINT64(Input + 1);
+    processStatsCounters total;
+    UINT64 values[LYCANITE_STATS_REPLY_SIZE / sizeof(UINT64)];
+    unsigned char reply[LYCANITE_STATS_REPLY_SIZE];
+
+    processInfos* pinfo = NULL;
+    FltAcquirePushLockShared(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, uuid, (any_t*)&pinfo) != MAP_OK) {
+        // unknown sandbox, or another controller's: empty reply
+        FltReleasePushLock(&Controller->lock);
+        return STATUS_SUCCESS;
+    }
+
+    ProcessStats_sum(pinfo->stats, &total);
+    FltReleasePushLock(&Controller->lock);
+
+    for (UINT8 op = 0; op < STATS_OPERATIONS; op++) {
+        values[op] = (UINT64)total.checks[op];
+        values[STATS_OPERATIONS + op] = (UINT64)total.allows[op];
+        values[2 * STATS_OPERATIONS + op] = (UINT64)total.denies[op];
+    }
+    values[3 * STATS_OPERATIONS] = (UINT64)total.nameQueryFailures;
+    values[3 * STATS_OPERATIONS + 1] = (UINT64)total.lookupProbes;
+    values[3 * STATS_OPERATIONS + 2] = (UINT64)total.throttled;
+    values[3 * STATS_OPERATIONS + 3] = (UINT64)total.throttleFailures;
+
+    for (UINT8 i = 0; i < LYCANITE_STATS_REPLY_SIZE / sizeof(UINT64); i++) {
+        writeUINT64(reply + i * sizeof(UINT64), values[i]);
+    }
+
+    __try {
+        Kmemcpy(Output, reply, LYCANITE_STATS_REPLY_SIZE);
+        *ReturnOutputBufferLength = LYCANITE_STATS_REPLY_SIZE;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return INVALID_REQUEST_SIZE;
+    }
+    return STATUS_SUCCESS;
+}
+
+/*
+ * [12][uuid UINT64][count UINT8]. The paths the sandbox accessed most, at most
+ * HOTPATHS_ENTRIES of them; the output buffer must hold that many. Its
+ * accesses are only tracked from the first request on, which gets none.
+ */
+UINT8
+comGetHotPaths(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+) {
+    UINT32 count = InputBufferSize == 10 && Input[9] < HOTPATHS_ENTRIES ? Input[9] : HOTPATHS_ENTRIES;
+    if (InputBufferSize != 10 || Output == NULL || OutputBufferSize < 9 + count * LYCANITE_HOT_PATH_SIZE) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 uuid = readUINT64(Input + 1);
+    HotPath top[HOTPATHS_ENTRIES];
+    UINT64 dropped = 0;
+    unsigned char reply[LYCANITE_HOT_PATHS_REPLY_SIZE];
+
+    processInfos* pinfo = NULL;
+    FltAcquirePushLockShared(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, uuid, (any_t*)&pinfo) != MAP_OK) {
+        // unknown sandbox, or another controller's: empty reply
+        FltReleasePushLock(&Controller->lock);
+        return STATUS_SUCCESS;
+    }
+
+    HotPaths* hotPaths = (HotPaths*)ReadPointerAcquire((PVOID volatile*)&pinfo->hotPaths);
+    if (hotPaths == NULL) {
+        hotPaths = HotPaths_create();
+        if (hotPaths != NULL && InterlockedCompareExchangePointer((PVOID volatile*)&pinfo->hotPaths, hotPaths, NULL) != NULL) {
+            HotPaths_destroy(hotPaths); // another request got there first
+            hotPaths = (HotPaths*)ReadPointerAcquire((PVOID volatile*)&pinfo->hotPaths);
+        }
+    }
+    count = HotPaths_top(hotPaths, top, count, &dropped);
+    FltReleasePushLock(&Controller->lock);
+
+    writeUINT64(reply, dropped);
+    reply[8] = (unsigned char)count;
+    ULONG size = 9;
+    for (UINT32 i = 0; i < count; i++) {
+        writeUINT32(reply + size, top[i].hash);
+        writeUINT64(reply + size + 4, top[i].count);
+        writeUINT64(reply + size + 12, top[i].error);
+        reply[size + 20] = top[i].tailLength;
+        size += 21;
+        for (UINT8 c = 0; c < top[i].tailLength; c++) {
+            reply[size++] = (unsigned char)(top[i].tail[c] & 0xFF);
+            reply[size++] = (unsigned char)((top[i].tail[c] >> 8) & 0xFF);
+        }
+    }
+
+    __try {
+        Kmemcpy(Output, reply, size);
+        *ReturnOutputBufferLength = size;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return INVALID_REQUEST_SIZE;
+    }
+    return STATUS_SUCCESS;
+}
+
+/*
+ * [13][uuid UINT64][enable UINT8]. A learning sandbox allows what its rules
+ * deny and learns the rules that would allow it; enabling forgets what was
+ * learned before. Global rules are still enforced.
+ */
+UINT8
+comSetLearning(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+) {
+    if (InputBufferSize != 10) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 uuid = readUINT64(Input + 1);
+    UINT8 status = STATUS_SUCCESS;
+    processInfos* pinfo = NULL;
+
+    FltAcquirePushLockExclusive(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, uuid, (any_t*)&pinfo) == MAP_OK) {
+        if (Input[9] == 0) {
+            InterlockedExchange(&pinfo->learning, 0);
+        }
+        else if (pinfo->learned != NULL) {
+            LearnedRules_reset(pinfo->learned);
+            InterlockedExchange(&pinfo->learning, 1);
+        }
+        else {
+            pinfo->learned = LearnedRules_create(LYCANITE_LEARNING_SLOTS, LYCANITE_LEARNING_TEXT, LYCANITE_LEARNING_FOLDER_FILES);
+            if (pinfo->learned == NULL) {
+                status = BAD_ALLOC;
+            }
+            else {
+                // published before the flag
+                InterlockedExchange(&pinfo->learning, 1);
+            }
+        }
+    }
+    FltReleasePushLock(&Controller->lock);
+
+    return status;
+}
+
+/*
+ * [14][uuid UINT64][cursor UINT32]. The rules learned by the sandbox from the
+ * cursor on, as many as fit; start at 0 and continue from the cursor of the
+ * reply until it is MAXUINT32. The output buffer must hold a rule of the
+ * longest path.
+ */
+UINT8
+comGetLearnedRules(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+) {
+    if (InputBufferSize != 13 || Output == NULL || OutputBufferSize < LYCANITE_LEARNED_REPLY_MIN) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 uuid = readUINT64(Input + 1);
+    UINT32 cursor = readUINT32(Input + 9);
+    UINT64 size = OutputBufferSize < LYCANITE_LEARNED_REPLY_MAX ? OutputBufferSize : LYCANITE_LEARNED_REPLY_MAX;
+    unsigned char* chunk = (unsigned char*)calloc(size, sizeof(unsigned char));
+    if (chunk == NULL) {
+        return BAD_ALLOC;
+    }
+
+    UINT64 written = 0;
+    UINT32 rules = 0;
+    UINT64 dropped = 0;
+    UINT32 next = LEARNEDRULES_END;
+    processInfos* pinfo = NULL;
+
+    // an unknown sandbox, or one that never learned, has no rules
+    FltAcquirePushLockShared(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, uuid, (any_t*)&pinfo) == MAP_OK && pinfo->learned != NULL) {
+        next = LearnedRules_read(pinfo->learned, cursor, chunk + LYCANITE_LEARNED_HEADER_SIZE,
+            size - LYCANITE_LEARNED_HEADER_SIZE, &written, &rules, &dropped);
+    }
+    FltReleasePushLock(&Controller->lock);
+
+    writeUINT64(chunk, dropped);
+    writeUINT32(chunk + 8, next);
+    writeUINT32(chunk + 12, rules);
+
+    UINT8 status = STATUS_SUCCESS;
+    __try {
+        Kmemcpy(Output, chunk, LYCANITE_LEARNED_HEADER_SIZE + written);
+        *ReturnOutputBufferLength = (ULONG)(LYCANITE_LEARNED_HEADER_SIZE + written);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = INVALID_REQUEST_SIZE;
+    }
+
+    free(chunk);
+    return status;
+}
+
+/*
+ * [15][uuid UINT64][read operations UINT64][read bytes UINT64][write operations UINT64][write bytes UINT64],
+ * per second, 0 for no limit. Each budget starts full, a second of I/O.
+ */
+UINT8
+comSetIoBudget(
+    _In_ controllerInfos* Controller,
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize
+) {
+    if (InputBufferSize != 41) {
+        return INVALID_REQUEST_SIZE;
+    }
+
+    UINT64 uuid = readUINT64(Input + 1);
+    UINT8 status = STATUS_SUCCESS;
+    processInfos* pinfo = NULL;
+
+    FltAcquirePushLockExclusive(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, uuid, (any_t*)&pinfo) == MAP_OK) {
+        ioBudget* budget = pinfo->budget;
+        if (budget == NULL) {
+            budget = (ioBudget*)calloc(1, sizeof(ioBudget));
+            UINT8 created = 0;
+            while (budget != NULL && created < BUDGET_BUCKETS && TokenBucket_create(&budget->buckets[created])) {
+                created++;
+            }
+            if (budget != NULL && created < BUDGET_BUCKETS) {
+                while (created > 0) {
+                    TokenBucket_destroy(&budget->buckets[--created]);
+                }
+                free(budget);
+                budget = NULL;
+            }
+        }
 
-    if (clientPort != NULL) {
-        KdPrint(("Com Disconnect\n"));
-        FltCloseClientPort(gFilterInstance, &clientPort);
+        if (budget == NULL) {
+            status = BAD_ALLOC;
+        }
+        else {
+            LONG64 now = (LONG64)KeQueryInterruptTime();
+            for (UINT8 i = 0; i < BUDGET_BUCKETS; i++) {
+                TokenBucket_setRate(&budget->buckets[i], readUINT64(Input + 9 + i * sizeof(UINT64)), 0, now);
+            }
+            if (pinfo->budget == NULL) {
+                InterlockedExchangePointer((PVOID volatile*)&pinfo->budget, budget);
+                InterlockedIncrement(&budgetedSandboxes);
+            }
+        }
     }
-    clientPort = NULL;
-    LPID = 0;
+    FltReleasePushLock(&Controller->lock);
+
+    return status;
 }
 
+/*
+ * [16][uuid UINT64][set UINT8][quota UINT64][usage UINT64]. Bit 0 of `set`
+ * sets the bytes the sandbox may write, 0 for no limit, bit 1 the bytes it
+ * wrote. Writes are accounted from the first set on; with nothing set it
+ * only reads. Replies with the quota, the usage and the writes refused, zeros
+ * before the first set.
+ */
 UINT8
-comSetLycanitePid(
+comWriteQuota(
+    _In_ controllerInfos* Controller,
     _In_ unsigned char* Input,
-    _In_ ULONG InputBufferSize
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
 ) {
-    if (InputBufferSize != 9) {
+    if (InputBufferSize != 26 || Output == NULL || OutputBufferSize < LYCANITE_WRITE_QUOTA_REPLY_SIZE) {
         return INVALID_REQUEST_SIZE;
     }
 
-    UINT64 pid = 0;
+    UINT64 uuid = readUINT64(Input + 1);
+    UINT8 set = Input[9];
+    UINT64 limit = 0;
+    UINT64 usage = 0;
+    UINT64 denied = 0;
+    UINT8 status = STATUS_SUCCESS;
+    processInfos* pinfo = NULL;
 
-    pid |= (((UINT64)Input[1]) & 0xFF);
-    pid |= (((UINT64)Input[2]) & 0xFF) << 8L;
-    pid |= (((UINT64)Input[3]) & 0xFF) << 16L;
-    pid |= (((UINT64)Input[4]) & 0xFF) << 24L;
-    pid |= (((UINT64)Input[5]) & 0xFF) << 32L;
-    pid |= (((UINT64)Input[6]) & 0xFF) << 40L;
-    pid |= (((UINT64)Input[7]) & 0xFF) << 48L;
-    pid |= (((UINT64)Input[8]) & 0xFF) << 56L;
+    FltAcquirePushLockExclusive(&Controller->lock);
+    if (ihashmap_get(Controller->sandboxes, uuid, (any_t*)&pinfo) != MAP_OK) {
+        // unknown sandbox, or another controller's: empty reply
+        FltReleasePushLock(&Controller->lock);
+        return STATUS_SUCCESS;
+    }
+
+    WriteQuota* quota = pinfo->writeQuota;
+    if (quota == NULL && (set & 0b11)) {
+        quota = WriteQuota_create();
+        if (quota == NULL) {
+            status = BAD_ALLOC;
+        }
+    }
+
+    if (quota != NULL) {
+        if (set & 0b01) {
+            WriteQuota_setQuota(quota, readUINT64(Input + 10));
+        }
+        if (set & 0b10) {
+            WriteQuota_setUsage(quota, readUINT64(Input + 18));
+        }
+        if (pinfo->writeQuota == NULL) {
+            InterlockedExchangePointer((PVOID volatile*)&pinfo->writeQuota, quota);
+            InterlockedIncrement(&quotaSandboxes);
+        }
+        WriteQuota_read(quota, &limit, &usage, &denied);
+    }
+    FltReleasePushLock(&Controller->lock);
+
+    if (status != STATUS_SUCCESS) {
+        return status;
+    }
 
-    KdPrint(("Set Lycanite PID [%llu]\n", pid));
+    unsigned char reply[LYCANITE_WRITE_QUOTA_REPLY_SIZE];
+    writeUINT64(reply, limit);
+    writeUINT64(reply + 8, usage);
+    writeUINT64(reply + 16, denied);
 
-    LPID = pid;
+    __try {
+        Kmemcpy(Output, reply, LYCANITE_WRITE_QUOTA_REPLY_SIZE);
+        *ReturnOutputBufferLength = LYCANITE_WRITE_QUOTA_REPLY_SIZE;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return INVALID_REQUEST_SIZE;
+    }
     return STATUS_SUCCESS;
 }
 
+/*
+ * [9][enable UINT8]. Enabling starts a new stream with a snapshot of the
+ * processes and rules; what wasn't read of the previous one is dropped.
+ */
 UINT8
-comSetAuthorizationPid(
+comSetCapture(
     _In_ unsigned char* Input,
     _In_ UINT64 InputBufferSize
 ) {
-    if (InputBufferSize <= 18) {
+    if (InputBufferSize != 2) {
         return INVALID_REQUEST_SIZE;
     }
 
-    UINT64 len = 0;
-    UINT64 pid = 0;
-    UINT64 perms = 0;
-
-    pid |= (((UINT64)Input[1]) & 0xFF);
-    pid |= (((UINT64)Input[2]) & 0xFF) << 8L;
-    pid |= (((UINT64)Input[3]) & 0xFF) << 16L;
-    pid |= (((UINT64)Input[4]) & 0xFF) << 24L;
-    pid |= (((UINT64)Input[5]) & 0xFF) << 32L;
-    pid |= (((UINT64)Input[6]) & 0xFF) << 40L;
-    pid |= (((UINT64)Input[7]) & 0xFF) << 48L;
-    pid |= (((UINT64)Input[8]) & 0xFF) << 56L;
-
-    perms |= (((UINT64)Input[9]) & 0xFF);
-    perms |= (((UINT64)Input[10]) & 0xFF) << 8L;
-    perms |= (((UINT64)Input[11]) & 0xFF) << 16L;
-    perms |= (((UINT64)Input[12]) & 0xFF) << 24L;
-    perms |= (((UINT64)Input[13]) & 0xFF) << 32L;
-    perms |= (((UINT64)Input[14]) & 0xFF) << 40L;
-    perms |= (((UINT64)Input[15]) & 0xFF) << 48L;
-    perms |= (((UINT64)Input[16]) & 0xFF) << 56L;
-
-    len |= (((UINT16)Input[17]) & 0xFF);
-    len |= (((UINT16)Input[18]) & 0xFF) << 8L;
-
-
-    char* Message = (char*)calloc(len+1, sizeof(char));
-
-    if (Message == NULL) {
-        return BAD_ALLOC;
+    if (Input[1] == 0) {
+        InterlockedExchange(&captureEnabled, 0);
+        KdPrint(("Capture Stopped\n"));
+        return STATUS_SUCCESS;
     }
 
-    Message[len] = 0;
-    RtlCopyMemory(Message, (PCHAR)Input + 19, len);
-
-    processInfos* pinfo = NULL;
-    if (ihashmap_get(ProcessesInfos, pid, &pinfo) == MAP_OK) {
-        PWCHAR file = wcharFromChar(Message, len, &len);
-        free(Message);
-
-        if (file == NULL) {
+    FltAcquirePushLockExclusive(&captureLock);
+    if (capture == NULL) {
+        capture = DecisionCapture_create(LYCANITE_CAPTURE_SIZE, LYCANITE_CAPTURE_PATHS);
+        if (capture == NULL) {
+            FltReleasePushLock(&captureLock);
             return BAD_ALLOC;
         }
-
-        UINT64 *perm_ptr = (UINT64 *)hashmap_get(&pinfo->permissions, file, (UINT32)len);
-
-        if (perm_ptr != NULL) {
-            KdPrint(("Set PID Auth [%llu] %ws\n", len, file));
-            free(file);
-            *perm_ptr = perms;
-        } else {
-            perm_ptr = (UINT64*)calloc(1, sizeof(UINT64));
-            if (perm_ptr == NULL) {
-                free(file);
-                return BAD_ALLOC;
-            }
-
-            *perm_ptr = perms;
-            hashmap_put(&pinfo->permissions, file, (UINT32)len, perm_ptr);
-            KdPrint(("Set PID Auth [%llu] %ws\n", len, file));
-        }
-
-        
-        return STATUS_SUCCESS;
     }
-    free(Message);
 
+    InterlockedExchange(&captureEnabled, 0);
+    DecisionCapture_begin(capture);
+    captureSnapshot();
+    InterlockedExchange(&captureEnabled, 1);
+    FltReleasePushLock(&captureLock);
+
+    KdPrint(("Capture Started\n"));
     return STATUS_SUCCESS;
 }
 
+/*
+ * [10]. Replies with the next bytes of the capture stream, as many as fit.
+ */
 UINT8
-comSetAuthorizationGlobal(
+comReadCapture(
     _In_ unsigned char* Input,
-    _In_ UINT64 InputBufferSize
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
 ) {
-    if (InputBufferSize <= 10) {
+    UNREFERENCED_PARAMETER(Input);
+
+    if (InputBufferSize != 1 || Output == NULL) {
         return INVALID_REQUEST_SIZE;
     }
+    if (capture == NULL) {
+        return STATUS_SUCCESS;
+    }
 
-    UINT64 len = 0;
-    UINT64 perms = 0;
-
-    perms |= (((UINT64)Input[1]) & 0xFF);
-    perms |= (((UINT64)Input[2]) & 0xFF) << 8L;
-    perms |= (((UINT64)Input[3]) & 0xFF) << 16L;
-    perms |= (((UINT64)Input[4]) & 0xFF) << 24L;
-    perms |= (((UINT64)Input[5]) & 0xFF) << 32L;
-    perms |= (((UINT64)Input[6]) & 0xFF) << 40L;
-    perms |= (((UINT64)Input[7]) & 0xFF) << 48L;
-    perms |= (((UINT64)Input[8]) & 0xFF) << 56L;
+    UINT64 size = OutputBufferSize < LYCANITE_CAPTURE_SIZE ? OutputBufferSize : LYCANITE_CAPTURE_SIZE;
+    unsigned char* chunk = (unsigned char*)calloc(size, sizeof(unsigned char));
+    if (chunk == NULL) {
+        return BAD_ALLOC;
+    }
 
-    len |= (((UINT16)Input[9]) & 0xFF);
-    len |= (((UINT16)Input[10]) & 0xFF) << 8L;
+    // the user buffer is only touched once the capture lock is released
+    UINT64 read = DecisionCapture_read(capture, chunk, size);
+    UINT8 status = STATUS_SUCCESS;
+    __try {
+        Kmemcpy(Output, chunk, read);
+        *ReturnOutputBufferLength = (ULONG)read;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = INVALID_REQUEST_SIZE;
+    }
 
-    char* Message = (char*)calloc(len + 1, sizeof(char));
+    free(chunk);
+    return status;
+}
 
-    if (Message == NULL) {
+#ifdef LYCANITE_TRACE
+UINT8
+comGetTrace(
+    _In_ unsigned char* Input,
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
+) {
+    if (InputBufferSize != 11 || Output == NULL || OutputBufferSize < LYCANITE_TRACE_REPLY_HEADER + TRACE_RECORD_SIZE) {
+        return INVALID_REQUEST_SIZE;
+    }
+    if (traceBuffer == NULL) {
         return BAD_ALLOC;
     }
 
-    Message[len] = 0;
-    RtlCopyMemory(Message, (PCHAR)Input + 11, len);
+    ULONG cpu = (ULONG)(Input[1] | (Input[2] << 8));
+    UINT64 from = readUINT64(Input + 3);
+    UINT32 count = (UINT32)((OutputBufferSize - LYCANITE_TRACE_REPLY_HEADER) / TRACE_RECORD_SIZE);
+    if (count > LYCANITE_TRACE_RECORDS) {
+        count = LYCANITE_TRACE_RECORDS;
+    }
 
-    PWCHAR file = wcharFromChar(Message, len, &len);
-    free(Message);
+    traceRecord* records = (traceRecord*)calloc(count, sizeof(traceRecord));
+    unsigned char* reply = (unsigned char*)calloc(LYCANITE_TRACE_REPLY_HEADER + (SIZE_T)count * TRACE_RECORD_SIZE, sizeof(unsigned char));
 
-    if (file == NULL) {
+    if (records == NULL || reply == NULL) {
+        free(records);
+        free(reply);
         return BAD_ALLOC;
     }
 
-    UINT64* perm_ptr = (UINT64*)hashmap_get(&globalPerm, file, (UINT32)len);
-    if (perm_ptr != NULL) {
-        KdPrint(("Set Global Auth [%llu] %ws\n", len, file));
-        free(file);
-        *perm_ptr = perms;
-    } else {
-        perm_ptr = (UINT64*)calloc(1, sizeof(UINT64));
-        if (perm_ptr == NULL) {
-            free(file);
-            return BAD_ALLOC;
-        }
+    UINT32 read = 0;
+    UINT64 next = TraceBuffer_read(traceBuffer, cpu, from, records, count, &read);
+
+    reply[0] = (unsigned char)(traceBuffer->cpuCount & 0xFF);
+    reply[1] = (unsigned char)((traceBuffer->cpuCount >> 8) & 0xFF);
+    writeUINT64(reply + 2, traceBuffer->frequency);
+    writeUINT64(reply + 10, next);
+    reply[18] = (unsigned char)(read & 0xFF);
+    reply[19] = (unsigned char)((read >> 8) & 0xFF);
+
+    for (UINT32 i = 0; i < read; i++) {
+        unsigned char* record = reply + LYCANITE_TRACE_REPLY_HEADER + i * TRACE_RECORD_SIZE;
+        writeUINT64(record, (UINT64)records[i].sequence);
+        writeUINT64(record + 8, records[i].timestamp);
+        writeUINT64(record + 16, records[i].args[0]);
+        writeUINT64(record + 24, records[i].args[1]);
+        writeUINT32(record + 32, records[i].pathHash);
+        record[36] = (unsigned char)(records[i].cpu & 0xFF);
+        record[37] = (unsigned char)((records[i].cpu >> 8) & 0xFF);
+        record[38] = (unsigned char)(records[i].event & 0xFF);
+        record[39] = (unsigned char)((records[i].event >> 8) & 0xFF);
+    }
 
-        *perm_ptr = perms;
-        hashmap_put(&globalPerm, file, (UINT32)len, perm_ptr);
-        KdPrint(("Set Global Auth [%llu] %ws\n", len, file));
+    ULONG size = LYCANITE_TRACE_REPLY_HEADER + read * TRACE_RECORD_SIZE;
+    UINT8 status = STATUS_SUCCESS;
+    __try {
+        Kmemcpy(Output, reply, size);
+        *ReturnOutputBufferLength = size;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = INVALID_REQUEST_SIZE;
     }
 
-    return STATUS_SUCCESS;
+    free(records);
+    free(reply);
+    return status;
 }
+#endif
 
+#ifdef LYCANITE_LATENCY
 UINT8
-comDeleteAuthorizationPid(
+comGetLatencyHistogram(
     _In_ unsigned char* Input,
-    _In_ UINT64 InputBufferSize
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
 ) {
-    if (InputBufferSize <= 10) {
+    if (InputBufferSize != 3 || Output == NULL || OutputBufferSize < LYCANITE_LATENCY_REPLY_SIZE) {
         return INVALID_REQUEST_SIZE;
     }
 
-    UINT64 len = 0;
-    UINT64 pid = 0;
-
-    pid |= (((UINT64)Input[1]) & 0xFF);
-    pid |= (((UINT64)Input[2]) & 0xFF) << 8L;
-    pid |= (((UINT64)Input[3]) & 0xFF) << 16L;
-    pid |= (((UINT64)Input[4]) & 0xFF) << 24L;
-    pid |= (((UINT64)Input[5]) & 0xFF) << 32L;
-    pid |= (((UINT64)Input[6]) & 0xFF) << 40L;
-    pid |= (((UINT64)Input[7]) & 0xFF) << 48L;
-    pid |= (((UINT64)Input[8]) & 0xFF) << 56L;
-
-    len |= (((UINT16)Input[9]) & 0xFF);
-    len |= (((UINT16)Input[10]) & 0xFF) << 8L;
-
-    char* Message = (char*)calloc(len + 1, sizeof(char));
+    UINT8 callback = Input[1];
+    UINT8 stage = Input[2];
 
-    if (Message == NULL) {
+    if (callback >= LATENCY_CALLBACKS || stage >= LATENCY_STAGES) {
+        return UNKNOWN_REQUEST;
+    }
+    if (latencies == NULL) {
         return BAD_ALLOC;
     }
-    Message[len] = 0;
 
-    RtlCopyMemory(Message, (PCHAR)Input + 11, len);
+    LatencyHistogram* merged = (LatencyHistogram*)calloc(1, sizeof(LatencyHistogram));
+    unsigned char* reply = (unsigned char*)calloc(LYCANITE_LATENCY_REPLY_SIZE, sizeof(unsigned char));
 
-    processInfos* pinfo = NULL;
-    if (ihashmap_get(ProcessesInfos, pid, &pinfo) == MAP_OK) {
+    if (merged == NULL || reply == NULL) {
+        free(merged);
+        free(reply);
+        return BAD_ALLOC;
+    }
 
-        PWCHAR file = wcharFromChar(Message, len, &len);
-        free(Message);
+    for (ULONG cpu = 0; cpu < latencyCpuCount; cpu++) {
+        LatencyHistogram_merge(merged, &latencies[(cpu * LATENCY_CALLBACKS + callback) * LATENCY_STAGES + stage]);
+    }
 
-        if (file == NULL) {
-            return BAD_ALLOC;
+    // only the non-empty buckets
+    ULONG size = 11;
+    UINT16 buckets = 0;
+    for (UINT16 i = 0; i < LATENCY_BUCKETS; i++) {
+        if (merged->buckets[i] != 0) {
+            reply[size] = (unsigned char)(i & 0xFF);
+            reply[size + 1] = (unsigned char)((i >> 8) & 0xFF);
+            writeUINT64(reply + size + 2, (UINT64)merged->buckets[i]);
+            size += 10;
+            buckets++;
         }
+    }
 
-        PWCHAR key = NULL;
-        UINT64* perms = NULL;
-
-        if (hashmap_remove(&pinfo->permissions, file, (UINT32)len, &perms, &key) == 0) {
-            free(perms);
-            free(key);
-        }
+    reply[0] = LATENCY_SUB_BUCKET_BITS;
+    writeUINT64(reply + 1, (UINT64)merged->count);
+    reply[9] = (unsigned char)(buckets & 0xFF);
+    reply[10] = (unsigned char)((buckets >> 8) & 0xFF);
 
-        KdPrint(("Delete PID Auth [%d] %ws\n", len, file));
-        free(file);
-        return STATUS_SUCCESS;
+    UINT8 status = STATUS_SUCCESS;
+    __try {
+        Kmemcpy(Output, reply, size);
+        *ReturnOutputBufferLength = size;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = INVALID_REQUEST_SIZE;
     }
 
-    free(Message);
-
-    return STATUS_SUCCESS;
+    free(merged);
+    free(reply);
+    return status;
 }
+#endif
 
 UINT8
-comDeleteAuthorizationGlobal(
+comSetEventRing(
+    _In_ controllerInfos* Controller,
     _In_ unsigned char* Input,
-    _In_ UINT64 InputBufferSize
+    _In_ UINT64 InputBufferSize,
+    _Out_ unsigned char* Output,
+    _In_ UINT64 OutputBufferSize,
+    _Out_ PULONG ReturnOutputBufferLength
 ) {
-    if (InputBufferSize <= 2) {
+    if (InputBufferSize != 9 || Output == NULL || OutputBufferSize < 12) {
         return INVALID_REQUEST_SIZE;
     }
 
-    UINT64 len = 0;
+    HANDLE doorbell = (HANDLE)(ULONG_PTR)readUINT64(Input + 1);
+    ULONG size = SHARED_RING_HEADER_SIZE + LYCANITE_EVENT_RING_SIZE;
+    eventRing mapped;
+    eventRing previous;
 
-    len |= (((UINT16)Input[1]) & 0xFF);
-    len |= (((UINT16)Input[2]) & 0xFF) << 8L;
+    Kmemset(&mapped, 0, sizeof(eventRing));
 
-    char* Message = (char*)calloc(len + 1, sizeof(char));
+    NTSTATUS status = ObReferenceObjectByHandle(doorbell, EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, (PVOID*)&mapped.doorbell, NULL);
+    if (!NT_SUCCESS(status)) {
+        return INVALID_HANDLE;
+    }
 
-    if (Message == NULL) {
+    // allocations of a page or more are page aligned, nothing else shares the mapped pages
+    mapped.ring = SharedRing_init(calloc(1, size), LYCANITE_EVENT_RING_SIZE, &mapped.producer);
+    if (mapped.ring != NULL) {
+        mapped.mdl = IoAllocateMdl(mapped.ring, size, FALSE, FALSE, NULL);
+    }
+    if (mapped.mdl == NULL) {
+        releaseEventRing(&mapped);
         return BAD_ALLOC;
     }
 
-    Message[len] = 0;
-    RtlCopyMemory(Message, (PCHAR)Input + 19, len);
+    MmBuildMdlForNonPagedPool(mapped.mdl);
 
-    PWCHAR file = wcharFromChar(Message, len, &len);
-    free(Message);
+    __try {
+        mapped.userAddress = MmMapLockedPagesSpecifyCache(mapped.mdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        mapped.userAddress = NULL;
+    }
 
-    if (file == NULL) {
-        return BAD_ALLOC;
+    if (mapped.userAddress == NULL) {
+        releaseEventRing(&mapped);
+        return MAPPING_FAILED;
     }
 
-    PWCHAR key = NULL;
-    UINT64* perms = NULL;
+    mapped.process = PsGetCurrentProcess();
+    ObReferenceObject(mapped.process);
 
-    if (hashmap_remove(&globalPerm, file, (UINT32)len, &perms, &key) == 0) {
-        free(perms);
-        free(key);
+    __try {
+        writeUINT64(Output, (UINT64)(ULONG_PTR)mapped.userAddress);
+        writeUINT32(Output + 8, size);
+        *ReturnOutputBufferLength = 12;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        releaseEventRing(&mapped);
+        return INVALID_REQUEST_SIZE;
     }
 
-    KdPrint(("Delete Global Auth [%d] %ws\n", len, file));
-    free(file);
+    FltAcquirePushLockExclusive(&Controller->ringLock);
+    previous = Controller->ring;
+    Controller->ring = mapped;
+    FltReleasePushLock(&Controller->ringLock);
+    releaseEventRing(&previous);
 
+    KdPrint(("Set Event Ring [%u] [%p]\n", Controller->slot, mapped.userAddress));
     return STATUS_SUCCESS;
 }
 
-
 NTSTATUS
 comMessageNotifyCallback(
     _In_ PVOID ConnectionCookie,
@@ -743,35 +3160,77 @@ comMessageNotifyCallback(
     _Out_ PULONG ReturnOutputBufferLength
 ) {
 
-    UNREFERENCED_PARAMETER(ConnectionCookie);
-    UNREFERENCED_PARAMETER(InputBuffer);
-    UNREFERENCED_PARAMETER(InputBufferSize);
-    UNREFERENCED_PARAMETER(OutputBuffer);
-    UNREFERENCED_PARAMETER(OutputBufferSize);
+    // connections are served in parallel, each only locks its own sandboxes
+    controllerInfos* cinfo = (controllerInfos*)ConnectionCookie;
 
     *ReturnOutputBufferLength = 0;
 
     UINT16 status = UNKNOWN_REQUEST;
 
-    if (InputBuffer != NULL && InputBufferSize > 0) {
+    if (cinfo != NULL && InputBuffer != NULL && InputBufferSize > 0) {
         unsigned char* Input = (unsigned char*)InputBuffer;
 
         switch (Input[0]) {
         case SET_LYCANITE_PID:
-            status = comSetLycanitePid(Input, InputBufferSize);
+            status = comSetLycanitePid(cinfo, Input, InputBufferSize);
             break;
         case SET_AUTHORIZATION_PID:
-            status = comSetAuthorizationPid(Input, InputBufferSize);
+            status = comSetAuthorizationPid(cinfo, Input, InputBufferSize, 0);
             break;
         case SET_AUTHORIZATION_GLOBAL:
-            status = comSetAuthorizationGlobal(Input, InputBufferSize);
+            status = isPrimaryController(cinfo) ? comSetAuthorizationGlobal(Input, InputBufferSize, 0) : NOT_PRIMARY_CONTROLLER;
+            break;
+        case SET_AUTHORIZATION_TTL:
+            status = comSetAuthorizationTtl(cinfo, Input, InputBufferSize);
             break;
         case DELETE_AUTHORIZATION_PID:
-            status = comDeleteAuthorizationPid(Input, InputBufferSize);
+            status = comDeleteAuthorizationPid(cinfo, Input, InputBufferSize);
             break;
         case DELETE_AUTHORIZATION_GLOBAL:
-            status = comDeleteAuthorizationGlobal(Input, InputBufferSize);
+            status = isPrimaryController(cinfo) ? comDeleteAuthorizationGlobal(Input, InputBufferSize) : NOT_PRIMARY_CONTROLLER;
+            break;
+        case GET_PROCESS_STATS:
+            status = comGetProcessStats(cinfo, Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength);
+            break;
+        case SET_EVENT_RING:
+            status = comSetEventRing(cinfo, Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength);
+            break;
+        case SET_CAPTURE:
+            status = isPrimaryController(cinfo) ? comSetCapture(Input, InputBufferSize) : NOT_PRIMARY_CONTROLLER;
+            break;
+        case READ_CAPTURE:
+            status = isPrimaryController(cinfo) ?
+                comReadCapture(Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength) : NOT_PRIMARY_CONTROLLER;
+            break;
+        case SEAL_AUTHORIZATION_PID:
+            status = comSealAuthorizationPid(cinfo, Input, InputBufferSize);
+            break;
+        case GET_HOT_PATHS:
+            status = comGetHotPaths(cinfo, Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength);
+            break;
+        case SET_LEARNING:
+            status = comSetLearning(cinfo, Input, InputBufferSize);
             break;
+        case GET_LEARNED_RULES:
+            status = comGetLearnedRules(cinfo, Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength);
+            break;
+        case SET_IO_BUDGET:
+            status = comSetIoBudget(cinfo, Input, InputBufferSize);
+            break;
+        case WRITE_QUOTA:
+            status = comWriteQuota(cinfo, Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength);
+            break;
+#ifdef LYCANITE_TRACE
+        case GET_TRACE:
+            status = isPrimaryController(cinfo) ?
+                comGetTrace(Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength) : NOT_PRIMARY_CONTROLLER;
+            break;
+#endif
+#ifdef LYCANITE_LATENCY
+        case GET_LATENCY_HISTOGRAM:
+            status = comGetLatencyHistogram(Input, InputBufferSize, (unsigned char*)OutputBuffer, OutputBufferSize, ReturnOutputBufferLength);
+            break;
+#endif
         }
 
         if (status == INVALID_REQUEST_SIZE) {
@@ -783,6 +3242,16 @@ comMessageNotifyCallback(
         else if (status == BAD_ALLOC) {
             DbgPrint(("bad allocation\n"));
         }
+        else if (status == INVALID_HANDLE) {
+            DbgPrint(("invalid handle\n"));
+        }
+        else if (status == MAPPING_FAILED) {
+            DbgPrint(("mapping failed\n"));
+        }
+        else if (status == NOT_PRIMARY_CONTROLLER) {
+            DbgPrint(("request reserved to the primary controller\n"));
+            return STATUS_ACCESS_DENIED;
+        }
     }
 
     return STATUS_SUCCESS;
@@ -795,130 +3264,75 @@ VOID CreateProcessNotify(
 ) {
     UINT64 ParentId = (UINT64)PParentId;
     UINT64 ProcessId = (UINT64)PProcessId;
-    if (LPID != 0) {
-        if (Create) {
-            if (LPID == ParentId) {
-                UUID uuid = UUIDRecycler_getUUID(uuidRecycler);
-
-                if (uuid == 0) { // Fail
-                    return;
-                }
-
-                processInfos* pinfo = (processInfos *)calloc(1, sizeof(processInfos));
-
-                if (pinfo == NULL) {
-                    return;
-                }
-
-                pinfo->referenceCount = 1;
-                pinfo->uuid = uuid;
-                if (hashmap_create(8, &pinfo->permissions)) { // Failed to alloc hashmap
-                    free(pinfo);
-                    return;
-                }
-
-                ihashmap_put(ProcessesInfos, uuid, pinfo);
-                ihashmap_put(Processes, ProcessId, pinfo);
-
-                char* sendBuff = (char *)calloc(17, sizeof(char));
-
-                if (sendBuff != NULL) {
-
-                    sendBuff[0] = PROCESS_CREATE;
-
-                    sendBuff[1] = (char)(ProcessId & 0xFF);
-                    sendBuff[2] = (char)((ProcessId >> 8) & 0xFF);
-                    sendBuff[3] = (char)((ProcessId >> 16) & 0xFF);
-                    sendBuff[4] = (char)((ProcessId >> 24) & 0xFF);
-                    sendBuff[5] = (char)((ProcessId >> 32) & 0xFF);
-                    sendBuff[6] = (char)((ProcessId >> 40) & 0xFF);
-                    sendBuff[7] = (char)((ProcessId >> 48) & 0xFF);
-                    sendBuff[8] = (char)((ProcessId >> 56) & 0xFF);
+    if (ReadNoFence(&registeredControllers) == 0) {
+        return;
+    }
 
-                    sendBuff[9] = (char)(uuid & 0xFF);
-                    sendBuff[10] = (char)((uuid >> 8) & 0xFF);
-                    sendBuff[11] = (char)((uuid >> 16) & 0xFF);
-                    sendBuff[12] = (char)((uuid >> 24) & 0xFF);
-                    sendBuff[13] = (char)((uuid >> 32) & 0xFF);
-                    sendBuff[14] = (char)((uuid >> 40) & 0xFF);
-                    sendBuff[15] = (char)((uuid >> 48) & 0xFF);
-                    sendBuff[16] = (char)((uuid >> 56) & 0xFF);
+    FltAcquirePushLockExclusive(&processesLock);
 
-                    LARGE_INTEGER time;
-                    time.QuadPart = -10000000;
-                    ULONG byterec = 0;
-                    NTSTATUS status = FltSendMessage(gFilterInstance, &clientPort, sendBuff, 17, NULL, &byterec, &time);
+    // an exit, or a creation reusing the id of a process whose exit was missed
+    ProcessNode* stale = ProcessTree_find(&processTree, ProcessId);
+    if (stale != NULL) {
+        exitProcess(stale);
+    }
 
-                    if (status == STATUS_TIMEOUT) {
-                        KdPrint(("Failed to deliver message: Timedout"));
-                    }
-                    else if (!NT_SUCCESS(status)) {
+    if (Create) {
+        // the controller itself may be sandboxed, its sandboxes nest in its own and are held to its rules too
+        ProcessNode* parent = ProcessTree_find(&processTree, ParentId);
+        controllerInfos* owner = controllerFor(ParentId);
 
-                    }
+        if (owner != NULL) {
+            UUID local = UUIDRecycler_getUUID(owner->uuids);
 
-                    free(sendBuff);
-                }
-                KdPrint(("Create Parent Process [%llu] -- %llu\n", ProcessId, uuid));
-            }
-            else {
-                processInfos *pinfo;
-                if (ihashmap_get(Processes, ParentId, (any_t*)&pinfo) == MAP_OK) {
-                    pinfo->referenceCount += 1;
-                    ihashmap_put(Processes, ProcessId, pinfo);
-                    KdPrint(("Create Sub Process [%llu] %llu -- %llu\n", ParentId, ProcessId, pinfo->uuid));
-                }
+            if (local == 0) { // Fail
+                FltReleasePushLock(&processesLock);
+                return;
             }
-        } else { // on process killed
-            processInfos* pinfo = NULL;
-            if (ihashmap_get(Processes, ProcessId, (any_t*)&pinfo) == MAP_OK) {
-                pinfo->referenceCount -= 1;
-
-                KdPrint(("Kill Process %llu -- %llu\n", ProcessId, pinfo->uuid));
-                if (pinfo->referenceCount == 0) {
-                    char* sendBuff = (char*)calloc(9, sizeof(char));
-
-                    if (sendBuff != NULL) {
-
-                        sendBuff[0] = PROCESS_DESTROY;
 
-                        sendBuff[1] = (char)(pinfo->uuid & 0xFF);
-                        sendBuff[2] = (char)((pinfo->uuid >> 8) & 0xFF);
-                        sendBuff[3] = (char)((pinfo->uuid >> 16) & 0xFF);
-                        sendBuff[4] = (char)((pinfo->uuid >> 24) & 0xFF);
-                        sendBuff[5] = (char)((pinfo->uuid >> 32) & 0xFF);
-                        sendBuff[6] = (char)((pinfo->uuid >> 40) & 0xFF);
-                        sendBuff[7] = (char)((pinfo->uuid >> 48) & 0xFF);
-                        sendBuff[8] = (char)((pinfo->uuid >> 56) & 0xFF);
+            processInfos* pinfo = acquireSandbox();
 
-                        LARGE_INTEGER time;
-                        time.QuadPart = -10000000;
-                        ULONG byterec = 0;
-                        NTSTATUS status = FltSendMessage(gFilterInstance, &clientPort, sendBuff, 9, NULL, &byterec, &time);
+            if (pinfo == NULL) {
+                UUIDRecycler_recycleUUID(owner->uuids, local);
+                FltReleasePushLock(&processesLock);
+                return;
+            }
 
-                        if (status == STATUS_TIMEOUT) {
-                            KdPrint(("Failed to deliver message: Timedout"));
-                        }
-                        else if (!NT_SUCCESS(status)) {
+            if (ProcessTree_add(&processTree, ProcessId, parent, pinfo, &pinfo->processes) == NULL) {
+                UUIDRecycler_recycleUUID(owner->uuids, local);
+                releaseSandbox(pinfo);
+                FltReleasePushLock(&processesLock);
+                return;
+            }
 
-                        }
+            UUID uuid = (local << LYCANITE_CONTROLLER_BITS) | owner->slot;
+            pinfo->uuid = uuid;
+            pinfo->owner = owner;
+            pinfo->enclosing = parent != NULL ? (processInfos*)parent->sandbox : NULL;
+            if (pinfo->enclosing != NULL) {
+                pinfo->enclosing->nested++;
+            }
 
-                        free(sendBuff);
-                    }
+            FltAcquirePushLockExclusive(&owner->lock);
+            ihashmap_put(owner->sandboxes, uuid, pinfo);
+            FltReleasePushLock(&owner->lock);
 
-                    ihashmap_remove(ProcessesInfos, pinfo->uuid, NULL);
+            if (ReadNoFence(&captureEnabled)) {
+                DecisionCapture_process(capture, ProcessId, 0, uuid, TRUE);
+            }
 
-                    if (0 != hashmap_iterate_pairs(&pinfo->permissions, cleanupHashmap, NULL)) {
-                        KdPrint(("%s\n", "failed to deallocate hashmap entries\n"));
-                    }
-                    hashmap_destroy(&pinfo->permissions);
+            queueEvent(PROCESS_CREATE, ProcessId, uuid);
+            KdPrint(("Create Parent Process [%llu] -- %llu\n", ProcessId, uuid));
+        }
+        else if (parent != NULL) {
+            processInfos* pinfo = (processInfos*)parent->sandbox;
 
-                    UUIDRecycler_recycleUUID(uuidRecycler, pinfo->uuid);
-                    KdPrint(("Remove Reference %llu\n", pinfo->uuid));
-                    free(pinfo);
+            if (ProcessTree_add(&processTree, ProcessId, parent, pinfo, parent->set) != NULL) {
+                if (ReadNoFence(&captureEnabled)) {
+                    DecisionCapture_process(capture, ProcessId, ParentId, pinfo->uuid, TRUE);
                 }
-
-                ihashmap_remove(Processes, ProcessId, NULL);
+                KdPrint(("Create Sub Process [%llu] %llu -- %llu\n", ParentId, ProcessId, pinfo->uuid));
             }
         }
     }
+    FltReleasePushLock(&processesLock);
 }
\ No newline at end of file
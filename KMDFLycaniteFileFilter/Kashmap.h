@@ -138,6 +138,53 @@ extern "C" {
     /// @param hashmap The hashmap to destroy.
     static void hashmap_destroy(struct hashmap_s* CONST hashmap) HASHMAP_USED;
 
+    /*
+     * Hashmaps looked up without a lock while a writer changes them. The
+     * writer only uses the _shared functions and hashmap_rebuild on them:
+     * - an element is written in full before it is marked in use, and
+     *   lookups test the mark with acquire;
+     * - a removed element is only unmarked, its key and value stay in the
+     *   slot as a tombstone lookups skip, no slot is reused under them;
+     * - a hashmap without room for a key is not rehashed in place, the
+     *   writer rebuilds it into a new one, publishes it, and frees the old
+     *   one and the tombstones' keys and values once no lookup can be
+     *   reading them.
+     */
+
+    /// @brief Get an element from a hashmap changed under the lookup.
+    static PVOID hashmap_get_shared(CONST struct hashmap_s* CONST hashmap,
+        CONST PWCHAR key,
+        CONST UINT32 len) HASHMAP_USED;
+
+    /// @brief Put a new element into a hashmap read without a lock.
+    /// @return On success 0 is returned, 1 if it has no room for the key,
+    /// it is then left as it was. The key must not be in the hashmap.
+    static INT8 hashmap_put_shared(struct hashmap_s* CONST hashmap,
+        CONST PWCHAR key,
+        CONST UINT32 len,
+        PVOID CONST value) HASHMAP_USED;
+
+    /// @brief Remove an element from a hashmap read without a lock,
+    /// leaving it as a tombstone.
+    /// @return On success 0 is returned.
+    static INT8 hashmap_remove_shared(struct hashmap_s* CONST hashmap,
+        CONST PWCHAR key,
+        CONST UINT32 len,
+        PVOID* data_removed,
+        PWCHAR* key_removed) HASHMAP_USED;
+
+    /// @brief Copy the elements of a hashmap into a new one without the
+    /// tombstones, twice as large if `grow` or if it is half full.
+    /// @return On success 0 is returned, `hashmap` is left untouched.
+    static INT8 hashmap_rebuild(CONST struct hashmap_s* CONST hashmap,
+        struct hashmap_s* CONST out_hashmap,
+        CONST INT8 grow) HASHMAP_USED;
+
+    /// @brief Call f with every tombstone of a hashmap and clear it.
+    static void hashmap_iterate_removed(struct hashmap_s* CONST hashmap,
+        INT8 (*f)(PVOID CONST, struct hashmap_element_s* CONST),
+        PVOID CONST context) HASHMAP_USED;
+
     static UINT32 hashmap_crc32_helper(CONST PWCHAR s,
         CONST UINT32 len) HASHMAP_USED;
     static UINT32
@@ -319,6 +366,117 @@ UINT32 hashmap_num_entries(CONST struct hashmap_s* CONST m) {
     return m->size;
 }
 
+PVOID hashmap_get_shared(CONST struct hashmap_s* CONST m, CONST PWCHAR key,
+    CONST UINT32 len) {
+    UINT32 curr;
+    UINT32 i;
+
+    curr = hashmap_hash_helper_int_helper(m, key, len);
+
+    for (i = 0; i < HASHMAP_MAX_CHAIN_LENGTH; i++) {
+        if (ReadAcquire((volatile LONG*)&m->data[curr].in_use)) {
+            if (hashmap_match_helper(&m->data[curr], key, len)) {
+                return m->data[curr].data;
+            }
+        }
+
+        curr = (curr + 1) % m->table_size;
+    }
+
+    return HASHMAP_NULL;
+}
+
+INT8 hashmap_put_shared(struct hashmap_s* CONST m, CONST PWCHAR key,
+    CONST UINT32 len, PVOID CONST value) {
+    UINT32 curr;
+    UINT32 i;
+
+    if (m->size >= m->table_size) {
+        return 1;
+    }
+
+    curr = hashmap_hash_helper_int_helper(m, key, len);
+
+    /* Only never used slots, a tombstone may still be read */
+    for (i = 0; i < HASHMAP_MAX_CHAIN_LENGTH; i++) {
+        struct hashmap_element_s* e = &m->data[curr];
+        if (!e->in_use && e->key == HASHMAP_NULL) {
+            e->data = value;
+            e->key = key;
+            e->key_len = len;
+            WriteRelease((volatile LONG*)&e->in_use, 1);
+            m->size++;
+            return 0;
+        }
+
+        curr = (curr + 1) % m->table_size;
+    }
+
+    return 1;
+}
+
+INT8 hashmap_remove_shared(struct hashmap_s* CONST m, CONST PWCHAR key,
+    CONST UINT32 len, PVOID* data_removed, PWCHAR* key_removed) {
+    UINT32 curr;
+    UINT32 i;
+
+    curr = hashmap_hash_helper_int_helper(m, key, len);
+
+    for (i = 0; i < HASHMAP_MAX_CHAIN_LENGTH; i++) {
+        struct hashmap_element_s* e = &m->data[curr];
+        if (e->in_use && hashmap_match_helper(e, key, len)) {
+            if (data_removed != NULL) {
+                *data_removed = e->data;
+            }
+            if (key_removed != NULL) {
+                *key_removed = e->key;
+            }
+
+            /* The key and the value stay for the lookups still comparing them */
+            WriteRelease((volatile LONG*)&e->in_use, 0);
+            m->size--;
+            return 0;
+        }
+
+        curr = (curr + 1) % m->table_size;
+    }
+
+    return 1;
+}
+
+INT8 hashmap_rebuild(CONST struct hashmap_s* CONST m,
+    struct hashmap_s* CONST out, CONST INT8 grow) {
+    UINT32 new_size = grow || m->size >= m->table_size / 2 ? 2 * m->table_size : m->table_size;
+    UINT32 i;
+
+    if (hashmap_create(new_size, out)) {
+        return 1;
+    }
+
+    for (i = 0; i < m->table_size; i++) {
+        CONST struct hashmap_element_s* e = &m->data[i];
+        if (e->in_use && hashmap_put(out, e->key, e->key_len, e->data)) {
+            hashmap_destroy(out);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void hashmap_iterate_removed(struct hashmap_s* CONST m,
+    INT8 (*f)(PVOID CONST, struct hashmap_element_s* CONST),
+    PVOID CONST context) {
+    UINT32 i;
+
+    for (i = 0; i < m->table_size; i++) {
+        struct hashmap_element_s* e = &m->data[i];
+        if (!e->in_use && e->key != HASHMAP_NULL) {
+            f(context, e);
+            Kmemset(e, 0, sizeof(struct hashmap_element_s));
+        }
+    }
+}
+
 UINT32 hashmap_crc32_helper(CONST PWCHAR s, CONST UINT32 len) {
     UINT32 i;
     UINT32 crc32val = 0;
@@ -397,7 +555,7 @@ UINT32 hashmap_crc32_helper(CONST PWCHAR s, CONST UINT32 len) {
 UINT32 hashmap_hash_helper_int_helper(CONST struct hashmap_s* CONST m,
     CONST PWCHAR keystring,
     CONST UINT32 len) {
-    UINT32 key = hashmap_crc32_helper(keystring, len * sizeof(WCHAR));
+    UINT32 key = hashmap_crc32_helper(keystring, len);
 
     /* Robert Jenkins' 32 bit Mix Function */
     key += (key << 12);
@@ -417,7 +575,7 @@ UINT32 hashmap_hash_helper_int_helper(CONST struct hashmap_s* CONST m,
 
 INT8 hashmap_match_helper(CONST struct hashmap_element_s* CONST element,
     CONST PWCHAR key, CONST UINT32 len) {
-    return (element->key_len == len) && (0 == Kmemcmp(element->key, key, len));
+    return (element->key_len == len) && (0 == Kmemcmp(element->key, key, len * sizeof(WCHAR)));
 }
 
 INT8 hashmap_hash_helper(CONST struct hashmap_s* CONST m, CONST PWCHAR key,
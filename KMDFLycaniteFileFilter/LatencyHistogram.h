@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Log-linear latency histogram (HdrHistogram style).
+ *
+ * Values below 2^LATENCY_SUB_BUCKET_BITS get a bucket each; every power of two
+ * above is split into 2^LATENCY_SUB_BUCKET_BITS linear buckets, so a bucket
+ * is never wider than 1/16 of its lower bound. Values are nanoseconds and
+ * saturate at 2^LATENCY_MAX_BITS (about 68 seconds).
+ *
+ * Nothing here depends on the kernel beyond the interlocked primitives, so
+ * the bucketing can be checked outside the driver.
+ */
+
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+#define LATENCY_CACHE_LINE 64
+
+// a whole number of cache lines, so per-CPU histograms laid out back to back never share one
+typedef struct LatencyHistogram_s {
+    volatile LONG64 count;
+    UCHAR pad[LATENCY_CACHE_LINE - sizeof(LONG64)];
+    volatile LONG64 buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static UINT16 LatencyHistogram_index(UINT64 value);
+    static UINT64 LatencyHistogram_lowerBound(UINT16 index);
+    static VOID LatencyHistogram_record(LatencyHistogram* histogram, UINT64 value);
+    static VOID LatencyHistogram_merge(LatencyHistogram* destination, CONST LatencyHistogram* source);
+    static UINT64 LatencyHistogram_quantile(CONST LatencyHistogram* histogram, UINT32 perMillion);
+
+#if defined(__cplusplus)
+}
+#endif
+
+UINT16 LatencyHistogram_index(UINT64 value) {
+    if (value >= (1ull << LATENCY_MAX_BITS)) {
+        return LATENCY_BUCKETS - 1;
+    }
+    if (value < LATENCY_SUB_BUCKETS) {
+        return (UINT16)value;
+    }
+
+    UINT8 msb = 0;
+    for (UINT64 v = value; v > 1; v >>= 1) {
+        msb++;
+    }
+
+    UINT8 shift = msb - LATENCY_SUB_BUCKET_BITS;
+    return (UINT16)((shift + 1) * LATENCY_SUB_BUCKETS + ((value >> shift) - LATENCY_SUB_BUCKETS));
+}
+
+UINT64 LatencyHistogram_lowerBound(UINT16 index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+
+    UINT8 shift = (UINT8)(index / LATENCY_SUB_BUCKETS - 1);
+    return ((UINT64)LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << shift;
+}
+
+/*
+ * Interlocked so a histogram can be shared, uncontended when it is per-CPU.
+ */
+VOID LatencyHistogram_record(LatencyHistogram* histogram, UINT64 value) {
+    InterlockedIncrement64(&histogram->buckets[LatencyHistogram_index(value)]);
+    InterlockedIncrement64(&histogram->count);
+}
+
+VOID LatencyHistogram_merge(LatencyHistogram* destination, CONST LatencyHistogram* source) {
+    for (UINT16 i = 0; i < LATENCY_BUCKETS; i++) {
+        destination->buckets[i] += ReadNoFence64(&source->buckets[i]);
+    }
+    destination->count += ReadNoFence64(&source->count);
+}
+
+/*
+ * Lower bound of the bucket holding the given quantile, e.g. 990000 for p99.
+ */
+UINT64 LatencyHistogram_quantile(CONST LatencyHistogram* histogram, UINT32 perMillion) {
+    UINT64 total = 0;
+    for (UINT16 i = 0; i < LATENCY_BUCKETS; i++) {
+        total += histogram->buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    // rank of the sample, rounded up so p100 is the largest one
+    UINT64 rank = (total * perMillion + 999999) / 1000000;
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    UINT64 seen = 0;
+    for (UINT16 i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            return LatencyHistogram_lowerBound(i);
+        }
+    }
+    return LatencyHistogram_lowerBound(LATENCY_BUCKETS - 1);
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Accesses of a learning sandbox, kept as the rules that would have allowed
+ * them.
+ *
+ * Every path is recorded once in an open-addressing table, with the union of
+ * the permissions it needed and the ones its rules already granted, so that a
+ * learned rule never takes away what a parent folder allowed. The table and
+ * the text of the paths are allocated when learning starts: recording only
+ * takes the lock, nothing is allocated per access.
+ *
+ * A folder counts the files recorded in it. Past the folder limit, or when
+ * the table is full, the folder is collapsed: it becomes a rule with the
+ * permissions of all its files, later accesses in it are folded into it, and
+ * its files are left out of the rules read back. A file that has a rule of
+ * its own stays apart, the folder's rule wouldn't override it. An access that
+ * fits nowhere is dropped and counted.
+ *
+ * Entries are never moved nor removed until the set is reset, a reader can
+ * page through the table with a slot cursor.
+ */
+
+#define LEARNEDRULES_END MAXUINT32
+
+// largest serialized rule: permissions, length, a full UNICODE_STRING path
+#define LEARNEDRULES_RECORD_MAX (3 + MAXUSHORT)
+
+#define LEARNED_USED      0b001
+#define LEARNED_COLLAPSED 0b010
+#define LEARNED_OWN_RULE  0b100
+
+typedef struct learnedEntry_s {
+    UINT32 hash;
+    UINT32 text; // first WCHAR in the text, folders share their first file's
+    UINT16 length;
+    UINT8 permissions; // accesses to the path itself, 0 for a folder only counting
+    UINT8 childPermissions; // accesses to the files recorded in it
+    UINT16 files;
+    UINT8 flags;
+    UINT8 reserved;
+} learnedEntry;
+
+typedef struct LearnedRules_s {
+    EX_PUSH_LOCK lock;
+    learnedEntry* entries;
+    WCHAR* text;
+    UINT32 mask;
+    UINT32 count;
+    UINT32 limit; // entries, 3/4 of the slots
+    UINT32 textUsed;
+    UINT32 textCapacity;
+    UINT16 folderLimit;
+    UINT64 dropped;
+} LearnedRules;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static LearnedRules* LearnedRules_create(UINT32 slots, UINT32 textCapacity, UINT16 folderLimit);
+    static BOOLEAN LearnedRules_record(LearnedRules* set, CONST WCHAR* path, UINT32 length, UINT8 permissions, BOOLEAN ownRule);
+    static UINT32 LearnedRules_read(LearnedRules* set, UINT32 cursor, unsigned char* buffer, UINT64 size, UINT64* written, UINT32* rules, UINT64* dropped);
+    static VOID LearnedRules_reset(LearnedRules* set);
+    static VOID LearnedRules_destroy(LearnedRules* set);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*
+ * Slots is rounded up to a power of two, textCapacity is in WCHARs shared by
+ * every path recorded.
+ */
+LearnedRules* LearnedRules_create(UINT32 slots, UINT32 textCapacity, UINT16 folderLimit) {
+    UINT32 size = 16;
+    while (size < slots) {
+        size <<= 1;
+    }
+
+    LearnedRules* set = (LearnedRules*)calloc(1, sizeof(LearnedRules));
+    if (set == NULL) {
+        return NULL;
+    }
+    set->entries = (learnedEntry*)calloc(size, sizeof(learnedEntry));
+    set->text = (WCHAR*)calloc(textCapacity, sizeof(WCHAR));
+    if (set->entries == NULL || set->text == NULL) {
+        free(set->entries);
+        free(set->text);
+        free(set);
+        return NULL;
+    }
+
+    set->mask = size - 1;
+    set->limit = size / 4 * 3;
+    set->textCapacity = textCapacity;
+    set->folderLimit = folderLimit;
+    FltInitializePushLock(&set->lock);
+    return set;
+}
+
+// Slot of the path, or of the empty slot ending its probe when it isn't there
+static learnedEntry* LearnedRules_slot(LearnedRules* set, UINT32 hash, CONST WCHAR* path, UINT32 length) {
+    for (UINT32 slot = hash & set->mask;; slot = (slot + 1) & set->mask) {
+        learnedEntry* entry = &set->entries[slot];
+        if (!(entry->flags & LEARNED_USED) ||
+            (entry->hash == hash && entry->length == length && Kmemcmp(&set->text[entry->text], (PVOID)path, length * sizeof(WCHAR)) == 0)) {
+            return entry;
+        }
+    }
+}
+
+/*
+ * One access needing `permissions`, with the ones already granted. ownRule
+ * if the path has a rule of its own. FALSE if it was dropped.
+ */
+BOOLEAN LearnedRules_record(LearnedRules* set, CONST WCHAR* path, UINT32 length, UINT8 permissions, BOOLEAN ownRule) {
+    if (set == NULL || length == 0 || length > MAXUSHORT) {
+        return FALSE;
+    }
+
+    // the folder is the path up to its last separator, none for a volume root
+    UINT32 folder = length - 1;
+    while (folder > 0 && path[folder] != '\\') {
+        folder--;
+    }
+    UINT32 folderHash = folder > 0 ? hashPath(path, folder) : 0;
+    UINT32 hash = hashPath(path, length);
+
+    FltAcquirePushLockExclusive(&set->lock);
+
+    learnedEntry* parent = folder > 0 ? LearnedRules_slot(set, folderHash, path, folder) : NULL;
+    if (parent != NULL && !(parent->flags & LEARNED_USED)) {
+        parent = NULL;
+    }
+    if (parent != NULL && (parent->flags & LEARNED_COLLAPSED) && !ownRule) {
+        parent->childPermissions |= permissions;
+        // kept apart for a rule it lost since, its learned rule still overrides the folder's
+        learnedEntry* entry = LearnedRules_slot(set, hash, path, length);
+        if (entry->flags & LEARNED_OWN_RULE) {
+            entry->permissions |= permissions;
+        }
+        FltReleasePushLock(&set->lock);
+        return TRUE;
+    }
+
+    learnedEntry* entry = LearnedRules_slot(set, hash, path, length);
+    if (entry->flags & LEARNED_USED) {
+        entry->permissions |= permissions;
+        entry->flags |= ownRule ? LEARNED_OWN_RULE : 0;
+        FltReleasePushLock(&set->lock);
+        return TRUE;
+    }
+
+    UINT32 needed = folder > 0 && parent == NULL ? 2 : 1;
+    if (set->count + needed > set->limit || set->textUsed + length > set->textCapacity) {
+        BOOLEAN folded = parent != NULL && !ownRule;
+        if (folded) {
+            parent->flags |= LEARNED_COLLAPSED;
+            parent->childPermissions |= permissions;
+        }
+        else {
+            set->dropped++;
+        }
+        FltReleasePushLock(&set->lock);
+        return folded;
+    }
+
+    entry->hash = hash;
+    entry->text = set->textUsed;
+    entry->length = (UINT16)length;
+    entry->permissions = permissions;
+    entry->flags = LEARNED_USED | (ownRule ? LEARNED_OWN_RULE : 0);
+    Kmemcpy(&set->text[set->textUsed], (PVOID)path, length * sizeof(WCHAR));
+    set->textUsed += length;
+    set->count++;
+
+    if (folder > 0) {
+        if (parent == NULL) {
+            parent = LearnedRules_slot(set, folderHash, path, folder);
+            parent->hash = folderHash;
+            parent->text = entry->text;
+            parent->length = (UINT16)folder;
+            parent->flags = LEARNED_USED;
+            set->count++;
+        }
+        parent->childPermissions |= permissions;
+        if (++parent->files >= set->folderLimit) {
+            parent->flags |= LEARNED_COLLAPSED;
+        }
+    }
+
+    FltReleasePushLock(&set->lock);
+    return TRUE;
+}
+
+// Whether the entry is read back as a rule
+static BOOLEAN LearnedRules_isRule(LearnedRules* set, CONST learnedEntry* entry) {
+    if (entry->flags & LEARNED_COLLAPSED) {
+        return TRUE;
+    }
+    if (entry->permissions == 0) {
+        return FALSE;
+    }
+    if (entry->flags & LEARNED_OWN_RULE) {
+        return TRUE;
+    }
+
+    CONST WCHAR* path = &set->text[entry->text];
+    UINT32 folder = entry->length - 1;
+    while (folder > 0 && path[folder] != '\\') {
+        folder--;
+    }
+    if (folder == 0) {
+        return TRUE;
+    }
+    CONST learnedEntry* parent = LearnedRules_slot(set, hashPath(path, folder), path, folder);
+    return (parent->flags & (LEARNED_USED | LEARNED_COLLAPSED)) != (LEARNED_USED | LEARNED_COLLAPSED);
+}
+
+/*
+ * Serializes the rules from slot `cursor` on, as many as fit in the buffer,
+ * each as permissions UINT8, length UINT16, then the path in UTF-16. Returns
+ * the cursor to continue from, LEARNEDRULES_END once every slot was read.
+ * Paths recorded behind the cursor meanwhile are missed: a batch read while
+ * the sandbox no longer learns is complete.
+ */
+UINT32 LearnedRules_read(LearnedRules* set, UINT32 cursor, unsigned char* buffer, UINT64 size, UINT64* written, UINT32* rules, UINT64* dropped) {
+    *written = 0;
+    *rules = 0;
+
+    FltAcquirePushLockShared(&set->lock);
+    *dropped = set->dropped;
+    for (; cursor <= set->mask; cursor++) {
+        CONST learnedEntry* entry = &set->entries[cursor];
+        if (!(entry->flags & LEARNED_USED) || !LearnedRules_isRule(set, entry)) {
+            continue;
+        }
+
+        UINT64 record = 3 + (UINT64)entry->length * sizeof(WCHAR);
+        if (*written + record > size) {
+            break;
+        }
+
+        unsigned char* out = buffer + *written;
+        CONST WCHAR* path = &set->text[entry->text];
+        out[0] = (entry->flags & LEARNED_COLLAPSED) ? entry->permissions | entry->childPermissions : entry->permissions;
+        out[1] = (unsigned char)(entry->length & 0xFF);
+        out[2] = (unsigned char)(entry->length >> 8);
+        for (UINT32 i = 0; i < entry->length; i++) {
+            out[3 + i * 2] = (unsigned char)(path[i] & 0xFF);
+            out[4 + i * 2] = (unsigned char)(path[i] >> 8);
+        }
+        *written += record;
+        *rules += 1;
+    }
+    FltReleasePushLock(&set->lock);
+
+    return cursor > set->mask ? LEARNEDRULES_END : cursor;
+}
+
+// Forgets every access, for a sandbox starting to learn again
+VOID LearnedRules_reset(LearnedRules* set) {
+    FltAcquirePushLockExclusive(&set->lock);
+    Kmemset(set->entries, 0, ((SIZE_T)set->mask + 1) * sizeof(learnedEntry));
+    set->count = 0;
+    set->textUsed = 0;
+    set->dropped = 0;
+    FltReleasePushLock(&set->lock);
+}
+
+VOID LearnedRules_destroy(LearnedRules* set) {
+    if (set != NULL) {
+        free(set->entries);
+        free(set->text);
+        free(set);
+    }
+}
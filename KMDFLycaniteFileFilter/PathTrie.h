@@ -0,0 +1,374 @@
+#pragma once
+
+#include "Utils.h"
+#include "Kashmap.h"
+
+/*
+ * Read-only rule table keyed by path components.
+ *
+ * Each distinct component ("Device", "HarddiskVolume2", "Users"...) is stored
+ * once and numbered; a rule path is a node of a trie whose edges are (parent
+ * node, component number) pairs. Lookups resolve the components of the path
+ * one by one and follow integer edges, so the deepest rule over a path is
+ * found in a single pass instead of one hash and compare of every prefix.
+ *
+ * Paths split on every '\', the text before the first one included: "\a\b" is
+ * "", "a", "b". The table is built once from a Kashmap of rules and never
+ * written after, lookups need no lock.
+ */
+
+#define PATHTRIE_NONE MAXUINT64 // node without a rule of its own
+#define PATHTRIE_NOT_FOUND MAXUINT32
+
+typedef struct PathTrieComponent_s {
+    UINT32 name; // first WCHAR in names
+    UINT32 hash; // hashPath of the name
+    UINT16 length;
+    UINT16 reserved;
+} PathTrieComponent;
+
+typedef struct PathTrieNode_s {
+    UINT64 permissions; // PATHTRIE_NONE if no rule ends here
+    UINT32 parent; // 0 is the root, above the first component
+    UINT32 component;
+} PathTrieNode;
+
+typedef struct PathTrie_s {
+    PathTrieComponent* components;
+    UINT32* componentIndex; // open addressing on the name hash: component + 1, 0 when empty
+    WCHAR* names; // component names, not terminated
+    PathTrieNode* nodes;
+    UINT32* edges; // open addressing on (parent, component): node, 0 when empty
+    UINT32 componentCount;
+    UINT32 componentMask;
+    UINT32 nodeCount;
+    UINT32 edgeMask;
+    UINT32 ruleCount;
+    UINT32 namesLength;
+    UINT32 longest; // WCHARs of the longest rule path
+} PathTrie;
+
+typedef BOOLEAN (*PathTrieVisitor)(PVOID context, CONST WCHAR* path, UINT32 length, UINT64 permissions);
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN PathTrie_build(PathTrie* trie, CONST struct hashmap_s* rules);
+    static BOOLEAN PathTrie_find(CONST PathTrie* trie, CONST WCHAR* path, UINT32 length, UINT64* permissions);
+    static UINT64 PathTrie_permission(CONST PathTrie* trie, CONST WCHAR* path, UINT32 length, UINT32* probes);
+    static BOOLEAN PathTrie_iterate(CONST PathTrie* trie, PathTrieVisitor visitor, PVOID context);
+    static UINT64 PathTrie_bytes(CONST PathTrie* trie);
+    static VOID PathTrie_destroy(PathTrie* trie);
+
+#if defined(__cplusplus)
+}
+#endif
+
+static UINT32 PathTrie_edgeHash(UINT32 parent, UINT32 component) {
+    return (UINT32)((((UINT64)parent << 32 | component) * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// Smallest power of two at least twice `count`
+static UINT32 PathTrie_indexSize(UINT32 count) {
+    UINT32 size = 16;
+    while (size / 2 < count) {
+        size <<= 1;
+    }
+    return size;
+}
+
+// Number of the component, PATHTRIE_NOT_FOUND if no rule uses it
+static UINT32 PathTrie_component(CONST PathTrie* trie, CONST WCHAR* name, UINT32 length, UINT32 hash) {
+    // the indexes are never more than half full, a probe always reaches an empty slot
+    for (UINT32 slot = hash & trie->componentMask; trie->componentIndex[slot] != 0; slot = (slot + 1) & trie->componentMask) {
+        CONST PathTrieComponent* component = &trie->components[trie->componentIndex[slot] - 1];
+        if (component->hash == hash && component->length == length &&
+            Kmemcmp((PVOID)&trie->names[component->name], (PVOID)name, length * sizeof(WCHAR)) == 0) {
+            return trie->componentIndex[slot] - 1;
+        }
+    }
+    return PATHTRIE_NOT_FOUND;
+}
+
+// Child node of `parent` through the component, 0 if none: the root is nobody's child
+static UINT32 PathTrie_child(CONST PathTrie* trie, UINT32 parent, UINT32 component) {
+    for (UINT32 slot = PathTrie_edgeHash(parent, component) & trie->edgeMask; trie->edges[slot] != 0; slot = (slot + 1) & trie->edgeMask) {
+        CONST PathTrieNode* node = &trie->nodes[trie->edges[slot]];
+        if (node->parent == parent && node->component == component) {
+            return trie->edges[slot];
+        }
+    }
+    return 0;
+}
+
+static VOID PathTrie_indexComponent(PathTrie* trie, UINT32 component) {
+    UINT32 slot = trie->components[component].hash & trie->componentMask;
+    while (trie->componentIndex[slot] != 0) {
+        slot = (slot + 1) & trie->componentMask;
+    }
+    trie->componentIndex[slot] = component + 1;
+}
+
+static VOID PathTrie_indexNode(PathTrie* trie, UINT32 node) {
+    UINT32 slot = PathTrie_edgeHash(trie->nodes[node].parent, trie->nodes[node].component) & trie->edgeMask;
+    while (trie->edges[slot] != 0) {
+        slot = (slot + 1) & trie->edgeMask;
+    }
+    trie->edges[slot] = node;
+}
+
+// Adds the path's nodes, the arrays are sized for every component of every rule
+static VOID PathTrie_insert(PathTrie* trie, CONST WCHAR* path, UINT32 length, UINT64 permissions) {
+    UINT32 node = 0;
+    UINT32 start = 0;
+    for (UINT32 end = 0; end <= length; end++) {
+        if (end < length && path[end] != '\\') {
+            continue;
+        }
+
+        UINT32 nameLength = end - start;
+        UINT32 hash = hashPath(&path[start], nameLength);
+        UINT32 component = PathTrie_component(trie, &path[start], nameLength, hash);
+        if (component == PATHTRIE_NOT_FOUND) {
+            component = trie->componentCount++;
+            trie->components[component].name = trie->namesLength;
+            trie->components[component].hash = hash;
+            trie->components[component].length = (UINT16)nameLength;
+            trie->components[component].reserved = 0;
+            Kmemcpy(&trie->names[trie->namesLength], (PVOID)&path[start], nameLength * sizeof(WCHAR));
+            trie->namesLength += nameLength;
+            PathTrie_indexComponent(trie, component);
+        }
+
+        UINT32 child = PathTrie_child(trie, node, component);
+        if (child == 0) {
+            child = trie->nodeCount++;
+            trie->nodes[child].permissions = PATHTRIE_NONE;
+            trie->nodes[child].parent = node;
+            trie->nodes[child].component = component;
+            PathTrie_indexNode(trie, child);
+        }
+        node = child;
+        start = end + 1;
+    }
+
+    if (trie->nodes[node].permissions == PATHTRIE_NONE) {
+        trie->ruleCount++;
+    }
+    trie->nodes[node].permissions = permissions;
+    if (length > trie->longest) {
+        trie->longest = length;
+    }
+}
+
+/*
+ * Copies the table into exactly sized arrays with their indexes rebuilt, FALSE
+ * if an allocation failed. `built` is left to the caller either way.
+ */
+static BOOLEAN PathTrie_compact(PathTrie* trie, CONST PathTrie* built) {
+    Kmemset(trie, 0, sizeof(PathTrie));
+    trie->componentCount = built->componentCount;
+    trie->componentMask = PathTrie_indexSize(built->componentCount) - 1;
+    trie->nodeCount = built->nodeCount;
+    trie->edgeMask = PathTrie_indexSize(built->nodeCount) - 1;
+    trie->ruleCount = built->ruleCount;
+    trie->namesLength = built->namesLength;
+    trie->longest = built->longest;
+
+    trie->components = (PathTrieComponent*)malloc(((SIZE_T)trie->componentCount + 1) * sizeof(PathTrieComponent));
+    trie->componentIndex = (UINT32*)calloc((SIZE_T)trie->componentMask + 1, sizeof(UINT32));
+    trie->names = (WCHAR*)malloc(((SIZE_T)trie->namesLength + 1) * sizeof(WCHAR));
+    trie->nodes = (PathTrieNode*)malloc((SIZE_T)trie->nodeCount * sizeof(PathTrieNode));
+    trie->edges = (UINT32*)calloc((SIZE_T)trie->edgeMask + 1, sizeof(UINT32));
+    if (trie->components == NULL || trie->componentIndex == NULL || trie->names == NULL || trie->nodes == NULL || trie->edges == NULL) {
+        PathTrie_destroy(trie);
+        return FALSE;
+    }
+
+    Kmemcpy(trie->components, built->components, (SIZE_T)trie->componentCount * sizeof(PathTrieComponent));
+    Kmemcpy(trie->names, built->names, (SIZE_T)trie->namesLength * sizeof(WCHAR));
+    Kmemcpy(trie->nodes, built->nodes, (SIZE_T)trie->nodeCount * sizeof(PathTrieNode));
+    for (UINT32 component = 0; component < trie->componentCount; component++) {
+        PathTrie_indexComponent(trie, component);
+    }
+    for (UINT32 node = 1; node < trie->nodeCount; node++) {
+        PathTrie_indexNode(trie, node);
+    }
+    return TRUE;
+}
+
+/*
+ * The table of the rules, a Kashmap of path -> UINT64 permissions. FALSE if an
+ * allocation failed, `trie` is then left empty. The arrays are first sized for
+ * the worst case, every component distinct, then copied to their used size.
+ */
+BOOLEAN PathTrie_build(PathTrie* trie, CONST struct hashmap_s* rules) {
+    PathTrie built;
+    UINT64 components = 0;
+    UINT64 characters = 0;
+
+    Kmemset(trie, 0, sizeof(PathTrie));
+    Kmemset(&built, 0, sizeof(PathTrie));
+    for (UINT32 i = 0; i < rules->table_size; i++) {
+        CONST struct hashmap_element_s* e = &rules->data[i];
+        if (e->in_use) {
+            components++;
+            for (UINT32 k = 0; k < e->key_len; k++) {
+                components += e->key[k] == '\\';
+            }
+            characters += e->key_len;
+        }
+    }
+    if (components >= MAXUINT32 / 4 || characters >= MAXUINT32) {
+        return FALSE;
+    }
+
+    built.componentMask = PathTrie_indexSize((UINT32)components) - 1;
+    built.edgeMask = PathTrie_indexSize((UINT32)components + 1) - 1;
+    built.nodeCount = 1;
+    built.components = (PathTrieComponent*)malloc(((SIZE_T)components + 1) * sizeof(PathTrieComponent));
+    built.componentIndex = (UINT32*)calloc((SIZE_T)built.componentMask + 1, sizeof(UINT32));
+    built.names = (WCHAR*)malloc(((SIZE_T)characters + 1) * sizeof(WCHAR));
+    built.nodes = (PathTrieNode*)malloc(((SIZE_T)components + 1) * sizeof(PathTrieNode));
+    built.edges = (UINT32*)calloc((SIZE_T)built.edgeMask + 1, sizeof(UINT32));
+
+    BOOLEAN done = FALSE;
+    if (built.components != NULL && built.componentIndex != NULL && built.names != NULL && built.nodes != NULL && built.edges != NULL) {
+        built.nodes[0].permissions = PATHTRIE_NONE;
+        built.nodes[0].parent = 0;
+        built.nodes[0].component = PATHTRIE_NOT_FOUND;
+        for (UINT32 i = 0; i < rules->table_size; i++) {
+            CONST struct hashmap_element_s* e = &rules->data[i];
+            if (e->in_use) {
+                PathTrie_insert(&built, e->key, e->key_len, *(UINT64*)e->data);
+            }
+        }
+        done = PathTrie_compact(trie, &built);
+    }
+    PathTrie_destroy(&built);
+    return done;
+}
+
+// TRUE if a rule is set on exactly this path, its permissions in `*permissions` if not NULL
+BOOLEAN PathTrie_find(CONST PathTrie* trie, CONST WCHAR* path, UINT32 length, UINT64* permissions) {
+    if (trie->nodeCount == 0) {
+        return FALSE;
+    }
+
+    UINT32 node = 0;
+    UINT32 start = 0;
+    for (UINT32 end = 0; end <= length; end++) {
+        if (end < length && path[end] != '\\') {
+            continue;
+        }
+        UINT32 component = PathTrie_component(trie, &path[start], end - start, hashPath(&path[start], end - start));
+        if (component == PATHTRIE_NOT_FOUND || (node = PathTrie_child(trie, node, component)) == 0) {
+            return FALSE;
+        }
+        start = end + 1;
+    }
+
+    if (trie->nodes[node].permissions == PATHTRIE_NONE) {
+        return FALSE;
+    }
+    if (permissions != NULL) {
+        *permissions = trie->nodes[node].permissions;
+    }
+    return TRUE;
+}
+
+/*
+ * Permissions of the deepest rule on the path or one of its parent folders,
+ * 0 if none: the same rules as getFilePermission's walk, which never looks up
+ * the empty prefix. One probe per component resolved.
+ */
+UINT64 PathTrie_permission(CONST PathTrie* trie, CONST WCHAR* path, UINT32 length, UINT32* probes) {
+    UINT64 permissions = 0;
+    UINT32 node = 0;
+    UINT32 start = 0;
+
+    if (trie->nodeCount == 0) {
+        return 0;
+    }
+    for (UINT32 end = 0; end <= length; end++) {
+        if (end < length && path[end] != '\\') {
+            continue;
+        }
+        if (probes != NULL) {
+            *probes += 1;
+        }
+
+        // no rule goes through a component no rule uses
+        UINT32 component = PathTrie_component(trie, &path[start], end - start, hashPath(&path[start], end - start));
+        if (component == PATHTRIE_NOT_FOUND || (node = PathTrie_child(trie, node, component)) == 0) {
+            break;
+        }
+        if (end > 0 && trie->nodes[node].permissions != PATHTRIE_NONE) {
+            permissions = trie->nodes[node].permissions;
+        }
+        start = end + 1;
+    }
+    return permissions;
+}
+
+/*
+ * Calls the visitor with every rule, its path rebuilt in a buffer reused
+ * between calls. Stops and returns FALSE when the visitor does or the buffer
+ * can't be allocated.
+ */
+BOOLEAN PathTrie_iterate(CONST PathTrie* trie, PathTrieVisitor visitor, PVOID context) {
+    if (trie->ruleCount == 0) {
+        return TRUE;
+    }
+    WCHAR* path = (WCHAR*)malloc(((SIZE_T)trie->longest + 1) * sizeof(WCHAR));
+    if (path == NULL) {
+        return FALSE;
+    }
+
+    BOOLEAN completed = TRUE;
+    for (UINT32 i = 1; i < trie->nodeCount && completed; i++) {
+        if (trie->nodes[i].permissions == PATHTRIE_NONE) {
+            continue;
+        }
+
+        UINT32 length = 0;
+        for (UINT32 node = i; node != 0; node = trie->nodes[node].parent) {
+            length += trie->components[trie->nodes[node].component].length + (trie->nodes[node].parent != 0);
+        }
+
+        // filled from the end, the rule's own component last
+        UINT32 position = length;
+        for (UINT32 node = i; node != 0; node = trie->nodes[node].parent) {
+            CONST PathTrieComponent* component = &trie->components[trie->nodes[node].component];
+            position -= component->length;
+            Kmemcpy(&path[position], (PVOID)&trie->names[component->name], component->length * sizeof(WCHAR));
+            if (trie->nodes[node].parent != 0) {
+                path[--position] = '\\';
+            }
+        }
+        path[length] = 0;
+        completed = visitor(context, path, length, trie->nodes[i].permissions);
+    }
+    free(path);
+    return completed;
+}
+
+// Bytes held by the table
+UINT64 PathTrie_bytes(CONST PathTrie* trie) {
+    if (trie->nodeCount == 0) {
+        return 0;
+    }
+    return ((UINT64)trie->componentCount + 1) * sizeof(PathTrieComponent) + ((UINT64)trie->componentMask + 1) * sizeof(UINT32) +
+        ((UINT64)trie->namesLength + 1) * sizeof(WCHAR) + (UINT64)trie->nodeCount * sizeof(PathTrieNode) +
+        ((UINT64)trie->edgeMask + 1) * sizeof(UINT32);
+}
+
+VOID PathTrie_destroy(PathTrie* trie) {
+    free(trie->components);
+    free(trie->componentIndex);
+    free(trie->names);
+    free(trie->nodes);
+    free(trie->edges);
+    Kmemset(trie, 0, sizeof(PathTrie));
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Wildcard rules, compiled offline (Tools/PolicyCompile.c) into an
+ * Aho-Corasick automaton and used in place from a policy snapshot.
+ *
+ * A pattern is an NT path where * matches any units, folder separators
+ * included, and ? a single one. Neither can appear in a file name, so there
+ * is no escaping. The compiler picks a literal run of each pattern as its
+ * anchor, the rarest among the patterns: the automaton finds every anchor in
+ * one pass over the path, and only the
+ * patterns whose anchor occurs are matched in full. Patterns without any
+ * literal are the outputs of the root and always matched. A bitmap of the
+ * first unit of every anchor lets the pass skip ahead while it is at the
+ * root.
+ *
+ * Of the patterns matching a path, the last one in the rules file wins.
+ *
+ *   header   PatternRulesHeader, offsets from the start of the section
+ *   starts   UINT64[PATTERNRULES_STARTS], first units of the anchors
+ *   patterns PatternRule[patternCount], in rules file order
+ *   states   PatternState[stateCount], breadth first, the root first
+ *   edges    PatternEdge[edgeCount], each state's sorted by unit
+ *   outputs  UINT32[outputCount], patterns whose anchor ends at a state
+ *   text     the patterns, UTF-16, not terminated
+ */
+
+#define PATTERNRULES_STARTS (65536 / 64)
+#define PATTERNRULES_NONE MAXUINT32
+
+typedef struct PatternRulesHeader_s {
+    UINT32 patternCount;
+    UINT32 stateCount;
+    UINT32 edgeCount;
+    UINT32 outputCount;
+    UINT32 textLength; // WCHARs
+    UINT32 reserved;
+    UINT64 startsOffset;
+    UINT64 patternsOffset;
+    UINT64 statesOffset;
+    UINT64 edgesOffset;
+    UINT64 outputsOffset;
+    UINT64 textOffset;
+} PatternRulesHeader;
+
+typedef struct PatternRule_s {
+    UINT64 permissions;
+    UINT32 text; // first WCHAR in the text
+    UINT16 length; // WCHARs
+    UINT16 reserved;
+} PatternRule;
+
+typedef struct PatternState_s {
+    UINT32 edges; // first edge
+    UINT32 edgeCount;
+    UINT32 outputs; // first output
+    UINT32 outputCount;
+    UINT32 fail; // longest proper suffix that is a state, earlier in the array
+    UINT32 dictionary; // longest proper suffix with outputs, 0 if none
+} PatternState;
+
+typedef struct PatternEdge_s {
+    UINT16 unit;
+    UINT16 reserved;
+    UINT32 next;
+} PatternEdge;
+
+typedef struct PatternRules_s {
+    CONST PatternRulesHeader* header; // NULL without patterns
+    CONST UINT64* starts;
+    CONST PatternRule* patterns;
+    CONST PatternState* states;
+    CONST PatternEdge* edges;
+    CONST UINT32* outputs;
+    CONST WCHAR* text;
+} PatternRules;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN PatternRules_open(PatternRules* rules, CONST VOID* section, UINT64 size);
+    static BOOLEAN PatternRules_glob(CONST WCHAR* pattern, UINT32 patternLength, CONST WCHAR* path, UINT32 length);
+    static UINT64 PatternRules_permission(CONST PatternRules* rules, CONST WCHAR* path, UINT32 length, UINT32* probes);
+
+#if defined(__cplusplus)
+}
+#endif
+
+// An array of count elements at offset, aligned and inside the section
+static BOOLEAN PatternRules_inside(UINT64 offset, UINT64 count, UINT64 element, UINT64 alignment, UINT64 size) {
+    return offset >= sizeof(PatternRulesHeader) && offset % alignment == 0 && offset <= size &&
+        count <= (size - offset) / element;
+}
+
+/*
+ * FALSE if the section is malformed. Failure and dictionary links must point
+ * to earlier states, the root's to itself, so no walk can loop.
+ */
+BOOLEAN PatternRules_open(PatternRules* rules, CONST VOID* section, UINT64 size) {
+    CONST PatternRulesHeader* header = (CONST PatternRulesHeader*)section;
+
+    Kmemset(rules, 0, sizeof(PatternRules));
+    if (size < sizeof(PatternRulesHeader) || header->stateCount == 0 ||
+        !PatternRules_inside(header->startsOffset, PATTERNRULES_STARTS, sizeof(UINT64), 8, size) ||
+        !PatternRules_inside(header->patternsOffset, header->patternCount, sizeof(PatternRule), 8, size) ||
+        !PatternRules_inside(header->statesOffset, header->stateCount, sizeof(PatternState), 4, size) ||
+        !PatternRules_inside(header->edgesOffset, header->edgeCount, sizeof(PatternEdge), 4, size) ||
+        !PatternRules_inside(header->outputsOffset, header->outputCount, sizeof(UINT32), 4, size) ||
+        !PatternRules_inside(header->textOffset, header->textLength, sizeof(WCHAR), 2, size)) {
+        return FALSE;
+    }
+
+    CONST UCHAR* base = (CONST UCHAR*)section;
+    rules->starts = (CONST UINT64*)(base + header->startsOffset);
+    rules->patterns = (CONST PatternRule*)(base + header->patternsOffset);
+    rules->states = (CONST PatternState*)(base + header->statesOffset);
+    rules->edges = (CONST PatternEdge*)(base + header->edgesOffset);
+    rules->outputs = (CONST UINT32*)(base + header->outputsOffset);
+    rules->text = (CONST WCHAR*)(base + header->textOffset);
+
+    for (UINT32 i = 0; i < header->patternCount; i++) {
+        if ((UINT64)rules->patterns[i].text + rules->patterns[i].length > header->textLength) {
+            return FALSE;
+        }
+    }
+    for (UINT32 i = 0; i < header->stateCount; i++) {
+        CONST PatternState* state = &rules->states[i];
+        if ((UINT64)state->edges + state->edgeCount > header->edgeCount ||
+            (UINT64)state->outputs + state->outputCount > header->outputCount ||
+            (i == 0 ? state->fail != 0 || state->dictionary != 0 : state->fail >= i || state->dictionary >= i)) {
+            return FALSE;
+        }
+    }
+    for (UINT32 i = 0; i < header->edgeCount; i++) {
+        if (rules->edges[i].next == 0 || rules->edges[i].next >= header->stateCount) {
+            return FALSE;
+        }
+    }
+    for (UINT32 i = 0; i < header->outputCount; i++) {
+        if (rules->outputs[i] >= header->patternCount) {
+            return FALSE;
+        }
+    }
+
+    rules->header = header;
+    return TRUE;
+}
+
+// Whole path against a pattern, backtracking to the last * only
+BOOLEAN PatternRules_glob(CONST WCHAR* pattern, UINT32 patternLength, CONST WCHAR* path, UINT32 length) {
+    UINT32 p = 0;
+    UINT32 s = 0;
+    UINT32 star = PATTERNRULES_NONE;
+    UINT32 resume = 0;
+
+    while (s < length) {
+        if (p < patternLength && pattern[p] == '*') {
+            star = p++;
+            resume = s;
+        }
+        else if (p < patternLength && (pattern[p] == '?' || pattern[p] == path[s])) {
+            p++;
+            s++;
+        }
+        else if (star != PATTERNRULES_NONE) {
+            p = star + 1;
+            s = ++resume;
+        }
+        else {
+            return FALSE;
+        }
+    }
+    while (p < patternLength && pattern[p] == '*') {
+        p++;
+    }
+    return p == patternLength;
+}
+
+static UINT32 PatternRules_next(CONST PatternRules* rules, CONST PatternState* state, WCHAR unit) {
+    CONST PatternEdge* edges = &rules->edges[state->edges];
+    UINT32 low = 0;
+    UINT32 high = state->edgeCount;
+    while (low < high) {
+        UINT32 middle = low + (high - low) / 2;
+        if (edges[middle].unit < unit) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low < state->edgeCount && edges[low].unit == unit ? edges[low].next : PATTERNRULES_NONE;
+}
+
+// Matches the outputs of a state not already beaten by the best pattern so far
+static VOID PatternRules_outputs(CONST PatternRules* rules, CONST PatternState* state, CONST WCHAR* path, UINT32 length, UINT32* best, UINT32* probes) {
+    for (UINT32 i = 0; i < state->outputCount; i++) {
+        UINT32 index = rules->outputs[state->outputs + i];
+        if (*best != PATTERNRULES_NONE && index <= *best) {
+            continue;
+        }
+        CONST PatternRule* pattern = &rules->patterns[index];
+        if (probes != NULL) {
+            *probes += 1;
+        }
+        if (PatternRules_glob(&rules->text[pattern->text], pattern->length, path, length)) {
+            *best = index;
+        }
+    }
+}
+
+/*
+ * Permissions of the last pattern matching the path, 0 if none. One probe
+ * per pattern matched in full.
+ */
+UINT64 PatternRules_permission(CONST PatternRules* rules, CONST WCHAR* path, UINT32 length, UINT32* probes) {
+    UINT32 best = PATTERNRULES_NONE;
+    UINT32 current = 0;
+
+    PatternRules_outputs(rules, &rules->states[0], path, length, &best, probes);
+    for (UINT32 i = 0; i < length; i++) {
+        WCHAR unit = path[i];
+        if (current == 0 && (rules->starts[unit / 64] & (1ull << (unit % 64))) == 0) {
+            continue;
+        }
+
+        UINT32 next;
+        while ((next = PatternRules_next(rules, &rules->states[current], unit)) == PATTERNRULES_NONE && current != 0) {
+            current = rules->states[current].fail;
+        }
+        current = next == PATTERNRULES_NONE ? 0 : next;
+
+        UINT32 reported = rules->states[current].outputCount != 0 ? current : rules->states[current].dictionary;
+        for (; reported != 0; reported = rules->states[reported].dictionary) {
+            PatternRules_outputs(rules, &rules->states[reported], path, length, &best, probes);
+        }
+    }
+    return best == PATTERNRULES_NONE ? 0 : rules->patterns[best].permissions;
+}
@@ -6,8 +6,9 @@
 extern "C" {
 #endif
 
-	static UINT64 getFilePermission(CONST PWCHAR path, CONST struct hashmap_s* map);
-	static UINT64 getFilePermissionWithFree(CONST PWCHAR path, CONST struct hashmap_s* map);
+	// probes, if not NULL, is increased by the number of map lookups
+	static UINT64 getFilePermission(CONST PWCHAR path, CONST struct hashmap_s* map, UINT32* probes);
+	static UINT64 getFilePermissionWithFree(CONST PWCHAR path, CONST struct hashmap_s* map, UINT32* probes);
 
 	static PWCHAR hasParentFolder(CONST PWCHAR path);
 
@@ -15,8 +16,12 @@ extern "C" {
 }
 #endif
 
-UINT64 getFilePermission(CONST PWCHAR path, CONST struct hashmap_s* map)
+UINT64 getFilePermission(CONST PWCHAR path, CONST struct hashmap_s* map, UINT32* probes)
 {
+	if (probes != NULL) {
+		*probes += 1;
+	}
+
 	PVOID path_permissions = hashmap_get(map, path, my_strlen(path));
 
 	if (path_permissions != HASHMAP_NULL) {
@@ -25,7 +30,7 @@ UINT64 getFilePermission(CONST PWCHAR path, CONST struct hashmap_s* map)
 	else {
 		PWCHAR parent = NULL;
 		if ((parent = hasParentFolder(path)) != NULL) {
-			return getFilePermissionWithFree(parent, map);
+			return getFilePermissionWithFree(parent, map, probes);
 		}
 		else {
 			return 0; // return no permissions
@@ -33,8 +38,12 @@ UINT64 getFilePermission(CONST PWCHAR path, CONST struct hashmap_s* map)
 	}
 }
 
-UINT64 getFilePermissionWithFree(CONST PWCHAR path, CONST struct hashmap_s* map)
+UINT64 getFilePermissionWithFree(CONST PWCHAR path, CONST struct hashmap_s* map, UINT32* probes)
 {
+	if (probes != NULL) {
+		*probes += 1;
+	}
+
 	PVOID path_permissions = hashmap_get(map, path, my_strlen(path));
 
 	if (path_permissions != HASHMAP_NULL) {
@@ -45,7 +54,7 @@ UINT64 getFilePermissionWithFree(CONST PWCHAR path, CONST struct hashmap_s* map)
 		PWCHAR parent = NULL;
 		if ((parent = hasParentFolder(path)) != NULL) {
 			free((PVOID)path);
-			return getFilePermissionWithFree(parent, map);
+			return getFilePermissionWithFree(parent, map, probes);
 		}
 		else {
 			free((PVOID)path);
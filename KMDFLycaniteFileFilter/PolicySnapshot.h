@@ -0,0 +1,231 @@
+#pragma once
+
+#include "Utils.h"
+#include "FrontCoded.h"
+#include "PatternRules.h"
+
+/*
+ * Global rules compiled offline (Tools/PolicyCompile.c), loaded at boot before
+ * any controller connects.
+ *
+ * The image is position independent, every reference is an offset, so it is
+ * used in place wherever it was read or mapped: opening it validates the
+ * bounds once and allocates nothing per rule. Little endian.
+ *
+ *   header  PolicySnapshotHeader
+ *   rules   PolicySnapshotRule[ruleCount], sorted by path
+ *   index   UINT32[indexSize], open addressing on the path hash: rule + 1, 0 when empty
+ *   paths   UTF-16 paths, not terminated
+ *
+ * Version 2 is front-coded (FrontCoded.h), for policies of millions of paths
+ * sharing long prefixes. There are no rules nor hash index, rulesOffset is 0:
+ *
+ *   header  PolicySnapshotHeader, indexSize is the number of blocks
+ *   index   UINT32[indexSize], first WCHAR of each block in the paths
+ *   paths   the blocks, permissions fit a WCHAR
+ *
+ * Both versions are loaded, PolicyCompile -f writes the second.
+ *
+ * Either can end with wildcard rules, a PatternRules section at
+ * patternsOffset, 0 without. Exact rules and their parent folders come
+ * first, patterns only decide paths no exact rule does.
+ */
+
+#define POLICY_SNAPSHOT_MAGIC 0x5350594C // "LYPS"
+#define POLICY_SNAPSHOT_VERSION 2
+#define POLICY_SNAPSHOT_HASHED 1
+#define POLICY_SNAPSHOT_FRONT_CODED 2
+
+typedef struct PolicySnapshotHeader_s {
+    UINT32 magic;
+    UINT16 version;
+    UINT16 headerSize;
+    UINT32 ruleCount;
+    UINT32 indexSize; // hashed: power of two, at least twice ruleCount. front-coded: blocks
+    UINT64 rulesOffset;
+    UINT64 indexOffset;
+    UINT64 pathsOffset;
+    UINT64 pathsLength; // WCHARs
+    UINT64 totalSize;
+    UINT64 patternsOffset; // 0 without patterns, after the paths
+} PolicySnapshotHeader;
+
+typedef struct PolicySnapshotRule_s {
+    UINT64 permissions;
+    UINT32 path; // first WCHAR in the paths
+    UINT32 hash; // hashPath of the path
+    UINT16 length; // WCHARs
+    UINT16 reserved[3];
+} PolicySnapshotRule;
+
+typedef struct PolicySnapshot_s {
+    CONST PolicySnapshotHeader* header;
+    CONST PolicySnapshotRule* rules;
+    CONST UINT32* index;
+    CONST WCHAR* paths;
+    UINT32 mask;
+    FrontCoded coded; // front-coded snapshots
+    PatternRules patterns;
+} PolicySnapshot;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN PolicySnapshot_open(PolicySnapshot* snapshot, CONST VOID* image, UINT64 size);
+    static CONST PolicySnapshotRule* PolicySnapshot_find(CONST PolicySnapshot* snapshot, CONST WCHAR* path, UINT32 length);
+    static UINT64 PolicySnapshot_permission(CONST PolicySnapshot* snapshot, CONST WCHAR* path, UINT32 length, UINT32* probes);
+
+#if defined(__cplusplus)
+}
+#endif
+
+// The patterns section, if any, after the end of the paths
+static BOOLEAN PolicySnapshot_openPatterns(PolicySnapshot* snapshot, CONST VOID* image, UINT64 size, UINT64 pathsEnd) {
+    UINT64 offset = snapshot->header->patternsOffset;
+    if (offset == 0) {
+        return TRUE;
+    }
+    return offset >= pathsEnd && offset % 8 == 0 && offset < size &&
+        PatternRules_open(&snapshot->patterns, (CONST UCHAR*)image + offset, size - offset);
+}
+
+/*
+ * `count` entries at `offset`, inside the image. The offset is checked before
+ * anything is added to it, so a crafted header can't wrap the end around.
+ */
+static BOOLEAN PolicySnapshot_section(UINT64 offset, UINT64 count, UINT64 entrySize, UINT64 size, UINT64* end) {
+    if (offset > size || count > (size - offset) / entrySize) {
+        return FALSE;
+    }
+    *end = offset + count * entrySize;
+    return TRUE;
+}
+
+/*
+ * FALSE if the image is malformed. The image must stay valid while the
+ * snapshot is used.
+ */
+BOOLEAN PolicySnapshot_open(PolicySnapshot* snapshot, CONST VOID* image, UINT64 size) {
+    CONST PolicySnapshotHeader* header = (CONST PolicySnapshotHeader*)image;
+
+    Kmemset(snapshot, 0, sizeof(PolicySnapshot));
+    if (image == NULL || size < sizeof(PolicySnapshotHeader) ||
+        header->magic != POLICY_SNAPSHOT_MAGIC || header->headerSize != sizeof(PolicySnapshotHeader) ||
+        header->totalSize != size) {
+        return FALSE;
+    }
+
+    if (header->version == POLICY_SNAPSHOT_FRONT_CODED) {
+        UINT64 blocksEnd;
+        UINT64 dataEnd;
+        if (header->rulesOffset != 0 || header->pathsLength > MAXUINT32 ||
+            !PolicySnapshot_section(header->indexOffset, header->indexSize, sizeof(UINT32), size, &blocksEnd) ||
+            !PolicySnapshot_section(header->pathsOffset, header->pathsLength, sizeof(WCHAR), size, &dataEnd) ||
+            header->indexOffset < sizeof(PolicySnapshotHeader) || header->indexOffset % 4 != 0 ||
+            header->pathsOffset < blocksEnd || header->pathsOffset % 2 != 0) {
+            return FALSE;
+        }
+
+        snapshot->index = (CONST UINT32*)((CONST UCHAR*)image + header->indexOffset);
+        snapshot->paths = (CONST WCHAR*)((CONST UCHAR*)image + header->pathsOffset);
+        if (!FrontCoded_open(&snapshot->coded, snapshot->index, header->indexSize, snapshot->paths, header->pathsLength, header->ruleCount)) {
+            return FALSE;
+        }
+        snapshot->header = header;
+        return PolicySnapshot_openPatterns(snapshot, image, size, dataEnd);
+    }
+    if (header->version != POLICY_SNAPSHOT_HASHED) {
+        return FALSE;
+    }
+
+    // sections in order, aligned for their entries, each inside the image
+    UINT64 rulesEnd;
+    UINT64 indexEnd;
+    UINT64 pathsEnd;
+    if (header->pathsLength > MAXUINT32 ||
+        !PolicySnapshot_section(header->rulesOffset, header->ruleCount, sizeof(PolicySnapshotRule), size, &rulesEnd) ||
+        !PolicySnapshot_section(header->indexOffset, header->indexSize, sizeof(UINT32), size, &indexEnd) ||
+        !PolicySnapshot_section(header->pathsOffset, header->pathsLength, sizeof(WCHAR), size, &pathsEnd) ||
+        header->rulesOffset < sizeof(PolicySnapshotHeader) || header->rulesOffset % 8 != 0 ||
+        header->indexOffset < rulesEnd || header->indexOffset % 4 != 0 ||
+        header->pathsOffset < indexEnd || header->pathsOffset % 2 != 0 || header->indexSize == 0 ||
+        (header->indexSize & (header->indexSize - 1)) != 0 || header->indexSize / 2 < header->ruleCount) {
+        return FALSE;
+    }
+
+    snapshot->header = header;
+    snapshot->rules = (CONST PolicySnapshotRule*)((CONST UCHAR*)image + header->rulesOffset);
+    snapshot->index = (CONST UINT32*)((CONST UCHAR*)image + header->indexOffset);
+    snapshot->paths = (CONST WCHAR*)((CONST UCHAR*)image + header->pathsOffset);
+    snapshot->mask = header->indexSize - 1;
+
+    for (UINT32 i = 0; i < header->ruleCount; i++) {
+        if ((UINT64)snapshot->rules[i].path + snapshot->rules[i].length > header->pathsLength) {
+            return FALSE;
+        }
+    }
+    // lookups stop on an empty slot: an index with none would never let them end
+    UINT32 used = 0;
+    for (UINT32 i = 0; i < header->indexSize; i++) {
+        if (snapshot->index[i] > header->ruleCount) {
+            return FALSE;
+        }
+        used += snapshot->index[i] != 0;
+    }
+    if (used > header->ruleCount || used == header->indexSize) {
+        return FALSE;
+    }
+    return PolicySnapshot_openPatterns(snapshot, image, size, pathsEnd);
+}
+
+// Hashed snapshots only, NULL on a front-coded one
+CONST PolicySnapshotRule* PolicySnapshot_find(CONST PolicySnapshot* snapshot, CONST WCHAR* path, UINT32 length) {
+    if (snapshot->header->version != POLICY_SNAPSHOT_HASHED) {
+        return NULL;
+    }
+    UINT32 hash = hashPath(path, length);
+
+    // the index is never more than half full, a probe always reaches an empty slot
+    for (UINT32 slot = hash & snapshot->mask; snapshot->index[slot] != 0; slot = (slot + 1) & snapshot->mask) {
+        CONST PolicySnapshotRule* rule = &snapshot->rules[snapshot->index[slot] - 1];
+        if (rule->hash == hash && rule->length == length &&
+            Kmemcmp((PVOID)&snapshot->paths[rule->path], (PVOID)path, length * sizeof(WCHAR)) == 0) {
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+// Hashed snapshots, one probe per prefix of the path
+static UINT64 PolicySnapshot_walk(CONST PolicySnapshot* snapshot, CONST WCHAR* path, UINT32 length, UINT32* probes) {
+    while (length > 0) {
+        if (probes != NULL) {
+            *probes += 1;
+        }
+
+        CONST PolicySnapshotRule* rule = PolicySnapshot_find(snapshot, path, length);
+        if (rule != NULL) {
+            return rule->permissions;
+        }
+
+        do {
+            length--;
+        } while (length > 0 && path[length] != '\\');
+    }
+    return 0;
+}
+
+/*
+ * Permissions of the deepest rule on the path or one of its parent folders,
+ * 0 if none. Same walk as getFilePermission, on prefixes of the path. The
+ * patterns are matched when no exact rule applies.
+ */
+UINT64 PolicySnapshot_permission(CONST PolicySnapshot* snapshot, CONST WCHAR* path, UINT32 length, UINT32* probes) {
+    UINT64 permissions = snapshot->header->version == POLICY_SNAPSHOT_FRONT_CODED ?
+        FrontCoded_permission(&snapshot->coded, path, length, probes) : PolicySnapshot_walk(snapshot, path, length, probes);
+    if (permissions == 0 && snapshot->patterns.header != NULL) {
+        permissions = PatternRules_permission(&snapshot->patterns, path, length, probes);
+    }
+    return permissions;
+}
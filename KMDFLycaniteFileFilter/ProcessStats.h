@@ -0,0 +1,122 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Per-sandbox counters of the filter decisions.
+ *
+ * Every CPU owns one cache-line aligned slot, so the I/O path only ever
+ * touches a line no other CPU writes to. A thread can still be preempted and
+ * rescheduled between picking its slot and incrementing, which is why the
+ * increments stay interlocked: uncontended on a line already owned by the
+ * CPU. Readers add the slots up; the totals are not a snapshot of a single
+ * instant.
+ */
+
+#define PROCESS_STATS_CACHE_LINE 64
+
+enum ProcessStatsOperation {
+    STATS_WRITE = 0,
+    STATS_READ = 1,
+    STATS_DELETE = 2,
+    STATS_OPERATIONS = 3
+};
+
+typedef struct processStatsCounters_s {
+    volatile LONG64 checks[STATS_OPERATIONS];
+    volatile LONG64 allows[STATS_OPERATIONS];
+    volatile LONG64 denies[STATS_OPERATIONS];
+    volatile LONG64 nameQueryFailures;
+    volatile LONG64 lookupProbes;
+    volatile LONG64 throttled; // reads and writes held back by the I/O budget
+    volatile LONG64 throttleFailures; // and failed once the wait was over
+} processStatsCounters;
+
+typedef union processStatsSlot_u {
+    processStatsCounters counters;
+    UCHAR pad[(sizeof(processStatsCounters) + PROCESS_STATS_CACHE_LINE - 1) & ~(PROCESS_STATS_CACHE_LINE - 1)];
+} processStatsSlot;
+
+typedef struct ProcessStats_s {
+    ULONG cpuCount;
+    PVOID allocation;
+    processStatsSlot* slots;
+} ProcessStats;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static ProcessStats* ProcessStats_create();
+    static processStatsCounters* ProcessStats_local(ProcessStats* stats);
+    static VOID ProcessStats_sum(ProcessStats* stats, processStatsCounters* total);
+    static VOID ProcessStats_reset(ProcessStats* stats);
+    static VOID ProcessStats_destroy(ProcessStats* stats);
+
+#if defined(__cplusplus)
+}
+#endif
+
+ProcessStats* ProcessStats_create() {
+    ProcessStats* stats = (ProcessStats*)calloc(1, sizeof(ProcessStats));
+    if (stats == NULL) {
+        return NULL;
+    }
+
+    stats->cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    // pool allocations under a page are only 16 bytes aligned
+    stats->allocation = calloc(1, stats->cpuCount * sizeof(processStatsSlot) + PROCESS_STATS_CACHE_LINE);
+    if (stats->allocation == NULL) {
+        free(stats);
+        return NULL;
+    }
+
+    stats->slots = (processStatsSlot*)(((ULONG_PTR)stats->allocation + PROCESS_STATS_CACHE_LINE - 1) & ~((ULONG_PTR)PROCESS_STATS_CACHE_LINE - 1));
+    return stats;
+}
+
+/*
+ * Slot of the current CPU. NULL stats are allowed so callers don't have to
+ * check for a sandbox that failed to allocate its counters.
+ */
+processStatsCounters* ProcessStats_local(ProcessStats* stats) {
+    if (stats == NULL) {
+        return NULL;
+    }
+
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+    return &stats->slots[cpu < stats->cpuCount ? cpu : cpu % stats->cpuCount].counters;
+}
+
+VOID ProcessStats_sum(ProcessStats* stats, processStatsCounters* total) {
+    Kmemset(total, 0, sizeof(processStatsCounters));
+
+    for (ULONG cpu = 0; stats != NULL && cpu < stats->cpuCount; cpu++) {
+        processStatsCounters* counters = &stats->slots[cpu].counters;
+
+        for (UINT8 op = 0; op < STATS_OPERATIONS; op++) {
+            total->checks[op] += ReadNoFence64(&counters->checks[op]);
+            total->allows[op] += ReadNoFence64(&counters->allows[op]);
+            total->denies[op] += ReadNoFence64(&counters->denies[op]);
+        }
+        total->nameQueryFailures += ReadNoFence64(&counters->nameQueryFailures);
+        total->lookupProbes += ReadNoFence64(&counters->lookupProbes);
+        total->throttled += ReadNoFence64(&counters->throttled);
+        total->throttleFailures += ReadNoFence64(&counters->throttleFailures);
+    }
+}
+
+// For a record handed to a new sandbox
+VOID ProcessStats_reset(ProcessStats* stats) {
+    if (stats != NULL) {
+        Kmemset(stats->slots, 0, stats->cpuCount * sizeof(processStatsSlot));
+    }
+}
+
+VOID ProcessStats_destroy(ProcessStats* stats) {
+    if (stats != NULL) {
+        free(stats->allocation);
+        free(stats);
+    }
+}
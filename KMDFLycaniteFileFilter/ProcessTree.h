@@ -0,0 +1,234 @@
+#pragma once
+
+#include "IKashmap.h"
+
+/*
+ * Tree of the sandboxed processes.
+ *
+ * Every tracked process has a node with a link to its parent, the sandbox it
+ * belongs to and the ids of its first PROCESS_TREE_ANCESTORS ancestors, so
+ * "which sandbox owns this process" and "is A an ancestor of B" are answered
+ * without walking the tree. Node ids are never reused, unlike process ids.
+ *
+ * A node outlives its process while it has children, which keeps the parent
+ * links of orphans valid. Nodes come from blocks kept on a free list, creating
+ * a process only allocates when the list runs dry. Not synchronized: callers
+ * serialize changes, and keep lookups off them since the index rehashes.
+ */
+
+#define PROCESS_TREE_ANCESTORS 16
+#define PROCESS_TREE_BLOCK 256
+
+struct ProcessNode_s;
+
+// Live processes of a sandbox
+typedef struct ProcessSet_s {
+    struct ProcessNode_s* head;
+    UINT32 count;
+} ProcessSet;
+
+typedef struct ProcessNode_s {
+    UINT64 id;
+    UINT64 processId;
+    struct ProcessNode_s* parent;
+    PVOID sandbox; // NULL once the process exited
+    ProcessSet* set;
+    struct ProcessNode_s* setPrevious;
+    struct ProcessNode_s* setNext; // also links the free list
+    UINT32 depth;
+    UINT32 children; // nodes still holding this one as parent
+    UINT64 ancestors[PROCESS_TREE_ANCESTORS]; // ids, by depth
+} ProcessNode;
+
+typedef struct ProcessTreeBlock_s {
+    struct ProcessTreeBlock_s* next;
+    ProcessNode nodes[PROCESS_TREE_BLOCK];
+} ProcessTreeBlock;
+
+typedef struct ProcessTree_s {
+    map_t index; // process id -> node, live processes only
+    ProcessTreeBlock* blocks;
+    ProcessNode* free;
+    UINT32 freeCount;
+    UINT32 nodes; // live and exited nodes still in the tree
+    UINT64 nextId;
+} ProcessTree;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN ProcessTree_init(ProcessTree* tree);
+    static BOOLEAN ProcessTree_reserve(ProcessTree* tree, UINT32 count);
+    static ProcessNode* ProcessTree_find(ProcessTree* tree, UINT64 processId);
+    static PVOID ProcessTree_sandbox(ProcessTree* tree, UINT64 processId);
+    static ProcessNode* ProcessTree_add(ProcessTree* tree, UINT64 processId, ProcessNode* parent, PVOID sandbox, ProcessSet* set);
+    static VOID ProcessTree_remove(ProcessTree* tree, ProcessNode* node);
+    static BOOLEAN ProcessTree_isAncestor(ProcessTree* tree, UINT64 ancestorId, UINT64 processId);
+    static BOOLEAN ProcessTree_isAncestorNode(CONST ProcessNode* ancestor, CONST ProcessNode* node);
+    static VOID ProcessTree_destroy(ProcessTree* tree);
+
+#if defined(__cplusplus)
+}
+#endif
+
+BOOLEAN ProcessTree_init(ProcessTree* tree) {
+    Kmemset(tree, 0, sizeof(ProcessTree));
+    tree->index = ihashmap_new();
+    return tree->index != NULL;
+}
+
+/*
+ * Makes sure `count` nodes are on the free list.
+ */
+BOOLEAN ProcessTree_reserve(ProcessTree* tree, UINT32 count) {
+    while (tree->freeCount < count) {
+        ProcessTreeBlock* block = (ProcessTreeBlock*)calloc(1, sizeof(ProcessTreeBlock));
+        if (block == NULL) {
+            return FALSE;
+        }
+
+        block->next = tree->blocks;
+        tree->blocks = block;
+        for (UINT32 i = 0; i < PROCESS_TREE_BLOCK; i++) {
+            block->nodes[i].setNext = tree->free;
+            tree->free = &block->nodes[i];
+        }
+        tree->freeCount += PROCESS_TREE_BLOCK;
+    }
+    return TRUE;
+}
+
+ProcessNode* ProcessTree_find(ProcessTree* tree, UINT64 processId) {
+    ProcessNode* node = NULL;
+    if (ihashmap_get(tree->index, processId, (any_t*)&node) != MAP_OK) {
+        return NULL;
+    }
+    return node;
+}
+
+PVOID ProcessTree_sandbox(ProcessTree* tree, UINT64 processId) {
+    ProcessNode* node = ProcessTree_find(tree, processId);
+    return node != NULL ? node->sandbox : NULL;
+}
+
+/*
+ * `parent` is NULL for a process whose parent isn't tracked, `sandbox` is
+ * never NULL. The process id must not be in the tree already.
+ */
+ProcessNode* ProcessTree_add(ProcessTree* tree, UINT64 processId, ProcessNode* parent, PVOID sandbox, ProcessSet* set) {
+    if (tree->free == NULL && !ProcessTree_reserve(tree, 1)) {
+        return NULL;
+    }
+
+    ProcessNode* node = tree->free;
+    if (ihashmap_put(tree->index, processId, node) != MAP_OK) {
+        return NULL;
+    }
+    tree->free = node->setNext;
+    tree->freeCount--;
+    tree->nodes++;
+
+    node->id = ++tree->nextId;
+    node->processId = processId;
+    node->parent = parent;
+    node->sandbox = sandbox;
+    node->children = 0;
+
+    if (parent != NULL) {
+        UINT32 known = parent->depth < PROCESS_TREE_ANCESTORS ? parent->depth : PROCESS_TREE_ANCESTORS;
+        Kmemcpy(node->ancestors, parent->ancestors, known * sizeof(UINT64));
+        if (parent->depth < PROCESS_TREE_ANCESTORS) {
+            node->ancestors[parent->depth] = parent->id;
+        }
+        node->depth = parent->depth + 1;
+        parent->children++;
+    }
+    else {
+        node->depth = 0;
+    }
+
+    node->set = set;
+    node->setPrevious = NULL;
+    node->setNext = set->head;
+    if (set->head != NULL) {
+        set->head->setPrevious = node;
+    }
+    set->head = node;
+    set->count++;
+    return node;
+}
+
+/*
+ * On exit. The node leaves the index and its sandbox, and goes back to the
+ * free list along with the exited ancestors it was the last child of.
+ */
+VOID ProcessTree_remove(ProcessTree* tree, ProcessNode* node) {
+    ihashmap_remove(tree->index, node->processId, NULL);
+
+    if (node->setPrevious != NULL) {
+        node->setPrevious->setNext = node->setNext;
+    }
+    else {
+        node->set->head = node->setNext;
+    }
+    if (node->setNext != NULL) {
+        node->setNext->setPrevious = node->setPrevious;
+    }
+    node->set->count--;
+    node->set = NULL;
+    node->sandbox = NULL;
+
+    while (node != NULL && node->sandbox == NULL && node->children == 0) {
+        ProcessNode* parent = node->parent;
+
+        node->parent = NULL;
+        node->setNext = tree->free;
+        tree->free = node;
+        tree->freeCount++;
+        tree->nodes--;
+
+        if (parent != NULL) {
+            parent->children--;
+        }
+        node = parent;
+    }
+}
+
+/*
+ * Both nodes must be in the tree. Constant time unless the ancestor is deeper
+ * than PROCESS_TREE_ANCESTORS, then the parent links are followed.
+ */
+BOOLEAN ProcessTree_isAncestorNode(CONST ProcessNode* ancestor, CONST ProcessNode* node) {
+    if (ancestor->depth >= node->depth) {
+        return FALSE;
+    }
+
+    if (ancestor->depth < PROCESS_TREE_ANCESTORS) {
+        return node->ancestors[ancestor->depth] == ancestor->id;
+    }
+
+    while (node->depth > ancestor->depth) {
+        node = node->parent;
+    }
+    return node == ancestor;
+}
+
+// Of live processes
+BOOLEAN ProcessTree_isAncestor(ProcessTree* tree, UINT64 ancestorId, UINT64 processId) {
+    ProcessNode* ancestor = ProcessTree_find(tree, ancestorId);
+    ProcessNode* node = ProcessTree_find(tree, processId);
+    return ancestor != NULL && node != NULL && ProcessTree_isAncestorNode(ancestor, node);
+}
+
+VOID ProcessTree_destroy(ProcessTree* tree) {
+    while (tree->blocks != NULL) {
+        ProcessTreeBlock* block = tree->blocks;
+        tree->blocks = block->next;
+        free(block);
+    }
+    if (tree->index != NULL) {
+        ihashmap_free(tree->index);
+    }
+    Kmemset(tree, 0, sizeof(ProcessTree));
+}
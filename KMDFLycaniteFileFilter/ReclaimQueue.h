@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Closed sandboxes waiting for the event worker to free their rules.
+ *
+ * Intrusive lock-free stack: producers (the process notify routine) push with
+ * a CAS, the single consumer (the event worker) detaches the whole list with
+ * an exchange. Nodes are never popped one at a time while another thread may
+ * be reading them, so there is no ABA to guard against.
+ */
+
+typedef struct ReclaimEntry_s {
+    struct ReclaimEntry_s* next;
+} ReclaimEntry;
+
+typedef struct ReclaimQueue_s {
+    ReclaimEntry* volatile head;
+    volatile LONG64 pushed;
+    volatile LONG64 taken;
+} ReclaimQueue;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static VOID ReclaimQueue_init(ReclaimQueue* queue);
+    static BOOLEAN ReclaimQueue_push(ReclaimQueue* queue, ReclaimEntry* entry);
+    static ReclaimEntry* ReclaimQueue_takeAll(ReclaimQueue* queue);
+    static BOOLEAN ReclaimQueue_isEmpty(ReclaimQueue* queue);
+    static UINT64 ReclaimQueue_pending(ReclaimQueue* queue);
+
+#if defined(__cplusplus)
+}
+#endif
+
+VOID ReclaimQueue_init(ReclaimQueue* queue) {
+    queue->head = NULL;
+    queue->pushed = 0;
+    queue->taken = 0;
+}
+
+/*
+ * Returns TRUE when the queue was empty, the consumer may be asleep.
+ */
+BOOLEAN ReclaimQueue_push(ReclaimQueue* queue, ReclaimEntry* entry) {
+    ReclaimEntry* head;
+
+    InterlockedIncrement64(&queue->pushed);
+    do {
+        head = queue->head;
+        entry->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*)&queue->head, entry, head) != head);
+
+    return head == NULL;
+}
+
+/*
+ * Consumer only. Detaches every entry and returns them oldest first.
+ */
+ReclaimEntry* ReclaimQueue_takeAll(ReclaimQueue* queue) {
+    ReclaimEntry* entry = (ReclaimEntry*)InterlockedExchangePointer((PVOID volatile*)&queue->head, NULL);
+    ReclaimEntry* ordered = NULL;
+
+    while (entry != NULL) {
+        ReclaimEntry* next = entry->next;
+        entry->next = ordered;
+        ordered = entry;
+        InterlockedIncrement64(&queue->taken);
+        entry = next;
+    }
+    return ordered;
+}
+
+BOOLEAN ReclaimQueue_isEmpty(ReclaimQueue* queue) {
+    return ReadPointerNoFence((PVOID volatile*)&queue->head) == NULL;
+}
+
+// Pushed and not yet taken by the consumer
+UINT64 ReclaimQueue_pending(ReclaimQueue* queue) {
+    return (UINT64)(ReadNoFence64(&queue->pushed) - ReadNoFence64(&queue->taken));
+}
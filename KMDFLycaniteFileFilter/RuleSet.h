@@ -0,0 +1,266 @@
+#pragma once
+
+#include "Utils.h"
+#include "Kashmap.h"
+#include "PathTrie.h"
+
+/*
+ * Sealed sandbox rules, shared between the sandboxes holding the same rules.
+ *
+ * Sealing a sandbox interns its rules by content: if an equal set is already
+ * known it is referenced, otherwise the rules are compiled into a new set, a
+ * PathTrie holding each path component once. A set is never written once
+ * interned; the sandbox keeps its later changes in its own rule table, looked
+ * up before the set, where a deletion of a shared rule is kept as a
+ * RULESET_DELETED entry.
+ *
+ * The table of sets is not locked here: RuleSets_intern and RuleSets_release
+ * are called under the caller's lock, the last release hands the set back to
+ * be destroyed outside of it.
+ */
+
+#define RULESET_BUCKETS 256
+
+// private rule hiding a shared one
+#define RULESET_DELETED (1ull << 63)
+
+typedef struct RuleSet_s {
+    PathTrie rules;
+    UINT64 hash; // of the content, whatever the insertion order
+    LONG references;
+    struct RuleSet_s* next; // bucket chain
+} RuleSet;
+
+typedef struct RuleSets_s {
+    RuleSet* buckets[RULESET_BUCKETS];
+    UINT32 count; // distinct sets
+} RuleSets;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static UINT64 RuleSet_contentHash(CONST struct hashmap_s* rules);
+    static BOOLEAN RuleSet_sameRules(CONST struct hashmap_s* rules, CONST PathTrie* other);
+    static BOOLEAN RuleSet_overlay(CONST RuleSet* set, CONST struct hashmap_s* changes, struct hashmap_s* out);
+    static UINT64 RuleSet_permission(CONST struct hashmap_s* rules, CONST RuleSet* set, CONST WCHAR* path, UINT32 length, UINT32* probes);
+    static BOOLEAN RuleSet_find(CONST struct hashmap_s* rules, CONST RuleSet* set, CONST WCHAR* path, UINT32 length, UINT64* permissions);
+    static VOID RuleSet_destroy(RuleSet* set);
+
+    static RuleSet* RuleSets_intern(RuleSets* sets, CONST struct hashmap_s* rules);
+    static RuleSet* RuleSets_release(RuleSets* sets, RuleSet* set);
+    static VOID RuleSets_destroy(RuleSets* sets);
+
+#if defined(__cplusplus)
+}
+#endif
+
+static UINT64 RuleSet_mix(UINT64 x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// Sum of the rule hashes, so the order rules were set in doesn't matter
+UINT64 RuleSet_contentHash(CONST struct hashmap_s* rules) {
+    UINT64 hash = rules->size;
+    for (UINT32 i = 0; i < rules->table_size; i++) {
+        CONST struct hashmap_element_s* e = &rules->data[i];
+        if (e->in_use) {
+            hash += RuleSet_mix(((UINT64)hashPath(e->key, e->key_len) << 32) ^ *(UINT64*)e->data);
+        }
+    }
+    return hash;
+}
+
+BOOLEAN RuleSet_sameRules(CONST struct hashmap_s* rules, CONST PathTrie* other) {
+    if (rules->size != other->ruleCount) {
+        return FALSE;
+    }
+    for (UINT32 i = 0; i < rules->table_size; i++) {
+        CONST struct hashmap_element_s* e = &rules->data[i];
+        UINT64 permissions = 0;
+        if (e->in_use && (!PathTrie_find(other, e->key, e->key_len, &permissions) || permissions != *(UINT64*)e->data)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static BOOLEAN RuleSet_put(struct hashmap_s* out, CONST WCHAR* path, UINT32 length, UINT64 permissions) {
+    UINT64* value = (UINT64*)hashmap_get(out, (PWCHAR)path, length);
+    if (value != NULL) {
+        *value = permissions;
+        return TRUE;
+    }
+
+    PWCHAR key = (PWCHAR)malloc((length + 1) * sizeof(WCHAR));
+    value = (UINT64*)malloc(sizeof(UINT64));
+    if (key != NULL && value != NULL) {
+        Kmemcpy(key, (PVOID)path, length * sizeof(WCHAR));
+        key[length] = 0;
+        *value = permissions;
+        if (hashmap_put(out, key, length, value) == 0) {
+            return TRUE;
+        }
+    }
+    free(key);
+    free(value);
+    return FALSE;
+}
+
+static INT8 RuleSet_freeRule(PVOID CONST context, struct hashmap_element_s* CONST e) {
+    UNREFERENCED_PARAMETER(context);
+    free(e->key);
+    free(e->data);
+    return -1;
+}
+
+typedef struct RuleSetOverlay_s {
+    CONST struct hashmap_s* changes;
+    struct hashmap_s* out;
+} RuleSetOverlay;
+
+// Shared rule into the overlay, unless a private one replaces it
+static BOOLEAN RuleSet_overlayRule(PVOID context, CONST WCHAR* path, UINT32 length, UINT64 permissions) {
+    RuleSetOverlay* overlay = (RuleSetOverlay*)context;
+    if (hashmap_get(overlay->changes, (PWCHAR)path, length) != NULL) {
+        return TRUE;
+    }
+    return RuleSet_put(overlay->out, path, length, permissions);
+}
+
+/*
+ * A new table with the rules of the set, changed by the private rules. FALSE
+ * if an allocation failed, `out` is then left empty.
+ */
+BOOLEAN RuleSet_overlay(CONST RuleSet* set, CONST struct hashmap_s* changes, struct hashmap_s* out) {
+    if (hashmap_create(8, out) != 0) {
+        return FALSE;
+    }
+
+    RuleSetOverlay overlay = { changes, out };
+    BOOLEAN copied = PathTrie_iterate(&set->rules, RuleSet_overlayRule, &overlay);
+    for (UINT32 i = 0; i < changes->table_size && copied; i++) {
+        CONST struct hashmap_element_s* e = &changes->data[i];
+        if (e->in_use && !(*(UINT64*)e->data & RULESET_DELETED)) {
+            copied = RuleSet_put(out, e->key, e->key_len, *(UINT64*)e->data);
+        }
+    }
+
+    if (!copied) {
+        hashmap_iterate_pairs(out, RuleSet_freeRule, NULL);
+        hashmap_destroy(out);
+    }
+    return copied;
+}
+
+/*
+ * Permissions of the deepest rule on the path or one of its parent folders,
+ * private rules first, 0 if none. `rules` or `set` may be NULL. Same walk as
+ * getFilePermission, on prefixes of the path; a sealed sandbox without
+ * changes takes the set's single pass instead.
+ */
+UINT64 RuleSet_permission(CONST struct hashmap_s* rules, CONST RuleSet* set, CONST WCHAR* path, UINT32 length, UINT32* probes) {
+    if (set != NULL && (rules == NULL || rules->size == 0)) {
+        return PathTrie_permission(&set->rules, path, length, probes);
+    }
+
+    while (length > 0) {
+        if (probes != NULL) {
+            *probes += 1;
+        }
+
+        UINT64* permissions = rules != NULL ? (UINT64*)hashmap_get(rules, (PWCHAR)path, length) : NULL;
+        if (permissions != NULL && !(*permissions & RULESET_DELETED)) {
+            return *permissions;
+        }
+
+        UINT64 shared = 0;
+        if (permissions == NULL && set != NULL && PathTrie_find(&set->rules, path, length, &shared)) {
+            return shared;
+        }
+
+        do {
+            length--;
+        } while (length > 0 && path[length] != '\\');
+    }
+    return 0;
+}
+
+// The rule on the path itself, ignoring its parent folders
+BOOLEAN RuleSet_find(CONST struct hashmap_s* rules, CONST RuleSet* set, CONST WCHAR* path, UINT32 length, UINT64* permissions) {
+    UINT64* own = rules != NULL ? (UINT64*)hashmap_get(rules, (PWCHAR)path, length) : NULL;
+    if (own != NULL) {
+        *permissions = *own;
+        return !(*own & RULESET_DELETED);
+    }
+    return set != NULL && PathTrie_find(&set->rules, path, length, permissions);
+}
+
+VOID RuleSet_destroy(RuleSet* set) {
+    PathTrie_destroy(&set->rules);
+    free(set);
+}
+
+/*
+ * The set holding these rules, with a new reference. When no equal set exists
+ * one is compiled from the table, which stays the caller's. NULL if the set
+ * can't be allocated.
+ */
+RuleSet* RuleSets_intern(RuleSets* sets, CONST struct hashmap_s* rules) {
+    UINT64 hash = RuleSet_contentHash(rules);
+    RuleSet** bucket = &sets->buckets[hash % RULESET_BUCKETS];
+
+    for (RuleSet* set = *bucket; set != NULL; set = set->next) {
+        if (set->hash == hash && RuleSet_sameRules(rules, &set->rules)) {
+            set->references++;
+            return set;
+        }
+    }
+
+    RuleSet* set = (RuleSet*)malloc(sizeof(RuleSet));
+    if (set == NULL) {
+        return NULL;
+    }
+    if (!PathTrie_build(&set->rules, rules)) {
+        free(set);
+        return NULL;
+    }
+    set->hash = hash;
+    set->references = 1;
+    set->next = *bucket;
+    *bucket = set;
+    sets->count++;
+    return set;
+}
+
+// The set once its last reference is gone, for RuleSet_destroy, else NULL
+RuleSet* RuleSets_release(RuleSets* sets, RuleSet* set) {
+    if (--set->references > 0) {
+        return NULL;
+    }
+
+    RuleSet** link = &sets->buckets[set->hash % RULESET_BUCKETS];
+    while (*link != set) {
+        link = &(*link)->next;
+    }
+    *link = set->next;
+    sets->count--;
+    return set;
+}
+
+// At unload, every sandbox is gone
+VOID RuleSets_destroy(RuleSets* sets) {
+    for (UINT32 i = 0; i < RULESET_BUCKETS; i++) {
+        while (sets->buckets[i] != NULL) {
+            RuleSet* set = sets->buckets[i];
+            sets->buckets[i] = set->next;
+            RuleSet_destroy(set);
+        }
+    }
+    sets->count = 0;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Single-producer / single-consumer byte ring living in one block of memory
+ * shared between the driver (producer) and the controller (consumer).
+ *
+ * Layout: a SHARED_RING_HEADER_SIZE header page holding the two indices on
+ * separate cache lines, followed by `capacity` bytes of entries. Indices are
+ * free-running byte counters. An entry is a little-endian UINT16 length
+ * followed by the payload; a length of SHARED_RING_WRAP means "skip to the
+ * start of the buffer". Entries never straddle the end of the buffer so the
+ * consumer can parse them in place.
+ *
+ * The producer keeps its index and the capacity in a SharedRingProducer of
+ * its own: the header is writable by the consumer, the producer only
+ * publishes its index there, and checks the consumer index it reads back.
+ *
+ * Doorbell: the producer publishes its index then reads the consumer index;
+ * the consumer publishes its index then reads the producer index. With full
+ * barriers on both sides at least one of them sees the other, so the producer
+ * only has to signal when the ring was empty before its write.
+ */
+
+#define SHARED_RING_MAGIC 0x474E5252 // "RRNG"
+#define SHARED_RING_VERSION 1
+#define SHARED_RING_HEADER_SIZE 4096
+#define SHARED_RING_CACHE_LINE 64
+#define SHARED_RING_WRAP 0xFFFF
+#define SHARED_RING_ENTRY_HEADER 2
+
+typedef struct SharedRingHeader_s {
+    UINT32 magic;
+    UINT32 version;
+    UINT32 headerSize;
+    UINT32 capacity;
+    UCHAR padProducer[SHARED_RING_CACHE_LINE - 16];
+
+    volatile LONG64 producer;
+    UCHAR padConsumer[SHARED_RING_CACHE_LINE - sizeof(LONG64)];
+
+    volatile LONG64 consumer;
+    UCHAR padEnd[SHARED_RING_CACHE_LINE - sizeof(LONG64)];
+} SharedRingHeader;
+
+// The producer's view of the ring, out of the consumer's reach
+typedef struct SharedRingProducer_s {
+    SharedRingHeader* header;
+    UINT64 capacity;
+    UINT64 head;
+} SharedRingProducer;
+
+enum SharedRingStatus {
+    SHARED_RING_OK = 0,
+    SHARED_RING_OK_WAKE = 1,
+    SHARED_RING_FULL = 2,
+    SHARED_RING_TOO_BIG = 3
+};
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static SharedRingHeader* SharedRing_init(PVOID memory, UINT32 capacity, SharedRingProducer* producer);
+    static PUCHAR SharedRing_data(SharedRingHeader* ring);
+    static UINT8 SharedRing_write(SharedRingProducer* producer, CONST PVOID data, UINT16 size);
+    static BOOLEAN SharedRing_peek(SharedRingHeader* ring, PUCHAR* data, UINT16* size);
+    static BOOLEAN SharedRing_release(SharedRingHeader* ring, UINT16 size);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*
+ * `memory` must hold SHARED_RING_HEADER_SIZE + capacity bytes, capacity being
+ * a power of two. `producer` is set up to write to it.
+ */
+SharedRingHeader* SharedRing_init(PVOID memory, UINT32 capacity, SharedRingProducer* producer) {
+    if (memory == NULL || capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return NULL;
+    }
+
+    SharedRingHeader* ring = (SharedRingHeader*)memory;
+    Kmemset(ring, 0, SHARED_RING_HEADER_SIZE);
+    ring->magic = SHARED_RING_MAGIC;
+    ring->version = SHARED_RING_VERSION;
+    ring->headerSize = SHARED_RING_HEADER_SIZE;
+    ring->capacity = capacity;
+
+    producer->header = ring;
+    producer->capacity = capacity;
+    producer->head = 0;
+    return ring;
+}
+
+PUCHAR SharedRing_data(SharedRingHeader* ring) {
+    return (PUCHAR)ring + SHARED_RING_HEADER_SIZE;
+}
+
+/*
+ * Producer side. Nothing is read from the shared header but the consumer
+ * index: one outside [head - capacity, head] is treated as a full ring.
+ */
+UINT8 SharedRing_write(SharedRingProducer* producer, CONST PVOID data, UINT16 size) {
+    SharedRingHeader* ring = producer->header;
+    UINT64 capacity = producer->capacity;
+    UINT64 mask = capacity - 1;
+    UINT64 entry = (UINT64)size + SHARED_RING_ENTRY_HEADER;
+
+    if (size >= SHARED_RING_WRAP || entry > capacity / 2) {
+        return SHARED_RING_TOO_BIG;
+    }
+
+    UINT64 head = producer->head;
+    UINT64 tail = (UINT64)ReadAcquire64(&ring->consumer);
+    UINT64 pos = head & mask;
+    UINT64 contiguous = capacity - pos;
+    UINT64 needed = contiguous < entry ? contiguous + entry : entry;
+
+    if (tail > head || head - tail + needed > capacity) {
+        return SHARED_RING_FULL;
+    }
+
+    PUCHAR buffer = SharedRing_data(ring);
+    UINT64 next = head;
+
+    if (contiguous < entry) {
+        if (contiguous >= SHARED_RING_ENTRY_HEADER) {
+            buffer[pos] = (UCHAR)(SHARED_RING_WRAP & 0xFF);
+            buffer[pos + 1] = (UCHAR)((SHARED_RING_WRAP >> 8) & 0xFF);
+        }
+        next += contiguous;
+        pos = 0;
+    }
+
+    buffer[pos] = (UCHAR)(size & 0xFF);
+    buffer[pos + 1] = (UCHAR)((size >> 8) & 0xFF);
+    Kmemcpy(buffer + pos + SHARED_RING_ENTRY_HEADER, data, size);
+    next += entry;
+
+    producer->head = next;
+    InterlockedExchange64(&ring->producer, (LONG64)next);
+
+    if ((UINT64)ReadAcquire64(&ring->consumer) == head) {
+        return SHARED_RING_OK_WAKE;
+    }
+    return SHARED_RING_OK;
+}
+
+/*
+ * Consumer side: points `data` at the next payload, in place. Call
+ * SharedRing_release with the same size once it has been processed.
+ */
+BOOLEAN SharedRing_peek(SharedRingHeader* ring, PUCHAR* data, UINT16* size) {
+    UINT64 mask = (UINT64)ring->capacity - 1;
+    PUCHAR buffer = SharedRing_data(ring);
+
+    for (;;) {
+        UINT64 tail = (UINT64)ring->consumer;
+        UINT64 head = (UINT64)ReadAcquire64(&ring->producer);
+
+        if (tail == head) {
+            return FALSE;
+        }
+
+        UINT64 pos = tail & mask;
+        UINT64 contiguous = (UINT64)ring->capacity - pos;
+        UINT16 len = contiguous >= SHARED_RING_ENTRY_HEADER ?
+            (UINT16)(buffer[pos] | (buffer[pos + 1] << 8)) : SHARED_RING_WRAP;
+
+        if (len == SHARED_RING_WRAP) {
+            WriteRelease64(&ring->consumer, (LONG64)(tail + contiguous));
+            continue;
+        }
+
+        *data = buffer + pos + SHARED_RING_ENTRY_HEADER;
+        *size = len;
+        return TRUE;
+    }
+}
+
+/*
+ * Returns TRUE if the ring is now empty and the consumer may wait on the
+ * doorbell.
+ */
+BOOLEAN SharedRing_release(SharedRingHeader* ring, UINT16 size) {
+    UINT64 next = (UINT64)ring->consumer + size + SHARED_RING_ENTRY_HEADER;
+
+    InterlockedExchange64(&ring->consumer, (LONG64)next);
+    return (UINT64)ReadAcquire64(&ring->producer) == next;
+}
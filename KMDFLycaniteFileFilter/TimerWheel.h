@@ -0,0 +1,207 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Hierarchical timer wheel: TIMERWHEEL_LEVELS levels of TIMERWHEEL_SLOTS
+ * slots, each level's slot spanning a whole turn of the level below.
+ *
+ * A timer goes to the lowest level whose turn reaches its expiry, in the
+ * slot of its expiry bits for that level: inserting and removing are O(1),
+ * the timers being intrusive doubly linked nodes. When the clock enters the
+ * span of a higher level slot, its timers are cascaded down to the levels
+ * below; a timer is cascaded at most once per level, expiring is O(1)
+ * amortized. Timers further than the top level's turn wait in its last slot
+ * and are cascaded back up until they are in reach.
+ *
+ * Time is in ticks chosen by the caller. The wheel isn't locked: the caller
+ * guards it, and pops the timers due in batches of its choosing.
+ */
+
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_NEVER MAXUINT64
+
+typedef struct TimerWheelNode_s {
+    struct TimerWheelNode_s* next;
+    struct TimerWheelNode_s** link; // what points to it, NULL while not armed
+    UINT64 expires;
+} TimerWheelNode;
+
+typedef VOID(*TimerWheelRelease)(TimerWheelNode* node);
+
+typedef struct TimerWheel_s {
+    UINT64 tick; // next tick to expire
+    UINT64 count; // armed timers, due ones included
+    TimerWheelNode* due; // expired, not popped yet
+    TimerWheelNode* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+} TimerWheel;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static VOID TimerWheel_init(TimerWheel* wheel, UINT64 now);
+    static VOID TimerWheel_insert(TimerWheel* wheel, TimerWheelNode* node, UINT64 expires);
+    static VOID TimerWheel_remove(TimerWheel* wheel, TimerWheelNode* node);
+    static TimerWheelNode* TimerWheel_pop(TimerWheel* wheel, UINT64 now, UINT32* budget);
+    static UINT64 TimerWheel_next(TimerWheel* wheel);
+    static VOID TimerWheel_clear(TimerWheel* wheel, TimerWheelRelease release);
+
+#if defined(__cplusplus)
+}
+#endif
+
+VOID TimerWheel_init(TimerWheel* wheel, UINT64 now) {
+    Kmemset(wheel, 0, sizeof(TimerWheel));
+    wheel->tick = now;
+}
+
+static VOID TimerWheel_push(TimerWheelNode** head, TimerWheelNode* node) {
+    node->next = *head;
+    if (node->next != NULL) {
+        node->next->link = &node->next;
+    }
+    node->link = head;
+    *head = node;
+}
+
+// Links the node in its slot, or with the due timers if it already expired
+static VOID TimerWheel_place(TimerWheel* wheel, TimerWheelNode* node) {
+    if (node->expires < wheel->tick) {
+        TimerWheel_push(&wheel->due, node);
+        return;
+    }
+
+    UINT64 delta = node->expires - wheel->tick;
+    UINT64 slotTick = node->expires;
+    UINT32 level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 && delta >> (TIMERWHEEL_SLOT_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    if (delta >> (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS) != 0) {
+        slotTick = wheel->tick + (1ull << (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS)) - 1;
+    }
+    TimerWheel_push(&wheel->slots[level][(slotTick >> (TIMERWHEEL_SLOT_BITS * level)) & TIMERWHEEL_MASK], node);
+}
+
+// The node must not be armed
+VOID TimerWheel_insert(TimerWheel* wheel, TimerWheelNode* node, UINT64 expires) {
+    node->expires = expires;
+    TimerWheel_place(wheel, node);
+    wheel->count++;
+}
+
+// Disarms an armed node, due or not
+VOID TimerWheel_remove(TimerWheel* wheel, TimerWheelNode* node) {
+    *node->link = node->next;
+    if (node->next != NULL) {
+        node->next->link = node->link;
+    }
+    node->next = NULL;
+    node->link = NULL;
+    wheel->count--;
+}
+
+// Moves the timers of the higher level slots the current tick enters down
+static VOID TimerWheel_cascade(TimerWheel* wheel) {
+    for (UINT32 level = 1; level < TIMERWHEEL_LEVELS; level++) {
+        if ((wheel->tick & ((1ull << (TIMERWHEEL_SLOT_BITS * level)) - 1)) != 0) {
+            return;
+        }
+
+        TimerWheelNode** slot = &wheel->slots[level][(wheel->tick >> (TIMERWHEEL_SLOT_BITS * level)) & TIMERWHEEL_MASK];
+        TimerWheelNode* node = *slot;
+        *slot = NULL;
+        while (node != NULL) {
+            TimerWheelNode* next = node->next;
+            TimerWheel_place(wheel, node);
+            node = next;
+        }
+    }
+}
+
+/*
+ * Lower bound of the next expiry, TIMERWHEEL_NEVER without timers: the
+ * earliest tick with timers in its level 0 slot or a cascade of timers.
+ * Scans the slots, for a caller deciding how long to sleep.
+ */
+UINT64 TimerWheel_next(TimerWheel* wheel) {
+    if (wheel->count == 0) {
+        return TIMERWHEEL_NEVER;
+    }
+    if (wheel->due != NULL) {
+        return wheel->tick;
+    }
+
+    UINT64 next = TIMERWHEEL_NEVER;
+    for (UINT32 level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        UINT32 shift = TIMERWHEEL_SLOT_BITS * level;
+        UINT64 position = wheel->tick >> shift;
+
+        // the current slot is cascaded at this tick only if it starts its span
+        BOOLEAN entering = level == 0 || (wheel->tick & ((1ull << shift) - 1)) == 0;
+        for (UINT32 offset = entering ? 0 : 1; offset <= TIMERWHEEL_SLOTS; offset++) {
+            if (wheel->slots[level][(position + offset) & TIMERWHEEL_MASK] != NULL) {
+                UINT64 start = (position + offset) << shift;
+                next = start < next ? start : next;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+/*
+ * A timer due at `now`, unlinked, NULL when there are none left or the
+ * budget is spent. Every timer popped and every tick the clock steps costs 1
+ * of the budget; the clock jumps over the ticks without timers.
+ */
+TimerWheelNode* TimerWheel_pop(TimerWheel* wheel, UINT64 now, UINT32* budget) {
+    while (*budget > 0) {
+        TimerWheelNode* node = wheel->due;
+        if (node != NULL) {
+            TimerWheel_remove(wheel, node);
+            (*budget)--;
+            return node;
+        }
+        if (wheel->tick > now) {
+            return NULL;
+        }
+
+        TimerWheel_cascade(wheel);
+        TimerWheelNode** slot = &wheel->slots[0][wheel->tick & TIMERWHEEL_MASK];
+        if (*slot != NULL) {
+            wheel->due = *slot;
+            wheel->due->link = &wheel->due;
+            *slot = NULL;
+        }
+        wheel->tick++;
+        (*budget)--;
+
+        if (wheel->due == NULL) {
+            UINT64 next = TimerWheel_next(wheel);
+            wheel->tick = next < now + 1 ? next : now + 1;
+        }
+    }
+    return NULL;
+}
+
+// Disarms every timer, handing each to `release`
+VOID TimerWheel_clear(TimerWheel* wheel, TimerWheelRelease release) {
+    for (UINT32 i = 0; i <= TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS; i++) {
+        TimerWheelNode** head = i == 0 ? &wheel->due : &wheel->slots[(i - 1) / TIMERWHEEL_SLOTS][(i - 1) % TIMERWHEEL_SLOTS];
+        TimerWheelNode* node = *head;
+        *head = NULL;
+        while (node != NULL) {
+            TimerWheelNode* next = node->next;
+            node->next = NULL;
+            node->link = NULL;
+            release(node);
+            node = next;
+        }
+    }
+    wheel->count = 0;
+}
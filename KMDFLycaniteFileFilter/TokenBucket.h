@@ -0,0 +1,192 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Rate limiter: a token bucket refilled at `rate` tokens per second, holding
+ * at most `burst` of them.
+ *
+ * Every CPU keeps a few tokens in its own cache-line aligned slot and spends
+ * them with a compare-exchange on a line no other CPU writes to. Only when
+ * its slot runs dry does a CPU go to the shared bucket, refilling it for the
+ * time elapsed and taking a batch. The slots together hold at most a
+ * 1/TOKENBUCKET_BATCH_SHARE of the burst, so that much can be spent over the
+ * rate, and a CPU can't spend what another one holds: an acquire fails only
+ * once the shared bucket is empty too.
+ *
+ * Nothing is locked: the shared bucket is a counter and a refill timestamp
+ * updated with compare-exchanges. Time is in the unit of KeQueryInterruptTime.
+ */
+
+#define TOKENBUCKET_CACHE_LINE 64
+#define TOKENBUCKET_SECOND 10000000ll
+
+// the slots hold this fraction of the burst at most
+#define TOKENBUCKET_BATCH_SHARE 4
+
+// rates and bursts are clamped so that a second times the rate fits a LONG64
+#define TOKENBUCKET_MAX_RATE (1ll << 39)
+
+typedef union tokenBucketSlot_u {
+    volatile LONG64 tokens; // may go below 0 when threads race on the slot
+    UCHAR pad[TOKENBUCKET_CACHE_LINE];
+} tokenBucketSlot;
+
+typedef struct TokenBucket_s {
+    volatile LONG64 tokens;
+    volatile LONG64 refilled; // time the shared tokens are refilled up to
+    volatile LONG64 rate; // tokens per second, 0 for no limit
+    volatile LONG64 burst;
+    volatile LONG64 batch; // tokens a CPU takes at once
+    ULONG cpuCount;
+    PVOID allocation;
+    tokenBucketSlot* slots;
+} TokenBucket;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN TokenBucket_create(TokenBucket* bucket);
+    static VOID TokenBucket_setRate(TokenBucket* bucket, UINT64 rate, UINT64 burst, LONG64 now);
+    static BOOLEAN TokenBucket_acquire(TokenBucket* bucket, UINT64 amount, LONG64 now);
+    static VOID TokenBucket_release(TokenBucket* bucket, UINT64 amount);
+    static VOID TokenBucket_destroy(TokenBucket* bucket);
+
+#if defined(__cplusplus)
+}
+#endif
+
+// Without a limit until TokenBucket_setRate. FALSE if out of memory
+BOOLEAN TokenBucket_create(TokenBucket* bucket) {
+    Kmemset(bucket, 0, sizeof(TokenBucket));
+    bucket->cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    bucket->allocation = calloc(1, bucket->cpuCount * sizeof(tokenBucketSlot) + TOKENBUCKET_CACHE_LINE);
+    if (bucket->allocation == NULL) {
+        return FALSE;
+    }
+
+    bucket->slots = (tokenBucketSlot*)(((ULONG_PTR)bucket->allocation + TOKENBUCKET_CACHE_LINE - 1) & ~((ULONG_PTR)TOKENBUCKET_CACHE_LINE - 1));
+    return TRUE;
+}
+
+/*
+ * A rate of 0 lifts the limit. The bucket starts full; tokens already held
+ * by the CPUs are kept.
+ */
+VOID TokenBucket_setRate(TokenBucket* bucket, UINT64 rate, UINT64 burst, LONG64 now) {
+    LONG64 clamped = rate < TOKENBUCKET_MAX_RATE ? (LONG64)rate : TOKENBUCKET_MAX_RATE;
+    LONG64 size = burst == 0 ? clamped : burst < TOKENBUCKET_MAX_RATE ? (LONG64)burst : TOKENBUCKET_MAX_RATE;
+    LONG64 batch = size / ((LONG64)TOKENBUCKET_BATCH_SHARE * bucket->cpuCount);
+
+    InterlockedExchange64(&bucket->rate, 0);
+    InterlockedExchange64(&bucket->burst, size);
+    InterlockedExchange64(&bucket->batch, batch > 0 ? batch : 1);
+    InterlockedExchange64(&bucket->tokens, size);
+    InterlockedExchange64(&bucket->refilled, now);
+    InterlockedExchange64(&bucket->rate, clamped);
+}
+
+// Adds the tokens of the time elapsed, for the CPU winning the timestamp
+static VOID TokenBucket_refill(TokenBucket* bucket, LONG64 rate, LONG64 burst, LONG64 now) {
+    LONG64 last = ReadNoFence64(&bucket->refilled);
+    LONG64 elapsed = now - last;
+    if (elapsed <= 0) {
+        return;
+    }
+
+    // a full second refills the whole burst, the rest is carried to the next refill
+    LONG64 added;
+    LONG64 until;
+    if (elapsed >= TOKENBUCKET_SECOND) {
+        added = burst;
+        until = now;
+    }
+    else {
+        added = elapsed * rate / TOKENBUCKET_SECOND;
+        if (added == 0) {
+            return;
+        }
+        until = last + added * TOKENBUCKET_SECOND / rate;
+    }
+    if (InterlockedCompareExchange64(&bucket->refilled, until, last) != last) {
+        return;
+    }
+
+    LONG64 tokens = ReadNoFence64(&bucket->tokens);
+    for (;;) {
+        LONG64 next = tokens + added < burst ? tokens + added : burst;
+        LONG64 seen = InterlockedCompareExchange64(&bucket->tokens, next, tokens);
+        if (seen == tokens) {
+            return;
+        }
+        tokens = seen;
+    }
+}
+
+// Between minimum and maximum shared tokens, 0 if there aren't minimum
+static LONG64 TokenBucket_take(TokenBucket* bucket, LONG64 minimum, LONG64 maximum, LONG64 now) {
+    TokenBucket_refill(bucket, ReadNoFence64(&bucket->rate), ReadNoFence64(&bucket->burst), now);
+
+    LONG64 tokens = ReadNoFence64(&bucket->tokens);
+    for (;;) {
+        if (tokens < minimum || tokens <= 0) {
+            return 0;
+        }
+        LONG64 taken = tokens < maximum ? tokens : maximum;
+        LONG64 seen = InterlockedCompareExchange64(&bucket->tokens, tokens - taken, tokens);
+        if (seen == tokens) {
+            return taken;
+        }
+        tokens = seen;
+    }
+}
+
+/*
+ * Spends `amount` tokens, FALSE and nothing spent if there aren't enough. An
+ * amount over the burst costs the whole burst.
+ */
+BOOLEAN TokenBucket_acquire(TokenBucket* bucket, UINT64 amount, LONG64 now) {
+    LONG64 rate = ReadNoFence64(&bucket->rate);
+    if (rate == 0 || amount == 0) {
+        return TRUE;
+    }
+
+    LONG64 burst = ReadNoFence64(&bucket->burst);
+    LONG64 cost = amount < (UINT64)burst ? (LONG64)amount : burst;
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+    volatile LONG64* local = &bucket->slots[cpu < bucket->cpuCount ? cpu : cpu % bucket->cpuCount].tokens;
+
+    LONG64 held = ReadNoFence64(local);
+    while (held >= cost) {
+        LONG64 seen = InterlockedCompareExchange64(local, held - cost, held);
+        if (seen == held) {
+            return TRUE;
+        }
+        held = seen;
+    }
+
+    // what the slot lacks, and a batch for the next ones
+    LONG64 lacking = cost - (held > 0 ? held : 0);
+    LONG64 taken = TokenBucket_take(bucket, lacking, lacking + ReadNoFence64(&bucket->batch), now);
+    if (taken == 0) {
+        return FALSE;
+    }
+    InterlockedExchangeAdd64(local, taken - cost);
+    return TRUE;
+}
+
+// Gives back tokens acquired but not spent
+VOID TokenBucket_release(TokenBucket* bucket, UINT64 amount) {
+    LONG64 burst = ReadNoFence64(&bucket->burst);
+    LONG64 cost = amount < (UINT64)burst ? (LONG64)amount : burst;
+    if (ReadNoFence64(&bucket->rate) != 0 && cost > 0) {
+        ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+        InterlockedExchangeAdd64(&bucket->slots[cpu < bucket->cpuCount ? cpu : cpu % bucket->cpuCount].tokens, cost);
+    }
+}
+
+VOID TokenBucket_destroy(TokenBucket* bucket) {
+    free(bucket->allocation);
+    Kmemset(bucket, 0, sizeof(TokenBucket));
+}
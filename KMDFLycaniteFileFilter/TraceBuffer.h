@@ -0,0 +1,153 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Binary trace buffer: fixed-size records in one ring per CPU, no formatting
+ * on the write side.
+ *
+ * A writer claims a record index with an interlocked increment on its CPU
+ * ring (the thread may migrate, so two writers can share a ring) and
+ * publishes the record by storing its sequence (index + 1) last. Rings wrap
+ * and overwrite the oldest records. A reader copies a record and checks the
+ * sequence before and after the copy, skipping the ones overwritten under it.
+ *
+ * Decoding is left to tools, the record layout is the wire format.
+ */
+
+#define TRACE_CACHE_LINE 64
+#define TRACE_RECORD_SIZE 40
+
+typedef struct traceRecord_s {
+    volatile LONG64 sequence;
+    UINT64 timestamp; // KeQueryPerformanceCounter ticks
+    UINT64 args[2];
+    UINT32 pathHash;
+    UINT16 cpu;
+    UINT16 event;
+} traceRecord;
+
+C_ASSERT(sizeof(traceRecord) == TRACE_RECORD_SIZE);
+
+typedef struct TraceRing_s {
+    volatile LONG64 next;
+    UCHAR pad[TRACE_CACHE_LINE - sizeof(LONG64)];
+} TraceRing;
+
+typedef struct TraceBuffer_s {
+    ULONG cpuCount;
+    UINT64 capacity;
+    UINT64 frequency;
+    TraceRing* rings;
+    traceRecord* records; // [cpu][capacity]
+} TraceBuffer;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static TraceBuffer* TraceBuffer_create(UINT64 capacity);
+    static VOID TraceBuffer_write(TraceBuffer* buffer, UINT16 event, UINT64 arg0, UINT64 arg1, UINT32 pathHash);
+    static UINT64 TraceBuffer_read(TraceBuffer* buffer, ULONG cpu, UINT64 from, traceRecord* records, UINT32 count, UINT32* read);
+    static VOID TraceBuffer_destroy(TraceBuffer* buffer);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/*
+ * Capacity, in records per CPU, is rounded up to a power of two.
+ */
+TraceBuffer* TraceBuffer_create(UINT64 capacity) {
+    UINT64 size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    TraceBuffer* buffer = (TraceBuffer*)calloc(1, sizeof(TraceBuffer));
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+
+    buffer->cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    buffer->capacity = size;
+    buffer->frequency = (UINT64)frequency.QuadPart;
+    buffer->rings = (TraceRing*)calloc(buffer->cpuCount, sizeof(TraceRing));
+    buffer->records = (traceRecord*)calloc(buffer->cpuCount * size, sizeof(traceRecord));
+
+    if (buffer->rings == NULL || buffer->records == NULL) {
+        TraceBuffer_destroy(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+/*
+ * Any IRQL, any number of writers. A NULL buffer is a no-op.
+ */
+VOID TraceBuffer_write(TraceBuffer* buffer, UINT16 event, UINT64 arg0, UINT64 arg1, UINT32 pathHash) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL) % buffer->cpuCount;
+    UINT64 index = (UINT64)InterlockedIncrement64(&buffer->rings[cpu].next) - 1;
+    traceRecord* record = &buffer->records[cpu * buffer->capacity + (index & (buffer->capacity - 1))];
+
+    WriteRelease64(&record->sequence, 0);
+    record->timestamp = (UINT64)KeQueryPerformanceCounter(NULL).QuadPart;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->pathHash = pathHash;
+    record->cpu = (UINT16)cpu;
+    record->event = event;
+    WriteRelease64(&record->sequence, (LONG64)index + 1);
+}
+
+/*
+ * Copies up to `count` records of a CPU starting at index `from` (clamped to
+ * the oldest one still in the ring). Returns the index to continue from.
+ */
+UINT64 TraceBuffer_read(TraceBuffer* buffer, ULONG cpu, UINT64 from, traceRecord* records, UINT32 count, UINT32* read) {
+    *read = 0;
+    if (buffer == NULL || cpu >= buffer->cpuCount) {
+        return from;
+    }
+
+    UINT64 next = (UINT64)ReadAcquire64(&buffer->rings[cpu].next);
+    if (next > buffer->capacity && from < next - buffer->capacity) {
+        from = next - buffer->capacity;
+    }
+
+    for (; from < next && *read < count; from++) {
+        traceRecord* record = &buffer->records[cpu * buffer->capacity + (from & (buffer->capacity - 1))];
+        LONG64 sequence = (LONG64)from + 1;
+
+        LONG64 current = ReadAcquire64(&record->sequence);
+        if (current > sequence) {
+            continue; // overwritten by a later lap
+        }
+        if (current != sequence) {
+            break; // claimed but not published yet, read it next time
+        }
+
+        records[*read] = *record;
+        KeMemoryBarrier();
+        if (ReadAcquire64(&record->sequence) == sequence) {
+            records[*read].sequence = sequence;
+            *read += 1;
+        }
+    }
+    return from;
+}
+
+VOID TraceBuffer_destroy(TraceBuffer* buffer) {
+    if (buffer != NULL) {
+        free(buffer->rings);
+        free(buffer->records);
+        free(buffer);
+    }
+}
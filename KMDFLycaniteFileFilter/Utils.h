@@ -23,6 +23,9 @@ extern "C" {
     // override memset
     static PVOID Kmemset(PVOID pointer, INT8 value, SIZE_T count);
 
+    // FNV-1a over the UTF-16 code units of a path, length in WCHARs
+    static UINT32 hashPath(CONST WCHAR* path, UINT32 length);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -116,4 +119,13 @@ PWCHAR wcharFromChar(PCHAR str, UINT64 strlen, UINT64 *outputLen) {
 
     KdPrint(("Failed to convert AnsiString to UnicodeString"));
     return NULL;
+}
+
+UINT32 hashPath(CONST WCHAR* path, UINT32 length) {
+    UINT32 hash = 2166136261u;
+    for (UINT32 i = 0; i < length; i++) {
+        hash ^= path[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
\ No newline at end of file
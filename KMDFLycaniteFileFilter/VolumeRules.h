@@ -0,0 +1,439 @@
+#pragma once
+
+#include "Utils.h"
+#include "Kashmap.h"
+#include "FingerprintTable.h"
+
+/*
+ * Global rules partitioned by volume.
+ *
+ * Every normalized name starts with its volume, "\Device\HarddiskVolume2",
+ * the Volume of FltParseFileNameInformation. Rules are split the same way:
+ * each volume holding rules has its own table keyed by the rest of the path,
+ * so a lookup finds the volume once and hashes and compares only the part
+ * below it, and a volume without rules is answered without walking the path.
+ * Rules on paths above a volume ("\Device") or outside of \Device stay keyed
+ * by the full path in a table looked up only when not empty.
+ *
+ * The tables are Kashmaps owning a copy of each path, or in the compact modes
+ * FingerprintTables holding fingerprints and permissions only, with or
+ * without the paths kept aside to verify matches. The mode is chosen once,
+ * by VolumeRules_init.
+ *
+ * Writers hold the caller's lock, lookups take none: a volume is published
+ * once its table is ready and stays, even emptied, until VolumeRules_destroy.
+ * Lookups run in a read section of the GracePeriod given to VolumeRules_init,
+ * and whatever they may be reading is freed after it: rules on volume roots,
+ * fingerprint slots, and in VOLUMERULES_STRINGS the Kashmaps, written with
+ * its _shared functions and rebuilt aside when full, with the paths and
+ * permissions of the rules removed from them.
+ */
+
+enum VolumeRulesMode {
+    VOLUMERULES_STRINGS = 0,
+    VOLUMERULES_FINGERPRINTS = 1,
+    VOLUMERULES_VERIFIED = 2 // fingerprints, paths compared on a match
+};
+
+typedef struct VolumeTable_s {
+    struct hashmap_s* strings; // path -> UINT64 permissions, VOLUMERULES_STRINGS, replaced whole when rebuilt
+    FingerprintTable fingerprints; // the compact modes
+} VolumeTable;
+
+typedef struct VolumePartition_s {
+    VolumeTable rules; // path below the volume
+    UINT64* root; // rule on the volume itself, NULL if none
+    PWCHAR volume;
+    UINT32 length;
+    UINT32 hash; // hashPath of the volume
+    struct VolumePartition_s* next;
+} VolumePartition;
+
+typedef struct VolumeRules_s {
+    VolumePartition* volumes; // newest first
+    VolumeTable outside; // full path
+    GracePeriod* grace; // lookups' read sections
+    UINT32 count; // rules
+    UINT8 mode; // VolumeRulesMode
+} VolumeRules;
+
+typedef BOOLEAN (*VolumeRulesVisitor)(PVOID context, CONST WCHAR* path, UINT32 length, UINT64 permissions);
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static BOOLEAN VolumeRules_init(VolumeRules* rules, UINT8 mode, GracePeriod* grace);
+    static UINT32 VolumeRules_volumeLength(CONST WCHAR* path, UINT32 length);
+    static UINT64 VolumeRules_permission(CONST VolumeRules* rules, CONST WCHAR* path, UINT32 length, UINT32 volume, UINT32* probes);
+    static BOOLEAN VolumeRules_set(VolumeRules* rules, CONST WCHAR* path, UINT32 length, UINT64 permissions);
+    static BOOLEAN VolumeRules_remove(VolumeRules* rules, CONST WCHAR* path, UINT32 length);
+    static BOOLEAN VolumeRules_iterate(CONST VolumeRules* rules, VolumeRulesVisitor visitor, PVOID context);
+    static VOID VolumeRules_destroy(VolumeRules* rules);
+
+#if defined(__cplusplus)
+}
+#endif
+
+/* ======================================================
+*                       Tables
+*  ======================================================*/
+
+static BOOLEAN VolumeTable_create(VolumeTable* table, UINT8 mode, GracePeriod* grace) {
+    Kmemset(table, 0, sizeof(VolumeTable));
+    if (mode == VOLUMERULES_STRINGS) {
+        table->strings = (struct hashmap_s*)malloc(sizeof(struct hashmap_s));
+        if (table->strings == NULL || hashmap_create(8, table->strings) != 0) {
+            free(table->strings);
+            table->strings = NULL;
+            return FALSE;
+        }
+        return TRUE;
+    }
+    return FingerprintTable_create(&table->fingerprints, mode == VOLUMERULES_VERIFIED, grace);
+}
+
+static CONST struct hashmap_s* VolumeTable_strings(CONST VolumeTable* table) {
+    return (CONST struct hashmap_s*)ReadPointerAcquire((PVOID volatile*)&table->strings);
+}
+
+static UINT32 VolumeTable_size(CONST VolumeTable* table, UINT8 mode) {
+    return mode == VOLUMERULES_STRINGS ? VolumeTable_strings(table)->size : table->fingerprints.count;
+}
+
+static UINT64* VolumeTable_get(CONST VolumeTable* table, UINT8 mode, CONST WCHAR* path, UINT32 length) {
+    if (mode == VOLUMERULES_STRINGS) {
+        return (UINT64*)hashmap_get_shared(VolumeTable_strings(table), (PWCHAR)path, length);
+    }
+    return FingerprintTable_get(&table->fingerprints, path, length);
+}
+
+static INT8 VolumeTable_freeRule(PVOID CONST context, struct hashmap_element_s* CONST e) {
+    UNREFERENCED_PARAMETER(context);
+    free(e->key);
+    free(e->data);
+    return -1;
+}
+
+// A new rule, the path not in the table yet
+static BOOLEAN VolumeTable_put(VolumeTable* table, UINT8 mode, GracePeriod* grace, CONST WCHAR* path, UINT32 length, UINT64 permissions) {
+    if (mode != VOLUMERULES_STRINGS) {
+        return FingerprintTable_put(&table->fingerprints, path, length, permissions);
+    }
+
+    PWCHAR key = (PWCHAR)malloc(((SIZE_T)length + 1) * sizeof(WCHAR));
+    UINT64* value = (UINT64*)malloc(sizeof(UINT64));
+    if (key == NULL || value == NULL) {
+        free(key);
+        free(value);
+        return FALSE;
+    }
+    Kmemcpy(key, (PVOID)path, length * sizeof(WCHAR));
+    key[length] = 0;
+    *value = permissions;
+
+    // no room for it: rebuilt without the tombstones, grown if that wasn't enough
+    struct hashmap_s* strings = table->strings;
+    for (INT8 grow = 0; hashmap_put_shared(strings, key, length, value) != 0; grow = 1) {
+        struct hashmap_s* rebuilt = (struct hashmap_s*)malloc(sizeof(struct hashmap_s));
+        if (rebuilt == NULL || hashmap_rebuild(strings, rebuilt, grow) != 0) {
+            free(rebuilt);
+            free(key);
+            free(value);
+            return FALSE;
+        }
+        WritePointerRelease((PVOID volatile*)&table->strings, rebuilt);
+        GracePeriod_synchronize(grace);
+        hashmap_iterate_removed(strings, VolumeTable_freeRule, NULL);
+        hashmap_destroy(strings);
+        free(strings);
+        strings = rebuilt;
+    }
+    return TRUE;
+}
+
+// The path and permissions of a rule removed stay in its tombstone until the table is rebuilt
+static BOOLEAN VolumeTable_remove(VolumeTable* table, UINT8 mode, CONST WCHAR* path, UINT32 length) {
+    if (mode != VOLUMERULES_STRINGS) {
+        return FingerprintTable_remove(&table->fingerprints, path, length);
+    }
+    return hashmap_remove_shared(table->strings, (PWCHAR)path, length, NULL, NULL) == 0;
+}
+
+static VOID VolumeTable_destroy(VolumeTable* table, UINT8 mode) {
+    if (mode == VOLUMERULES_STRINGS) {
+        if (table->strings != NULL) {
+            hashmap_iterate_pairs(table->strings, VolumeTable_freeRule, NULL);
+            hashmap_iterate_removed(table->strings, VolumeTable_freeRule, NULL);
+            hashmap_destroy(table->strings);
+            free(table->strings);
+            table->strings = NULL;
+        }
+    }
+    else {
+        FingerprintTable_destroy(&table->fingerprints);
+    }
+}
+
+/* ======================================================
+*                       Volumes
+*  ======================================================*/
+
+BOOLEAN VolumeRules_init(VolumeRules* rules, UINT8 mode, GracePeriod* grace) {
+    Kmemset(rules, 0, sizeof(VolumeRules));
+    rules->mode = mode <= VOLUMERULES_VERIFIED ? mode : VOLUMERULES_STRINGS;
+    rules->grace = grace;
+    return VolumeTable_create(&rules->outside, rules->mode, grace);
+}
+
+/*
+ * Length of the volume the path starts with, "\Device\Name" up to the third
+ * separator, as the filter manager parses it. 0 if the path is not below a
+ * volume.
+ */
+UINT32 VolumeRules_volumeLength(CONST WCHAR* path, UINT32 length) {
+    UINT32 separators = 0;
+
+    if (length == 0 || path[0] != '\\') {
+        return 0;
+    }
+    for (UINT32 i = 0; i < length; i++) {
+        if (path[i] == '\\' && ++separators == 3) {
+            return i;
+        }
+    }
+    return separators == 2 && path[length - 1] != '\\' ? length : 0;
+}
+
+static VolumePartition* VolumeRules_find(CONST VolumeRules* rules, CONST WCHAR* volume, UINT32 length, UINT32 hash) {
+    for (VolumePartition* partition = (VolumePartition*)ReadPointerAcquire((PVOID volatile*)&rules->volumes);
+        partition != NULL; partition = partition->next) {
+        if (partition->hash == hash && partition->length == length &&
+            Kmemcmp(partition->volume, (PVOID)volume, length * sizeof(WCHAR)) == 0) {
+            return partition;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Permissions of the deepest rule on the path or one of its parent folders,
+ * 0 if none: the same rules as getFilePermission's walk. `volume` is the
+ * length of the path's volume, the parsed Volume of the name or
+ * VolumeRules_volumeLength, 0 if it has none.
+ */
+UINT64 VolumeRules_permission(CONST VolumeRules* rules, CONST WCHAR* path, UINT32 length, UINT32 volume, UINT32* probes) {
+    if (volume > 0) {
+        if (probes != NULL) {
+            *probes += 1;
+        }
+
+        VolumePartition* partition = VolumeRules_find(rules, path, volume, hashPath(path, volume));
+        if (partition != NULL) {
+            while (length > volume) {
+                if (probes != NULL) {
+                    *probes += 1;
+                }
+
+                UINT64* permissions = VolumeTable_get(&partition->rules, rules->mode, &path[volume], length - volume);
+                if (permissions != NULL) {
+                    return *permissions;
+                }
+
+                do {
+                    length--;
+                } while (length > volume && path[length] != '\\');
+            }
+
+            UINT64* root = (UINT64*)ReadPointerAcquire((PVOID volatile*)&partition->root);
+            if (root != NULL) {
+                return *root;
+            }
+        }
+
+        // what is left is above the volume
+        length = volume;
+        do {
+            length--;
+        } while (length > 0 && path[length] != '\\');
+    }
+
+    if (VolumeTable_size(&rules->outside, rules->mode) == 0) {
+        return 0;
+    }
+    while (length > 0) {
+        if (probes != NULL) {
+            *probes += 1;
+        }
+
+        UINT64* permissions = VolumeTable_get(&rules->outside, rules->mode, path, length);
+        if (permissions != NULL) {
+            return *permissions;
+        }
+
+        do {
+            length--;
+        } while (length > 0 && path[length] != '\\');
+    }
+    return 0;
+}
+
+// The table the path's rule belongs to, created if `create`; NULL if none or an allocation failed
+static VolumeTable* VolumeRules_table(VolumeRules* rules, CONST WCHAR* path, UINT32 length, BOOLEAN create, VolumePartition** partition) {
+    UINT32 volume = VolumeRules_volumeLength(path, length);
+
+    *partition = NULL;
+    if (volume == 0) {
+        return &rules->outside;
+    }
+
+    UINT32 hash = hashPath(path, volume);
+    *partition = VolumeRules_find(rules, path, volume, hash);
+    if (*partition == NULL && create) {
+        VolumePartition* created = (VolumePartition*)calloc(1, sizeof(VolumePartition));
+        PWCHAR name = (PWCHAR)malloc(((SIZE_T)volume + 1) * sizeof(WCHAR));
+        if (created == NULL || name == NULL || !VolumeTable_create(&created->rules, rules->mode, rules->grace)) {
+            free(created);
+            free(name);
+            return NULL;
+        }
+        Kmemcpy(name, (PVOID)path, volume * sizeof(WCHAR));
+        name[volume] = 0;
+        created->volume = name;
+        created->length = volume;
+        created->hash = hash;
+        created->next = rules->volumes;
+        WritePointerRelease((PVOID volatile*)&rules->volumes, created);
+        *partition = created;
+    }
+    return *partition != NULL ? &(*partition)->rules : NULL;
+}
+
+// FALSE if an allocation failed, the rule is then left as it was
+BOOLEAN VolumeRules_set(VolumeRules* rules, CONST WCHAR* path, UINT32 length, UINT64 permissions) {
+    VolumePartition* partition = NULL;
+    VolumeTable* table = VolumeRules_table(rules, path, length, TRUE, &partition);
+    if (table == NULL) {
+        return FALSE;
+    }
+
+    UINT32 offset = partition != NULL ? partition->length : 0;
+    UINT64* value = NULL;
+    if (partition != NULL && length == offset) {
+        value = partition->root;
+    }
+    else {
+        value = VolumeTable_get(table, rules->mode, &path[offset], length - offset);
+    }
+    if (value != NULL) {
+        *value = permissions;
+        return TRUE;
+    }
+
+    if (partition != NULL && length == offset) {
+        value = (UINT64*)malloc(sizeof(UINT64));
+        if (value == NULL) {
+            return FALSE;
+        }
+        *value = permissions;
+        WritePointerRelease((PVOID volatile*)&partition->root, value);
+    }
+    else if (!VolumeTable_put(table, rules->mode, rules->grace, &path[offset], length - offset, permissions)) {
+        return FALSE;
+    }
+    rules->count++;
+    return TRUE;
+}
+
+// FALSE if no rule was set on the path
+BOOLEAN VolumeRules_remove(VolumeRules* rules, CONST WCHAR* path, UINT32 length) {
+    VolumePartition* partition = NULL;
+    VolumeTable* table = VolumeRules_table(rules, path, length, FALSE, &partition);
+    if (table == NULL) {
+        return FALSE;
+    }
+
+    UINT32 offset = partition != NULL ? partition->length : 0;
+    if (partition != NULL && length == offset) {
+        UINT64* root = partition->root;
+        if (root == NULL) {
+            return FALSE;
+        }
+        WritePointerRelease((PVOID volatile*)&partition->root, NULL);
+        GracePeriod_synchronize(rules->grace);
+        free(root);
+    }
+    else if (!VolumeTable_remove(table, rules->mode, &path[offset], length - offset)) {
+        return FALSE;
+    }
+    rules->count--;
+    return TRUE;
+}
+
+typedef struct VolumeRulesVisit_s {
+    CONST VolumePartition* partition;
+    VolumeRulesVisitor visitor;
+    PVOID context;
+} VolumeRulesVisit;
+
+// Rule below a volume to the visitor with its full path
+static BOOLEAN VolumeRules_visit(PVOID context, CONST WCHAR* below, UINT32 length, UINT64 permissions) {
+    CONST VolumeRulesVisit* visit = (CONST VolumeRulesVisit*)context;
+    CONST VolumePartition* partition = visit->partition;
+    PWCHAR path = (PWCHAR)malloc(((SIZE_T)partition->length + length + 1) * sizeof(WCHAR));
+    if (path == NULL) {
+        return FALSE;
+    }
+    Kmemcpy(path, partition->volume, partition->length * sizeof(WCHAR));
+    Kmemcpy(&path[partition->length], (PVOID)below, length * sizeof(WCHAR));
+    path[partition->length + length] = 0;
+
+    BOOLEAN visited = visit->visitor(visit->context, path, partition->length + length, permissions);
+    free(path);
+    return visited;
+}
+
+static BOOLEAN VolumeTable_iterate(CONST VolumeTable* table, UINT8 mode, VolumeRulesVisitor visitor, PVOID context) {
+    if (mode != VOLUMERULES_STRINGS) {
+        return FingerprintTable_iterate(&table->fingerprints, visitor, context);
+    }
+    for (UINT32 i = 0; i < table->strings->table_size; i++) {
+        CONST struct hashmap_element_s* e = &table->strings->data[i];
+        if (e->in_use && !visitor(context, e->key, e->key_len, *(UINT64*)e->data)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Calls the visitor with every rule and its full path. Stops and returns FALSE
+ * when the visitor does or a path can't be allocated; in VOLUMERULES_FINGERPRINTS
+ * the paths are not kept, only the rules on volume roots are visited and
+ * FALSE is returned if there are others.
+ */
+BOOLEAN VolumeRules_iterate(CONST VolumeRules* rules, VolumeRulesVisitor visitor, PVOID context) {
+    BOOLEAN complete = TRUE;
+    for (CONST VolumePartition* partition = rules->volumes; partition != NULL; partition = partition->next) {
+        VolumeRulesVisit visit = { partition, visitor, context };
+        if (partition->root != NULL && !VolumeRules_visit(&visit, NULL, 0, *partition->root)) {
+            return FALSE;
+        }
+        complete = VolumeTable_iterate(&partition->rules, rules->mode, VolumeRules_visit, &visit) && complete;
+    }
+    return VolumeTable_iterate(&rules->outside, rules->mode, visitor, context) && complete;
+}
+
+// At unload, no lookup is running
+VOID VolumeRules_destroy(VolumeRules* rules) {
+    while (rules->volumes != NULL) {
+        VolumePartition* partition = rules->volumes;
+        rules->volumes = partition->next;
+        VolumeTable_destroy(&partition->rules, rules->mode);
+        free(partition->root);
+        free(partition->volume);
+        free(partition);
+    }
+    VolumeTable_destroy(&rules->outside, rules->mode);
+    rules->count = 0;
+}
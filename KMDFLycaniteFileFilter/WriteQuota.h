@@ -0,0 +1,220 @@
+#pragma once
+
+#include "Utils.h"
+
+/*
+ * Bytes a sandbox may write, and how many it wrote.
+ *
+ * Every CPU accounts writes against an allowance held in its own cache-line
+ * aligned slot: a write it fits is a compare-exchange on a line no other CPU
+ * writes to. When the allowance runs out the CPU folds what is left of it
+ * back into the shared usage, then charges the write and reserves a new
+ * allowance there, a share of what remains of the quota. Allowances shrink
+ * as the quota is used up, and a write is refused only after the allowances
+ * of every CPU were folded back: the quota is exact.
+ *
+ * The shared usage counts the bytes written and the allowances reserved, the
+ * usage read back leaves the allowances out, off by the writes racing the
+ * read. Nothing is locked. Writes in flight while the quota or the usage is
+ * set may be counted against the previous values.
+ *
+ * A write is charged before it is sent down and refunded what it didn't
+ * write once it completed; it holds a reference on the quota in between, the
+ * quota is freed with its last reference.
+ */
+
+#define WRITEQUOTA_CACHE_LINE 64
+
+// a quota of 0 is no limit, quotas and usages are clamped to this
+#define WRITEQUOTA_MAX (1ll << 62)
+
+// an allowance is at most this share of the remaining quota per CPU
+#define WRITEQUOTA_ALLOWANCE_SHARE 4
+
+// and at most this many bytes, folded at least that often
+#define WRITEQUOTA_MAX_ALLOWANCE (1ll << 24)
+
+typedef union writeQuotaSlot_u {
+    volatile LONG64 allowance; // bytes reserved by the CPU and not written yet
+    UCHAR pad[WRITEQUOTA_CACHE_LINE];
+} writeQuotaSlot;
+
+typedef struct WriteQuota_s {
+    volatile LONG64 quota; // 0 for no limit
+    volatile LONG64 charged; // bytes written, and allowances reserved
+    volatile LONG64 denied; // writes refused
+    volatile LONG references; // its sandbox's, and one per charged write not completed yet
+    ULONG cpuCount;
+    PVOID allocation;
+    writeQuotaSlot* slots;
+} WriteQuota;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    static WriteQuota* WriteQuota_create();
+    static BOOLEAN WriteQuota_charge(WriteQuota* quota, UINT64 bytes);
+    static VOID WriteQuota_refund(WriteQuota* quota, UINT64 bytes);
+    static VOID WriteQuota_reference(WriteQuota* quota);
+    static VOID WriteQuota_release(WriteQuota* quota);
+    static VOID WriteQuota_setQuota(WriteQuota* quota, UINT64 bytes);
+    static VOID WriteQuota_setUsage(WriteQuota* quota, UINT64 bytes);
+    static VOID WriteQuota_read(WriteQuota* quota, UINT64* limit, UINT64* usage, UINT64* denied);
+    static VOID WriteQuota_destroy(WriteQuota* quota);
+
+#if defined(__cplusplus)
+}
+#endif
+
+// No limit and nothing written, with one reference. NULL if out of memory
+WriteQuota* WriteQuota_create() {
+    WriteQuota* quota = (WriteQuota*)calloc(1, sizeof(WriteQuota));
+    if (quota == NULL) {
+        return NULL;
+    }
+
+    quota->references = 1;
+    quota->cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    quota->allocation = calloc(1, quota->cpuCount * sizeof(writeQuotaSlot) + WRITEQUOTA_CACHE_LINE);
+    if (quota->allocation == NULL) {
+        free(quota);
+        return NULL;
+    }
+
+    quota->slots = (writeQuotaSlot*)(((ULONG_PTR)quota->allocation + WRITEQUOTA_CACHE_LINE - 1) & ~((ULONG_PTR)WRITEQUOTA_CACHE_LINE - 1));
+    return quota;
+}
+
+// Gives what is left of an allowance back to the shared usage
+static VOID WriteQuota_fold(WriteQuota* quota, volatile LONG64* allowance) {
+    LONG64 left = InterlockedExchange64(allowance, 0);
+    if (left > 0) {
+        InterlockedExchangeAdd64(&quota->charged, -left);
+    }
+}
+
+// Folds the allowances of every CPU
+static VOID WriteQuota_foldAll(WriteQuota* quota) {
+    for (ULONG cpu = 0; cpu < quota->cpuCount; cpu++) {
+        WriteQuota_fold(quota, &quota->slots[cpu].allowance);
+    }
+}
+
+// Charges the write to the shared usage with a new allowance, FALSE if it doesn't fit
+static BOOLEAN WriteQuota_reserve(WriteQuota* quota, volatile LONG64* allowance, LONG64 bytes) {
+    LONG64 charged = ReadNoFence64(&quota->charged);
+    for (;;) {
+        LONG64 limit = ReadNoFence64(&quota->quota);
+        limit = limit == 0 ? WRITEQUOTA_MAX : limit;
+        if (charged + bytes > limit) {
+            return FALSE;
+        }
+
+        LONG64 reserved = (limit - charged - bytes) / ((LONG64)WRITEQUOTA_ALLOWANCE_SHARE * quota->cpuCount);
+        reserved = reserved < WRITEQUOTA_MAX_ALLOWANCE ? reserved : WRITEQUOTA_MAX_ALLOWANCE;
+        LONG64 seen = InterlockedCompareExchange64(&quota->charged, charged + bytes + reserved, charged);
+        if (seen == charged) {
+            if (reserved > 0) {
+                InterlockedExchangeAdd64(allowance, reserved);
+            }
+            return TRUE;
+        }
+        charged = seen;
+    }
+}
+
+/*
+ * Accounts a write of `bytes`, FALSE and nothing accounted if it would take
+ * the usage over the quota.
+ */
+BOOLEAN WriteQuota_charge(WriteQuota* quota, UINT64 bytes) {
+    if (bytes == 0) {
+        return TRUE;
+    }
+    if (bytes > WRITEQUOTA_MAX) {
+        InterlockedIncrement64(&quota->denied);
+        return FALSE;
+    }
+
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+    volatile LONG64* allowance = &quota->slots[cpu < quota->cpuCount ? cpu : cpu % quota->cpuCount].allowance;
+
+    LONG64 held = ReadNoFence64(allowance);
+    while (held >= (LONG64)bytes) {
+        LONG64 seen = InterlockedCompareExchange64(allowance, held - (LONG64)bytes, held);
+        if (seen == held) {
+            return TRUE;
+        }
+        held = seen;
+    }
+
+    // the other CPUs may hold what is left of the quota
+    WriteQuota_fold(quota, allowance);
+    if (WriteQuota_reserve(quota, allowance, (LONG64)bytes)) {
+        return TRUE;
+    }
+    WriteQuota_foldAll(quota);
+    if (WriteQuota_reserve(quota, allowance, (LONG64)bytes)) {
+        return TRUE;
+    }
+
+    InterlockedIncrement64(&quota->denied);
+    return FALSE;
+}
+
+/*
+ * Gives back `bytes` charged for a write that didn't happen. They go to the
+ * allowance of the CPU, the usage drops by as much.
+ */
+VOID WriteQuota_refund(WriteQuota* quota, UINT64 bytes) {
+    if (bytes == 0 || bytes > WRITEQUOTA_MAX) {
+        return;
+    }
+
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+    InterlockedExchangeAdd64(&quota->slots[cpu < quota->cpuCount ? cpu : cpu % quota->cpuCount].allowance, (LONG64)bytes);
+}
+
+VOID WriteQuota_reference(WriteQuota* quota) {
+    InterlockedIncrement(&quota->references);
+}
+
+// Destroys the quota with its last reference
+VOID WriteQuota_release(WriteQuota* quota) {
+    if (InterlockedDecrement(&quota->references) == 0) {
+        WriteQuota_destroy(quota);
+    }
+}
+
+// A quota under the usage refuses every write until the usage is lowered
+VOID WriteQuota_setQuota(WriteQuota* quota, UINT64 bytes) {
+    InterlockedExchange64(&quota->quota, bytes < WRITEQUOTA_MAX ? (LONG64)bytes : WRITEQUOTA_MAX);
+
+    // allowances reserved under the previous quota
+    WriteQuota_foldAll(quota);
+}
+
+VOID WriteQuota_setUsage(WriteQuota* quota, UINT64 bytes) {
+    WriteQuota_foldAll(quota);
+    InterlockedExchange64(&quota->charged, bytes < WRITEQUOTA_MAX ? (LONG64)bytes : WRITEQUOTA_MAX);
+}
+
+// The quota, 0 for none, and the bytes written
+VOID WriteQuota_read(WriteQuota* quota, UINT64* limit, UINT64* usage, UINT64* denied) {
+    LONG64 written = ReadNoFence64(&quota->charged);
+    for (ULONG cpu = 0; cpu < quota->cpuCount; cpu++) {
+        written -= ReadNoFence64(&quota->slots[cpu].allowance);
+    }
+
+    *limit = (UINT64)ReadNoFence64(&quota->quota);
+    *usage = written > 0 ? (UINT64)written : 0;
+    *denied = (UINT64)ReadNoFence64(&quota->denied);
+}
+
+VOID WriteQuota_destroy(WriteQuota* quota) {
+    if (quota != NULL) {
+        free(quota->allocation);
+        free(quota);
+    }
+}
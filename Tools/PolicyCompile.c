@@ -0,0 +1,727 @@
+/*
+ * Compiles global rules into the policy snapshot the driver loads at boot.
+ *
+ *   cc -O2 -o PolicyCompile PolicyCompile.c
+ *   PolicyCompile [-f] rules.txt policy.bin
+ *
+ * One rule per line: permission letters, r read, w write, d delete, then the
+ * NT path in UTF-8, e.g.
+ *
+ *   rw \Device\HarddiskVolume2\Users\Public
+ *
+ * Blank lines and lines starting with # are skipped, the last rule on a path
+ * wins. A path with * or ? is a pattern, compiled into the automaton of
+ * PatternRules.h, e.g.
+ *
+ *   r *\AppData\Local\Temp\*
+ *
+ * and the last pattern in the file matching a path wins. The snapshot is named by the PolicySnapshot value of the driver's
+ * service key.
+ *
+ * -f writes the front-coded layout, a fraction of the size when paths share
+ * long prefixes, at the cost of a binary search per lookup.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// PolicySnapshot.h, keep in sync
+#define POLICY_SNAPSHOT_MAGIC 0x5350594C
+#define POLICY_SNAPSHOT_HASHED 1
+#define POLICY_SNAPSHOT_FRONT_CODED 2
+#define POLICY_SNAPSHOT_HEADER 64
+#define POLICY_SNAPSHOT_RULE 24
+
+// FrontCoded.h
+#define FRONTCODED_BLOCK 16
+
+// PatternRules.h
+#define PATTERN_RULES_HEADER 72
+#define PATTERN_RULES_STARTS 8192
+#define PATTERN_RULE 16
+#define PATTERN_STATE 24
+#define PATTERN_EDGE 8
+
+// Permissions in Driver.h
+#define LYCANITE_WRITE 1
+#define LYCANITE_READ 2
+#define LYCANITE_DELETE 4
+
+#define MAX_LINE 65536
+
+typedef struct rule_s {
+    uint64_t permissions;
+    uint32_t path; // first unit in paths
+    uint32_t line;
+    uint16_t length;
+} rule;
+
+// Trie of the pattern anchors
+typedef struct node_s {
+    uint32_t child; // first child, 0 if none, the root is no child
+    uint32_t sibling;
+    uint32_t fail;
+    uint32_t dictionary;
+    uint32_t outputCount;
+    uint32_t order; // breadth first, its state in the automaton
+    uint16_t unit;
+} node;
+
+static node* nodes = NULL;
+static size_t nodeCount = 0;
+static size_t nodeCapacity = 0;
+
+static uint16_t* paths = NULL;
+static size_t pathsLength = 0;
+static size_t pathsCapacity = 0;
+
+static double now() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+static void writeLE(unsigned char* p, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        p[i] = (unsigned char)(value >> (i * 8));
+    }
+}
+
+// hashPath in Utils.h
+static uint32_t hashPath(const uint16_t* path, uint32_t length) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash ^= path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int appendUnit(uint32_t unit) {
+    if (pathsLength == pathsCapacity) {
+        pathsCapacity = pathsCapacity ? pathsCapacity * 2 : 1 << 20;
+        uint16_t* grown = (uint16_t*)realloc(paths, pathsCapacity * sizeof(uint16_t));
+        if (grown == NULL) {
+            return 0;
+        }
+        paths = grown;
+    }
+    paths[pathsLength++] = (uint16_t)unit;
+    return 1;
+}
+
+// UTF-8 to UTF-16 at the end of the paths, 0 on malformed input
+static int appendPath(const unsigned char* s, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        uint32_t c = s[i];
+        int extra = c < 0x80 ? 0 : (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : -1;
+        if (extra < 0 || i + extra >= length) {
+            return 0;
+        }
+        c = extra == 0 ? c : c & (0x3F >> extra);
+        for (int k = 1; k <= extra; k++) {
+            if ((s[i + k] & 0xC0) != 0x80) {
+                return 0;
+            }
+            c = (c << 6) | (s[i + k] & 0x3F);
+        }
+        i += 1 + extra;
+
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            if (!appendUnit(0xD800 | (c >> 10)) || !appendUnit(0xDC00 | (c & 0x3FF))) {
+                return 0;
+            }
+        }
+        else if (!appendUnit(c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int comparePaths(const rule* a, const rule* b) {
+    uint32_t length = a->length < b->length ? a->length : b->length;
+    for (uint32_t i = 0; i < length; i++) {
+        if (paths[a->path + i] != paths[b->path + i]) {
+            return paths[a->path + i] < paths[b->path + i] ? -1 : 1;
+        }
+    }
+    return a->length < b->length ? -1 : a->length > b->length;
+}
+
+static int compareRules(const void* a, const void* b) {
+    const rule* ra = (const rule*)a;
+    const rule* rb = (const rule*)b;
+    int order = comparePaths(ra, rb);
+    if (order != 0) {
+        return order;
+    }
+    return ra->line < rb->line ? -1 : ra->line > rb->line;
+}
+
+static int parseLine(char* line, uint32_t number, rule* r) {
+    size_t end = strlen(line);
+    while (end > 0 && (line[end - 1] == '\n' || line[end - 1] == '\r')) {
+        line[--end] = 0;
+    }
+
+    char* p = line;
+    r->permissions = 0;
+    for (; *p != ' ' && *p != '\t' && *p != 0; p++) {
+        switch (*p) {
+        case 'r': r->permissions |= LYCANITE_READ; break;
+        case 'w': r->permissions |= LYCANITE_WRITE; break;
+        case 'd': r->permissions |= LYCANITE_DELETE; break;
+        default:
+            fprintf(stderr, "line %u: unknown permission '%c'\n", number, *p);
+            return 0;
+        }
+    }
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+
+    // a rule without permissions reads as no rule in the driver
+    if (r->permissions == 0 || *p == 0) {
+        fprintf(stderr, "line %u: expected permissions and a path\n", number);
+        return 0;
+    }
+
+    size_t start = pathsLength;
+    if (!appendPath((const unsigned char*)p, strlen(p)) || pathsLength - start > 0xFFFF || pathsLength > 0xFFFFFFFFu) {
+        fprintf(stderr, "line %u: malformed or too long path\n", number);
+        return 0;
+    }
+    r->path = (uint32_t)start;
+    r->length = (uint16_t)(pathsLength - start);
+    r->line = number;
+    return 1;
+}
+
+static void writeHeader(unsigned char* image, uint16_t version, size_t ruleCount, uint32_t indexSize,
+    uint64_t rulesOffset, uint64_t indexOffset, uint64_t pathsOffset, uint64_t pathsLength, uint64_t totalSize) {
+    writeLE(image, POLICY_SNAPSHOT_MAGIC, 4);
+    writeLE(image + 4, version, 2);
+    writeLE(image + 6, POLICY_SNAPSHOT_HEADER, 2);
+    writeLE(image + 8, ruleCount, 4);
+    writeLE(image + 12, indexSize, 4);
+    writeLE(image + 16, rulesOffset, 8);
+    writeLE(image + 24, indexOffset, 8);
+    writeLE(image + 32, pathsOffset, 8);
+    writeLE(image + 40, pathsLength, 8);
+    writeLE(image + 48, totalSize, 8);
+}
+
+// Rules, hash index, then paths. NULL if out of memory, the size wanted in *totalSize
+static unsigned char* buildHashed(const rule* rules, size_t unique, uint64_t* totalSize) {
+    uint32_t indexSize = 2;
+    while (indexSize / 2 < unique) {
+        indexSize *= 2;
+    }
+
+    // paths are copied in rule order, the image holds no duplicate
+    uint64_t rulesOffset = POLICY_SNAPSHOT_HEADER;
+    uint64_t indexOffset = rulesOffset + (uint64_t)unique * POLICY_SNAPSHOT_RULE;
+    uint64_t pathsOffset = indexOffset + (uint64_t)indexSize * 4;
+    uint64_t imagePaths = 0;
+    for (size_t i = 0; i < unique; i++) {
+        imagePaths += rules[i].length;
+    }
+    *totalSize = pathsOffset + imagePaths * 2;
+
+    unsigned char* image = (unsigned char*)calloc(1, (size_t)*totalSize);
+    uint32_t* index = (uint32_t*)calloc(indexSize, sizeof(uint32_t));
+    if (image == NULL || index == NULL) {
+        free(image);
+        free(index);
+        return NULL;
+    }
+    writeHeader(image, POLICY_SNAPSHOT_HASHED, unique, indexSize, rulesOffset, indexOffset, pathsOffset, imagePaths, *totalSize);
+
+    uint32_t position = 0;
+    for (size_t i = 0; i < unique; i++) {
+        const rule* r = &rules[i];
+        unsigned char* entry = image + rulesOffset + i * POLICY_SNAPSHOT_RULE;
+        uint32_t hash = hashPath(&paths[r->path], r->length);
+
+        writeLE(entry, r->permissions, 8);
+        writeLE(entry + 8, position, 4);
+        writeLE(entry + 12, hash, 4);
+        writeLE(entry + 16, r->length, 2);
+        for (uint32_t k = 0; k < r->length; k++) {
+            writeLE(image + pathsOffset + ((uint64_t)position + k) * 2, paths[r->path + k], 2);
+        }
+        position += r->length;
+
+        // linear probing, the driver probes the same way
+        uint32_t slot = hash & (indexSize - 1);
+        while (index[slot] != 0) {
+            slot = (slot + 1) & (indexSize - 1);
+        }
+        index[slot] = (uint32_t)(i + 1);
+    }
+    for (uint32_t slot = 0; slot < indexSize; slot++) {
+        writeLE(image + indexOffset + (uint64_t)slot * 4, index[slot], 4);
+    }
+    free(index);
+    return image;
+}
+
+// Units the paths of two rules share
+static uint32_t sharedUnits(const rule* a, const rule* b) {
+    uint32_t shared = 0;
+    while (shared < a->length && shared < b->length && paths[a->path + shared] == paths[b->path + shared]) {
+        shared++;
+    }
+    return shared;
+}
+
+// Block offsets, then the front-coded blocks. NULL if out of memory, the size wanted in *totalSize
+static unsigned char* buildFrontCoded(const rule* rules, size_t unique, uint64_t* totalSize) {
+    uint32_t blocks = (uint32_t)((unique + FRONTCODED_BLOCK - 1) / FRONTCODED_BLOCK);
+    uint64_t data = 0;
+    for (size_t i = 0; i < unique; i++) {
+        data += i % FRONTCODED_BLOCK == 0 ? 2 + (uint64_t)rules[i].length : 3 + (uint64_t)rules[i].length - sharedUnits(&rules[i - 1], &rules[i]);
+    }
+
+    uint64_t indexOffset = POLICY_SNAPSHOT_HEADER;
+    uint64_t pathsOffset = indexOffset + (uint64_t)blocks * 4;
+    *totalSize = pathsOffset + data * 2;
+    if (data > 0xFFFFFFFFu) {
+        return NULL;
+    }
+
+    unsigned char* image = (unsigned char*)calloc(1, (size_t)*totalSize);
+    if (image == NULL) {
+        return NULL;
+    }
+    writeHeader(image, POLICY_SNAPSHOT_FRONT_CODED, unique, blocks, 0, indexOffset, pathsOffset, data, *totalSize);
+
+    uint64_t position = 0;
+    for (size_t i = 0; i < unique; i++) {
+        const rule* r = &rules[i];
+        uint32_t shared = 0;
+        if (i % FRONTCODED_BLOCK == 0) {
+            writeLE(image + indexOffset + (i / FRONTCODED_BLOCK) * 4, position, 4);
+            writeLE(image + pathsOffset + position * 2, r->permissions, 2);
+            writeLE(image + pathsOffset + (position + 1) * 2, r->length, 2);
+            position += 2;
+        }
+        else {
+            shared = sharedUnits(&rules[i - 1], r);
+            writeLE(image + pathsOffset + position * 2, r->permissions, 2);
+            writeLE(image + pathsOffset + (position + 1) * 2, shared, 2);
+            writeLE(image + pathsOffset + (position + 2) * 2, r->length - shared, 2);
+            position += 3;
+        }
+        for (uint32_t k = shared; k < r->length; k++) {
+            writeLE(image + pathsOffset + position * 2, paths[r->path + k], 2);
+            position++;
+        }
+    }
+    return image;
+}
+
+static int isPattern(const rule* r) {
+    for (uint32_t i = 0; i < r->length; i++) {
+        if (paths[r->path + i] == '*' || paths[r->path + i] == '?') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compareLines(const void* a, const void* b) {
+    uint32_t la = ((const rule*)a)->line;
+    uint32_t lb = ((const rule*)b)->line;
+    return la < lb ? -1 : la > lb;
+}
+
+static uint32_t findChild(uint32_t parent, uint16_t unit) {
+    for (uint32_t child = nodes[parent].child; child != 0; child = nodes[child].sibling) {
+        if (nodes[child].unit == unit) {
+            return child;
+        }
+    }
+    return 0;
+}
+
+static uint32_t addNode(uint32_t parent, uint16_t unit) {
+    if (nodeCount == nodeCapacity) {
+        nodeCapacity = nodeCapacity ? nodeCapacity * 2 : 4096;
+        node* grown = (node*)realloc(nodes, nodeCapacity * sizeof(node));
+        if (grown == NULL) {
+            return 0;
+        }
+        nodes = grown;
+    }
+    node* n = &nodes[nodeCount];
+    memset(n, 0, sizeof(node));
+    n->unit = unit;
+    if (nodeCount > 0) {
+        n->sibling = nodes[parent].child;
+        nodes[parent].child = (uint32_t)nodeCount;
+    }
+    return (uint32_t)nodeCount++;
+}
+
+// A literal run of a pattern, candidate anchor
+typedef struct run_s {
+    uint32_t pattern;
+    uint32_t start; // first unit in paths
+    uint32_t length;
+    uint32_t shared; // patterns with the same run
+} run;
+
+static int compareRuns(const void* a, const void* b) {
+    const run* ra = (const run*)a;
+    const run* rb = (const run*)b;
+    uint32_t length = ra->length < rb->length ? ra->length : rb->length;
+    for (uint32_t i = 0; i < length; i++) {
+        if (paths[ra->start + i] != paths[rb->start + i]) {
+            return paths[ra->start + i] < paths[rb->start + i] ? -1 : 1;
+        }
+    }
+    if (ra->length != rb->length) {
+        return ra->length < rb->length ? -1 : 1;
+    }
+    return ra->pattern < rb->pattern ? -1 : ra->pattern > rb->pattern;
+}
+
+/*
+ * The anchor of each pattern: its literal run shared by the fewest patterns,
+ * the longest among equals. A run every pattern of a volume starts with
+ * would have them all matched in full on each of its paths.
+ */
+static int chooseAnchors(const rule* patterns, size_t count, run* anchors) {
+    size_t runCount = 0;
+    size_t capacity = count + 1;
+    run* runs = (run*)malloc(capacity * sizeof(run));
+    for (size_t i = 0; runs != NULL && i < count; i++) {
+        anchors[i].pattern = (uint32_t)i;
+        anchors[i].start = patterns[i].path;
+        anchors[i].length = 0;
+        anchors[i].shared = 0xFFFFFFFFu;
+        for (uint32_t start = 0, length = 0; start + length <= patterns[i].length; ) {
+            uint16_t unit = start + length < patterns[i].length ? paths[patterns[i].path + start + length] : '*';
+            if (unit != '*' && unit != '?') {
+                length++;
+                continue;
+            }
+            if (length > 0) {
+                if (runCount == capacity) {
+                    capacity *= 2;
+                    run* grown = (run*)realloc(runs, capacity * sizeof(run));
+                    if (grown == NULL) {
+                        free(runs);
+                        return 0;
+                    }
+                    runs = grown;
+                }
+                run* r = &runs[runCount++];
+                r->pattern = (uint32_t)i;
+                r->start = patterns[i].path + start;
+                r->length = length;
+            }
+            start += length + 1;
+            length = 0;
+        }
+    }
+    if (runs == NULL) {
+        return 0;
+    }
+
+    // equal runs are adjacent once sorted, a pattern counts once per run
+    qsort(runs, runCount, sizeof(run), compareRuns);
+    for (size_t first = 0, last; first < runCount; first = last) {
+        uint32_t shared = 1;
+        for (last = first + 1; last < runCount && runs[last].length == runs[first].length &&
+            memcmp(&paths[runs[last].start], &paths[runs[first].start], runs[first].length * sizeof(uint16_t)) == 0; last++) {
+            shared += runs[last].pattern != runs[last - 1].pattern;
+        }
+        for (size_t k = first; k < last; k++) {
+            run* anchor = &anchors[runs[k].pattern];
+            if (shared < anchor->shared || (shared == anchor->shared && runs[k].length > anchor->length)) {
+                *anchor = runs[k];
+                anchor->shared = shared;
+            }
+        }
+    }
+    free(runs);
+    return 1;
+}
+
+static int compareUnits(const void* a, const void* b) {
+    uint16_t ua = nodes[*(const uint32_t*)a].unit;
+    uint16_t ub = nodes[*(const uint32_t*)b].unit;
+    return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * Aho-Corasick automaton over the anchors of the patterns, in file order.
+ * NULL if out of memory, the section size in *size.
+ */
+static unsigned char* buildPatterns(const rule* patterns, size_t count, uint64_t* size) {
+    uint32_t* terminal = (uint32_t*)malloc((count + 1) * sizeof(uint32_t));
+    run* anchors = (run*)malloc((count + 1) * sizeof(run));
+    uint64_t starts[PATTERN_RULES_STARTS / 8] = { 0 };
+    uint64_t textLength = 0;
+    nodeCount = 0;
+    if (terminal == NULL || anchors == NULL || !chooseAnchors(patterns, count, anchors) || addNode(0, 0) != 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const uint16_t* anchor = &paths[anchors[i].start];
+        uint32_t current = 0;
+        for (uint32_t k = 0; k < anchors[i].length; k++) {
+            uint32_t child = findChild(current, anchor[k]);
+            if (child == 0 && (child = addNode(current, anchor[k])) == 0) {
+                return NULL;
+            }
+            current = child;
+        }
+        if (anchors[i].length > 0) {
+            starts[anchor[0] / 64] |= 1ull << (anchor[0] % 64);
+        }
+        nodes[current].outputCount++;
+        terminal[i] = current;
+        textLength += patterns[i].length;
+    }
+
+    // breadth first: failure links of a depth only need the ones above
+    uint32_t* queue = (uint32_t*)malloc(nodeCount * sizeof(uint32_t));
+    uint32_t* children = (uint32_t*)malloc(nodeCount * sizeof(uint32_t));
+    if (queue == NULL || children == NULL) {
+        return NULL;
+    }
+    size_t head = 0;
+    size_t tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        uint32_t parent = queue[head];
+        nodes[parent].order = (uint32_t)head++;
+        for (uint32_t child = nodes[parent].child; child != 0; child = nodes[child].sibling) {
+            uint32_t fail = 0;
+            if (parent != 0) {
+                uint32_t suffix = nodes[parent].fail;
+                while (suffix != 0 && findChild(suffix, nodes[child].unit) == 0) {
+                    suffix = nodes[suffix].fail;
+                }
+                fail = findChild(suffix, nodes[child].unit);
+            }
+            nodes[child].fail = fail;
+            nodes[child].dictionary = fail != 0 && nodes[fail].outputCount != 0 ? fail : nodes[fail].dictionary;
+            queue[tail++] = child;
+        }
+    }
+
+    size_t edgeCount = nodeCount - 1;
+    uint64_t patternsOffset = PATTERN_RULES_HEADER + PATTERN_RULES_STARTS;
+    uint64_t statesOffset = patternsOffset + (uint64_t)count * PATTERN_RULE;
+    uint64_t edgesOffset = statesOffset + (uint64_t)nodeCount * PATTERN_STATE;
+    uint64_t outputsOffset = edgesOffset + (uint64_t)edgeCount * PATTERN_EDGE;
+    uint64_t textOffset = outputsOffset + (uint64_t)count * 4;
+    *size = (textOffset + textLength * 2 + 7) / 8 * 8;
+
+    unsigned char* section = (unsigned char*)calloc(1, (size_t)*size);
+    uint32_t* outputs = (uint32_t*)calloc(nodeCount + 1, sizeof(uint32_t));
+    if (section == NULL || outputs == NULL || textLength > 0xFFFFFFFFu) {
+        return NULL;
+    }
+    writeLE(section, count, 4);
+    writeLE(section + 4, nodeCount, 4);
+    writeLE(section + 8, edgeCount, 4);
+    writeLE(section + 12, count, 4);
+    writeLE(section + 16, textLength, 4);
+    writeLE(section + 24, PATTERN_RULES_HEADER, 8);
+    writeLE(section + 32, patternsOffset, 8);
+    writeLE(section + 40, statesOffset, 8);
+    writeLE(section + 48, edgesOffset, 8);
+    writeLE(section + 56, outputsOffset, 8);
+    writeLE(section + 64, textOffset, 8);
+    for (uint32_t i = 0; i < PATTERN_RULES_STARTS / 8; i++) {
+        writeLE(section + PATTERN_RULES_HEADER + i * 8, starts[i], 8);
+    }
+
+    uint32_t position = 0;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char* entry = section + patternsOffset + i * PATTERN_RULE;
+        writeLE(entry, patterns[i].permissions, 8);
+        writeLE(entry + 8, position, 4);
+        writeLE(entry + 12, patterns[i].length, 2);
+        for (uint32_t k = 0; k < patterns[i].length; k++) {
+            writeLE(section + textOffset + ((uint64_t)position + k) * 2, paths[patterns[i].path + k], 2);
+        }
+        position += patterns[i].length;
+    }
+
+    // outputs grouped by state, each group in file order
+    for (uint32_t n = 0; n < nodeCount; n++) {
+        outputs[n + 1] = outputs[n] + nodes[queue[n]].outputCount;
+    }
+    uint32_t edge = 0;
+    for (uint32_t n = 0; n < nodeCount; n++) {
+        const node* state = &nodes[queue[n]];
+        unsigned char* entry = section + statesOffset + (uint64_t)n * PATTERN_STATE;
+        uint32_t childCount = 0;
+        for (uint32_t child = state->child; child != 0; child = nodes[child].sibling) {
+            children[childCount++] = child;
+        }
+        qsort(children, childCount, sizeof(uint32_t), compareUnits);
+
+        writeLE(entry, edge, 4);
+        writeLE(entry + 4, childCount, 4);
+        writeLE(entry + 8, outputs[n], 4);
+        writeLE(entry + 12, state->outputCount, 4);
+        writeLE(entry + 16, nodes[state->fail].order, 4);
+        writeLE(entry + 20, nodes[state->dictionary].order, 4);
+        for (uint32_t c = 0; c < childCount; c++, edge++) {
+            writeLE(section + edgesOffset + (uint64_t)edge * PATTERN_EDGE, nodes[children[c]].unit, 2);
+            writeLE(section + edgesOffset + (uint64_t)edge * PATTERN_EDGE + 4, nodes[children[c]].order, 4);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        writeLE(section + outputsOffset + (uint64_t)outputs[nodes[terminal[i]].order]++ * 4, i, 4);
+    }
+
+    free(outputs);
+    free(anchors);
+    free(children);
+    free(queue);
+    free(terminal);
+    return section;
+}
+
+int main(int argc, char** argv) {
+    int frontCoded = argc == 4 && strcmp(argv[1], "-f") == 0;
+    if (argc != 3 + frontCoded) {
+        fprintf(stderr, "usage: %s [-f] rules.txt policy.bin\n", argv[0]);
+        return 1;
+    }
+    argv += frontCoded;
+
+    FILE* input = fopen(argv[1], "rb");
+    if (input == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    double start = now();
+    size_t count = 0;
+    size_t capacity = 4096;
+    rule* rules = (rule*)malloc(capacity * sizeof(rule));
+    char* line = (char*)malloc(MAX_LINE);
+    uint32_t number = 0;
+    while (rules != NULL && line != NULL && fgets(line, MAX_LINE, input) != NULL) {
+        number++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            rule* grown = (rule*)realloc(rules, capacity * sizeof(rule));
+            if (grown == NULL) {
+                break;
+            }
+            rules = grown;
+        }
+        if (!parseLine(line, number, &rules[count])) {
+            return 1;
+        }
+        count++;
+    }
+    int failed = rules == NULL || line == NULL || ferror(input) != 0;
+    fclose(input);
+    free(line);
+    if (failed) {
+        fprintf(stderr, "%s: read failed\n", argv[1]);
+        return 1;
+    }
+    double parsed = now();
+
+    // sorted by path, then by line to keep the last rule of a path
+    qsort(rules, count, sizeof(rule), compareRules);
+    size_t unique = 0;
+    size_t patternCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && comparePaths(&rules[unique - 1], &rules[i]) == 0) {
+            rules[unique - 1] = rules[i];
+        }
+        else {
+            rules[unique++] = rules[i];
+        }
+    }
+    // patterns apart, back in file order
+    rule* patterns = (rule*)malloc((unique + 1) * sizeof(rule));
+    if (patterns == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    size_t exact = 0;
+    for (size_t i = 0; i < unique; i++) {
+        if (isPattern(&rules[i])) {
+            patterns[patternCount++] = rules[i];
+        }
+        else {
+            rules[exact++] = rules[i];
+        }
+    }
+    unique = exact;
+    qsort(patterns, patternCount, sizeof(rule), compareLines);
+    double sorted = now();
+
+    uint64_t totalSize = 0;
+    unsigned char* image = frontCoded ? buildFrontCoded(rules, unique, &totalSize) : buildHashed(rules, unique, &totalSize);
+    if (image == NULL) {
+        fprintf(stderr, "cannot build a %llu bytes snapshot\n", (unsigned long long)totalSize);
+        return 1;
+    }
+
+    // the patterns section ends the image
+    if (patternCount > 0) {
+        uint64_t sectionSize = 0;
+        uint64_t patternsOffset = (totalSize + 7) / 8 * 8;
+        unsigned char* section = buildPatterns(patterns, patternCount, &sectionSize);
+        unsigned char* grown = section != NULL ? (unsigned char*)realloc(image, (size_t)(patternsOffset + sectionSize)) : NULL;
+        if (grown == NULL) {
+            fprintf(stderr, "cannot build the patterns of %zu rules\n", patternCount);
+            return 1;
+        }
+        image = grown;
+        memset(image + totalSize, 0, (size_t)(patternsOffset - totalSize));
+        memcpy(image + patternsOffset, section, (size_t)sectionSize);
+        totalSize = patternsOffset + sectionSize;
+        writeLE(image + 48, totalSize, 8);
+        writeLE(image + 56, patternsOffset, 8);
+        free(section);
+    }
+    double built = now();
+
+    FILE* output = fopen(argv[2], "wb");
+    if (output == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (fwrite(image, 1, (size_t)totalSize, output) != totalSize || fclose(output) != 0) {
+        fprintf(stderr, "%s: write failed\n", argv[2]);
+        return 1;
+    }
+    double written = now();
+
+    printf("%zu rules, %zu patterns, %zu duplicates, %llu bytes: parse %.1fms, sort %.1fms, build %.1fms, write %.1fms\n",
+        unique, patternCount, count - unique - patternCount, (unsigned long long)totalSize,
+        parsed - start, sorted - parsed, built - sorted, written - built);
+
+    free(image);
+    free(patterns);
+    free(nodes);
+    free(rules);
+    free(paths);
+    return 0;
+}
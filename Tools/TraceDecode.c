@@ -0,0 +1,138 @@
+/*
+ * Decodes a trace dump written by LycaniteBridge.DumpTrace.
+ *
+ *   cc -O2 -o TraceDecode TraceDecode.c
+ *   TraceDecode trace.bin
+ *
+ * Records of all CPUs are merged by timestamp, times are printed in
+ * microseconds from the first record.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRACE_DUMP_MAGIC 0x5254594C
+#define TRACE_DUMP_VERSION 1
+#define TRACE_DUMP_HEADER 16
+#define TRACE_RECORD_SIZE 40
+
+// TraceEvent in Driver.h
+static const char* eventNames[] = {
+    "UNKNOWN",
+    "CHECK",
+    "CHECK_GLOBAL"
+};
+
+typedef struct record_s {
+    uint64_t sequence;
+    uint64_t timestamp;
+    uint64_t args[2];
+    uint32_t pathHash;
+    uint16_t cpu;
+    uint16_t event;
+} record;
+
+static uint64_t readLE(const unsigned char* p, int size) {
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static int compareRecords(const void* a, const void* b) {
+    const record* ra = (const record*)a;
+    const record* rb = (const record*)b;
+    if (ra->timestamp != rb->timestamp) {
+        return ra->timestamp < rb->timestamp ? -1 : 1;
+    }
+    return ra->cpu < rb->cpu ? -1 : ra->cpu > rb->cpu;
+}
+
+static void printRecord(const record* r, uint64_t start, uint64_t frequency) {
+    double us = (double)(r->timestamp - start) * 1000000.0 / (double)frequency;
+    const char* name = r->event < sizeof(eventNames) / sizeof(eventNames[0]) ? eventNames[r->event] : "UNKNOWN";
+
+    printf("%14.3f cpu %-3u %-13s", us, r->cpu, name);
+    switch (r->event) {
+    case 1:
+    case 2:
+        printf(" pid %llu permissions 0x%x restricted %u path %08x\n",
+            (unsigned long long)r->args[0], (unsigned)(r->args[1] & 0xFFFFFFFF), (unsigned)(r->args[1] >> 32), r->pathHash);
+        break;
+    default:
+        printf(" %016llx %016llx path %08x\n", (unsigned long long)r->args[0], (unsigned long long)r->args[1], r->pathHash);
+        break;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    unsigned char header[TRACE_DUMP_HEADER];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || readLE(header, 4) != TRACE_DUMP_MAGIC) {
+        fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+        return 1;
+    }
+    if (readLE(header + 4, 2) != TRACE_DUMP_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u\n", argv[1], (unsigned)readLE(header + 4, 2));
+        return 1;
+    }
+    unsigned cpuCount = (unsigned)readLE(header + 6, 2);
+    uint64_t frequency = readLE(header + 8, 8);
+    if (frequency == 0) {
+        frequency = 1;
+    }
+
+    size_t count = 0;
+    size_t capacity = 4096;
+    record* records = (record*)malloc(capacity * sizeof(record));
+    unsigned char raw[TRACE_RECORD_SIZE];
+
+    while (records != NULL && fread(raw, 1, sizeof(raw), file) == sizeof(raw)) {
+        if (count == capacity) {
+            record* grown = (record*)realloc(records, capacity * 2 * sizeof(record));
+            if (grown == NULL) {
+                free(records);
+                records = NULL;
+                break;
+            }
+            records = grown;
+            capacity *= 2;
+        }
+        record* r = &records[count++];
+        r->sequence = readLE(raw, 8);
+        r->timestamp = readLE(raw + 8, 8);
+        r->args[0] = readLE(raw + 16, 8);
+        r->args[1] = readLE(raw + 24, 8);
+        r->pathHash = (uint32_t)readLE(raw + 32, 4);
+        r->cpu = (uint16_t)readLE(raw + 36, 2);
+        r->event = (uint16_t)readLE(raw + 38, 2);
+    }
+    fclose(file);
+
+    if (records == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    qsort(records, count, sizeof(record), compareRecords);
+
+    printf("%zu records, %u cpus, %llu ticks/s\n", count, cpuCount, (unsigned long long)frequency);
+    for (size_t i = 0; i < count; i++) {
+        printRecord(&records[i], records[0].timestamp, frequency);
+    }
+
+    free(records);
+    return 0;
+}